@@ -67,6 +67,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 317574 $")
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -98,6 +99,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 317574 $")
 #include "asterisk/stringfields.h"
 #include "asterisk/astobj2.h"
 #include "asterisk/global_datastores.h"
+#include "asterisk/test.h"
 
 /* Please read before modifying this file.
  * There are three locks which are regularly used
@@ -138,8 +140,9 @@ static struct strategy {
 
 #define DEFAULT_RETRY		5
 #define DEFAULT_TIMEOUT		15
-#define RECHECK			1		/* Recheck every second to see we we're at the top yet */
+#define RECHECK			1		/* Recheck every second to see we we're at the top yet, if not woken up before */
 #define MAX_PERIODIC_ANNOUNCEMENTS 10 /* The maximum periodic announcements we can have */
+#define MAX_INTERFACE_BUCKETS 509	/* Buckets of the index of devices used by queue members */
 
 #define	RES_OKAY	0		/* Action completed */
 #define	RES_EXISTS	(-1)		/* Entry already exists */
@@ -350,6 +353,8 @@ struct queue_ent {
 	int opos;                           /*!< Where we started in the queue */
 	int handled;                        /*!< Whether our call was handled */
 	int pending;                        /*!< Non-zero if we are attempting to call a member */
+	int turn;                           /*!< Non-zero if the distributor let us try calling members */
+	int wakeup[2];                      /*!< Pipe written when our turn comes */
 	int max_penalty;                    /*!< Limit the members that can take this call to this penalty or lower */
 	time_t start;                       /*!< When we started holding */
 	time_t expire;                      /*!< When this entry should expire (time out of queue) */
@@ -372,12 +377,20 @@ struct member {
 	unsigned int delme:1;               /*!< Flag to delete entry on reload */
 };
 
+/*! \brief A device the state of queue members is read from */
 struct member_interface {
-	char interface[80];
-	AST_LIST_ENTRY(member_interface) list;    /*!< Next call queue */
+	char interface[80];                 /*!< Device, as device state changes name it */
+	struct ao2_container *memberships;  /*!< The queue members using this device */
 };
 
-static AST_LIST_HEAD_STATIC(interfaces, member_interface);
+/*! \brief A queue member reading its state from a device */
+struct membership {
+	struct call_queue *q;
+	struct member *member;
+};
+
+/*! \brief All devices queue members use, so a state change only visits the members of that device */
+static struct ao2_container *interfaces;
 
 /* values used in multi-bit flags in call_queue */
 #define QUEUE_EMPTY_NORMAL 1
@@ -449,6 +462,7 @@ struct call_queue {
 	 */
 	int membercount;
 	struct queue_ent *head;             /*!< Head of the list of callers */
+	time_t distributed;                 /*!< When callers were last given their turns */
 	AST_LIST_ENTRY(call_queue) list;    /*!< Next call queue */
 };
 
@@ -513,6 +527,9 @@ static int strat2int(const char *strategy)
 	return -1;
 }
 
+static void remove_queue_from_interfaces(struct call_queue *q);
+static void distribute_queue(struct call_queue *q);
+
 /*!
  * \brief removes a call_queue from the list of call_queues
  */
@@ -520,6 +537,7 @@ static void remove_queue(struct call_queue *q)
 {
 	AST_LIST_LOCK(&queues);
 	if (AST_LIST_REMOVE(&queues, q, list)) {
+		remove_queue_from_interfaces(q);
 		ao2_ref(q, -1);
 	}
 	AST_LIST_UNLOCK(&queues);
@@ -625,36 +643,40 @@ struct statechange {
 	char dev[0];
 };
 
-static int update_status(const char *interface, const int status)
+/*! \brief The device a state interface reports its state as, without the options of Local channels */
+static void interface_device(const char *state_interface, char *device, size_t len)
 {
-	struct member *cur;
-	struct ao2_iterator mem_iter;
-	struct call_queue *q;
-	char tmp_interface[80];
+	char *slash_pos;
 
-	AST_LIST_LOCK(&queues);
-	AST_LIST_TRAVERSE(&queues, q, list) {
-		ao2_lock(q);
-		mem_iter = ao2_iterator_init(q->members, 0);
-		while ((cur = ao2_iterator_next(&mem_iter))) {
-			char *slash_pos;
-			ast_copy_string(tmp_interface, cur->state_interface, sizeof(tmp_interface));
-			if ((slash_pos = strchr(tmp_interface, '/')))
-				if ((slash_pos = strchr(slash_pos + 1, '/')))
-					*slash_pos = '\0';
+	ast_copy_string(device, state_interface, len);
+	if ((slash_pos = strchr(device, '/')))
+		if ((slash_pos = strchr(slash_pos + 1, '/')))
+			*slash_pos = '\0';
+}
 
-			if (strcasecmp(interface, tmp_interface)) {
-				ao2_ref(cur, -1);
-				continue;
-			}
+/*! \brief Set the status of the members using a device
+ * \retval -1 if no queue member uses the device
+ */
+static int update_status(const char *interface, const int status)
+{
+	struct member_interface *curint, tmpint;
+	struct membership *m;
+	struct ao2_iterator i;
+	struct call_queue *q;
+	struct member *cur;
 
-			if (cur->status != status) {
-				cur->status = status;
-				if (q->maskmemberstatus) {
-					ao2_ref(cur, -1);
-					continue;
-				}
+	interface_device(interface, tmpint.interface, sizeof(tmpint.interface));
+	if (!(curint = ao2_find(interfaces, &tmpint, OBJ_POINTER)))
+		return -1;
 
+	i = ao2_iterator_init(curint->memberships, 0);
+	while ((m = ao2_iterator_next(&i))) {
+		q = m->q;
+		cur = m->member;
+		ao2_lock(q);
+		if (cur->status != status) {
+			cur->status = status;
+			if (!q->maskmemberstatus) {
 				manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
 					"Queue: %s\r\n"
 					"Location: %s\r\n"
@@ -668,12 +690,13 @@ static int update_status(const char *interface, const int status)
 					q->name, cur->interface, cur->membername, cur->dynamic ? "dynamic" : cur->realtime ? "realtime" : "static",
 					cur->penalty, cur->calls, (int)cur->lastcall, cur->status, cur->paused);
 			}
-			ao2_ref(cur, -1);
+			distribute_queue(q);
 		}
-		ao2_iterator_destroy(&mem_iter);
 		ao2_unlock(q);
+		ao2_ref(m, -1);
 	}
-	AST_LIST_UNLOCK(&queues);
+	ao2_iterator_destroy(&i);
+	ao2_ref(curint, -1);
 
 	return 0;
 }
@@ -681,10 +704,8 @@ static int update_status(const char *interface, const int status)
 /*! \brief set a member's status based on device state of that member's interface*/
 static void *handle_statechange(struct statechange *sc)
 {
-	struct member_interface *curint;
 	char *loc;
 	char *technology;
-	char interface[80];
 
 	technology = ast_strdupa(sc->dev);
 	loc = strchr(technology, '/');
@@ -694,20 +715,7 @@ static void *handle_statechange(struct statechange *sc)
 		return NULL;
 	}
 
-	AST_LIST_LOCK(&interfaces);
-	AST_LIST_TRAVERSE(&interfaces, curint, list) {
-		char *slash_pos;
-		ast_copy_string(interface, curint->interface, sizeof(interface));
-		if ((slash_pos = strchr(interface, '/')))
-			if ((slash_pos = strchr(slash_pos + 1, '/')))
-				*slash_pos = '\0';
-
-		if (!strcasecmp(interface, sc->dev))
-			break;
-	}
-	AST_LIST_UNLOCK(&interfaces);
-
-	if (!curint) {
+	if (update_status(sc->dev, sc->state)) {
 		if (option_debug > 2)
 			ast_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s) but we don't care because they're not a member of any queue.\n", technology, loc, sc->state, devstate2str(sc->state));
 		return NULL;
@@ -716,8 +724,6 @@ static void *handle_statechange(struct statechange *sc)
 	if (option_debug)
 		ast_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s)\n", technology, loc, sc->state, devstate2str(sc->state));
 
-	update_status(sc->dev, sc->state);
-
 	return NULL;
 }
 
@@ -919,93 +925,126 @@ static void clear_queue(struct call_queue *q)
 	q->wrapuptime = 0;
 }
 
-static int add_to_interfaces(const char *interface)
+static int member_interface_hash_fn(const void *obj, const int flags)
 {
-	struct member_interface *curint;
+	const struct member_interface *curint = obj;
 
-	AST_LIST_LOCK(&interfaces);
-	AST_LIST_TRAVERSE(&interfaces, curint, list) {
-		if (!strcasecmp(curint->interface, interface))
-			break;
-	}
+	return ast_str_case_hash(curint->interface);
+}
 
-	if (curint) {
-		AST_LIST_UNLOCK(&interfaces);
-		return 0;
-	}
+static int member_interface_cmp_fn(void *obj1, void *obj2, int flags)
+{
+	struct member_interface *int1 = obj1, *int2 = obj2;
 
-	if (option_debug)
-		ast_log(LOG_DEBUG, "Adding %s to the list of interfaces that make up all of our queue members.\n", interface);
-	
-	if ((curint = ast_calloc(1, sizeof(*curint)))) {
-		ast_copy_string(curint->interface, interface, sizeof(curint->interface));
-		AST_LIST_INSERT_HEAD(&interfaces, curint, list);
-	}
-	AST_LIST_UNLOCK(&interfaces);
+	return strcasecmp(int1->interface, int2->interface) ? 0 : CMP_MATCH | CMP_STOP;
+}
 
-	return 0;
+static void member_interface_destructor(void *obj)
+{
+	struct member_interface *curint = obj;
+
+	if (curint->memberships)
+		ao2_ref(curint->memberships, -1);
 }
 
-static int interface_exists_global(const char *interface)
+static void membership_destructor(void *obj)
 {
-	struct call_queue *q;
-	struct member *mem;
-	struct ao2_iterator mem_iter;
-	int ret = 0;
+	struct membership *m = obj;
 
-	AST_LIST_LOCK(&queues);
-	AST_LIST_TRAVERSE(&queues, q, list) {
-		ao2_lock(q);
-		mem_iter = ao2_iterator_init(q->members, 0);
-		while ((mem = ao2_iterator_next(&mem_iter))) {
-			if (!strcasecmp(mem->state_interface, interface)) {
-				ao2_ref(mem, -1);
-				ret = 1;
-				break;
-			}
-			ao2_ref(mem, -1);
+	ao2_ref(m->member, -1);
+	ao2_ref(m->q, -1);
+}
+
+static int membership_match(void *obj, void *arg, int flags)
+{
+	struct membership *m = obj;
+
+	return m->member == arg ? CMP_MATCH : 0;
+}
+
+/*! \brief Index a member of a queue under the device it reads its state from
+ * \note Queues must drop their members from the index before they leave the
+ * queue list, see remove_queue_from_interfaces(), as the index holds a
+ * reference to them.
+ */
+static int add_to_interfaces(struct call_queue *q, struct member *mem)
+{
+	struct member_interface *curint, tmpint;
+	struct membership *m;
+
+	interface_device(mem->state_interface, tmpint.interface, sizeof(tmpint.interface));
+
+	ao2_lock(interfaces);
+	if (!(curint = ao2_find(interfaces, &tmpint, OBJ_POINTER))) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "Adding %s to the list of interfaces that make up all of our queue members.\n", tmpint.interface);
+		if (!(curint = ao2_alloc(sizeof(*curint), member_interface_destructor))) {
+			ao2_unlock(interfaces);
+			return -1;
 		}
-		ao2_iterator_destroy(&mem_iter);
-		ao2_unlock(q);
-		if (ret)
-			break;
+		ast_copy_string(curint->interface, tmpint.interface, sizeof(curint->interface));
+		if (!(curint->memberships = ao2_container_alloc(1, NULL, NULL))) {
+			ao2_unlock(interfaces);
+			ao2_ref(curint, -1);
+			return -1;
+		}
+		ao2_link(interfaces, curint);
 	}
-	AST_LIST_UNLOCK(&queues);
 
-	return ret;
+	if ((m = ao2_alloc(sizeof(*m), membership_destructor))) {
+		ao2_ref(q, +1);
+		m->q = q;
+		ao2_ref(mem, +1);
+		m->member = mem;
+		ao2_link(curint->memberships, m);
+		ao2_ref(m, -1);
+	}
+	ao2_unlock(interfaces);
+	ao2_ref(curint, -1);
+
+	return m ? 0 : -1;
 }
 
-static int remove_from_interfaces(const char *interface)
+static int remove_from_interfaces(struct call_queue *q, struct member *mem)
 {
-	struct member_interface *curint;
+	struct member_interface *curint, tmpint;
 
-	if (interface_exists_global(interface))
-		return 0;
+	interface_device(mem->state_interface, tmpint.interface, sizeof(tmpint.interface));
 
-	AST_LIST_LOCK(&interfaces);
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&interfaces, curint, list) {
-		if (!strcasecmp(curint->interface, interface)) {
+	ao2_lock(interfaces);
+	if ((curint = ao2_find(interfaces, &tmpint, OBJ_POINTER))) {
+		ao2_callback(curint->memberships, OBJ_UNLINK | OBJ_NODATA, membership_match, mem);
+		if (!ao2_container_count(curint->memberships)) {
 			if (option_debug)
-				ast_log(LOG_DEBUG, "Removing %s from the list of interfaces that make up all of our queue members.\n", interface);
-			AST_LIST_REMOVE_CURRENT(&interfaces, list);
-			free(curint);
-			break;
+				ast_log(LOG_DEBUG, "Removing %s from the list of interfaces that make up all of our queue members.\n", curint->interface);
+			ao2_unlink(interfaces, curint);
 		}
+		ao2_ref(curint, -1);
 	}
-	AST_LIST_TRAVERSE_SAFE_END;
-	AST_LIST_UNLOCK(&interfaces);
+	ao2_unlock(interfaces);
 
 	return 0;
 }
 
-static void clear_and_free_interfaces(void)
+/*! \brief Drop all members of a queue from the index, as it leaves the queue list */
+static void remove_queue_from_interfaces(struct call_queue *q)
 {
-	struct member_interface *curint;
+	struct member *cur;
+	struct ao2_iterator mem_iter;
 
-	AST_LIST_LOCK(&interfaces);
-	while ((curint = AST_LIST_REMOVE_HEAD(&interfaces, list)))
-		free(curint);
-	AST_LIST_UNLOCK(&interfaces);
+	ao2_lock(q);
+	mem_iter = ao2_iterator_init(q->members, 0);
+	while ((cur = ao2_iterator_next(&mem_iter))) {
+		remove_from_interfaces(q, cur);
+		ao2_ref(cur, -1);
+	}
+	ao2_iterator_destroy(&mem_iter);
+	ao2_unlock(q);
+}
+
+static void clear_and_free_interfaces(void)
+{
+	ao2_callback(interfaces, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
 }
 
 /*! \brief Configure a queue parameter.
@@ -1190,7 +1229,7 @@ static void rt_handle_member_record(struct call_queue *q, char *interface, const
 		if ((m = create_queue_member(interface, membername, penalty, paused, state_interface))) {
 			m->dead = 0;
 			m->realtime = 1;
-			add_to_interfaces(m->state_interface);
+			add_to_interfaces(q, m);
 			ao2_link(q->members, m);
 			ao2_ref(m, -1);
 			m = NULL;
@@ -1201,9 +1240,9 @@ static void rt_handle_member_record(struct call_queue *q, char *interface, const
 		if (paused_str)
 			m->paused = paused;
 		if (strcasecmp(state_interface, m->state_interface)) {
-			remove_from_interfaces(m->state_interface);
+			remove_from_interfaces(q, m);
 			ast_copy_string(m->state_interface, state_interface, sizeof(m->state_interface));
-			add_to_interfaces(m->state_interface);
+			add_to_interfaces(q, m);
 		}
 		m->penalty = penalty;
 		ao2_ref(m, -1);
@@ -1219,7 +1258,7 @@ static void free_members(struct call_queue *q, int all)
 	while ((cur = ao2_iterator_next(&mem_iter))) {
 		if (all || !cur->dynamic) {
 			ao2_unlink(q->members, cur);
-			remove_from_interfaces(cur->state_interface);
+			remove_from_interfaces(q, cur);
 			q->membercount--;
 		}
 		ao2_ref(cur, -1);
@@ -1362,9 +1401,7 @@ static struct call_queue *find_queue_by_name_rt(const char *queuename, struct as
 	while ((m = ao2_iterator_next(&mem_iter))) {
 		if (m->dead) {
 			ao2_unlink(q->members, m);
-			ao2_unlock(q);
-			remove_from_interfaces(m->state_interface);
-			ao2_lock(q);
+			remove_from_interfaces(q, m);
 			q->membercount--;
 		}
 		ao2_ref(m, -1);
@@ -1435,9 +1472,7 @@ static void update_realtime_members(struct call_queue *q)
 	while ((m = ao2_iterator_next(&mem_iter))) {
 		if (m->dead) {
 			ao2_unlink(q->members, m);
-			ao2_unlock(q);
-			remove_from_interfaces(m->state_interface);
-			ao2_lock(q);
+			remove_from_interfaces(q, m);
 			q->membercount--;
 		}
 		ao2_ref(m, -1);
@@ -1546,6 +1581,7 @@ static int join_queue(char *queuename, struct queue_ent *qe, enum queue_result *
 		ast_copy_string(qe->announce, q->announce, sizeof(qe->announce));
 		ast_copy_string(qe->context, q->context, sizeof(qe->context));
 		q->count++;
+		distribute_queue(q);
 		res = 0;
 		manager_event(EVENT_FLAG_CALL, "Join",
 			"Channel: %s\r\nCallerID: %s\r\nCallerIDName: %s\r\nQueue: %s\r\nPosition: %d\r\nCount: %d\r\nUniqueid: %s\r\n",
@@ -1774,6 +1810,7 @@ static void leave_queue(struct queue_ent *qe)
 			prev = cur;
 		}
 	}
+	distribute_queue(q);
 	ao2_unlock(q);
 
 	if (q->dead && !q->count) {	
@@ -1848,6 +1885,50 @@ static int num_available_members(struct call_queue *q)
 	return avl;
 }
 
+/*! \brief Wake up a waiting caller, whose thread may be sleeping until its next recheck */
+static void wake_queue_ent(struct queue_ent *qe)
+{
+	if (qe->wakeup[1] > -1 && write(qe->wakeup[1], "", 1) < 0 && errno != EAGAIN)
+		ast_log(LOG_WARNING, "Unable to wake up '%s': %s\n", qe->chan->name, strerror(errno));
+}
+
+/*! \brief Give waiting callers their turn to call members
+ *
+ * Called with the queue locked whenever callers join or leave, start or stop
+ * calling members, or members change state, so that turns are decided once
+ * per event rather than by every waiting caller once a second.  The callers
+ * not already calling members, from the head of the queue and as many as
+ * there are available members, may try calling; those whose turn has just
+ * come are woken up.
+ */
+static void distribute_queue(struct call_queue *q)
+{
+	struct queue_ent *ch;
+	int avl, idx = 0;
+
+	q->distributed = time(NULL);
+	avl = num_available_members(q);
+
+	if (option_debug) {
+		ast_log(LOG_DEBUG, "There %s %d available %s in '%s'.\n", avl != 1 ? "are" : "is", avl, avl != 1 ? "members" : "member", q->name);
+	}
+
+	for (ch = q->head; ch; ch = ch->next) {
+		if (ch->pending)
+			continue;
+		/* Autofill and position check added to support autofill=no (as only calls
+		 * from the front of the queue are valid when autofill is disabled)
+		 */
+		if (idx++ < avl && (q->autofill || ch->pos == 1)) {
+			if (!ch->turn)
+				wake_queue_ent(ch);
+			ch->turn = 1;
+		} else {
+			ch->turn = 0;
+		}
+	}
+}
+
 /* traverse all defined queues which have calls waiting and contain this member
    return 0 if no other queue has precedence (higher weight) or 1 if found  */
 static int compare_weight(struct call_queue *rq, struct member *member)
@@ -2515,44 +2596,22 @@ static struct callattempt *wait_for_answer(struct queue_ent *qe, struct callatte
  */
 static int is_our_turn(struct queue_ent *qe)
 {
-	struct queue_ent *ch;
 	int res;
-	int avl;
-	int idx = 0;
-	/* This needs a lock. How many members are available to be served? */
-	ao2_lock(qe->parent);
-
-	avl = num_available_members(qe->parent);
-
-	ch = qe->parent->head;
-
-	if (option_debug) {
-		ast_log(LOG_DEBUG, "There %s %d available %s.\n", avl != 1 ? "are" : "is", avl, avl != 1 ? "members" : "member");
-	}
-
-	while ((idx < avl) && (ch) && (ch != qe)) {
-		if (!ch->pending)
-			idx++;
-		ch = ch->next;			
-	}
 
+	ao2_lock(qe->parent);
+	/* Turns are given out as things change; only catch up with what
+	 * went unnoticed, such as realtime members, once per recheck */
+	if (qe->parent->distributed != time(NULL))
+		distribute_queue(qe->parent);
+	res = qe->turn;
 	ao2_unlock(qe->parent);
-	/* If the queue entry is within avl [the number of available members] calls from the top ... 
-	 * Autofill and position check added to support autofill=no (as only calls
-	 * from the front of the queue are valid when autofill is disabled)
-	 */
-	if (ch && idx < avl && (qe->parent->autofill || qe->pos == 1)) {
-		if (option_debug)
-			ast_log(LOG_DEBUG, "It's our turn (%s).\n", qe->chan->name);
-		res = 1;
-	} else {
-		if (option_debug)
-			ast_log(LOG_DEBUG, "It's not our turn (%s).\n", qe->chan->name);
-		res = 0;
-	}
+
+	if (option_debug)
+		ast_log(LOG_DEBUG, "It's %sour turn (%s).\n", res ? "" : "not ", qe->chan->name);
 
 	return res;
 }
+
 /*! \brief The waiting areas for callers who are not actively calling members
  *
  * This function is one large loop. This function will return if a caller
@@ -2620,9 +2679,14 @@ static int wait_our_turn(struct queue_ent *qe, int ringing, enum queue_result *r
 			break;
 		}
 		
-		/* Wait a second before checking again */
-		if ((res = ast_waitfordigit(qe->chan, RECHECK * 1000))) {
-			if (res > 0 && !valid_exit(qe, res))
+		/* Wait a second before checking again, unless our turn comes first */
+		if ((res = ast_waitfordigit_full(qe->chan, RECHECK * 1000, -1, qe->wakeup[0]))) {
+			if (res == 1) {
+				char buf[16];
+
+				while (read(qe->wakeup[0], buf, sizeof(buf)) > 0);
+				res = 0;
+			} else if (res > 0 && !valid_exit(qe, res))
 				res = 0;
 			else
 				break;
@@ -3042,6 +3106,7 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
 	else
 		to = (qe->parent->timeout) ? qe->parent->timeout * 1000 : -1;
 	++qe->pending;
+	distribute_queue(qe->parent);
 	ao2_unlock(qe->parent);
 	ring_one(qe, outgoing, &numbusies);
 	if (need_weight)
@@ -3065,7 +3130,10 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
 	ao2_unlock(qe->parent);
 	peer = lpeer ? lpeer->chan : NULL;
 	if (!peer) {
+		ao2_lock(qe->parent);
 		qe->pending = 0;
+		distribute_queue(qe->parent);
+		ao2_unlock(qe->parent);
 		if (to) {
 			/* Must gotten hung up */
 			res = -1;
@@ -3523,8 +3591,9 @@ static int remove_from_queue(const char *queuename, const char *interface)
 				"MemberName: %s\r\n",
 				q->name, mem->interface, mem->membername);
 			ao2_unlink(q->members, mem);
-			remove_from_interfaces(mem->state_interface);
+			remove_from_interfaces(q, mem);
 			ao2_ref(mem, -1);
+			distribute_queue(q);
 
 			if (queue_persistent_members)
 				dump_queue_members(q);
@@ -3559,7 +3628,7 @@ static int add_to_queue(const char *queuename, const char *interface, const char
 	ao2_lock(q);
 	if ((old_member = interface_exists(q, interface)) == NULL) {
 		if ((new_member = create_queue_member(interface, membername, penalty, paused, state_interface))) {
-			add_to_interfaces(new_member->state_interface);
+			add_to_interfaces(q, new_member);
 			new_member->dynamic = 1;
 			ao2_link(q->members, new_member);
 			q->membercount++;
@@ -3580,6 +3649,7 @@ static int add_to_queue(const char *queuename, const char *interface, const char
 			
 			ao2_ref(new_member, -1);
 			new_member = NULL;
+			distribute_queue(q);
 
 			if (dump)
 				dump_queue_members(q);
@@ -3618,6 +3688,7 @@ static int set_member_paused(const char *queuename, const char *interface, int p
 				if (mem->paused == paused)
 					ast_log(LOG_DEBUG, "%spausing already-%spaused queue member %s:%s\n", (paused ? "" : "un"), (paused ? "" : "un"), q->name, interface);
 				mem->paused = paused;
+				distribute_queue(q);
 
 				if (queue_persistent_members)
 					dump_queue_members(q);
@@ -4132,6 +4203,13 @@ static int queue_exec(struct ast_channel *chan, void *data)
 	qe.last_periodic_announce_time = time(NULL);
 	qe.last_periodic_announce_sound = 0;
 	qe.valid_digits = 0;
+	if (pipe(qe.wakeup)) {
+		ast_log(LOG_WARNING, "Unable to create wakeup pipe: %s\n", strerror(errno));
+		qe.wakeup[0] = qe.wakeup[1] = -1;
+	} else {
+		fcntl(qe.wakeup[0], F_SETFL, fcntl(qe.wakeup[0], F_GETFL) | O_NONBLOCK);
+		fcntl(qe.wakeup[1], F_SETFL, fcntl(qe.wakeup[1], F_GETFL) | O_NONBLOCK);
+	}
 	if (!join_queue(args.queuename, &qe, &reason)) {
 		int makeannouncement = 0;
 
@@ -4301,6 +4379,10 @@ stop:
 		 * the queue_ent is about to be returned on the stack */
 		ao2_ref(qe.parent, -1);
 	}
+	if (qe.wakeup[0] > -1) {
+		close(qe.wakeup[0]);
+		close(qe.wakeup[1]);
+	}
 	ast_module_user_remove(lu);
 
 	return res;
@@ -4624,15 +4706,12 @@ static int reload_queues(void)
 						ast_copy_string(tmpmem.interface, interface, sizeof(tmpmem.interface));
 						cur = ao2_find(q->members, &tmpmem, OBJ_POINTER | OBJ_UNLINK);
 
-						/* Only attempt removing from interfaces list if the new state_interface is different than the old one */
-						if (cur && strcasecmp(cur->state_interface, state_interface)) {
-							remove_from_interfaces(cur->state_interface);
+						if (cur) {
+							remove_from_interfaces(q, cur);
 						}
 
 						newm = create_queue_member(interface, membername, penalty, cur ? cur->paused : 0, state_interface);
-						if (!cur || (cur && strcasecmp(cur->state_interface, state_interface))) {
-							add_to_interfaces(state_interface);
-						}
+						add_to_interfaces(q, newm);
 						ao2_link(q->members, newm);
 						ao2_ref(newm, -1);
 						newm = NULL;
@@ -4658,7 +4737,7 @@ static int reload_queues(void)
 
 					q->membercount--;
 					ao2_unlink(q->members, cur);
-					remove_from_interfaces(cur->state_interface);
+					remove_from_interfaces(q, cur);
 					ao2_ref(cur, -1);
 				}
 				ao2_iterator_destroy(&mem_iter);
@@ -4677,6 +4756,7 @@ static int reload_queues(void)
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&queues, q, list) {
 		if (q->dead) {
 			AST_LIST_REMOVE_CURRENT(&queues, list);
+			remove_queue_from_interfaces(q);
 			ao2_ref(q, -1);
 		} else {
 			ao2_lock(q);
@@ -5306,6 +5386,193 @@ static struct ast_cli_entry cli_queue[] = {
 	qrm_cmd_usage, complete_queue_remove_member, &cli_remove_queue_member_deprecated },
 };
 
+#ifdef TEST_FRAMEWORK
+/*! Queues, members of each and devices they share in the churn test */
+#define QUEUE_CHURN_QUEUES	300
+#define QUEUE_CHURN_MEMBERS	30
+#define QUEUE_CHURN_DEVICES	2000
+/*! Device state changes replayed against the index */
+#define QUEUE_CHURN_CHANGES	200000
+
+static int queue_churn_random(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7fff;
+}
+
+/*! \brief Set member status the way it was done before the index, by scanning every member */
+static void queue_churn_scan(struct call_queue **qs, const char *interface, int status)
+{
+	struct member *cur;
+	struct ao2_iterator mem_iter;
+	char device[80];
+	int i;
+
+	for (i = 0; i < QUEUE_CHURN_QUEUES; i++) {
+		ao2_lock(qs[i]);
+		mem_iter = ao2_iterator_init(qs[i]->members, 0);
+		while ((cur = ao2_iterator_next(&mem_iter))) {
+			interface_device(cur->state_interface, device, sizeof(device));
+			if (!strcasecmp(interface, device))
+				cur->status = status;
+			ao2_ref(cur, -1);
+		}
+		ao2_iterator_destroy(&mem_iter);
+		ao2_unlock(qs[i]);
+	}
+}
+
+/*! \brief Replay random state changes, by the index or by a scan of every member */
+static void queue_churn_replay(struct ast_test *test, const char *what, struct call_queue **qs, int *expect, int changes, unsigned int *seed)
+{
+	struct timeval start, diff;
+	char device[80];
+	int64_t us;
+	int i, dev, state;
+
+	start = ast_tvnow();
+	for (i = 0; i < changes; i++) {
+		dev = queue_churn_random(seed) % QUEUE_CHURN_DEVICES;
+		state = AST_DEVICE_NOT_INUSE + queue_churn_random(seed) % 6;
+		snprintf(device, sizeof(device), "Test/churn%d", dev);
+		if (qs)
+			queue_churn_scan(qs, device, state);
+		else
+			update_status(device, state);
+		expect[dev] = state;
+	}
+	diff = ast_tvsub(ast_tvnow(), start);
+	us = (int64_t) diff.tv_sec * 1000000 + diff.tv_usec;
+	ast_test_status_update(test, "%-14s %10.1f changes/ms\n", what, us ? (double) changes * 1000 / us : 0.0);
+}
+
+/*! \brief Check every member has the state last set for its device */
+static int queue_churn_check(struct ast_test *test, struct call_queue **qs, int *expect, int moved)
+{
+	struct member *cur;
+	struct ao2_iterator mem_iter;
+	int i, dev, want, bad = 0;
+
+	for (i = 0; i < QUEUE_CHURN_QUEUES; i++) {
+		mem_iter = ao2_iterator_init(qs[i]->members, 0);
+		while ((cur = ao2_iterator_next(&mem_iter))) {
+			want = sscanf(cur->state_interface, "Test/churn%30d", &dev) == 1 ? expect[dev] : moved;
+			if (cur->status != want && !bad++)
+				ast_test_status_update(test, "%s in %s has state %d, not %d\n", cur->interface, qs[i]->name, cur->status, want);
+			ao2_ref(cur, -1);
+		}
+		ao2_iterator_destroy(&mem_iter);
+	}
+
+	return bad;
+}
+
+AST_TEST_DEFINE(queue_devstate_churn)
+{
+	struct call_queue **qs;
+	struct member *mem, tmpmem;
+	char name[80], interface[80];
+	unsigned int seed = 42;
+	int *expect;
+	int i, j, dev, count, res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "queue_devstate_churn";
+		info->category = "apps/app_queue/";
+		info->summary = "device state changes of queue members";
+		info->description =
+			"Builds many queues whose members share devices, replays random device\n"
+			"state changes through the device index and through a scan of every\n"
+			"member, moves members to other devices, and checks every member ends up\n"
+			"with the state last set for its device.  Reports changes per millisecond.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	qs = ast_calloc(QUEUE_CHURN_QUEUES, sizeof(*qs));
+	expect = ast_calloc(QUEUE_CHURN_DEVICES, sizeof(*expect));
+	if (!qs || !expect) {
+		free(qs);
+		free(expect);
+		return AST_TEST_FAIL;
+	}
+	count = ao2_container_count(interfaces);
+
+	for (i = 0; i < QUEUE_CHURN_DEVICES; i++)
+		expect[i] = AST_DEVICE_INVALID;
+	for (i = 0; i < QUEUE_CHURN_QUEUES && res == AST_TEST_PASS; i++) {
+		snprintf(name, sizeof(name), "test-churn-%d", i);
+		if (!(qs[i] = alloc_queue(name))) {
+			res = AST_TEST_FAIL;
+			break;
+		}
+		init_queue(qs[i]);
+		qs[i]->maskmemberstatus = 1;
+		for (j = 0; j < QUEUE_CHURN_MEMBERS; j++) {
+			/* 67 is prime to the device count, so members of a queue never share a device */
+			dev = (i * 53 + j * 67) % QUEUE_CHURN_DEVICES;
+			snprintf(interface, sizeof(interface), "Test/churn%d", dev);
+			if (!(mem = create_queue_member(interface, NULL, 0, 0, NULL)) || add_to_interfaces(qs[i], mem)) {
+				if (mem)
+					ao2_ref(mem, -1);
+				res = AST_TEST_FAIL;
+				break;
+			}
+			ao2_link(qs[i]->members, mem);
+			ao2_ref(mem, -1);
+		}
+	}
+
+	if (res == AST_TEST_FAIL) {
+		ast_test_status_update(test, "Unable to build the queues\n");
+	} else {
+		queue_churn_replay(test, "member scan", qs, expect, QUEUE_CHURN_CHANGES / 100, &seed);
+		queue_churn_replay(test, "device index", NULL, expect, QUEUE_CHURN_CHANGES, &seed);
+		if (queue_churn_check(test, qs, expect, 0))
+			res = AST_TEST_FAIL;
+	}
+
+	if (res == AST_TEST_PASS) {
+		/* Move the first member of every third queue to a device of its own */
+		for (i = 0; i < QUEUE_CHURN_QUEUES; i += 3) {
+			snprintf(tmpmem.interface, sizeof(tmpmem.interface), "Test/churn%d", (i * 53) % QUEUE_CHURN_DEVICES);
+			if (!(mem = ao2_find(qs[i]->members, &tmpmem, OBJ_POINTER | OBJ_UNLINK)))
+				continue;
+			remove_from_interfaces(qs[i], mem);
+			ao2_ref(mem, -1);
+			snprintf(interface, sizeof(interface), "Test/moved%d", i);
+			if ((mem = create_queue_member(tmpmem.interface, NULL, 0, 0, interface))) {
+				add_to_interfaces(qs[i], mem);
+				ao2_link(qs[i]->members, mem);
+				ao2_ref(mem, -1);
+			}
+		}
+		for (i = 0; i < QUEUE_CHURN_QUEUES; i += 3) {
+			snprintf(interface, sizeof(interface), "Test/moved%d", i);
+			update_status(interface, AST_DEVICE_BUSY);
+		}
+		queue_churn_replay(test, "device index", NULL, expect, QUEUE_CHURN_CHANGES, &seed);
+		if (queue_churn_check(test, qs, expect, AST_DEVICE_BUSY))
+			res = AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < QUEUE_CHURN_QUEUES && qs[i]; i++) {
+		remove_queue_from_interfaces(qs[i]);
+		ao2_ref(qs[i], -1);
+	}
+	if (ao2_container_count(interfaces) != count) {
+		ast_test_status_update(test, "%d devices left in the index, not %d\n", ao2_container_count(interfaces), count);
+		res = AST_TEST_FAIL;
+	}
+	free(qs);
+	free(expect);
+
+	return res;
+}
+#endif
+
 static int unload_module(void)
 {
 	int res;
@@ -5339,6 +5606,9 @@ static int unload_module(void)
 	ast_module_user_hangup_all();
 
 	clear_and_free_interfaces();
+	ao2_ref(interfaces, -1);
+
+	AST_TEST_UNREGISTER(queue_devstate_churn);
 
 	return res;
 }
@@ -5347,6 +5617,9 @@ static int load_module(void)
 {
 	int res;
 
+	if (!(interfaces = ao2_container_alloc(MAX_INTERFACE_BUCKETS, member_interface_hash_fn, member_interface_cmp_fn)))
+		return AST_MODULE_LOAD_DECLINE;
+
 	if (!reload_queues())
 		return AST_MODULE_LOAD_DECLINE;
 
@@ -5375,6 +5648,8 @@ static int load_module(void)
 	res |= ast_custom_function_register(&queuewaitingcount_function);
 	res |= ast_devstate_add(statechange_queue, NULL);
 
+	AST_TEST_REGISTER(queue_devstate_churn);
+
 	return res;
 }
 
@@ -66,6 +66,10 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 316707 $")
 #include <sys/mman.h>
 #include <time.h>
 #include <dirent.h>
+#include <sys/poll.h>
+#ifdef HAVE_INOTIFY_INIT
+#include <sys/inotify.h>
+#endif
 #ifdef IMAP_STORAGE
 #include <ctype.h>
 #include <signal.h>
@@ -468,6 +472,298 @@ static int inprocess_count(const char *context, const char *mailbox, int delta)
 	return 0;
 }
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+/*! \brief How message counts of folders are kept, voicemail.conf mailboxindex option */
+enum vm_index_mode {
+	VM_INDEX_OFF,               /*!< Read the folder on every lookup */
+	VM_INDEX_MTIME,             /*!< Keep counts, checking the modification time of the folder on every lookup */
+	VM_INDEX_WATCH,             /*!< Keep counts, told of changes made outside app_voicemail by inotify */
+};
+
+static enum vm_index_mode vm_index_mode = VM_INDEX_WATCH;
+
+/*! \brief Message counts of a mailbox folder, so MWI checks need not read the spool */
+struct vm_index_entry {
+	int valid;                  /*!< Non-zero if the counts still reflect the folder */
+	int count;                  /*!< Number of messages */
+	int last;                   /*!< Highest message number, -1 if none */
+	time_t mtime;               /*!< Modification time of the folder when it was read */
+	time_t read;                /*!< When the folder was read */
+	int wd;                     /*!< inotify watch on the folder, -1 if none */
+	char dir[0];
+};
+
+/*! \brief Folders by path */
+static struct ao2_container *vm_index;
+/*! \brief Folders by inotify watch */
+static struct ao2_container *vm_index_watches;
+static int vm_index_fd = -1;
+static pthread_t vm_index_thread = AST_PTHREADT_NULL;
+
+static int vm_index_hash_fn(const void *obj, const int flags)
+{
+	const struct vm_index_entry *e = obj;
+	return ast_str_hash(e->dir);
+}
+
+static int vm_index_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct vm_index_entry *e = obj, *f = arg;
+	return !strcmp(e->dir, f->dir) ? CMP_MATCH : 0;
+}
+
+static int vm_index_watch_hash_fn(const void *obj, const int flags)
+{
+	const struct vm_index_entry *e = obj;
+	return e->wd;
+}
+
+static int vm_index_watch_cmp_fn(void *obj, void *arg, int flags)
+{
+	struct vm_index_entry *e = obj, *f = arg;
+	return e->wd == f->wd ? CMP_MATCH : 0;
+}
+
+static void vm_index_destructor(void *obj)
+{
+#ifdef HAVE_INOTIFY_INIT
+	struct vm_index_entry *e = obj;
+
+	if (e->wd > -1)
+		inotify_rm_watch(vm_index_fd, e->wd);
+#endif
+}
+
+static int vm_index_invalidate_cb(void *obj, void *arg, int flags)
+{
+	struct vm_index_entry *e = obj;
+
+	ao2_lock(e);
+	e->valid = 0;
+	ao2_unlock(e);
+
+	return 0;
+}
+
+/*! \brief Whether a file name is that of a message, the .txt file being what makes one */
+static int vm_index_msgnum(const char *name)
+{
+	int msgnum;
+	char extension[4];
+
+	if (sscanf(name, "msg%30d.%3s", &msgnum, extension) == 2 && !strcmp(extension, "txt"))
+		return msgnum;
+	return -1;
+}
+
+/*! \brief Read a folder into its entry, called with the entry locked */
+static int vm_index_read(struct vm_index_entry *e)
+{
+	DIR *msgdir;
+	struct dirent *msgdirent;
+	struct stat st;
+	int msgnum;
+
+	/* Note the time before reading, so a change made while reading is noticed next time */
+	if (stat(e->dir, &st) || !(msgdir = opendir(e->dir)))
+		return -1;
+
+	e->mtime = st.st_mtime;
+	e->read = time(NULL);
+	e->count = 0;
+	e->last = -1;
+	while ((msgdirent = readdir(msgdir))) {
+		if ((msgnum = vm_index_msgnum(msgdirent->d_name)) < 0)
+			continue;
+		e->count++;
+		if (msgnum < MAXMSGLIMIT && msgnum > e->last)
+			e->last = msgnum;
+	}
+	closedir(msgdir);
+
+	return 0;
+}
+
+/*!
+ * \brief Count the messages of a mailbox folder and find the highest message number in it
+ * \retval 0 on success
+ * \retval -1 if the folder could not be read
+ */
+static int vm_index_lookup(const char *dir, int *count, int *last)
+{
+	struct vm_index_entry *e, *tmp;
+	struct stat st;
+	size_t len = strlen(dir);
+	int res = 0;
+
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	tmp = alloca(sizeof(*tmp) + len + 1);
+	memset(tmp, 0, sizeof(*tmp));
+	ast_copy_string(tmp->dir, dir, len + 1);
+
+	if (vm_index_mode == VM_INDEX_OFF) {
+		res = vm_index_read(tmp);
+		*count = tmp->count;
+		*last = tmp->last;
+		return res;
+	}
+
+	ao2_lock(vm_index);
+	if (!(e = ao2_find(vm_index, tmp, OBJ_POINTER))) {
+		if (!(e = ao2_alloc(sizeof(*e) + len + 1, vm_index_destructor))) {
+			ao2_unlock(vm_index);
+			res = vm_index_read(tmp);
+			*count = tmp->count;
+			*last = tmp->last;
+			return res;
+		}
+		strcpy(e->dir, tmp->dir); /* SAFE */
+		e->wd = -1;
+		ao2_link(vm_index, e);
+	}
+	ao2_unlock(vm_index);
+
+	ao2_lock(e);
+	/* Without a watch, a folder changed by someone else is only noticed by its
+	 * modification time, which can not be trusted within the second it was read in */
+	if (e->valid && e->wd < 0 && (stat(e->dir, &st) || st.st_mtime != e->mtime || e->mtime >= e->read))
+		e->valid = 0;
+	if (!e->valid) {
+#ifdef HAVE_INOTIFY_INIT
+		/* Watch before reading, so nothing changed from here on goes unnoticed */
+		if (vm_index_mode == VM_INDEX_WATCH && e->wd < 0 && vm_index_fd > -1 &&
+			(e->wd = inotify_add_watch(vm_index_fd, e->dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)) > -1) {
+			ao2_link(vm_index_watches, e);
+		}
+#endif
+		if (!(res = vm_index_read(e)))
+			e->valid = 1;
+	}
+	*count = e->count;
+	*last = e->last;
+	ao2_unlock(e);
+	/* Don't keep folders that can not be read, such as those of mailboxes
+	 * that never got any messages, or the index grows with every lookup */
+	if (res) {
+		ao2_unlink(vm_index_watches, e);
+		ao2_unlink(vm_index, e);
+	}
+	ao2_ref(e, -1);
+
+	return res;
+}
+
+/*! \brief Note that app_voicemail changed a message file, so its folder is read again */
+static void vm_index_changed(const char *file)
+{
+	struct vm_index_entry *e, *tmp;
+	const char *slash;
+
+	if (!(slash = strrchr(file, '/')))
+		return;
+	tmp = alloca(sizeof(*tmp) + (slash - file) + 1);
+	ast_copy_string(tmp->dir, file, (slash - file) + 1);
+	if ((e = ao2_find(vm_index, tmp, OBJ_POINTER))) {
+		vm_index_invalidate_cb(e, NULL, 0);
+		ao2_ref(e, -1);
+	}
+}
+
+/*! \brief Forget all folders, as when the way they are kept changes */
+static void vm_index_flush(void)
+{
+	ao2_callback(vm_index_watches, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
+	ao2_callback(vm_index, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL);
+}
+
+#ifdef HAVE_INOTIFY_INIT
+/*! \brief Note changes to watched folders made by anyone, app_voicemail included */
+static void *vm_index_watch(void *data)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct vm_index_entry *e, tmp;
+	struct pollfd pfd = { .fd = vm_index_fd, .events = POLLIN };
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		/* Only waiting may be cancelled, never with an entry locked */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (poll(&pfd, 1, -1) < 1)
+			continue;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if ((len = read(vm_index_fd, buf, sizeof(buf))) < 1)
+			continue;
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				ast_log(LOG_NOTICE, "Voicemail folder changes were lost, reading all folders again\n");
+				ao2_callback(vm_index, OBJ_NODATA, vm_index_invalidate_cb, NULL);
+				continue;
+			}
+			/* Recordings and locks come and go without changing the counts */
+			if (ev->len && !(ev->mask & IN_ISDIR) && vm_index_msgnum(ev->name) < 0)
+				continue;
+			tmp.wd = ev->wd;
+			if (!(e = ao2_find(vm_index_watches, &tmp, OBJ_POINTER)))
+				continue;
+			ao2_lock(e);
+			e->valid = 0;
+			if (ev->mask & IN_IGNORED) {
+				/* The folder is gone, or was moved away */
+				ao2_unlink(vm_index_watches, e);
+				e->wd = -1;
+			}
+			ao2_unlock(e);
+			ao2_ref(e, -1);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+static int vm_index_start(void)
+{
+	if (!(vm_index = ao2_container_alloc(1567, vm_index_hash_fn, vm_index_cmp_fn)))
+		return -1;
+	if (!(vm_index_watches = ao2_container_alloc(1567, vm_index_watch_hash_fn, vm_index_watch_cmp_fn))) {
+		ao2_ref(vm_index, -1);
+		return -1;
+	}
+#ifdef HAVE_INOTIFY_INIT
+	if ((vm_index_fd = inotify_init()) < 0) {
+		ast_log(LOG_WARNING, "Unable to watch voicemail folders, checking their modification times instead: %s\n", strerror(errno));
+	} else if (ast_pthread_create_background(&vm_index_thread, NULL, vm_index_watch, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start voicemail folder watch thread, checking modification times instead\n");
+		close(vm_index_fd);
+		vm_index_fd = -1;
+	}
+#endif
+	return 0;
+}
+
+static void vm_index_shutdown(void)
+{
+	if (vm_index_thread != AST_PTHREADT_NULL) {
+		pthread_cancel(vm_index_thread);
+		pthread_join(vm_index_thread, NULL);
+		vm_index_thread = AST_PTHREADT_NULL;
+	}
+	vm_index_flush();
+	if (vm_index_fd > -1) {
+		close(vm_index_fd);
+		vm_index_fd = -1;
+	}
+	ao2_ref(vm_index_watches, -1);
+	ao2_ref(vm_index, -1);
+}
+#else
+#define vm_index_changed(file)
+#endif
+
 #ifdef ODBC_STORAGE
 static char odbc_database[80];
 static char odbc_table[80];
@@ -2926,19 +3222,13 @@ static int count_messages(struct ast_vm_user *vmu, char *dir)
 	/* Find all .txt files - even if they are not in sequence from 0000 */
 
 	int vmcount = 0;
-	DIR *vmdir = NULL;
-	struct dirent *vment = NULL;
+	int last;
 
 	if (vm_lock_path(dir))
 		return ERROR_LOCK_PATH;
 
-	if ((vmdir = opendir(dir))) {
-		while ((vment = readdir(vmdir))) {
-			if (strlen(vment->d_name) > 7 && !strncmp(vment->d_name + 7, ".txt", 4)) 
-				vmcount++;
-		}
-		closedir(vmdir);
-	}
+	if (vm_index_lookup(dir, &vmcount, &last))
+		vmcount = 0;
 	ast_unlock_path(dir);
 	
 	return vmcount;
@@ -2952,6 +3242,8 @@ static void rename_file(char *sfn, char *dfn)
 	snprintf(stxt, sizeof(stxt), "%s.txt", sfn);
 	snprintf(dtxt, sizeof(dtxt), "%s.txt", dfn);
 	rename(stxt, dtxt);
+	vm_index_changed(sfn);
+	vm_index_changed(dfn);
 }
 #endif
 
@@ -2969,42 +3261,13 @@ static void rename_file(char *sfn, char *dfn)
 #if (!defined(IMAP_STORAGE) && !defined(ODBC_STORAGE))
 static int last_message_index(struct ast_vm_user *vmu, char *dir)
 {
-	int x;
-	unsigned char map[MAXMSGLIMIT] = "";
-	DIR *msgdir;
-	struct dirent *msgdirent;
-	int msgdirint;
-	char extension[4];
-	int stopcount = 0;
+	int count, last;
 
-	/* Reading the entire directory into a file map scales better than
-	 * doing a stat repeatedly on a predicted sequence.  I suspect this
-	 * is partially due to stat(2) internally doing a readdir(2) itself to
-	 * find each file. */
-	if (!(msgdir = opendir(dir))) {
+	if (vm_index_lookup(dir, &count, &last))
 		return -1;
-	}
 
-	while ((msgdirent = readdir(msgdir))) {
-		if (sscanf(msgdirent->d_name, "msg%30d.%3s", &msgdirint, extension) == 2 && !strcmp(extension, "txt") && msgdirint < MAXMSGLIMIT) {
-			map[msgdirint] = 1;
-			stopcount++;
-			if (option_debug > 3) {
-				ast_log(LOG_DEBUG, "%s map[%d] = %d, count = %d\n", dir, msgdirint, map[msgdirint], stopcount);
-			}
-		}
-	}
-	closedir(msgdir);
-
-	for (x = 0; x < vmu->maxmsg; x++) {
-		if (map[x] == 1) {
-			stopcount--;
-		} else if (map[x] == 0 && !stopcount) {
-			break;
-		}
-	}
-
-	return x - 1;
+	/* Messages are only looked for up to the folder's limit */
+	return last < vmu->maxmsg ? last : vmu->maxmsg - 1;
 }
 #endif
 #endif
@@ -3095,6 +3358,7 @@ static void copy_plain_file(char *frompath, char *topath)
 	snprintf(frompath2, sizeof(frompath2), "%s.txt", frompath);
 	snprintf(topath2, sizeof(topath2), "%s.txt", topath);
 	copy(frompath2, topath2);
+	vm_index_changed(topath);
 }
 #endif
 
@@ -3111,6 +3375,7 @@ static int vm_delete(char *file)
 	 */
 	snprintf(txt, txtsize, "%s.txt", file);
 	unlink(txt);
+	vm_index_changed(file);
 	return ast_filedelete(file, NULL);
 }
 #endif
@@ -4089,10 +4354,9 @@ static int messagecount(const char *context, const char *mailbox, const char *fo
 
 static int __has_voicemail(const char *context, const char *mailbox, const char *folder, int shortcircuit)
 {
-	DIR *dir;
-	struct dirent *de;
 	char fn[256];
-	int ret = 0;
+	int count, last;
+
 	if (!folder)
 		folder = "INBOX";
 	/* If no mailbox, return immediately */
@@ -4101,20 +4365,9 @@ static int __has_voicemail(const char *context, const char *mailbox, const char
 	if (!context)
 		context = "default";
 	snprintf(fn, sizeof(fn), "%s%s/%s/%s", VM_SPOOL_DIR, context, mailbox, folder);
-	dir = opendir(fn);
-	if (!dir)
+	if (vm_index_lookup(fn, &count, &last))
 		return 0;
-	while ((de = readdir(dir))) {
-		if (!strncasecmp(de->d_name, "msg", 3)) {
-			if (shortcircuit) {
-				ret = 1;
-				break;
-			} else if (!strncasecmp(de->d_name + 8, "txt", 3))
-				ret++;
-		}
-	}
-	closedir(dir);
-	return ret;
+	return shortcircuit ? count > 0 : count;
 }
 
 
@@ -4551,6 +4804,7 @@ static int leave_voicemail(struct ast_channel *chan, char *ext, struct leave_vm_
 					snprintf(txtfile, sizeof(txtfile), "%s.txt", fn);
 					ast_filerename(tmptxtfile, fn, NULL);
 					rename(tmptxtfile, txtfile);
+					vm_index_changed(fn);
 					inprocess_count(vmu->mailbox, vmu->context, -1);
 
 					ast_unlock_path(dir);
@@ -8683,6 +8937,10 @@ static int load_config(void)
 	const char *extpc;
 	const char *emaildateformatstr;
 	const char *volgainstr;
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	const char *indexstr;
+	enum vm_index_mode indexmode = VM_INDEX_WATCH;
+#endif
 	int x;
 	int tmpadsi[4];
 
@@ -8748,6 +9006,21 @@ static int load_config(void)
 			}
 		}
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+		if ((indexstr = ast_variable_retrieve(cfg, "general", "mailboxindex"))) {
+			if (!strcasecmp(indexstr, "mtime"))
+				indexmode = VM_INDEX_MTIME;
+			else if (ast_false(indexstr))
+				indexmode = VM_INDEX_OFF;
+			else if (!ast_true(indexstr))
+				ast_log(LOG_WARNING, "Invalid mailboxindex value '%s'. Using default value 'yes'\n", indexstr);
+		}
+		if (indexmode != vm_index_mode) {
+			vm_index_mode = indexmode;
+			vm_index_flush();
+		}
+#endif
+
 		/* Load date format config for voicemail mail */
 		if ((emaildateformatstr = ast_variable_retrieve(cfg, "general", "emaildateformat"))) {
 			ast_copy_string(emaildateformat, emaildateformatstr, sizeof(emaildateformat));
@@ -9233,6 +9506,9 @@ static int unload_module(void)
 	ast_cli_unregister_multiple(cli_voicemail, sizeof(cli_voicemail) / sizeof(struct ast_cli_entry));
 	ast_uninstall_vm_functions();
 	ao2_ref(inprocess_container, -1);
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	vm_index_shutdown();
+#endif
 	
 	ast_module_user_hangup_all();
 
@@ -9261,6 +9537,13 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+#if !(defined(ODBC_STORAGE) || defined(IMAP_STORAGE))
+	if (vm_index_start()) {
+		ao2_ref(inprocess_container, -1);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+#endif
+
 	my_umask = umask(0);
 	umask(my_umask);
 	res = ast_register_application(app, vm_exec, synopsis_vm, descrip_vm);
@@ -68,18 +68,12 @@ AST_MUTEX_DEFINE_STATIC(pgsql_lock);
 
 static PGconn	*conn = NULL;
 
-static int pgsql_log(struct ast_cdr *cdr)
+/*! \brief Connect to the database if we are not yet
+ * \note pgsql_lock must be held.
+ */
+static void pgsql_connect(void)
 {
-	struct tm tm;
-	time_t t = cdr->start.tv_sec;
-	char sqlcmd[2048] = "", timestr[128];
 	char *pgerror;
-	PGresult *result;
-
-	ast_mutex_lock(&pgsql_lock);
-
-	ast_localtime(&t, &tm, NULL);
-	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
 
 	if ((!connected) && pghostname && pgdbuser && pgpassword && pgdbname) {
 		conn = PQsetdbLogin(pghostname, pgdbport, NULL, NULL, pgdbname, pgdbuser, pgpassword);
@@ -100,106 +94,231 @@ static int pgsql_log(struct ast_cdr *cdr)
 			conn = NULL;
 		}
 	}
+}
 
-	if (connected) {
-		char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
-		char *src=NULL, *dst=NULL, *uniqueid=NULL, *userfield=NULL;
-		int pgerr;
-
-		/* Maximum space needed would be if all characters needed to be escaped, plus a trailing NULL */
-		if ((clid = alloca(strlen(cdr->clid) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, clid, cdr->clid, strlen(cdr->clid), &pgerr);
-		if ((dcontext = alloca(strlen(cdr->dcontext) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dcontext, cdr->dcontext, strlen(cdr->dcontext), &pgerr);
-		if ((channel = alloca(strlen(cdr->channel) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, channel, cdr->channel, strlen(cdr->channel), &pgerr);
-		if ((dstchannel = alloca(strlen(cdr->dstchannel) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dstchannel, cdr->dstchannel, strlen(cdr->dstchannel), &pgerr);
-		if ((lastapp = alloca(strlen(cdr->lastapp) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, lastapp, cdr->lastapp, strlen(cdr->lastapp), &pgerr);
-		if ((lastdata = alloca(strlen(cdr->lastdata) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, lastdata, cdr->lastdata, strlen(cdr->lastdata), &pgerr);
-		if ((uniqueid = alloca(strlen(cdr->uniqueid) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, uniqueid, cdr->uniqueid, strlen(cdr->uniqueid), &pgerr);
-		if ((userfield = alloca(strlen(cdr->userfield) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, userfield, cdr->userfield, strlen(cdr->userfield), &pgerr);
-		if ((src = alloca(strlen(cdr->src) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, src, cdr->src, strlen(cdr->src), &pgerr);
-		if ((dst = alloca(strlen(cdr->dst) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dst, cdr->dst, strlen(cdr->dst), &pgerr);
-
-		/* Check for all alloca failures above at once */
-		if ((!clid) || (!dcontext) || (!channel) || (!dstchannel) || (!lastapp) || (!lastdata) || (!uniqueid) || (!userfield) || (!src) || (!dst)) {
-			ast_log(LOG_ERROR, "cdr_pgsql:  Out of memory error (insert fails)\n");
-			ast_mutex_unlock(&pgsql_lock);
-			return -1;
-		}
+/*! \brief Build the INSERT statement for a CDR
+ * \note pgsql_lock must be held, and the connection up.
+ */
+static int pgsql_build_insert(struct ast_cdr *cdr, char *sqlcmd, size_t len)
+{
+	struct tm tm;
+	time_t t = cdr->start.tv_sec;
+	char timestr[128];
+	char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
+	char *src=NULL, *dst=NULL, *uniqueid=NULL, *userfield=NULL;
+	int pgerr;
 
-		if (option_debug > 1)
-			ast_log(LOG_DEBUG, "cdr_pgsql: inserting a CDR record.\n");
+	ast_localtime(&t, &tm, NULL);
+	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
 
-		snprintf(sqlcmd,sizeof(sqlcmd),"INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
-				 "lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES"
-				 " ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%ld,%ld,'%s',%ld,'%s','%s','%s')",
-				 table, timestr, clid, src, dst, dcontext, channel, dstchannel, lastapp, lastdata,
-				 cdr->duration,cdr->billsec,ast_cdr_disp2str(cdr->disposition),cdr->amaflags, cdr->accountcode, uniqueid, userfield);
-		
-		if (option_debug > 2)
-			ast_log(LOG_DEBUG, "cdr_pgsql: SQL command executed:  %s\n",sqlcmd);
-		
-		/* Test to be sure we're still connected... */
-		/* If we're connected, and connection is working, good. */
-		/* Otherwise, attempt reconnect.  If it fails... sorry... */
+	/* Maximum space needed would be if all characters needed to be escaped, plus a trailing NULL */
+	if ((clid = alloca(strlen(cdr->clid) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, clid, cdr->clid, strlen(cdr->clid), &pgerr);
+	if ((dcontext = alloca(strlen(cdr->dcontext) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, dcontext, cdr->dcontext, strlen(cdr->dcontext), &pgerr);
+	if ((channel = alloca(strlen(cdr->channel) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, channel, cdr->channel, strlen(cdr->channel), &pgerr);
+	if ((dstchannel = alloca(strlen(cdr->dstchannel) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, dstchannel, cdr->dstchannel, strlen(cdr->dstchannel), &pgerr);
+	if ((lastapp = alloca(strlen(cdr->lastapp) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, lastapp, cdr->lastapp, strlen(cdr->lastapp), &pgerr);
+	if ((lastdata = alloca(strlen(cdr->lastdata) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, lastdata, cdr->lastdata, strlen(cdr->lastdata), &pgerr);
+	if ((uniqueid = alloca(strlen(cdr->uniqueid) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, uniqueid, cdr->uniqueid, strlen(cdr->uniqueid), &pgerr);
+	if ((userfield = alloca(strlen(cdr->userfield) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, userfield, cdr->userfield, strlen(cdr->userfield), &pgerr);
+	if ((src = alloca(strlen(cdr->src) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, src, cdr->src, strlen(cdr->src), &pgerr);
+	if ((dst = alloca(strlen(cdr->dst) * 2 + 1)) != NULL)
+		PQescapeStringConn(conn, dst, cdr->dst, strlen(cdr->dst), &pgerr);
+
+	/* Check for all alloca failures above at once */
+	if ((!clid) || (!dcontext) || (!channel) || (!dstchannel) || (!lastapp) || (!lastdata) || (!uniqueid) || (!userfield) || (!src) || (!dst)) {
+		ast_log(LOG_ERROR, "cdr_pgsql:  Out of memory error (insert fails)\n");
+		return -1;
+	}
+
+	if (option_debug > 1)
+		ast_log(LOG_DEBUG, "cdr_pgsql: inserting a CDR record.\n");
+
+	snprintf(sqlcmd, len,"INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
+			 "lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES"
+			 " ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%ld,%ld,'%s',%ld,'%s','%s','%s')",
+			 table, timestr, clid, src, dst, dcontext, channel, dstchannel, lastapp, lastdata,
+			 cdr->duration,cdr->billsec,ast_cdr_disp2str(cdr->disposition),cdr->amaflags, cdr->accountcode, uniqueid, userfield);
+
+	return 0;
+}
+
+static int pgsql_log(struct ast_cdr *cdr)
+{
+	char sqlcmd[2048] = "";
+	char *pgerror;
+	PGresult *result;
+
+	ast_mutex_lock(&pgsql_lock);
+
+	pgsql_connect();
+
+	if (!connected) {
+		ast_mutex_unlock(&pgsql_lock);
+		return AST_CDR_BACKEND_DOWN;
+	}
+
+	if (pgsql_build_insert(cdr, sqlcmd, sizeof(sqlcmd))) {
+		ast_mutex_unlock(&pgsql_lock);
+		return -1;
+	}
+
+	if (option_debug > 2)
+		ast_log(LOG_DEBUG, "cdr_pgsql: SQL command executed:  %s\n",sqlcmd);
+	
+	/* Test to be sure we're still connected... */
+	/* If we're connected, and connection is working, good. */
+	/* Otherwise, attempt reconnect.  If it fails... sorry... */
+	if (PQstatus(conn) == CONNECTION_OK) {
+		connected = 1;
+	} else {
+		ast_log(LOG_ERROR, "cdr_pgsql: Connection was lost... attempting to reconnect.\n");
+		PQreset(conn);
 		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
 			connected = 1;
 		} else {
-			ast_log(LOG_ERROR, "cdr_pgsql: Connection was lost... attempting to reconnect.\n");
-			PQreset(conn);
-			if (PQstatus(conn) == CONNECTION_OK) {
-				ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
-				connected = 1;
-			} else {
-				pgerror = PQerrorMessage(conn);
-				ast_log(LOG_ERROR, "cdr_pgsql: Unable to reconnect to database server %s. Calls will not be logged!\n", pghostname);
-				ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", pgerror);
-				PQfinish(conn);
-				conn = NULL;
-				connected = 0;
-				ast_mutex_unlock(&pgsql_lock);
-				return -1;
-			}
+			pgerror = PQerrorMessage(conn);
+			ast_log(LOG_ERROR, "cdr_pgsql: Unable to reconnect to database server %s.\n", pghostname);
+			ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", pgerror);
+			PQfinish(conn);
+			conn = NULL;
+			connected = 0;
+			ast_mutex_unlock(&pgsql_lock);
+			return AST_CDR_BACKEND_DOWN;
 		}
+	}
+	result = PQexec(conn, sqlcmd);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		pgerror = PQresultErrorMessage(result);
+		ast_log(LOG_ERROR,"cdr_pgsql: Failed to insert call detail record into database!\n");
+		ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
+		PQclear(result);
+		/* The server refused the record itself unless the connection went away */
+		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_mutex_unlock(&pgsql_lock);
+			return -1;
+		}
+		ast_log(LOG_ERROR,"cdr_pgsql: Connection was lost... attempting to reconnect.\n");
+		PQreset(conn);
+		if (PQstatus(conn) != CONNECTION_OK) {
+			ast_mutex_unlock(&pgsql_lock);
+			return AST_CDR_BACKEND_DOWN;
+		}
+		ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
 		result = PQexec(conn, sqlcmd);
 		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
 			pgerror = PQresultErrorMessage(result);
-			ast_log(LOG_ERROR,"cdr_pgsql: Failed to insert call detail record into database!\n");
+			ast_log(LOG_ERROR,"cdr_pgsql: HARD ERROR!  Insert failed again after reconnecting.\n");
 			ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
-			ast_log(LOG_ERROR,"cdr_pgsql: Connection may have been lost... attempting to reconnect.\n");
-			PQreset(conn);
-			if (PQstatus(conn) == CONNECTION_OK) {
-				ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
-				connected = 1;
-				PQclear(result);
-				result = PQexec(conn, sqlcmd);
-				if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-					pgerror = PQresultErrorMessage(result);
-					ast_log(LOG_ERROR,"cdr_pgsql: HARD ERROR!  Attempted reconnection failed.  DROPPING CALL RECORD!\n");
-					ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
-				}
-			}
-			ast_mutex_unlock(&pgsql_lock);
 			PQclear(result);
-			return -1;
+			ast_mutex_unlock(&pgsql_lock);
+			return PQstatus(conn) == CONNECTION_OK ? -1 : AST_CDR_BACKEND_DOWN;
 		}
-		PQclear(result);
 	}
+	PQclear(result);
 	ast_mutex_unlock(&pgsql_lock);
 	return 0;
 }
 
+/*! \brief Run a statement, returning 0 if it succeeded */
+static int pgsql_exec(const char *sqlcmd)
+{
+	PGresult *result;
+	int res = 0;
+
+	result = PQexec(conn, sqlcmd);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", PQresultErrorMessage(result));
+		res = -1;
+	}
+	PQclear(result);
+	return res;
+}
+
+/*! \brief Post a batch of CDRs in a single transaction
+ *
+ * If the server refuses any record the whole transaction is rolled back and
+ * -1 returned, so the core posts the records one at a time and sets aside
+ * the ones refused.  If the connection goes away the whole batch is reported
+ * with AST_CDR_BACKEND_DOWN and the core keeps it for a later retry.
+ */
+static int pgsql_log_batch(struct ast_cdr **cdrs, int count)
+{
+	char sqlcmd[2048];
+	int i, res = 0;
+
+	ast_mutex_lock(&pgsql_lock);
+
+	pgsql_connect();
+
+	if (connected && PQstatus(conn) != CONNECTION_OK) {
+		ast_log(LOG_ERROR, "cdr_pgsql: Connection was lost... attempting to reconnect.\n");
+		PQreset(conn);
+		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
+		} else {
+			ast_log(LOG_ERROR, "cdr_pgsql: Unable to reconnect to database server %s.\n", pghostname);
+			ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", PQerrorMessage(conn));
+			PQfinish(conn);
+			conn = NULL;
+			connected = 0;
+		}
+	}
+
+	if (!connected) {
+		ast_mutex_unlock(&pgsql_lock);
+		return AST_CDR_BACKEND_DOWN;
+	}
+
+	if (pgsql_exec("BEGIN")) {
+		ast_mutex_unlock(&pgsql_lock);
+		return PQstatus(conn) == CONNECTION_OK ? -1 : AST_CDR_BACKEND_DOWN;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (pgsql_build_insert(cdrs[i], sqlcmd, sizeof(sqlcmd))) {
+			res = -1;
+			break;
+		}
+		if (option_debug > 2)
+			ast_log(LOG_DEBUG, "cdr_pgsql: SQL command executed:  %s\n", sqlcmd);
+		if (pgsql_exec(sqlcmd)) {
+			res = -1;
+			break;
+		}
+	}
+
+	if (!res && pgsql_exec("COMMIT"))
+		res = -1;
+	if (res) {
+		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_log(LOG_WARNING, "cdr_pgsql: Batch of %d call detail records failed at record %s, posting them one at a time\n", count, i < count ? cdrs[i]->uniqueid : "COMMIT");
+			pgsql_exec("ROLLBACK");
+		} else {
+			ast_log(LOG_ERROR, "cdr_pgsql: Failed to store a batch of %d call detail records\n", count);
+			res = AST_CDR_BACKEND_DOWN;
+		}
+	}
+
+	ast_mutex_unlock(&pgsql_lock);
+	return res;
+}
+
 static int my_unload_module(void)
 { 
+	ast_cdr_unregister(name);
 	PQfinish(conn);
+	conn = NULL;
+	connected = 0;
 	if (pghostname)
 		free(pghostname);
 	if (pgdbname)
@@ -215,7 +334,6 @@ static int my_unload_module(void)
 	if (encoding) {
 		free(encoding);
 	}
-	ast_cdr_unregister(name);
 	return 0;
 }
 
@@ -315,7 +433,7 @@ static int process_my_load_module(struct ast_config *cfg)
 		connected = 0;
 	}
 
-	return ast_cdr_register(name, ast_module_info->description, pgsql_log);
+	return ast_cdr_register_batch(name, ast_module_info->description, pgsql_log, pgsql_log_batch);
 }
 
 static int my_load_module(void)
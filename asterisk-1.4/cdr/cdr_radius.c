@@ -232,7 +232,10 @@ return_cleanup:
 		rc_avpair_free(send);
 	}
 
-	return result;
+	/* No answer from any server is the only failure worth retrying */
+	if (result == TIMEOUT_RC)
+		return AST_CDR_BACKEND_DOWN;
+	return result == OK_RC ? 0 : -1;
 }
 
 static int unload_module(void)
@@ -162,6 +162,12 @@ static int sqlite_log(struct ast_cdr *cdr)
 	}
 
 	ast_mutex_unlock(&sqlite_lock);
+
+	/* Only a database we can not get at is worth retrying, any other error
+	 * is about this record */
+	if (res == SQLITE_BUSY || res == SQLITE_LOCKED || res == SQLITE_FULL ||
+	    res == SQLITE_IOERR || res == SQLITE_CANTOPEN)
+		return AST_CDR_BACKEND_DOWN;
 	return res;
 }
 
@@ -235,10 +235,11 @@ static AST_LIST_HEAD_STATIC(agents, agent_pvt);	/*!< Holds the list of agents (l
 	int x; \
 	if (p->chan) { \
 		for (x=0;x<AST_MAX_FDS;x++) {\
-			if (x != AST_TIMING_FD) \
-				ast->fds[x] = p->chan->fds[x]; \
+			if (x != AST_TIMING_FD && ast->fds[x] != p->chan->fds[x]) \
+				ast_channel_set_fd(ast, x, p->chan->fds[x]); \
 		} \
-		ast->fds[AST_AGENT_FD] = p->chan->fds[AST_TIMING_FD]; \
+		if (ast->fds[AST_AGENT_FD] != p->chan->fds[AST_TIMING_FD]) \
+			ast_channel_set_fd(ast, AST_AGENT_FD, p->chan->fds[AST_TIMING_FD]); \
 	} \
 } while(0)
 
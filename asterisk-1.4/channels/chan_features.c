@@ -171,8 +171,8 @@ static void restore_channel(struct feature_pvt *p, int index)
 	p->subs[index].owner->timingfd = p->subs[index].timingfdbackup;
 	p->subs[index].owner->alertpipe[0] = p->subs[index].alertpipebackup[0];
 	p->subs[index].owner->alertpipe[1] = p->subs[index].alertpipebackup[1];
-	p->subs[index].owner->fds[AST_ALERT_FD] = p->subs[index].alertpipebackup[0];
-	p->subs[index].owner->fds[AST_TIMING_FD] = p->subs[index].timingfdbackup;
+	ast_channel_set_fd(p->subs[index].owner, AST_ALERT_FD, p->subs[index].alertpipebackup[0]);
+	ast_channel_set_fd(p->subs[index].owner, AST_TIMING_FD, p->subs[index].timingfdbackup);
 }
 
 static void update_features(struct feature_pvt *p, int index)
@@ -180,10 +180,11 @@ static void update_features(struct feature_pvt *p, int index)
 	int x;
 	if (p->subs[index].owner) {
 		for (x=0; x<AST_MAX_FDS; x++) {
-			if (index) 
-				p->subs[index].owner->fds[x] = -1;
-			else
-				p->subs[index].owner->fds[x] = p->subchan->fds[x];
+			int fd = index ? -1 : p->subchan->fds[x];
+
+			/* This runs for every frame, so only touch the fds that changed */
+			if (p->subs[index].owner->fds[x] != fd)
+				ast_channel_set_fd(p->subs[index].owner, x, fd);
 		}
 		if (!index) {
 			/* Copy timings from master channel */
@@ -603,7 +603,7 @@ static int local_call(struct ast_channel *ast, char *dest, int timeout)
 		if ((new = ast_calloc(1, len))) {
 			memcpy(new, varptr, len);
 			new->value = &(new->name[0]) + namelen + 1;
-			AST_LIST_INSERT_TAIL(&p->chan->varshead, new, entries);
+			ast_var_insert_tail(&p->chan->varshead, new);
 		}
 	}
 	ast_channel_datastore_inherit(p->owner, p->chan);
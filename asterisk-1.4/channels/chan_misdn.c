@@ -3421,7 +3421,7 @@ static void update_name(struct ast_channel *tmp, int port, int c)
 	if (c < 0)
 		c = 0;
 
-	ast_string_field_build(tmp, name, "%s/%d-u%d",
+	ast_channel_set_name(tmp, "%s/%d-u%d",
 		misdn_type, chan_offset + c, glob_channel++);
 
 	chan_misdn_log(3, port, " --> updating channel name to [%s]\n", tmp->name);
@@ -3483,7 +3483,7 @@ static struct ast_channel *misdn_new(struct chan_list *chlist, int state,  char
 
 		if (pipe(chlist->pipe) < 0)
 			perror("Pipe failed\n");
-		tmp->fds[0] = chlist->pipe[0];
+		ast_channel_set_fd(tmp, 0, chlist->pipe[0]);
 
 		if (state == AST_STATE_RING)
 			tmp->rings = 1;
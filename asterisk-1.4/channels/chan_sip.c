@@ -175,6 +175,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 325275 $")
 #define DEFAULT_MAX_EXPIRY      3600
 #define DEFAULT_REGISTRATION_TIMEOUT 20
 #define DEFAULT_MAX_FORWARDS    "70"
+#define DEFAULT_SIPWORKERS      0		/*!< SIP worker threads, 0 reads the SIP socket in the monitor thread */
+#define SIP_MAX_WORKERS         64		/*!< Maximum number of SIP worker threads */
+#define SIP_RECV_BATCH          16		/*!< Maximum number of messages a SIP worker reads at once */
 
 /* guard limit must be larger than guard secs */
 /* guard min must be < 1000, and should be >= 250 */
@@ -558,6 +561,7 @@ static int global_rtpholdtimeout;
 static int global_rtpkeepalive;		/*!< Send RTP keepalives */
 static int global_reg_timeout;	
 static int global_regattempts_max;	/*!< Registration attempts before giving up */
+static int global_sipworkers;		/*!< Number of SIP worker threads reading the SIP socket */
 static int global_shrinkcallerid;	/*!< enable or disable shrinking of caller id  */
 static int global_allowguest;		/*!< allow unauthenticated users/peers to connect? */
 static int global_allowsubscribe;	/*!< Flag for disabling ALL subscriptions, this is FALSE only if all peers are FALSE 
@@ -597,13 +601,16 @@ static int regobjs = 0;                  /*!< Registry objects */
 
 static struct ast_flags global_flags[2] = {{0}};        /*!< global SIP_ flags */
 
-/*! \brief Protect the SIP dialog list (of sip_pvt's) */
-AST_MUTEX_DEFINE_STATIC(iflock);
+/*! \brief Serializes SIP message handling against the monitor thread.
+   It is held for reading while a message that only affects its own dialog is
+   handled, so SIP worker threads can handle those in parallel. It is held for
+   writing by messages touching peers, the registry or other dialogs, and by
+   the monitor thread while it reloads or runs the scheduler. Set up by
+   sip_netlock_init() so that the monitor thread is not starved by readers. */
+static ast_rwlock_t netlock;
 
 /*! \brief Protect the monitoring thread, so only one process can kill or start it, and not
    when it's doing something critical. */
-AST_MUTEX_DEFINE_STATIC(netlock);
-
 AST_MUTEX_DEFINE_STATIC(monlock);
 
 AST_MUTEX_DEFINE_STATIC(sip_reload_lock);
@@ -943,7 +950,7 @@ struct offered_media {
 	char text[128];
 };
 /*! \brief sip_pvt: PVT structures are used for each SIP dialog, ie. a call, a registration, a subscribe  */
-static struct sip_pvt {
+struct sip_pvt {
 	ast_mutex_t lock;			/*!< Dialog private lock */
 	int method;				/*!< SIP method that opened this dialog */
 	enum invitestates invitestate;		/*!< The state of the INVITE transaction only */
@@ -1064,7 +1071,8 @@ static struct sip_pvt {
 	int request_queue_sched_id;		/*!< Scheduler ID of any scheduled action to process queued requests */
 	struct provisional_keepalive_data *provisional_keepalive_data; /*!< Scheduler data for provisional responses that need to be sent out to avoid cancellation */
 	const char *last_provisional;   /*!< The last successfully transmitted provisonal response message */
-	struct sip_pvt *next;			/*!< Next dialog in chain */
+	struct sip_pvt *next;			/*!< Next dialog in the same dialog hash bucket */
+	struct sip_dialog_bucket *bucket;	/*!< Dialog hash bucket we are linked into, NULL if none */
 	struct sip_invite_param *options;	/*!< Options for INVITE */
 	int autoframing;
 	int hangupcause;			/*!< Storage of hangupcause copied from our owner before we disconnect from the AST channel (only used at hangup) */
@@ -1083,7 +1091,40 @@ static struct sip_pvt {
 	 * The large-scale changes would be a good idea for implementing during an SDP rewrite.
 	 */
 	struct offered_media offered_media[3];
-} *iflist = NULL;
+};
+
+/*! \brief Number of buckets in the dialog hash table (should be prime) */
+#ifdef LOW_MEMORY
+#define DIALOG_BUCKETS 17
+#else
+#define DIALOG_BUCKETS 563
+#endif
+
+/*! \brief A bucket of the SIP dialog hash table.
+ *
+ * Dialogs are hashed on their Call-ID.  Each bucket has its own lock, so
+ * looking up a dialog only serializes against dialogs that share its bucket,
+ * and walking all dialogs (monitor thread, CLI) holds one bucket at a time.
+ * Lock order is bucket lock, then sip_pvt lock.
+ */
+struct sip_dialog_bucket {
+	ast_mutex_t lock;		/*!< Protects the chain and the Call-ID of every dialog in it */
+	struct sip_pvt *head;		/*!< First dialog in this bucket */
+};
+
+/*! \brief The SIP dialog hash table (of sip_pvt's) */
+static struct sip_dialog_bucket dialogs[DIALOG_BUCKETS];
+
+/*! \brief A SIP worker thread, see sipworkers= in sip.conf */
+struct sip_worker {
+	pthread_t thread;
+	int stop;					/*!< Set to make the thread exit */
+	struct sip_request req[SIP_RECV_BATCH];		/*!< Receive buffers, cleared when not in use */
+	struct sockaddr_in sin[SIP_RECV_BATCH];		/*!< Source address of each message */
+};
+
+static struct sip_worker *sip_workers[SIP_MAX_WORKERS];	/*!< Running SIP worker threads */
+static int sip_workers_count;				/*!< Number of running SIP worker threads */
 
 /*! Max entires in the history list for a sip_pvt */
 #define MAX_HISTORY_ENTRIES 50
@@ -3388,10 +3429,49 @@ static void sip_registry_destroy(struct sip_registry *reg)
 	
 }
 
-/*! \brief Execute destruction of SIP dialog structure, release memory */
-static int __sip_destroy(struct sip_pvt *p, int lockowner)
+/*! \brief Find the dialog hash bucket for a Call-ID */
+static struct sip_dialog_bucket *dialog_bucket(const char *callid)
+{
+	return &dialogs[ast_str_hash(callid) % DIALOG_BUCKETS];
+}
+
+/*! \brief Add a dialog to the dialog hash table, keyed on its current Call-ID */
+static void dialog_link(struct sip_pvt *p)
+{
+	struct sip_dialog_bucket *bucket = dialog_bucket(p->callid);
+
+	ast_mutex_lock(&bucket->lock);
+	p->next = bucket->head;
+	bucket->head = p;
+	p->bucket = bucket;
+	ast_mutex_unlock(&bucket->lock);
+}
+
+/*! \brief Remove a dialog from the dialog hash table
+ * \note The bucket lock of the dialog must be held
+ * \return 0 if the dialog was unlinked, -1 if it was not in the table */
+static int dialog_unlink(struct sip_pvt *p)
 {
 	struct sip_pvt *cur, *prev = NULL;
+
+	if (!p->bucket)
+		return -1;
+
+	for (cur = p->bucket->head; cur; prev = cur, cur = cur->next) {
+		if (cur == p) {
+			UNLINK(cur, p->bucket->head, prev);
+			break;
+		}
+	}
+	p->next = NULL;
+	p->bucket = NULL;
+	return cur ? 0 : -1;
+}
+
+/*! \brief Execute destruction of SIP dialog structure, release memory
+ * \note The dialog hash bucket lock of the dialog must be held */
+static int __sip_destroy(struct sip_pvt *p, int lockowner)
+{
 	struct sip_pkt *cp;
 	struct sip_request *req;
 
@@ -3498,13 +3578,7 @@ static int __sip_destroy(struct sip_pvt *p, int lockowner)
 		ast_free(req);
 	}
 
-	for (prev = NULL, cur = iflist; cur; prev = cur, cur = cur->next) {
-		if (cur == p) {
-			UNLINK(cur, iflist, prev);
-			break;
-		}
-	}
-	if (!cur) {
+	if (dialog_unlink(p)) {
 		ast_log(LOG_WARNING, "Trying to destroy \"%s\", not found in dialog list?!?! \n", p->callid);
 		return 0;
 	} 
@@ -3657,11 +3731,15 @@ static int update_call_counter(struct sip_pvt *fup, int event)
 /*! \brief Destroy SIP call structure */
 static void sip_destroy(struct sip_pvt *p)
 {
-	ast_mutex_lock(&iflock);
+	struct sip_dialog_bucket *bucket = p->bucket;
+
+	if (bucket)
+		ast_mutex_lock(&bucket->lock);
 	if (option_debug > 2)
 		ast_log(LOG_DEBUG, "Destroying SIP dialog %s\n", p->callid);
 	__sip_destroy(p, 1);
-	ast_mutex_unlock(&iflock);
+	if (bucket)
+		ast_mutex_unlock(&bucket->lock);
 }
 
 /*! \brief Convert SIP hangup causes to Asterisk hangup causes */
@@ -4444,15 +4522,15 @@ static struct ast_channel *sip_new(struct sip_pvt *i, int state, const char *tit
 			ast_dsp_digitmode(i->vad, DSP_DIGITMODE_DTMF | DSP_DIGITMODE_RELAXDTMF);
 	}
 	if (i->rtp) {
-		tmp->fds[0] = ast_rtp_fd(i->rtp);
-		tmp->fds[1] = ast_rtcp_fd(i->rtp);
+		ast_channel_set_fd(tmp, 0, ast_rtp_fd(i->rtp));
+		ast_channel_set_fd(tmp, 1, ast_rtcp_fd(i->rtp));
 	}
 	if (needvideo && i->vrtp) {
-		tmp->fds[2] = ast_rtp_fd(i->vrtp);
-		tmp->fds[3] = ast_rtcp_fd(i->vrtp);
+		ast_channel_set_fd(tmp, 2, ast_rtp_fd(i->vrtp));
+		ast_channel_set_fd(tmp, 3, ast_rtcp_fd(i->vrtp));
 	}
 	if (i->udptl) {
-		tmp->fds[5] = ast_udptl_fd(i->udptl);
+		ast_channel_set_fd(tmp, 5, ast_udptl_fd(i->udptl));
 	}
 	if (state == AST_STATE_RING)
 		tmp->rings = 1;
@@ -4806,11 +4884,21 @@ static char *generate_random_string(char *buf, size_t size)
 static void build_callid_pvt(struct sip_pvt *pvt)
 {
 	char buf[33];
+	struct sip_dialog_bucket *bucket = pvt->bucket;
 
 	const char *host = S_OR(pvt->fromdomain, ast_inet_ntoa(pvt->ourip));
-	
+
+	/* The Call-ID is the dialog hash key, so move the dialog to its new bucket */
+	if (bucket) {
+		ast_mutex_lock(&bucket->lock);
+		dialog_unlink(pvt);
+		ast_mutex_unlock(&bucket->lock);
+	}
+
 	ast_string_field_build(pvt, callid, "%s@%s", generate_random_string(buf, sizeof(buf)), host);
 
+	if (bucket)
+		dialog_link(pvt);
 }
 
 /*! \brief Build SIP Call-ID value for a REGISTER transaction */
@@ -4959,10 +5047,7 @@ static struct sip_pvt *sip_alloc(ast_string_field callid, struct sockaddr_in *si
 	AST_LIST_HEAD_INIT_NOLOCK(&p->request_queue);
 
 	/* Add to active dialog list */
-	ast_mutex_lock(&iflock);
-	p->next = iflist;
-	iflist = p;
-	ast_mutex_unlock(&iflock);
+	dialog_link(p);
 	if (option_debug)
 		ast_log(LOG_DEBUG, "Allocating new SIP dialog for %s - %s (%s)\n", callid ? callid : "(No Call-ID)", sip_methods[intended_method].text, p->rtp ? "With RTP" : "No RTP");
 	return p;
@@ -5152,6 +5237,7 @@ static int process_via(struct sip_pvt *p, const struct sip_request *req)
 static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *sin, const int intended_method)
 {
 	struct sip_pvt *p = NULL;
+	struct sip_dialog_bucket *bucket;
 	char *tag = "";	/* note, tag is never NULL */
 	char totag[128];
 	char fromtag[128];
@@ -5183,8 +5269,10 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 			ast_log(LOG_DEBUG, "= Looking for  Call ID: %s (Checking %s) --From tag %s --To-tag %s  \n", callid, req->method==SIP_RESPONSE ? "To" : "From", fromtag, totag);
 	}
 
-	ast_mutex_lock(&iflock);
-	for (p = iflist; p; p = p->next) {
+	/* Only dialogs with this Call-ID can match, so we only need to look in its bucket */
+	bucket = dialog_bucket(callid);
+	ast_mutex_lock(&bucket->lock);
+	for (p = bucket->head; p; p = p->next) {
 		/* In pedantic, we do not want packets with bad syntax to be connected to a PVT */
 		int found = FALSE;
 		if (ast_strlen_zero(p->callid))
@@ -5217,11 +5305,10 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 		if (found) {
 			/* Found the call */
 			ast_mutex_lock(&p->lock);
-			ast_mutex_unlock(&iflock);
+			ast_mutex_unlock(&bucket->lock);
 			return p;
 		}
 	}
-	ast_mutex_unlock(&iflock);
 
 	/* See if the method is capable of creating a dialog */
 	if (sip_methods[intended_method].can_create == CAN_CREATE_DIALOG) {
@@ -5233,7 +5320,9 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 		   	like voicemail notification, so cancel that early */
 			transmit_response_using_temp(callid, sin, 1, intended_method, req, "481 No subscription");
 		} else {
-			/* Ok, time to create a new SIP dialog object, a pvt */
+			/* Ok, time to create a new SIP dialog object, a pvt.  The bucket is
+			   still locked, so a retransmission handled by another SIP worker
+			   can not create a second dialog for this Call-ID meanwhile. */
 			if ((p = sip_alloc(callid, sin, 1, intended_method)))  {
 				/* Ok, we've created a dialog, let's go and process it */
 				ast_mutex_lock(&p->lock);
@@ -5251,8 +5340,12 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 					ast_log(LOG_DEBUG, "Failed allocating SIP dialog, sending 500 Server internal error and giving up\n");
 			}
 		}
+		ast_mutex_unlock(&bucket->lock);
 		return p;
-	} else if( sip_methods[intended_method].can_create == CAN_CREATE_DIALOG_UNSUPPORTED_METHOD) {
+	}
+	ast_mutex_unlock(&bucket->lock);
+
+	if( sip_methods[intended_method].can_create == CAN_CREATE_DIALOG_UNSUPPORTED_METHOD) {
 		/* A method we do not support, let's take it on the volley */
 		transmit_response_using_temp(callid, sin, 1, intended_method, req, "501 Method Not Implemented");
 	} else if (intended_method != SIP_RESPONSE && intended_method != SIP_ACK) {
@@ -10232,15 +10325,16 @@ static int get_destination(struct sip_pvt *p, struct sip_request *oreq)
 static struct sip_pvt *get_sip_pvt_byid_locked(const char *callid, const char *totag, const char *fromtag) 
 {
 	struct sip_pvt *sip_pvt_ptr;
+	struct sip_dialog_bucket *bucket = dialog_bucket(callid);
 
-	ast_mutex_lock(&iflock);
+	ast_mutex_lock(&bucket->lock);
 
 	if (option_debug > 3 && totag) {
 		ast_log(LOG_DEBUG, "Looking for callid %s (fromtag %s totag %s)\n", callid, fromtag ? fromtag : "<no fromtag>", totag ? totag : "<no totag>");
 	}
 
-	/* Search interfaces and find the match */
-	for (sip_pvt_ptr = iflist; sip_pvt_ptr; sip_pvt_ptr = sip_pvt_ptr->next) {
+	/* Search the dialogs sharing this Call-ID's bucket and find the match */
+	for (sip_pvt_ptr = bucket->head; sip_pvt_ptr; sip_pvt_ptr = sip_pvt_ptr->next) {
 		if (!strcmp(sip_pvt_ptr->callid, callid)) {
 			int match = 1;
 
@@ -10290,7 +10384,7 @@ static struct sip_pvt *get_sip_pvt_byid_locked(const char *callid, const char *t
 			break;
 		}
 	}
-	ast_mutex_unlock(&iflock);
+	ast_mutex_unlock(&bucket->lock);
 	if (option_debug > 3 && !sip_pvt_ptr)
 		ast_log(LOG_DEBUG, "Found no match for callid %s to-tag %s from-tag %s\n", callid, totag, fromtag);
 	return sip_pvt_ptr;
@@ -12082,6 +12176,7 @@ static int sip_show_settings(int fd, int argc, char *argv[])
 	ast_cli(fd, "  MWI NOTIFY mime type:   %s\n", default_notifymime);
 	ast_cli(fd, "  DNS SRV lookup:         %s\n", srvlookup ? "Yes" : "No");
 	ast_cli(fd, "  Pedantic SIP support:   %s\n", pedanticsipchecking ? "Yes" : "No");
+	ast_cli(fd, "  SIP worker threads:     %d %s\n", sip_workers_count, sip_workers_count ? "" : "(Monitor thread reads)");
 	ast_cli(fd, "  Reg. min duration       %d secs\n", min_expiry);
 	ast_cli(fd, "  Reg. max duration:      %d secs\n", max_expiry);
 	ast_cli(fd, "  Reg. default duration:  %d secs\n", default_expiry);
@@ -12166,50 +12261,51 @@ static int __sip_show_channels(int fd, int argc, char *argv[], int subscriptions
 #define FORMAT2 "%-15.15s  %-15.15s  %-11.11s  %-11.11s  %-15.15s  %-7.7s  %-15.15s\n"
 #define FORMAT  "%-15.15s  %-15.15s  %-11.11s  %5.5d/%5.5d  %-15.15s  %-3.3s %-3.3s  %-15.15s %-10.10s\n"
 	struct sip_pvt *cur;
-	int numchans = 0;
+	int numchans = 0, i;
 	char *referstatus = NULL;
 
 	if (argc != 3)
 		return RESULT_SHOWUSAGE;
-	ast_mutex_lock(&iflock);
-	cur = iflist;
 	if (!subscriptions)
 		ast_cli(fd, FORMAT2, "Peer", "User/ANR", "Call ID", "Seq (Tx/Rx)", "Format", "Hold", "Last Message");
 	else 
 		ast_cli(fd, FORMAT3, "Peer", "User", "Call ID", "Extension", "Last state", "Type", "Mailbox");
-	for (; cur; cur = cur->next) {
-		referstatus = "";
-		if (cur->refer) { /* SIP transfer in progress */
-			referstatus = referstatus2str(cur->refer->status);
-		}
-		if (cur->subscribed == NONE && !subscriptions) {
-			char formatbuf[SIPBUFSIZE/2];
-			ast_cli(fd, FORMAT, ast_inet_ntoa(cur->sa.sin_addr), 
-				S_OR(cur->username, S_OR(cur->cid_num, "(None)")),
-				cur->callid, 
-				cur->ocseq, cur->icseq,
-				ast_getformatname_multiple(formatbuf, sizeof(formatbuf), cur->owner ? cur->owner->nativeformats : 0),
-				ast_test_flag(&cur->flags[1], SIP_PAGE2_CALL_ONHOLD) ? "Yes" : "No",
-				ast_test_flag(&cur->flags[0], SIP_NEEDDESTROY) ? "(d)" : "",
-				cur->lastmsg ,
-				referstatus
-			);
-			numchans++;
-		}
-		if (cur->subscribed != NONE && subscriptions) {
-			ast_cli(fd, FORMAT3, ast_inet_ntoa(cur->sa.sin_addr),
-				S_OR(cur->username, S_OR(cur->cid_num, "(None)")), 
-			   	cur->callid,
-				/* the 'complete' exten/context is hidden in the refer_to field for subscriptions */
-				cur->subscribed == MWI_NOTIFICATION ? "--" : cur->subscribeuri,
-				cur->subscribed == MWI_NOTIFICATION ? "<none>" : ast_extension_state2str(cur->laststate), 
-				subscription_type2str(cur->subscribed),
-				cur->subscribed == MWI_NOTIFICATION ? (cur->relatedpeer ? cur->relatedpeer->mailbox : "<none>") : "<none>"
-);
-			numchans++;
-		}
-	}
-	ast_mutex_unlock(&iflock);
+	for (i = 0; i < DIALOG_BUCKETS; i++) {
+		ast_mutex_lock(&dialogs[i].lock);
+		for (cur = dialogs[i].head; cur; cur = cur->next) {
+			referstatus = "";
+			if (cur->refer) { /* SIP transfer in progress */
+				referstatus = referstatus2str(cur->refer->status);
+			}
+			if (cur->subscribed == NONE && !subscriptions) {
+				char formatbuf[SIPBUFSIZE/2];
+				ast_cli(fd, FORMAT, ast_inet_ntoa(cur->sa.sin_addr), 
+					S_OR(cur->username, S_OR(cur->cid_num, "(None)")),
+					cur->callid, 
+					cur->ocseq, cur->icseq,
+					ast_getformatname_multiple(formatbuf, sizeof(formatbuf), cur->owner ? cur->owner->nativeformats : 0),
+					ast_test_flag(&cur->flags[1], SIP_PAGE2_CALL_ONHOLD) ? "Yes" : "No",
+					ast_test_flag(&cur->flags[0], SIP_NEEDDESTROY) ? "(d)" : "",
+					cur->lastmsg ,
+					referstatus
+				);
+				numchans++;
+			}
+			if (cur->subscribed != NONE && subscriptions) {
+				ast_cli(fd, FORMAT3, ast_inet_ntoa(cur->sa.sin_addr),
+					S_OR(cur->username, S_OR(cur->cid_num, "(None)")), 
+				   	cur->callid,
+					/* the 'complete' exten/context is hidden in the refer_to field for subscriptions */
+					cur->subscribed == MWI_NOTIFICATION ? "--" : cur->subscribeuri,
+					cur->subscribed == MWI_NOTIFICATION ? "<none>" : ast_extension_state2str(cur->laststate), 
+					subscription_type2str(cur->subscribed),
+					cur->subscribed == MWI_NOTIFICATION ? (cur->relatedpeer ? cur->relatedpeer->mailbox : "<none>") : "<none>"
+				);
+				numchans++;
+			}
+		}
+		ast_mutex_unlock(&dialogs[i].lock);
+	}
 	if (!subscriptions)
 		ast_cli(fd, "%d active SIP channel%s\n", numchans, (numchans != 1) ? "s" : "");
 	else
@@ -12223,7 +12319,7 @@ static int __sip_show_channels(int fd, int argc, char *argv[], int subscriptions
 /*! \brief Support routine for 'sip show channel' CLI */
 static char *complete_sipch(const char *line, const char *word, int pos, int state)
 {
-	int which=0;
+	int which=0, i;
 	struct sip_pvt *cur;
 	char *c = NULL;
 	int wordlen = strlen(word);
@@ -12232,14 +12328,16 @@ static char *complete_sipch(const char *line, const char *word, int pos, int sta
 		return NULL;
 	}
 
-	ast_mutex_lock(&iflock);
-	for (cur = iflist; cur; cur = cur->next) {
-		if (!strncasecmp(word, cur->callid, wordlen) && ++which > state) {
-			c = ast_strdup(cur->callid);
-			break;
+	for (i = 0; !c && i < DIALOG_BUCKETS; i++) {
+		ast_mutex_lock(&dialogs[i].lock);
+		for (cur = dialogs[i].head; cur; cur = cur->next) {
+			if (!strncasecmp(word, cur->callid, wordlen) && ++which > state) {
+				c = ast_strdup(cur->callid);
+				break;
+			}
 		}
+		ast_mutex_unlock(&dialogs[i].lock);
 	}
-	ast_mutex_unlock(&iflock);
 	return c;
 }
 
@@ -12359,64 +12457,66 @@ static int sip_show_channel(int fd, int argc, char *argv[])
 {
 	struct sip_pvt *cur;
 	size_t len;
-	int found = 0;
+	int found = 0, i;
 
 	if (argc != 4)
 		return RESULT_SHOWUSAGE;
 	len = strlen(argv[3]);
-	ast_mutex_lock(&iflock);
-	for (cur = iflist; cur; cur = cur->next) {
-		if (!strncasecmp(cur->callid, argv[3], len)) {
-			char formatbuf[SIPBUFSIZE/2];
-			ast_cli(fd,"\n");
-			if (cur->subscribed != NONE)
-				ast_cli(fd, "  * Subscription (type: %s)\n", subscription_type2str(cur->subscribed));
-			else
-				ast_cli(fd, "  * SIP Call\n");
-			ast_cli(fd, "  Curr. trans. direction:  %s\n", ast_test_flag(&cur->flags[0], SIP_OUTGOING) ? "Outgoing" : "Incoming");
-			ast_cli(fd, "  Call-ID:                %s\n", cur->callid);
-			ast_cli(fd, "  Owner channel ID:       %s\n", cur->owner ? cur->owner->name : "<none>");
-			ast_cli(fd, "  Our Codec Capability:   %d\n", cur->capability);
-			ast_cli(fd, "  Non-Codec Capability (DTMF):   %d\n", cur->noncodeccapability);
-			ast_cli(fd, "  Their Codec Capability:   %d\n", cur->peercapability);
-			ast_cli(fd, "  Joint Codec Capability:   %d\n", cur->jointcapability);
-			ast_cli(fd, "  Format:                 %s\n", ast_getformatname_multiple(formatbuf, sizeof(formatbuf), cur->owner ? cur->owner->nativeformats : 0) );
-			ast_cli(fd, "  MaxCallBR:              %d kbps\n", cur->maxcallbitrate);
-			ast_cli(fd, "  Theoretical Address:    %s:%d\n", ast_inet_ntoa(cur->sa.sin_addr), ntohs(cur->sa.sin_port));
-			ast_cli(fd, "  Received Address:       %s:%d\n", ast_inet_ntoa(cur->recv.sin_addr), ntohs(cur->recv.sin_port));
-			ast_cli(fd, "  SIP Transfer mode:      %s\n", transfermode2str(cur->allowtransfer));
-			ast_cli(fd, "  NAT Support:            %s\n", nat2str(ast_test_flag(&cur->flags[0], SIP_NAT)));
-			ast_cli(fd, "  Audio IP:               %s %s\n", ast_inet_ntoa(cur->redirip.sin_addr.s_addr ? cur->redirip.sin_addr : cur->ourip), cur->redirip.sin_addr.s_addr ? "(Outside bridge)" : "(local)" );
-			ast_cli(fd, "  Our Tag:                %s\n", cur->tag);
-			ast_cli(fd, "  Their Tag:              %s\n", cur->theirtag);
-			ast_cli(fd, "  SIP User agent:         %s\n", cur->useragent);
-			if (!ast_strlen_zero(cur->username))
-				ast_cli(fd, "  Username:               %s\n", cur->username);
-			if (!ast_strlen_zero(cur->peername))
-				ast_cli(fd, "  Peername:               %s\n", cur->peername);
-			if (!ast_strlen_zero(cur->uri))
-				ast_cli(fd, "  Original uri:           %s\n", cur->uri);
-			if (!ast_strlen_zero(cur->cid_num))
-				ast_cli(fd, "  Caller-ID:              %s\n", cur->cid_num);
-			ast_cli(fd, "  Need Destroy:           %d\n", ast_test_flag(&cur->flags[0], SIP_NEEDDESTROY));
-			ast_cli(fd, "  Last Message:           %s\n", cur->lastmsg);
-			ast_cli(fd, "  Promiscuous Redir:      %s\n", ast_test_flag(&cur->flags[0], SIP_PROMISCREDIR) ? "Yes" : "No");
-			ast_cli(fd, "  Route:                  %s\n", cur->route ? cur->route->hop : "N/A");
-			ast_cli(fd, "  DTMF Mode:              %s\n", dtmfmode2str(ast_test_flag(&cur->flags[0], SIP_DTMF)));
-			ast_cli(fd, "  SIP Options:            ");
-			if (cur->sipoptions) {
-				int x;
-				for (x=0 ; (x < (sizeof(sip_options) / sizeof(sip_options[0]))); x++) {
-					if (cur->sipoptions & sip_options[x].id)
-						ast_cli(fd, "%s ", sip_options[x].text);
-				}
-			} else
-				ast_cli(fd, "(none)\n");
-			ast_cli(fd, "\n\n");
-			found++;
+	for (i = 0; i < DIALOG_BUCKETS; i++) {
+		ast_mutex_lock(&dialogs[i].lock);
+		for (cur = dialogs[i].head; cur; cur = cur->next) {
+			if (!strncasecmp(cur->callid, argv[3], len)) {
+				char formatbuf[SIPBUFSIZE/2];
+				ast_cli(fd,"\n");
+				if (cur->subscribed != NONE)
+					ast_cli(fd, "  * Subscription (type: %s)\n", subscription_type2str(cur->subscribed));
+				else
+					ast_cli(fd, "  * SIP Call\n");
+				ast_cli(fd, "  Curr. trans. direction:  %s\n", ast_test_flag(&cur->flags[0], SIP_OUTGOING) ? "Outgoing" : "Incoming");
+				ast_cli(fd, "  Call-ID:                %s\n", cur->callid);
+				ast_cli(fd, "  Owner channel ID:       %s\n", cur->owner ? cur->owner->name : "<none>");
+				ast_cli(fd, "  Our Codec Capability:   %d\n", cur->capability);
+				ast_cli(fd, "  Non-Codec Capability (DTMF):   %d\n", cur->noncodeccapability);
+				ast_cli(fd, "  Their Codec Capability:   %d\n", cur->peercapability);
+				ast_cli(fd, "  Joint Codec Capability:   %d\n", cur->jointcapability);
+				ast_cli(fd, "  Format:                 %s\n", ast_getformatname_multiple(formatbuf, sizeof(formatbuf), cur->owner ? cur->owner->nativeformats : 0) );
+				ast_cli(fd, "  MaxCallBR:              %d kbps\n", cur->maxcallbitrate);
+				ast_cli(fd, "  Theoretical Address:    %s:%d\n", ast_inet_ntoa(cur->sa.sin_addr), ntohs(cur->sa.sin_port));
+				ast_cli(fd, "  Received Address:       %s:%d\n", ast_inet_ntoa(cur->recv.sin_addr), ntohs(cur->recv.sin_port));
+				ast_cli(fd, "  SIP Transfer mode:      %s\n", transfermode2str(cur->allowtransfer));
+				ast_cli(fd, "  NAT Support:            %s\n", nat2str(ast_test_flag(&cur->flags[0], SIP_NAT)));
+				ast_cli(fd, "  Audio IP:               %s %s\n", ast_inet_ntoa(cur->redirip.sin_addr.s_addr ? cur->redirip.sin_addr : cur->ourip), cur->redirip.sin_addr.s_addr ? "(Outside bridge)" : "(local)" );
+				ast_cli(fd, "  Our Tag:                %s\n", cur->tag);
+				ast_cli(fd, "  Their Tag:              %s\n", cur->theirtag);
+				ast_cli(fd, "  SIP User agent:         %s\n", cur->useragent);
+				if (!ast_strlen_zero(cur->username))
+					ast_cli(fd, "  Username:               %s\n", cur->username);
+				if (!ast_strlen_zero(cur->peername))
+					ast_cli(fd, "  Peername:               %s\n", cur->peername);
+				if (!ast_strlen_zero(cur->uri))
+					ast_cli(fd, "  Original uri:           %s\n", cur->uri);
+				if (!ast_strlen_zero(cur->cid_num))
+					ast_cli(fd, "  Caller-ID:              %s\n", cur->cid_num);
+				ast_cli(fd, "  Need Destroy:           %d\n", ast_test_flag(&cur->flags[0], SIP_NEEDDESTROY));
+				ast_cli(fd, "  Last Message:           %s\n", cur->lastmsg);
+				ast_cli(fd, "  Promiscuous Redir:      %s\n", ast_test_flag(&cur->flags[0], SIP_PROMISCREDIR) ? "Yes" : "No");
+				ast_cli(fd, "  Route:                  %s\n", cur->route ? cur->route->hop : "N/A");
+				ast_cli(fd, "  DTMF Mode:              %s\n", dtmfmode2str(ast_test_flag(&cur->flags[0], SIP_DTMF)));
+				ast_cli(fd, "  SIP Options:            ");
+				if (cur->sipoptions) {
+					int x;
+					for (x=0 ; (x < (sizeof(sip_options) / sizeof(sip_options[0]))); x++) {
+						if (cur->sipoptions & sip_options[x].id)
+							ast_cli(fd, "%s ", sip_options[x].text);
+					}
+				} else
+					ast_cli(fd, "(none)\n");
+				ast_cli(fd, "\n\n");
+				found++;
+			}
 		}
+		ast_mutex_unlock(&dialogs[i].lock);
 	}
-	ast_mutex_unlock(&iflock);
 	if (!found) 
 		ast_cli(fd, "No such SIP Call ID starting with '%s'\n", argv[3]);
 	return RESULT_SUCCESS;
@@ -12427,33 +12527,35 @@ static int sip_show_history(int fd, int argc, char *argv[])
 {
 	struct sip_pvt *cur;
 	size_t len;
-	int found = 0;
+	int found = 0, i;
 
 	if (argc != 4)
 		return RESULT_SHOWUSAGE;
 	if (!recordhistory)
 		ast_cli(fd, "\n***Note: History recording is currently DISABLED.  Use 'sip history' to ENABLE.\n");
 	len = strlen(argv[3]);
-	ast_mutex_lock(&iflock);
-	for (cur = iflist; cur; cur = cur->next) {
-		if (!strncasecmp(cur->callid, argv[3], len)) {
-			struct sip_history *hist;
-			int x = 0;
-
-			ast_cli(fd,"\n");
-			if (cur->subscribed != NONE)
-				ast_cli(fd, "  * Subscription\n");
-			else
-				ast_cli(fd, "  * SIP Call\n");
-			if (cur->history)
-				AST_LIST_TRAVERSE(cur->history, hist, list)
-					ast_cli(fd, "%d. %s\n", ++x, hist->event);
-			if (x == 0)
-				ast_cli(fd, "Call '%s' has no history\n", cur->callid);
-			found++;
+	for (i = 0; i < DIALOG_BUCKETS; i++) {
+		ast_mutex_lock(&dialogs[i].lock);
+		for (cur = dialogs[i].head; cur; cur = cur->next) {
+			if (!strncasecmp(cur->callid, argv[3], len)) {
+				struct sip_history *hist;
+				int x = 0;
+
+				ast_cli(fd,"\n");
+				if (cur->subscribed != NONE)
+					ast_cli(fd, "  * Subscription\n");
+				else
+					ast_cli(fd, "  * SIP Call\n");
+				if (cur->history)
+					AST_LIST_TRAVERSE(cur->history, hist, list)
+						ast_cli(fd, "%d. %s\n", ++x, hist->event);
+				if (x == 0)
+					ast_cli(fd, "Call '%s' has no history\n", cur->callid);
+				found++;
+			}
 		}
+		ast_mutex_unlock(&dialogs[i].lock);
 	}
-	ast_mutex_unlock(&iflock);
 	if (!found) 
 		ast_cli(fd, "No such SIP Call ID starting with '%s'\n", argv[3]);
 	return RESULT_SUCCESS;
@@ -17387,68 +17489,87 @@ static int queue_request(struct sip_pvt *p, const struct sip_request *req)
 	return 0;
 }
 
-/*! \brief Read data from SIP socket
-\note sipsock_read locks the owner channel while we are processing the SIP message
-\return 1 on error, 0 on success
+/*! \brief Check whether a SIP message can be handled in parallel with others
+\note Requests and responses within a call only touch their own dialog and its
+	channel, so SIP worker threads may handle them concurrently.  Everything
+	else (registrations, qualify, subscriptions, transfers and INVITEs with
+	Replaces) touches peers, the registry or other dialogs and is handled one
+	message at a time.
+*/
+static int sip_msg_is_parallel(struct sip_request *req)
+{
+	int method = req->method;
+
+	if (method == SIP_RESPONSE) {
+		/* Responses are classified by the request they answer */
+		char cseq_method[16];
+
+		if (sscanf(get_header(req, "CSeq"), "%*d %15s", cseq_method) != 1)
+			return FALSE;
+		method = find_sip_method(cseq_method);
+	}
+
+	switch (method) {
+	case SIP_INVITE:
+		return ast_strlen_zero(get_header(req, "Replaces"));
+	case SIP_ACK:
+	case SIP_BYE:
+	case SIP_CANCEL:
+	case SIP_INFO:
+	case SIP_PRACK:
+	case SIP_UPDATE:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/*! \brief Parse a SIP message read from the SIP socket and handle it
+\note Locks the dialog and its owner channel while we are processing the SIP message
 \note Successful messages is connected to SIP call and forwarded to handle_request() 
 */
-static int sipsock_read(int *id, int fd, short events, void *ignore)
+static void handle_request_do(struct sip_request *req, struct sockaddr_in *sin)
 {
-	struct sip_request req;
-	struct sockaddr_in sin = { 0, };
 	struct sip_pvt *p;
-	int res;
-	socklen_t len = sizeof(sin);
 	int nounlock = 0;
 	int recount = 0;
 	int lockretry;
+	int parallel;
 
-	memset(&req, 0, sizeof(req));
-	res = recvfrom(sipsock, req.data, sizeof(req.data) - 1, 0, (struct sockaddr *)&sin, &len);
-	if (res < 0) {
-#if !defined(__FreeBSD__)
-		if (errno == EAGAIN)
-			ast_log(LOG_NOTICE, "SIP: Received packet with bad UDP checksum\n");
-		else 
-#endif
-		if (errno != ECONNREFUSED)
-			ast_log(LOG_WARNING, "Recv error: %s\n", strerror(errno));
-		return 1;
-	}
-	if (option_debug && res == sizeof(req.data) - 1)
-		ast_log(LOG_DEBUG, "Received packet exceeds buffer. Data is possibly lost\n");
-
-	req.data[res] = '\0';
-	req.len = res;
-	if(sip_debug_test_addr(&sin))	/* Set the debug flag early on packet level */
-		ast_set_flag(&req, SIP_PKT_DEBUG);
+	if(sip_debug_test_addr(sin))	/* Set the debug flag early on packet level */
+		ast_set_flag(req, SIP_PKT_DEBUG);
 	if (pedanticsipchecking)
-		req.len = lws2sws(req.data, req.len);	/* Fix multiline headers */
-	if (ast_test_flag(&req, SIP_PKT_DEBUG))
-		ast_verbose("\n<--- SIP read from %s:%d --->\n%s\n<------------->\n", ast_inet_ntoa(sin.sin_addr), ntohs(sin.sin_port), req.data);
+		req->len = lws2sws(req->data, req->len);	/* Fix multiline headers */
+	if (ast_test_flag(req, SIP_PKT_DEBUG))
+		ast_verbose("\n<--- SIP read from %s:%d --->\n%s\n<------------->\n", ast_inet_ntoa(sin->sin_addr), ntohs(sin->sin_port), req->data);
 
-	if(parse_request(&req) == -1) /* Bad packet, can't parse */
-		return 1;
+	if(parse_request(req) == -1) /* Bad packet, can't parse */
+		return;
 
-	req.method = find_sip_method(req.rlPart1);
+	req->method = find_sip_method(req->rlPart1);
 
-	if (ast_test_flag(&req, SIP_PKT_DEBUG))
-		ast_verbose("--- (%d headers %d lines)%s ---\n", req.headers, req.lines, (req.headers + req.lines == 0) ? " Nat keepalive" : "");
+	if (ast_test_flag(req, SIP_PKT_DEBUG))
+		ast_verbose("--- (%d headers %d lines)%s ---\n", req->headers, req->lines, (req->headers + req->lines == 0) ? " Nat keepalive" : "");
 
-	if (req.headers < 2)	/* Must have at least two headers */
-		return 1;
+	if (req->headers < 2)	/* Must have at least two headers */
+		return;
+
+	parallel = sip_msg_is_parallel(req);
 
 	/* Process request, with netlock held, and with usual deadlock avoidance */
 	for (lockretry = 10; lockretry > 0; lockretry--) {
-		ast_mutex_lock(&netlock);
+		if (parallel)
+			ast_rwlock_rdlock(&netlock);
+		else
+			ast_rwlock_wrlock(&netlock);
 
 		/* Find the active SIP dialog or create a new one */
-		p = find_call(&req, &sin, req.method);	/* returns p locked */
+		p = find_call(req, sin, req->method);	/* returns p locked */
 		if (p == NULL) {
 			if (option_debug)
-				ast_log(LOG_DEBUG, "Invalid SIP message - rejected , no callid, len %d\n", req.len);
-			ast_mutex_unlock(&netlock);
-			return 1;
+				ast_log(LOG_DEBUG, "Invalid SIP message - rejected , no callid, len %d\n", req->len);
+			ast_rwlock_unlock(&netlock);
+			return;
 		}
 		/* Go ahead and lock the owner if it has one -- we may need it */
 		/* because this is deadlock-prone, we need to try and unlock if failed */
@@ -17456,35 +17577,35 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 			break;	/* locking succeeded */
 		if (lockretry != 1) {
 			ast_mutex_unlock(&p->lock);
-			ast_mutex_unlock(&netlock);
+			ast_rwlock_unlock(&netlock);
 			/* Sleep for a very short amount of time */
 			usleep(1);
 		}
 	}
-	p->recv = sin;
+	p->recv = *sin;
 
 	if (!ast_test_flag(&p->flags[0], SIP_NO_HISTORY)) /* This is a request or response, note what it was for */
-		append_history(p, "Rx", "%s / %s / %s", req.data, get_header(&req, "CSeq"), req.rlPart2);
+		append_history(p, "Rx", "%s / %s / %s", req->data, get_header(req, "CSeq"), req->rlPart2);
 
 	if (!lockretry) {
-		if (!queue_request(p, &req)) {
+		if (!queue_request(p, req)) {
 			/* the request has been queued for later handling */
 			ast_mutex_unlock(&p->lock);
-			ast_mutex_unlock(&netlock);
-			return 1;
+			ast_rwlock_unlock(&netlock);
+			return;
 		}
 
 		/* This is unsafe, since p->owner is not locked. */
 		if (p->owner)
 			ast_log(LOG_ERROR, "Channel lock for %s could not be obtained, and request was unable to be queued.\n", S_OR(p->owner->name, "- no channel name ??? - "));
 		ast_log(LOG_ERROR, "SIP transaction failed: %s \n", p->callid);
-		if (req.method != SIP_ACK)
-			transmit_response(p, "503 Server error", &req);	/* We must respond according to RFC 3261 sec 12.2 */
+		if (req->method != SIP_ACK)
+			transmit_response(p, "503 Server error", req);	/* We must respond according to RFC 3261 sec 12.2 */
 		/* XXX We could add retry-after to make sure they come back */
 		append_history(p, "LockFail", "Owner lock failed, transaction failed.");
 		ast_mutex_unlock(&p->lock);
-		ast_mutex_unlock(&netlock);
-		return 1;
+		ast_rwlock_unlock(&netlock);
+		return;
 	}
 
 	/* if there are queued requests on this sip_pvt, process them first, so that everything is
@@ -17495,7 +17616,7 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 		process_request_queue(p, &recount, &nounlock);
 	}
 
-	if (handle_request(p, &req, &sin, &recount, &nounlock) == -1) {
+	if (handle_request(p, req, sin, &recount, &nounlock) == -1) {
 		/* Request failed */
 		if (option_debug)
 			ast_log(LOG_DEBUG, "SIP message could not be handled, bad request: %-70.70s\n", p->callid[0] ? p->callid : "<no callid>");
@@ -17504,13 +17625,160 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 	if (p->owner && !nounlock)
 		ast_channel_unlock(p->owner);
 	ast_mutex_unlock(&p->lock);
-	ast_mutex_unlock(&netlock);
+	ast_rwlock_unlock(&netlock);
 	if (recount)
 		ast_update_use_count();
+}
+
+/*! \brief Read data from SIP socket
+\note Used when the monitor thread reads the SIP socket itself (sipworkers=0)
+\return 1 to keep the I/O callback registered
+*/
+static int sipsock_read(int *id, int fd, short events, void *ignore)
+{
+	struct sip_request req;
+	struct sockaddr_in sin = { 0, };
+	int res;
+	socklen_t len = sizeof(sin);
+
+	memset(&req, 0, sizeof(req));
+	res = recvfrom(sipsock, req.data, sizeof(req.data) - 1, 0, (struct sockaddr *)&sin, &len);
+	if (res < 0) {
+#if !defined(__FreeBSD__)
+		if (errno == EAGAIN)
+			ast_log(LOG_NOTICE, "SIP: Received packet with bad UDP checksum\n");
+		else 
+#endif
+		if (errno != ECONNREFUSED)
+			ast_log(LOG_WARNING, "Recv error: %s\n", strerror(errno));
+		return 1;
+	}
+	if (option_debug && res == sizeof(req.data) - 1)
+		ast_log(LOG_DEBUG, "Received packet exceeds buffer. Data is possibly lost\n");
+
+	req.data[res] = '\0';
+	req.len = res;
+
+	handle_request_do(&req, &sin);
 
 	return 1;
 }
 
+/*! \brief Read a batch of messages from the SIP socket without blocking
+\note Called with netlock held, so the socket can not be closed by a reload meanwhile
+\return the number of messages read into the worker's buffers
+*/
+static int sipsock_read_batch(struct sip_worker *worker)
+{
+	int res, i;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[SIP_RECV_BATCH];
+	struct iovec iov[SIP_RECV_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < SIP_RECV_BATCH; i++) {
+		iov[i].iov_base = worker->req[i].data;
+		iov[i].iov_len = sizeof(worker->req[i].data) - 1;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &worker->sin[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(worker->sin[i]);
+	}
+	res = recvmmsg(sipsock, msgs, SIP_RECV_BATCH, MSG_DONTWAIT, NULL);
+#else
+	socklen_t len = sizeof(worker->sin[0]);
+
+	res = recvfrom(sipsock, worker->req[0].data, sizeof(worker->req[0].data) - 1, MSG_DONTWAIT,
+		(struct sockaddr *) &worker->sin[0], &len);
+	if (res >= 0) {
+		worker->req[0].len = res;
+		res = 1;
+	}
+#endif
+	if (res < 0) {
+		/* Another worker may have drained the socket before us */
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED && errno != EINTR)
+			ast_log(LOG_WARNING, "Recv error: %s\n", strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < res; i++) {
+#ifdef HAVE_RECVMMSG
+		worker->req[i].len = msgs[i].msg_len;
+#endif
+		if (option_debug && worker->req[i].len == sizeof(worker->req[i].data) - 1)
+			ast_log(LOG_DEBUG, "Received packet exceeds buffer. Data is possibly lost\n");
+		worker->req[i].data[worker->req[i].len] = '\0';
+	}
+
+	return res;
+}
+
+/*! \brief SIP worker thread, reads the SIP socket in batches and handles the messages */
+static void *sip_worker_thread(void *data)
+{
+	struct sip_worker *worker = data;
+	struct pollfd pfd = { .events = POLLIN, };
+	int res, i;
+
+	while (!worker->stop) {
+		/* Wait for the socket to become readable; wake up once in a while to
+		   notice a new socket after a reload or a request to stop */
+		if ((pfd.fd = sipsock) < 0) {
+			ast_poll(NULL, 0, 1000);
+			continue;
+		}
+		if (ast_poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		ast_rwlock_rdlock(&netlock);
+		res = (sipsock > -1) ? sipsock_read_batch(worker) : 0;
+		ast_rwlock_unlock(&netlock);
+
+		/* Messages of a batch are handled in the order they were received */
+		for (i = 0; i < res; i++) {
+			handle_request_do(&worker->req[i], &worker->sin[i]);
+			memset(&worker->req[i], 0, sizeof(worker->req[i]));
+		}
+	}
+
+	return NULL;
+}
+
+/*! \brief Start or stop SIP worker threads so that the configured number is running
+\note Only called from the monitor thread, or on unload once the monitor thread is gone
+*/
+static void sip_workers_update(int count)
+{
+	int i;
+
+	if (count == sip_workers_count)
+		return;
+
+	/* Stop all running workers, then start the new number of them */
+	for (i = 0; i < sip_workers_count; i++)
+		sip_workers[i]->stop = TRUE;
+	for (i = 0; i < sip_workers_count; i++) {
+		pthread_kill(sip_workers[i]->thread, SIGURG);
+		pthread_join(sip_workers[i]->thread, NULL);
+		free(sip_workers[i]);
+	}
+	sip_workers_count = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!(sip_workers[i] = ast_calloc(1, sizeof(*sip_workers[i]))))
+			break;
+		if (ast_pthread_create(&sip_workers[i]->thread, NULL, sip_worker_thread, sip_workers[i])) {
+			ast_log(LOG_ERROR, "Unable to start SIP worker thread: %s\n", strerror(errno));
+			free(sip_workers[i]);
+			break;
+		}
+		sip_workers_count++;
+	}
+	if (option_verbose > 1 && sip_workers_count)
+		ast_verbose(VERBOSE_PREFIX_2 "Started %d SIP worker thread%s\n", sip_workers_count, sip_workers_count == 1 ? "" : "s");
+}
+
 /*! \brief Send message waiting indication to alert peer that they've got voicemail */
 static int sip_send_mwi_to_peer(struct sip_peer *peer, int force)
 {
@@ -17585,8 +17853,8 @@ static int does_peer_need_mwi(struct sip_peer *peer)
 */
 static void *do_monitor(void *data)
 {
-	int res;
-	struct sip_pvt *sip;
+	int res, i;
+	struct sip_pvt *sip, *next;
 	struct sip_peer *peer = NULL;
 	time_t t;
 	int fastrestart = FALSE;
@@ -17594,8 +17862,9 @@ static void *do_monitor(void *data)
 	int curpeernum;
 	int reloading;
 
-	/* Add an I/O event to our SIP UDP socket */
-	if (sipsock > -1) 
+	/* Start the SIP workers, or add an I/O event to our SIP UDP socket if we read it ourselves */
+	sip_workers_update(global_sipworkers);
+	if (sipsock > -1 && !sip_workers_count)
 		sipsock_read_id = ast_io_add(io, sipsock, sipsock_read, AST_IO_IN, NULL);
 	
 	/* From here on out, we die whenever asked */
@@ -17608,10 +17877,18 @@ static void *do_monitor(void *data)
 		if (reloading) {
 			if (option_verbose > 0)
 				ast_verbose(VERBOSE_PREFIX_1 "Reloading SIP\n");
+			/* Keep SIP workers out while the configuration changes, and do not
+			   get cancelled by an unload while they are locked out */
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			ast_rwlock_wrlock(&netlock);
 			sip_do_reload(sip_reloadreason);
+			ast_rwlock_unlock(&netlock);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+			sip_workers_update(global_sipworkers);
 
 			/* Change the I/O fd of our UDP socket */
-			if (sipsock > -1) {
+			if (sipsock > -1 && !sip_workers_count) {
 				if (sipsock_read_id)
 					sipsock_read_id = ast_io_change(io, sipsock_read_id, sipsock, NULL, 0, NULL);
 				else
@@ -17628,92 +17905,98 @@ static void *do_monitor(void *data)
 			markall_extenstate_updates();
 		}
 
-restartsearch:
 		/* Check for interfaces needing to be killed and for pending extension state notifications. */
-		ast_mutex_lock(&iflock);
 		t = time(NULL);
 		/* don't scan the interface list if it hasn't been a reasonable period
 		   of time since the last time we did it (when MWI is being sent, we can
-		   get back to this point every millisecond or less)
+		   get back to this point every millisecond or less).
+		   Only one bucket of the dialog table is locked at a time, so packets
+		   for dialogs in other buckets are processed while we walk this one.
 		*/
-		for (sip = iflist; !fastrestart && sip; sip = sip->next) {
-			/*! \note If we can't get a lock on an interface, skip it and come
-			 * back later. Note that there is the possibility of a deadlock with
-			 * sip_hangup otherwise, because sip_hangup is called with the channel
-			 * locked first, and the iface lock is attempted second.
-			 */
-			if (ast_mutex_trylock(&sip->lock)) {
-				/* make sure to unmark any extension state updates for this pvt so
-				 * they can be sent out when we come back to it. */
-				unmark_extenstate_update(sip);
-				continue;
-			}
-
-			/* since we are iterating through all the sip_pvts here, this is a good place
-			 * to send out extension state updates. */
-			check_extenstate_updates(sip);
-
-			/* Check RTP timeouts and kill calls if we have a timeout set and do not get RTP */
-			if (sip->rtp && sip->owner &&
-			    (sip->owner->_state == AST_STATE_UP) &&
-			    !sip->redirip.sin_addr.s_addr &&
-			    sip->t38.state != T38_ENABLED) {
-				if (sip->lastrtptx &&
-				    ast_rtp_get_rtpkeepalive(sip->rtp) &&
-				    (t > sip->lastrtptx + ast_rtp_get_rtpkeepalive(sip->rtp))) {
-					/* Need to send an empty RTP packet */
-					sip->lastrtptx = time(NULL);
-					ast_rtp_sendcng(sip->rtp, 0);
+		for (i = 0; !fastrestart && i < DIALOG_BUCKETS; i++) {
+			ast_mutex_lock(&dialogs[i].lock);
+			for (sip = dialogs[i].head; sip; sip = next) {
+				/* We may destroy this dialog below, which unlinks it */
+				next = sip->next;
+				/*! \note If we can't get a lock on an interface, skip it and come
+				 * back later. Note that there is the possibility of a deadlock with
+				 * sip_hangup otherwise, because sip_hangup is called with the channel
+				 * locked first, and the iface lock is attempted second.
+				 */
+				if (ast_mutex_trylock(&sip->lock)) {
+					/* make sure to unmark any extension state updates for this pvt so
+					 * they can be sent out when we come back to it. */
+					unmark_extenstate_update(sip);
+					continue;
 				}
-				if (sip->lastrtprx &&
-					(ast_rtp_get_rtptimeout(sip->rtp) || ast_rtp_get_rtpholdtimeout(sip->rtp)) &&
-				    (t > sip->lastrtprx + ast_rtp_get_rtptimeout(sip->rtp))) {
-					/* Might be a timeout now -- see if we're on hold */
-					struct sockaddr_in sin = { 0, };
-					ast_rtp_get_peer(sip->rtp, &sin);
-					if (!ast_test_flag(&sip->flags[1], SIP_PAGE2_CALL_ONHOLD) || 
-					    (ast_rtp_get_rtpholdtimeout(sip->rtp) &&
-					     (t > sip->lastrtprx + ast_rtp_get_rtpholdtimeout(sip->rtp)))) {
-						/* Needs a hangup */
-						if (ast_rtp_get_rtptimeout(sip->rtp)) {
-							while (sip->owner && ast_channel_trylock(sip->owner)) {
-								DEADLOCK_AVOIDANCE(&sip->lock);
-							}
-							if (sip->owner) {
-								ast_log(LOG_NOTICE,
-									"Disconnecting call '%s' for lack of RTP activity in %ld seconds\n",
-									sip->owner->name,
-									(long) (t - sip->lastrtprx));
-								/* Issue a softhangup */
-								ast_softhangup_nolock(sip->owner, AST_SOFTHANGUP_DEV);
-								ast_channel_unlock(sip->owner);
-								/* forget the timeouts for this call, since a hangup
-								   has already been requested and we don't want to
-								   repeatedly request hangups
-								*/
-								ast_rtp_set_rtptimeout(sip->rtp, 0);
-								ast_rtp_set_rtpholdtimeout(sip->rtp, 0);
-								if (sip->vrtp) {
-									ast_rtp_set_rtptimeout(sip->vrtp, 0);
-									ast_rtp_set_rtpholdtimeout(sip->vrtp, 0);
+
+				/* since we are iterating through all the sip_pvts here, this is a good place
+				 * to send out extension state updates. */
+				check_extenstate_updates(sip);
+
+				/* Check RTP timeouts and kill calls if we have a timeout set and do not get RTP */
+				if (sip->rtp && sip->owner &&
+				    (sip->owner->_state == AST_STATE_UP) &&
+				    !sip->redirip.sin_addr.s_addr &&
+				    sip->t38.state != T38_ENABLED) {
+					if (sip->lastrtptx &&
+					    ast_rtp_get_rtpkeepalive(sip->rtp) &&
+					    (t > sip->lastrtptx + ast_rtp_get_rtpkeepalive(sip->rtp))) {
+						/* Need to send an empty RTP packet */
+						sip->lastrtptx = time(NULL);
+						ast_rtp_sendcng(sip->rtp, 0);
+					}
+					/* RTP relayed in a Packet2Packet bridge is not read through us */
+					if (sip->lastrtprx && ast_rtp_get_lastrelayed(sip->rtp) > sip->lastrtprx)
+						sip->lastrtprx = ast_rtp_get_lastrelayed(sip->rtp);
+					if (sip->lastrtprx &&
+						(ast_rtp_get_rtptimeout(sip->rtp) || ast_rtp_get_rtpholdtimeout(sip->rtp)) &&
+					    (t > sip->lastrtprx + ast_rtp_get_rtptimeout(sip->rtp))) {
+						/* Might be a timeout now -- see if we're on hold */
+						struct sockaddr_in sin = { 0, };
+						ast_rtp_get_peer(sip->rtp, &sin);
+						if (!ast_test_flag(&sip->flags[1], SIP_PAGE2_CALL_ONHOLD) || 
+						    (ast_rtp_get_rtpholdtimeout(sip->rtp) &&
+						     (t > sip->lastrtprx + ast_rtp_get_rtpholdtimeout(sip->rtp)))) {
+							/* Needs a hangup */
+							if (ast_rtp_get_rtptimeout(sip->rtp)) {
+								while (sip->owner && ast_channel_trylock(sip->owner)) {
+									DEADLOCK_AVOIDANCE(&sip->lock);
+								}
+								if (sip->owner) {
+									ast_log(LOG_NOTICE,
+										"Disconnecting call '%s' for lack of RTP activity in %ld seconds\n",
+										sip->owner->name,
+										(long) (t - sip->lastrtprx));
+									/* Issue a softhangup */
+									ast_softhangup_nolock(sip->owner, AST_SOFTHANGUP_DEV);
+									ast_channel_unlock(sip->owner);
+									/* forget the timeouts for this call, since a hangup
+									   has already been requested and we don't want to
+									   repeatedly request hangups
+									*/
+									ast_rtp_set_rtptimeout(sip->rtp, 0);
+									ast_rtp_set_rtpholdtimeout(sip->rtp, 0);
+									if (sip->vrtp) {
+										ast_rtp_set_rtptimeout(sip->vrtp, 0);
+										ast_rtp_set_rtpholdtimeout(sip->vrtp, 0);
+									}
 								}
 							}
 						}
 					}
 				}
-			}
-			/* If we have sessions that needs to be destroyed, do it now */
-			if (ast_test_flag(&sip->flags[0], SIP_NEEDDESTROY) && !sip->packets &&
-			    !sip->owner) {
+				/* If we have sessions that needs to be destroyed, do it now */
+				if (ast_test_flag(&sip->flags[0], SIP_NEEDDESTROY) && !sip->packets &&
+				    !sip->owner) {
+					ast_mutex_unlock(&sip->lock);
+					__sip_destroy(sip, 1);
+					continue;
+				}
 				ast_mutex_unlock(&sip->lock);
-				__sip_destroy(sip, 1);
-				ast_mutex_unlock(&iflock);
-				usleep(1);
-				goto restartsearch;
 			}
-			ast_mutex_unlock(&sip->lock);
+			ast_mutex_unlock(&dialogs[i].lock);
 		}
-		ast_mutex_unlock(&iflock);
 
 		/* we only want to clear the extension state updates if the dialog list was traversed */
 		if (!fastrestart) {
@@ -17738,6 +18021,9 @@ restartsearch:
 		if (option_debug && res > 20)
 			ast_log(LOG_DEBUG, "chan_sip: ast_io_wait ran %d all at once\n", res);
 		ast_mutex_lock(&monlock);
+		/* Scheduled items and MWI touch peers and the registry just like
+		   the SIP messages that can not be handled in parallel */
+		ast_rwlock_wrlock(&netlock);
 		res = ast_sched_runq(sched);
 		if (option_debug && res >= 20)
 			ast_log(LOG_DEBUG, "chan_sip: ast_sched_runq ran %d all at once\n", res);
@@ -17767,6 +18053,7 @@ restartsearch:
 			/* Reset where we come from */
 			lastpeernum = -1;
 		}
+		ast_rwlock_unlock(&netlock);
 		ast_mutex_unlock(&monlock);
 	}
 	/* Never reached */
@@ -19071,6 +19358,7 @@ static int reload_config(enum channelreloadreason reason)
 	compactheaders = DEFAULT_COMPACTHEADERS;
 	global_reg_timeout = DEFAULT_REGISTRATION_TIMEOUT;
 	global_regattempts_max = 0;
+	global_sipworkers = DEFAULT_SIPWORKERS;
 	pedanticsipchecking = DEFAULT_PEDANTIC;
 	global_mwitime = DEFAULT_MWITIME;
 	autocreatepeer = DEFAULT_AUTOCREATEPEER;
@@ -19262,6 +19550,14 @@ static int reload_config(enum channelreloadreason reason)
 			global_reg_timeout = atoi(v->value);
 			if (global_reg_timeout < 1)
 				global_reg_timeout = DEFAULT_REGISTRATION_TIMEOUT;
+		} else if (!strcasecmp(v->name, "sipworkers")) {
+			if ((sscanf(v->value, "%30d", &global_sipworkers) != 1) || (global_sipworkers < 0)) {
+				ast_log(LOG_WARNING, "'%s' is not a valid number of SIP workers at line %d.  Using default.\n", v->value, v->lineno);
+				global_sipworkers = DEFAULT_SIPWORKERS;
+			} else if (global_sipworkers > SIP_MAX_WORKERS) {
+				ast_log(LOG_WARNING, "Limiting sipworkers to %d at line %d.\n", SIP_MAX_WORKERS, v->lineno);
+				global_sipworkers = SIP_MAX_WORKERS;
+			}
 		} else if (!strcasecmp(v->name, "registerattempts")) {
 			global_regattempts_max = atoi(v->value);
 		} else if (!strcasecmp(v->name, "bindaddr")) {
@@ -19500,7 +19796,7 @@ static int reload_config(enum channelreloadreason reason)
 	if (!ntohs(bindaddr.sin_port))
 		bindaddr.sin_port = ntohs(STANDARD_SIP_PORT);
 	bindaddr.sin_family = AF_INET;
-	ast_mutex_lock(&netlock);
+	/* On reload, the monitor thread holds netlock for writing, so no SIP worker uses the socket */
 	if ((sipsock > -1) && (memcmp(&old_bindaddr, &bindaddr, sizeof(struct sockaddr_in)))) {
 		close(sipsock);
 		sipsock = -1;
@@ -19510,7 +19806,6 @@ static int reload_config(enum channelreloadreason reason)
 		if (sipsock < 0) {
 			ast_log(LOG_WARNING, "Unable to create SIP socket: %s\n", strerror(errno));
 			ast_config_destroy(cfg);
-			ast_mutex_unlock(&netlock);
 			return -1;
 		} else {
 			/* Allow SIP clients on the same host to access us: */
@@ -19541,7 +19836,6 @@ static int reload_config(enum channelreloadreason reason)
 	} else if (setsockopt(sipsock, IPPROTO_IP, IP_TOS, &global_tos_sip, sizeof(global_tos_sip))) {
 		ast_log(LOG_WARNING, "Unable to set SIP TOS to %s\n", ast_tos2str(global_tos_sip));
 	}
-	ast_mutex_unlock(&netlock);
 
 	/* Add default domains - host name, IP address and IP:port */
 	/* Only do this if user added any sip domain with "localdomains" */
@@ -20242,12 +20536,40 @@ static struct ast_cli_entry cli_sip[] = {
 	sip_reload_usage },
 };
 
+/*! \brief Make netlock prefer writers, so that SIP worker threads taking turns
+   at reading it can not keep the monitor thread from writing forever.
+   glibc ignores the plain writer preference ast_rwlock_init() asks for, and
+   only honours it for locks nobody takes recursively, as is the case here. */
+static int sip_netlock_init(void)
+{
+#if defined(__GLIBC__) && defined(HAVE_PTHREAD_RWLOCK_PREFER_WRITER_NP)
+	pthread_rwlockattr_t attr;
+	int res;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	res = pthread_rwlock_init(&netlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return res;
+#else
+	return ast_rwlock_init(&netlock);
+#endif
+}
+
 /*! \brief PBX load module - initialization */
 static int load_module(void)
 {
+	int i;
+
+	if (sip_netlock_init()) {
+		ast_log(LOG_ERROR, "Unable to initialize the SIP network lock\n");
+		return AST_MODULE_LOAD_FAILURE;
+	}
 	ASTOBJ_CONTAINER_INIT(&userl);	/* User object list */
 	ASTOBJ_CONTAINER_INIT(&peerl);	/* Peer object list */
 	ASTOBJ_CONTAINER_INIT(&regl);	/* Registry object list */
+	for (i = 0; i < DIALOG_BUCKETS; i++)	/* Dialog hash table */
+		ast_mutex_init(&dialogs[i].lock);
 
 	if (!(sched = sched_context_create())) {
 		ast_log(LOG_ERROR, "Unable to create scheduler context\n");
@@ -20312,6 +20634,7 @@ static int unload_module(void)
 {
 	struct sip_pvt *p, *pl;
 	struct sip_extenstate_update *update;
+	int i;
 
 	/* First, take us out of the channel type list */
 	ast_channel_unregister(&sip_tech);
@@ -20339,13 +20662,15 @@ static int unload_module(void)
 	ast_manager_unregister("SIPpeers");
 	ast_manager_unregister("SIPshowpeer");
 
-	ast_mutex_lock(&iflock);
 	/* Hangup all interfaces if they have an owner */
-	for (p = iflist; p ; p = p->next) {
-		if (p->owner)
-			ast_softhangup(p->owner, AST_SOFTHANGUP_APPUNLOAD);
+	for (i = 0; i < DIALOG_BUCKETS; i++) {
+		ast_mutex_lock(&dialogs[i].lock);
+		for (p = dialogs[i].head; p ; p = p->next) {
+			if (p->owner)
+				ast_softhangup(p->owner, AST_SOFTHANGUP_APPUNLOAD);
+		}
+		ast_mutex_unlock(&dialogs[i].lock);
 	}
-	ast_mutex_unlock(&iflock);
 
 	ast_mutex_lock(&monlock);
 	if (monitor_thread && (monitor_thread != AST_PTHREADT_STOP) && (monitor_thread != AST_PTHREADT_NULL)) {
@@ -20356,23 +20681,27 @@ static int unload_module(void)
 	monitor_thread = AST_PTHREADT_STOP;
 	ast_mutex_unlock(&monlock);
 
-restartdestroy:
-	ast_mutex_lock(&iflock);
+	/* The monitor thread is gone, stop the SIP workers it started */
+	sip_workers_update(0);
+
 	/* Destroy all the interfaces and free their memory */
-	p = iflist;
-	while (p) {
-		pl = p;
-		p = p->next;
-		if (__sip_destroy(pl, TRUE) < 0) {
-			/* Something is still bridged, let it react to getting a hangup */
-			iflist = p;
-			ast_mutex_unlock(&iflock);
-			usleep(1);
-			goto restartdestroy;
+	for (i = 0; i < DIALOG_BUCKETS; i++) {
+restartdestroy:
+		ast_mutex_lock(&dialogs[i].lock);
+		p = dialogs[i].head;
+		while (p) {
+			pl = p;
+			p = p->next;
+			if (__sip_destroy(pl, TRUE) < 0) {
+				/* Something is still bridged, let it react to getting a hangup */
+				ast_mutex_unlock(&dialogs[i].lock);
+				usleep(1);
+				goto restartdestroy;
+			}
 		}
+		ast_mutex_unlock(&dialogs[i].lock);
+		ast_mutex_destroy(&dialogs[i].lock);
 	}
-	iflist = NULL;
-	ast_mutex_unlock(&iflock);
 
 	/* Free memory for local network address mask */
 	ast_free_ha(localaddr);
@@ -20397,6 +20726,7 @@ restartdestroy:
 	ast_free_ha(global_contact_ha);
 	close(sipsock);
 	sched_context_destroy(sched);
+	ast_rwlock_destroy(&netlock);
 		
 	return 0;
 }
@@ -42,6 +42,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 267539 $")
 #include "asterisk/translate.h"
 #include "asterisk/channel.h"
 #include "asterisk/alaw.h"
+#include "asterisk/slinear.h"
 #include "asterisk/utils.h"
 
 #define BUFFER_SAMPLES   8096	/* size for the translation buffers */
@@ -61,8 +62,7 @@ static int alawtolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 	pvt->samples += i;
 	pvt->datalen += i * 2;	/* 2 bytes/sample */
 	
-	while (i--)
-		*dst++ = AST_ALAW(*src++);
+	ast_alaw_to_slinear_n(dst, src, i);
 
 	return 0;
 }
@@ -71,14 +71,13 @@ static int alawtolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 static int lintoalaw_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 {
 	int i = f->samples;
-	char *dst = pvt->outbuf + pvt->samples;
+	unsigned char *dst = (unsigned char *) pvt->outbuf + pvt->samples;
 	int16_t *src = f->data;
 
 	pvt->samples += i;
 	pvt->datalen += i;	/* 1 byte/sample */
 
-	while (i--) 
-		*dst++ = AST_LIN2A(*src++);
+	ast_slinear_to_alaw_n(dst, src, i);
 
 	return 0;
 }
@@ -698,6 +698,17 @@ static int lintog726_new(struct ast_trans_pvt *pvt)
 	return 0;
 }
 
+/*! \brief reinit an instance of g726_coder_pvt being reused. */
+static int g726_reset(struct ast_trans_pvt *pvt)
+{
+	struct g726_coder_pvt *tmp = pvt->pvt;
+
+	tmp->next_flag = 0;
+	g726_init_state(&tmp->g726);
+
+	return 0;
+}
+
 /*! \brief decode packed 4-bit G726 values (AAL2 packing) and store in buffer. */
 static int g726aal2tolin_framein (struct ast_trans_pvt *pvt, struct ast_frame *f)
 {
@@ -813,11 +824,13 @@ static struct ast_translator g726tolin = {
 	.srcfmt = AST_FORMAT_G726,
 	.dstfmt = AST_FORMAT_SLINEAR,
 	.newpvt = lintog726_new,	/* same for both directions */
+	.reset = g726_reset,
 	.framein = g726tolin_framein,
 	.sample = g726tolin_sample,
 	.desc_size = sizeof(struct g726_coder_pvt),
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES * 2,
+	.offload = 1,
 };
 
 static struct ast_translator lintog726 = {
@@ -825,11 +838,13 @@ static struct ast_translator lintog726 = {
 	.srcfmt = AST_FORMAT_SLINEAR,
 	.dstfmt = AST_FORMAT_G726,
 	.newpvt = lintog726_new,	/* same for both directions */
+	.reset = g726_reset,
 	.framein = lintog726_framein,
 	.sample = lintog726_sample,
 	.desc_size = sizeof(struct g726_coder_pvt),
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES/2,
+	.offload = 1,
 };
 
 static struct ast_translator g726aal2tolin = {
@@ -837,11 +852,13 @@ static struct ast_translator g726aal2tolin = {
 	.srcfmt = AST_FORMAT_G726_AAL2,
 	.dstfmt = AST_FORMAT_SLINEAR,
 	.newpvt = lintog726_new,	/* same for both directions */
+	.reset = g726_reset,
 	.framein = g726aal2tolin_framein,
 	.sample = g726tolin_sample,
 	.desc_size = sizeof(struct g726_coder_pvt),
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES * 2,
+	.offload = 1,
 };
 
 static struct ast_translator lintog726aal2 = {
@@ -849,11 +866,13 @@ static struct ast_translator lintog726aal2 = {
 	.srcfmt = AST_FORMAT_SLINEAR,
 	.dstfmt = AST_FORMAT_G726_AAL2,
 	.newpvt = lintog726_new,	/* same for both directions */
+	.reset = g726_reset,
 	.framein = lintog726aal2_framein,
 	.sample = lintog726_sample,
 	.desc_size = sizeof(struct g726_coder_pvt),
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES / 2,
+	.offload = 1,
 };
 
 static int reload(void)
@@ -79,6 +79,17 @@ static int gsm_new(struct ast_trans_pvt *pvt)
 	return (tmp->gsm = gsm_create()) ? 0 : -1;
 }
 
+/*! \brief gsm has no way to reset its state, so start again with a new one */
+static int gsm_reset(struct ast_trans_pvt *pvt)
+{
+	struct gsm_translator_pvt *tmp = pvt->pvt;
+
+	if (tmp->gsm)
+		gsm_destroy(tmp->gsm);
+
+	return gsm_new(pvt);
+}
+
 static struct ast_frame *lintogsm_sample(void)
 {
 	static struct ast_frame f;
@@ -214,10 +225,12 @@ static struct ast_translator gsmtolin = {
 	.newpvt = gsm_new,
 	.framein = gsmtolin_framein,
 	.destroy = gsm_destroy_stuff,
+	.reset = gsm_reset,
 	.sample = gsmtolin_sample,
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES * 2,
 	.desc_size = sizeof (struct gsm_translator_pvt ),
+	.offload = 1,
 };
 
 static struct ast_translator lintogsm = {
@@ -228,9 +241,11 @@ static struct ast_translator lintogsm = {
 	.framein = lintogsm_framein,
 	.frameout = lintogsm_frameout,
 	.destroy = gsm_destroy_stuff,
+	.reset = gsm_reset,
 	.sample = lintogsm_sample,
 	.desc_size = sizeof (struct gsm_translator_pvt ),
 	.buf_size = (BUFFER_SAMPLES * GSM_FRAME_LEN + GSM_SAMPLES - 1)/GSM_SAMPLES,
+	.offload = 1,
 };
 
 /*! \brief standard module glue */
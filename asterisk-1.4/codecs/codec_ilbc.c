@@ -208,11 +208,13 @@ static struct ast_translator ilbctolin = {
 	.srcfmt = AST_FORMAT_ILBC,
 	.dstfmt = AST_FORMAT_SLINEAR,
 	.newpvt = ilbctolin_new,
+	.reset = ilbctolin_new,		/* initDecode() resets it all */
 	.framein = ilbctolin_framein,
 	.sample = ilbctolin_sample,
 	.desc_size = sizeof(struct ilbc_coder_pvt),
 	.buf_size = BUFFER_SAMPLES * 2,
 	.native_plc = 1,
+	.offload = 1,
 };
 
 static struct ast_translator lintoilbc = {
@@ -220,11 +222,13 @@ static struct ast_translator lintoilbc = {
 	.srcfmt = AST_FORMAT_SLINEAR,
 	.dstfmt = AST_FORMAT_ILBC,
 	.newpvt = lintoilbc_new,
+	.reset = lintoilbc_new,		/* initEncode() resets it all */
 	.framein = lintoilbc_framein,
 	.frameout = lintoilbc_frameout,
 	.sample = lintoilbc_sample,
 	.desc_size = sizeof(struct ilbc_coder_pvt),
 	.buf_size = (BUFFER_SAMPLES * ILBC_FRAME_LEN + ILBC_SAMPLES - 1) / ILBC_SAMPLES,
+	.offload = 1,
 };
 
 static int unload_module(void)
@@ -86,6 +86,26 @@ static int lpc10_dec_new(struct ast_trans_pvt *pvt)
 	return (tmp->lpc10.dec = create_lpc10_decoder_state()) ? 0 : -1;
 }
 
+static int lpc10_enc_reset(struct ast_trans_pvt *pvt)
+{
+	struct lpc10_coder_pvt *tmp = pvt->pvt;
+
+	init_lpc10_encoder_state(tmp->lpc10.enc);
+	tmp->longer = 0;
+
+	return 0;
+}
+
+static int lpc10_dec_reset(struct ast_trans_pvt *pvt)
+{
+	struct lpc10_coder_pvt *tmp = pvt->pvt;
+
+	init_lpc10_decoder_state(tmp->lpc10.dec);
+	tmp->longer = 0;
+
+	return 0;
+}
+
 static struct ast_frame *lintolpc10_sample(void)
 {
 	static struct ast_frame f;
@@ -238,6 +258,7 @@ static struct ast_translator lpc10tolin = {
 	.srcfmt = AST_FORMAT_LPC10,
 	.dstfmt = AST_FORMAT_SLINEAR,
 	.newpvt = lpc10_dec_new,
+	.reset = lpc10_dec_reset,
 	.framein = lpc10tolin_framein,
 	.destroy = lpc10_destroy,
 	.sample = lpc10tolin_sample,
@@ -251,6 +272,7 @@ static struct ast_translator lintolpc10 = {
 	.srcfmt = AST_FORMAT_SLINEAR,
 	.dstfmt = AST_FORMAT_LPC10,
 	.newpvt = lpc10_enc_new,
+	.reset = lpc10_enc_reset,
 	.framein = lintolpc10_framein,
 	.frameout = lintolpc10_frameout,
 	.destroy = lpc10_destroy,
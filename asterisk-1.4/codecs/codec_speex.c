@@ -358,6 +358,7 @@ static struct ast_translator speextolin = {
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES * 2,
 	.native_plc = 1,
+	.offload = 1,
 };
 
 static struct ast_translator lintospeex = {
@@ -372,6 +373,7 @@ static struct ast_translator lintospeex = {
 	.desc_size = sizeof(struct speex_coder_pvt),
 	.buffer_samples = BUFFER_SAMPLES,
 	.buf_size = BUFFER_SAMPLES * 2, /* XXX maybe a lot less ? */
+	.offload = 1,
 };
 
 static void parse_config(void) 
@@ -42,6 +42,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 267539 $")
 #include "asterisk/translate.h"
 #include "asterisk/channel.h"
 #include "asterisk/ulaw.h"
+#include "asterisk/slinear.h"
 #include "asterisk/utils.h"
 
 #define BUFFER_SAMPLES   8096	/* size for the translation buffers */
@@ -62,8 +63,7 @@ static int ulawtolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 	pvt->datalen += i * 2;	/* 2 bytes/sample */
 
 	/* convert and copy in outbuf */
-	while (i--)
-		*dst++ = AST_MULAW(*src++);
+	ast_ulaw_to_slinear_n(dst, src, i);
 
 	return 0;
 }
@@ -72,14 +72,13 @@ static int ulawtolin_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 static int lintoulaw_framein(struct ast_trans_pvt *pvt, struct ast_frame *f)
 {
 	int i = f->samples;
-	char *dst = pvt->outbuf + pvt->samples;
+	unsigned char *dst = (unsigned char *) pvt->outbuf + pvt->samples;
 	int16_t *src = f->data;
 
 	pvt->samples += i;
 	pvt->datalen += i;	/* 1 byte/sample */
 
-	while (i--)
-		*dst++ = AST_LIN2MU(*src++);
+	ast_slinear_to_ulaw_n(dst, src, i);
 
 	return 0;
 }
@@ -110,6 +110,9 @@ void ast_autoservice_init(void);    /*!< Provided by autoservice.c */
 int ast_fd_init(void);				/*!< Provided by astfd.c */
 int ast_test_init(void);                        /*!< Provided by test.c */
 int ast_pbx_init(void);                         /*!< Provided by pbx.c */
+void ast_sched_init(void);                      /*!< Provided by sched.c */
+void ast_slinear_init(void);                    /*!< Provided by slinear.c */
+void ast_transcoder_init(void);                 /*!< Provided by translate.c */
 
 /* Many headers need 'ast_channel' to be defined */
 struct ast_channel;
@@ -112,13 +112,29 @@ int ast_cdr_serialize_variables(struct ast_cdr *cdr, char *buf, size_t size, cha
 void ast_cdr_free_vars(struct ast_cdr *cdr, int recur);
 int ast_cdr_copy_vars(struct ast_cdr *to_cdr, struct ast_cdr *from_cdr);
 
+/*! Returned by a CDR backend that can not reach its storage right now.  In
+ * batch mode the core spools the records and retries them later. */
+#define AST_CDR_BACKEND_DOWN		-2
+
 /*!\brief CDR backend callback
  * \warning CDR backends should NOT attempt to access the channel associated
  * with a CDR record.  This channel is not guaranteed to exist when the CDR
  * backend is invoked.
+ * \retval 0 if the record was stored
+ * \retval AST_CDR_BACKEND_DOWN if the storage could not be reached
+ * \retval other if the record itself was refused, it would be again
  */
 typedef int (*ast_cdrbe)(struct ast_cdr *cdr);
 
+/*!\brief CDR backend callback posting many records at once
+ * \param cdrs the records, oldest first
+ * \param count how many there are
+ * \retval 0 if every record was stored
+ * \retval AST_CDR_BACKEND_DOWN if none were, so they can be spooled and retried
+ * \retval other if none were, the core then posts them one at a time
+ */
+typedef int (*ast_cdrbe_batch)(struct ast_cdr **cdrs, int count);
+
 /*! \brief Allocate a CDR record 
  * Returns a malloc'd ast_cdr structure, returns NULL on error (malloc failure)
  */
@@ -168,6 +184,17 @@ int ast_cdr_setcid(struct ast_cdr *cdr, struct ast_channel *chan);
  */
 int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be);
 
+/*! Register a CDR handling engine that can store many records at once */
+/*!
+ * \param name name associated with the particular CDR handler
+ * \param desc description of the CDR handler
+ * \param be function pointer to a CDR handler
+ * \param batch_be function pointer to a handler for many CDRs, used in
+ * batch mode so the backend can, for example, insert them in one transaction
+ * Returns -1 on error, 0 on success.
+ */
+int ast_cdr_register_batch(const char *name, const char *desc, ast_cdrbe be, ast_cdrbe_batch batch_be);
+
 /*! Unregister a CDR handling engine */
 /*!
  * \param name name of CDR handler to unregister
@@ -212,6 +212,14 @@ typedef struct {
 	const char *value;
 } ast_chan_write_info_t;
 
+#ifdef HAVE_EPOLL_CREATE
+/*! \brief Identifies one of a channel's fds in its epoll set */
+struct ast_epoll_data {
+	struct ast_channel *chan;	/*!< Channel the fd belongs to */
+	int which;			/*!< Index of the fd in chan->fds */
+};
+#endif
+
 /*! \brief 
 	Structure to describe a channel "technology", ie a channel driver 
 	See for examples:
@@ -373,8 +381,15 @@ struct ast_channel {
 		AST_STRING_FIELD(uniqueid);		/*!< Unique Channel Identifier */
 	);
 	
-	/*! \brief File descriptor for channel -- Drivers will poll on these file descriptors, so at least one must be non -1.  */
+	/*! \brief File descriptor for channel -- Drivers will poll on these file descriptors, so at least one must be non -1.
+	 *  Use ast_channel_set_fd() to change them, fds written directly are not waited on. */
 	int fds[AST_MAX_FDS];			
+#ifdef HAVE_EPOLL_CREATE
+	int epfd;					/*!< epoll set holding fds[], kept current by ast_channel_set_fd() */
+	struct ast_epoll_data epfd_data[AST_MAX_FDS];	/*!< What each of fds[] is, for epoll events */
+	int epoll_fds[AST_MAX_FDS];			/*!< fds[] as last put in the epoll sets */
+	struct ast_channel *epoll_peer;			/*!< Channel sharing our epoll set, see ast_poll_channel_add() */
+#endif
 
 	void *music_state;				/*!< Music State*/
 	void *generatordata;				/*!< Current generator data if there is any */
@@ -465,6 +480,8 @@ struct ast_channel {
 			 *  for the sake of ABI compatability. */
 
 	AST_LIST_ENTRY(ast_channel) chan_list;		/*!< For easy linking */
+	AST_LIST_ENTRY(ast_channel) name_list;		/*!< Entry in the channel name hash */
+	int name_bucket;				/*!< Name hash bucket we are in, -1 if none */
 	
 	struct ast_jb jb;				/*!< The jitterbuffer state  */
 
@@ -758,6 +775,11 @@ int ast_queue_control_data(struct ast_channel *chan, enum ast_control_frame_type
 /*! \brief Change channel name */
 void ast_change_name(struct ast_channel *chan, char *newname);
 
+/*! \brief Change channel name, without a Rename manager event.
+ * Use this rather than setting chan->name directly, so the channel can
+ * still be found by its name. */
+void ast_channel_set_name(struct ast_channel *chan, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
 /*! \brief Free a channel structure */
 void  ast_channel_free(struct ast_channel *);
 
@@ -978,6 +1000,24 @@ int ast_safe_sleep_conditional(struct ast_channel *chan, int ms, int (*cond)(voi
    will be -1 */
 struct ast_channel *ast_waitfor_nandfds(struct ast_channel **chan, int n, int *fds, int nfds, int *exception, int *outfd, int *ms);
 
+/*! \brief Set one of the file descriptors of a channel
+ * \param chan channel to change
+ * \param which index in chan->fds
+ * \param fd new file descriptor, or -1
+ * Drivers must use this instead of assigning chan->fds directly, so the
+ * channel's epoll set follows the change. */
+void ast_channel_set_fd(struct ast_channel *chan, int which, int fd);
+
+/*! \brief Let two channels wait on one epoll set
+ * Adds the fds of each channel to the epoll set of the other, so that
+ * ast_waitfor_n() on just these two channels (as bridges do) does a
+ * single epoll_wait().  Undo with ast_poll_channel_del() before the
+ * channels are waited on separately again. */
+void ast_poll_channel_add(struct ast_channel *chan0, struct ast_channel *chan1);
+
+/*! \brief Undo ast_poll_channel_add() */
+void ast_poll_channel_del(struct ast_channel *chan0, struct ast_channel *chan1);
+
 /*! \brief Waits for input on a group of channels
    Wait for input on an array of channels for a given # of milliseconds. 
 	\return Return channel with activity, or NULL if none has activity.  
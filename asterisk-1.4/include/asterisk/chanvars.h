@@ -27,11 +27,23 @@
 
 struct ast_var_t {
 	AST_LIST_ENTRY(ast_var_t) entries;
+	struct ast_var_t *hash_next;	/*!< Next variable in the same bucket of the index */
 	char *value;
 	char name[0];
 };
 
-AST_LIST_HEAD_NOLOCK(varshead, ast_var_t);
+struct ast_var_index;
+
+/*! \brief A list of variables.
+ * It can be walked with the AST_LIST_* macros.  A list changed with the
+ * ast_var_insert_*(), ast_var_remove() and ast_var_list_*() functions below
+ * is indexed by name once it holds more than a few variables, and must not
+ * be changed with the AST_LIST_* macros from then on. */
+struct varshead {
+	struct ast_var_t *first;
+	struct ast_var_t *last;
+	struct ast_var_index *index;	/*!< Hash of the variables by name, kept by the functions changing the list */
+};
 
 struct ast_var_t *ast_var_assign(const char *name, const char *value);
 void ast_var_delete(struct ast_var_t *var);
@@ -39,4 +51,32 @@ const char *ast_var_name(const struct ast_var_t *var);
 const char *ast_var_full_name(const struct ast_var_t *var);
 const char *ast_var_value(const struct ast_var_t *var);
 
+/*! \brief Add a variable at the head of a list */
+void ast_var_insert_head(struct varshead *head, struct ast_var_t *var);
+
+/*! \brief Add a variable at the tail of a list */
+void ast_var_insert_tail(struct varshead *head, struct ast_var_t *var);
+
+/*! \brief Remove a variable from a list, without deleting it */
+void ast_var_remove(struct varshead *head, struct ast_var_t *var);
+
+/*! \brief Move all the variables of from to the tail of head */
+void ast_var_list_append(struct varshead *head, struct varshead *from);
+
+/*! \brief Remove and delete all the variables of a list */
+void ast_var_list_destroy(struct varshead *head);
+
+/*!
+ * \brief Find the first variable of a list with the given name
+ * \param head the list
+ * \param name the name, without the leading underscores
+ * \param nocase compare the names case insensitively
+ * \return the variable, NULL if there is none
+ *
+ * Short lists are scanned, longer ones are looked up in their index.  The
+ * list is not changed, so lookups only need to be kept from running along
+ * with changes to it.
+ */
+struct ast_var_t *ast_var_find(struct varshead *head, const char *name, int nocase);
+
 #endif /* _ASTERISK_CHANVARS_H */
@@ -130,6 +130,8 @@ enum {
 	AST_FRFLAG_HAS_TIMING_INFO = (1 << 0),
 };
 
+struct ast_frame_payload;
+
 /*! \brief Data structure associated with a single frame of data
  */
 struct ast_frame {
@@ -163,6 +165,8 @@ struct ast_frame {
 	long len;
 	/*! Sequence number */
 	int seqno;
+	/*! Reference counted buffer holding the data, if AST_MALLOCD_PAYLOAD is set */
+	struct ast_frame_payload *payload;
 };
 
 /*!
@@ -195,6 +199,8 @@ extern struct ast_frame ast_null_frame;
 #define AST_MALLOCD_DATA	(1 << 1)
 /*! Need the source be free'd? (haha!) */
 #define AST_MALLOCD_SRC		(1 << 2)
+/*! Is the data in a reference counted payload from the frame pool? */
+#define AST_MALLOCD_PAYLOAD	(1 << 3)
 
 /* MODEM subclasses */
 /*! T.38 Fax-over-IP */
@@ -428,6 +434,25 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr);
  */
 struct ast_frame *ast_frdup(const struct ast_frame *fr);
 
+/*! \brief Copies a frame, sharing its data if possible
+ * \param fr frame to copy
+ * Like ast_frdup(), but if the data is in a reference counted payload
+ * (as it is for frames from ast_frdup() and ast_frisolate()) the new frame
+ * refers to the same payload instead of copying it.  The data of a shared
+ * frame must not be written to without calling ast_frame_unshare() first,
+ * and it has no space before the data (its offset is 0).
+ * \return Returns a frame on success, NULL on error
+ */
+struct ast_frame *ast_frshare(const struct ast_frame *fr);
+
+/*! \brief Makes sure the data of a frame is not shared with other frames
+ * \param fr frame to act upon
+ * Call this before writing to the data of a frame that might have been
+ * passed to ast_frshare(), and the data will be copied if it is shared.
+ * \return Returns 0 on success, -1 on error
+ */
+int ast_frame_unshare(struct ast_frame *fr);
+
 void ast_swapcopy_samples(void *dst, const void *src, int samples);
 
 /* Helpers for byteswapping native samples to/from 
@@ -142,6 +142,9 @@ extern const enum dahdi_chan_modes {
 } *dahdi_chan_mode;
 	
 extern int ast_language_is_prefix;
+extern int ast_sounds_index;
+extern int ast_sounds_cache_size;
+extern int ast_sounds_compile;
 
 #if defined(__cplusplus) || defined(c_plusplus)
 }
@@ -279,6 +279,8 @@ int ast_rtp_get_rtpholdtimeout(struct ast_rtp *rtp);
 int ast_rtp_get_rtptimeout(struct ast_rtp *rtp);
 /* \brief Put RTP timeout timers on hold during another transaction, like T.38 */
 void ast_rtp_set_rtptimers_onhold(struct ast_rtp *rtp);
+/*! \brief Get when RTP was last relayed from this stream without being read through its channel */
+time_t ast_rtp_get_lastrelayed(struct ast_rtp *rtp);
 
 #if defined(__cplusplus) || defined(c_plusplus)
 }
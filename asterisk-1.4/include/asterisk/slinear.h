@@ -0,0 +1,60 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Signed linear sample kernels
+ *
+ * Block versions of the ast_slinear_saturated_*() helpers and of the
+ * u-law and A-law conversion tables.  They give exactly the same results,
+ * using SIMD instructions when the CPU has them.
+ */
+
+#ifndef _ASTERISK_SLINEAR_H
+#define _ASTERISK_SLINEAR_H
+
+/*! \brief Add src to dst, sample by sample, as ast_slinear_saturated_add() does */
+void ast_slinear_saturated_add_n(short *dst, const short *src, int samples);
+
+/*! \brief Multiply samples by value, as ast_slinear_saturated_multiply() does */
+void ast_slinear_saturated_multiply_n(short *data, short value, int samples);
+
+/*! \brief Divide samples by value, as ast_slinear_saturated_divide() does */
+void ast_slinear_saturated_divide_n(short *data, short value, int samples);
+
+/*! \brief Convert u-law samples to signed linear, as AST_MULAW() does */
+void ast_ulaw_to_slinear_n(short *dst, const unsigned char *src, int samples);
+
+/*! \brief Convert signed linear samples to u-law, as AST_LIN2MU() does */
+void ast_slinear_to_ulaw_n(unsigned char *dst, const short *src, int samples);
+
+/*! \brief Convert A-law samples to signed linear, as AST_ALAW() does */
+void ast_alaw_to_slinear_n(short *dst, const unsigned char *src, int samples);
+
+/*! \brief Convert signed linear samples to A-law, as AST_LIN2A() does */
+void ast_slinear_to_alaw_n(unsigned char *dst, const short *src, int samples);
+
+/*!
+ * \brief Choose the implementation of the kernels
+ * \param name "scalar", "sse2" or "avx2", or NULL for the best the CPU supports
+ * \retval 0 success
+ * \retval -1 the implementation is unknown or not supported by this CPU
+ */
+int ast_slinear_select(const char *name);
+
+/*! \brief Name of the implementation of the kernels in use */
+const char *ast_slinear_selected(void);
+
+#endif /* _ASTERISK_SLINEAR_H */
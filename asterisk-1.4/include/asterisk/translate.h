@@ -83,6 +83,13 @@ struct ast_translator {
 					/*!< cleanup private data, if needed 
 						(often unnecessary). */
 
+	int (*reset)(struct ast_trans_pvt *pvt);
+					/*!< Reinitialize private data left by a
+					     previous stream so the pvt can be reused.
+					     Return -1 if it cannot be. Translators
+					     with neither newpvt nor destroy do not
+					     need it, their descriptor is cleared. */
+
 	struct ast_frame * (*sample)(void);	/*!< Generate an example frame */
 
 	/*! \brief size of outbuf, in samples. Leave it 0 if you want the framein
@@ -101,11 +108,15 @@ struct ast_translator {
 	int plc_samples; /* Unused. Kept for ABI purposes */
 	int useplc; /* Unused. Kept for ABI purposes */
 	int native_plc;			/*!< true if the translator can do native plc */
+	int offload;			/*!< true if the translator is expensive enough
+					     to be run by the transcoder threads */
 
 	struct ast_module *module;	/* opaque reference to the parent module */
 
 	int cost;			/*!< Cost in milliseconds for encoding/decoding 1 second of sound */
 	int active;			/*!< Whether this translator should be used or not */
+	struct ast_trans_pvt *pool;	/*!< Idle pvts kept for reuse, linked by next */
+	int pool_count;			/*!< Number of pvts in the pool */
 	AST_LIST_ENTRY(ast_translator) list;	/*!< link field */
 };
 
@@ -141,6 +152,7 @@ struct ast_trans_pvt {
 	struct ast_trans_pvt *next;	/*!< next in translator chain */
 	struct timeval nextin;
 	struct timeval nextout;
+	struct transcoder_path *xc;	/*!< on the first step, the frames of the path in the transcoder */
 };
 
 /*! \brief generic frameout function */
@@ -204,6 +216,15 @@ int ast_translator_best_choice(int *dsts, int *srcs);
  * */
 struct ast_trans_pvt *ast_translator_build_path(int dest, int source);
 
+/*!
+ * \brief Lets the transcoder threads run a path, if it has an expensive step
+ * Only for paths frames go through in real time, like those of a channel, as
+ * ast_translate() then returns the frames translated since the last call, as
+ * a list, and drops frames rather than fall further behind.
+ * \param tr translator path, as built by ast_translator_build_path()
+ */
+void ast_translator_offload(struct ast_trans_pvt *tr);
+
 /*!
  * \brief Frees a translator path
  * Frees the given translator path structure
@@ -214,7 +235,9 @@ void ast_translator_free_path(struct ast_trans_pvt *tr);
 /*!
  * \brief translates one or more frames
  * Apply an input frame into the translator and receive zero or one output frames.  Consume
- * determines whether the original frame should be freed
+ * determines whether the original frame should be freed.  When the transcoder threads
+ * run the path, the frame returned is one they translated from an earlier call, see
+ * ast_translator_offload().
  * \param tr translator structure to use for translation
  * \param f frame to translate
  * \param consume Whether or not to free the original frame
@@ -244,6 +267,13 @@ unsigned int ast_translate_path_steps(unsigned int dest, unsigned int src);
  */
 unsigned int ast_translate_available_formats(unsigned int dest, unsigned int src);
 
+/*!
+ * \brief Start, stop or resize the transcoder from the [transcoder]
+ * section of codecs.conf
+ * \return 0
+ */
+int ast_transcoder_reload(void);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
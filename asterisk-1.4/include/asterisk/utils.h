@@ -255,6 +255,17 @@ int ast_wait_for_input(int fd, int ms);
 */
 int ast_carefulwrite(int fd, char *s, int len, int timeoutms);
 
+struct iovec;
+
+/*! ast_carefulwritev
+	\brief Like ast_carefulwrite(), but gathers the data from an iovec array
+	so several buffers go out in as few system calls as possible.
+
+	\note The iovec array is modified to track partial writes.
+	\return 0 once everything was written, -1 on error or timeout.
+*/
+int ast_carefulwritev(int fd, struct iovec *iov, int iovcnt, int timeoutms);
+
 /*! Compares the source address and port of two sockaddr_in */
 static force_inline int inaddrcmp(const struct sockaddr_in *sin1, const struct sockaddr_in *sin2)
 {
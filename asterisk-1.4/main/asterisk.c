@@ -2693,6 +2693,18 @@ static void ast_readconfig(void)
 			ast_copy_string(ast_config_AST_SYSTEM_NAME, v->value, sizeof(ast_config_AST_SYSTEM_NAME));
 		} else if (!strcasecmp(v->name, "languageprefix")) {
 			ast_language_is_prefix = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "sounds_index")) {
+			ast_sounds_index = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "sounds_compile")) {
+			if ((sscanf(v->value, "%30d", &ast_sounds_compile) != 1) || (ast_sounds_compile < 0)) {
+				ast_log(LOG_WARNING, "Invalid sounds_compile value '%s', not compiling sound files\n", v->value);
+				ast_sounds_compile = 0;
+			}
+		} else if (!strcasecmp(v->name, "sounds_cache")) {
+			if ((sscanf(v->value, "%30d", &ast_sounds_cache_size) != 1) || (ast_sounds_cache_size < 0)) {
+				ast_log(LOG_WARNING, "Invalid sounds_cache value '%s', not caching sound files\n", v->value);
+				ast_sounds_cache_size = 0;
+			}
 		} else if (!strcasecmp(v->name, "dahdichanname")) {
 #ifdef HAVE_ZAPTEL
 			if (ast_true(v->value)) {
@@ -2772,6 +2784,7 @@ int main(int argc, char *argv[])
 	ast_mainpid = getpid();
 	ast_ulaw_init();
 	ast_alaw_init();
+	ast_slinear_init();
 	callerid_init();
 	ast_builtins_init();
 	ast_utils_init();
@@ -3206,6 +3219,8 @@ int main(int argc, char *argv[])
 
 	ast_autoservice_init();
 
+	ast_sched_init();
+
 	if (load_modules(1)) {
 		printf("%s", term_quit());
 		exit(1);
@@ -3220,6 +3235,8 @@ int main(int argc, char *argv[])
 
 	ast_channels_init();
 
+	ast_transcoder_init();
+
 	if (init_manager()) {
 		printf("%s", term_quit());
 		exit(1);
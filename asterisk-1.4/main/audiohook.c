@@ -44,6 +44,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 279945 $")
 #include "asterisk/slinfactory.h"
 #include "asterisk/frame.h"
 #include "asterisk/translate.h"
+#include "asterisk/slinear.h"
 
 struct ast_audiohook_translate {
 	struct ast_trans_pvt *trans_pvt;
@@ -204,8 +205,8 @@ static struct ast_frame *audiohook_read_frame_single(struct ast_audiohook *audio
 
 static struct ast_frame *audiohook_read_frame_both(struct ast_audiohook *audiohook, size_t samples)
 {
-	int i = 0, usable_read, usable_write;
-	short buf1[samples], buf2[samples], *read_buf = NULL, *write_buf = NULL, *final_buf = NULL, *data1 = NULL, *data2 = NULL;
+	int usable_read, usable_write;
+	short buf1[samples], buf2[samples], *read_buf = NULL, *write_buf = NULL, *final_buf = NULL;
 	struct ast_frame frame = {
 		.frametype = AST_FRAME_VOICE,
 		.subclass = AST_FORMAT_SLINEAR,
@@ -244,16 +245,10 @@ static struct ast_frame *audiohook_read_frame_both(struct ast_audiohook *audioho
 		if (ast_slinfactory_read(&audiohook->read_factory, buf1, samples)) {
 			read_buf = buf1;
 			/* Adjust read volume if need be */
-			if (audiohook->options.read_volume) {
-				int count = 0;
-				short adjust_value = abs(audiohook->options.read_volume);
-				for (count = 0; count < samples; count++) {
-					if (audiohook->options.read_volume > 0)
-						ast_slinear_saturated_multiply(&buf1[count], &adjust_value);
-					else if (audiohook->options.read_volume < 0)
-						ast_slinear_saturated_divide(&buf1[count], &adjust_value);
-				}
-			}
+			if (audiohook->options.read_volume > 0)
+				ast_slinear_saturated_multiply_n(buf1, abs(audiohook->options.read_volume), samples);
+			else if (audiohook->options.read_volume < 0)
+				ast_slinear_saturated_divide_n(buf1, abs(audiohook->options.read_volume), samples);
 		}
 	} else if (option_debug)
 		ast_log(LOG_DEBUG, "Failed to get %zd samples from read factory %p\n", samples, &audiohook->read_factory);
@@ -263,16 +258,10 @@ static struct ast_frame *audiohook_read_frame_both(struct ast_audiohook *audioho
 		if (ast_slinfactory_read(&audiohook->write_factory, buf2, samples)) {
 			write_buf = buf2;
 			/* Adjust write volume if need be */
-			if (audiohook->options.write_volume) {
-				int count = 0;
-				short adjust_value = abs(audiohook->options.write_volume);
-				for (count = 0; count < samples; count++) {
-					if (audiohook->options.write_volume > 0)
-						ast_slinear_saturated_multiply(&buf2[count], &adjust_value);
-					else if (audiohook->options.write_volume < 0)
-						ast_slinear_saturated_divide(&buf2[count], &adjust_value);
-				}
-			}
+			if (audiohook->options.write_volume > 0)
+				ast_slinear_saturated_multiply_n(buf2, abs(audiohook->options.write_volume), samples);
+			else if (audiohook->options.write_volume < 0)
+				ast_slinear_saturated_divide_n(buf2, abs(audiohook->options.write_volume), samples);
 		}
 	} else if (option_debug)
 		ast_log(LOG_DEBUG, "Failed to get %zd samples from write factory %p\n", samples, &audiohook->write_factory);
@@ -281,8 +270,7 @@ static struct ast_frame *audiohook_read_frame_both(struct ast_audiohook *audioho
 	if (!read_buf && !write_buf)
 		return NULL;
 	else if (read_buf && write_buf) {
-		for (i = 0, data1 = read_buf, data2 = write_buf; i < samples; i++, data1++, data2++)
-			ast_slinear_saturated_add(data1, data2);
+		ast_slinear_saturated_add_n(read_buf, write_buf, samples);
 		final_buf = buf1;
 	} else if (read_buf)
 		final_buf = buf1;
@@ -605,7 +593,7 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 {
 	struct ast_audiohook_translate *in_translate = (direction == AST_AUDIOHOOK_DIRECTION_READ ? &audiohook_list->in_translate[0] : &audiohook_list->in_translate[1]);
 	struct ast_audiohook_translate *out_translate = (direction == AST_AUDIOHOOK_DIRECTION_READ ? &audiohook_list->out_translate[0] : &audiohook_list->out_translate[1]);
-	struct ast_frame *start_frame = frame, *middle_frame = frame, *end_frame = frame;
+	struct ast_frame *start_frame = frame, *middle_frame = frame, *end_frame = frame, *spy_frame;
 	struct ast_audiohook *audiohook = NULL;
 	int samples = frame->samples;
 
@@ -625,7 +613,13 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 	}
 
 	/* ---Part_2: Send middle_frame to spy and manipulator lists.  middle_frame is guaranteed to be SLINEAR here.*/
-	/* Queue up signed linear frame to each spy */
+	/* Queue up signed linear frame to each spy.  Spies share the payload of the frame,
+	 * so one that does not have one (straight off an RTP socket, say) is copied once
+	 * here rather than once by every spy. */
+	spy_frame = middle_frame;
+	if (!AST_LIST_EMPTY(&audiohook_list->spy_list) && !(middle_frame->mallocd & AST_MALLOCD_PAYLOAD) &&
+	    !(spy_frame = ast_frdup(middle_frame)))
+		spy_frame = middle_frame;
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&audiohook_list->spy_list, audiohook, list) {
 		ast_audiohook_lock(audiohook);
 		if (audiohook->status != AST_AUDIOHOOK_STATUS_RUNNING) {
@@ -635,15 +629,16 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 			ast_audiohook_unlock(audiohook);
 			continue;
 		}
-		ast_audiohook_write_frame(audiohook, direction, middle_frame);
+		ast_audiohook_write_frame(audiohook, direction, spy_frame);
 		ast_audiohook_unlock(audiohook);
 	}
 	AST_LIST_TRAVERSE_SAFE_END
+	if (spy_frame != middle_frame)
+		ast_frfree(spy_frame);
 
 	/* If this frame is being written out to the channel then we need to use whisper sources */
 	if (direction == AST_AUDIOHOOK_DIRECTION_WRITE && !AST_LIST_EMPTY(&audiohook_list->whisper_list)) {
-		int i = 0;
-		short read_buf[samples], combine_buf[samples], *data1 = NULL, *data2 = NULL;
+		short read_buf[samples], combine_buf[samples];
 		memset(&combine_buf, 0, sizeof(combine_buf));
 		AST_LIST_TRAVERSE_SAFE_BEGIN(&audiohook_list->whisper_list, audiohook, list) {
 			ast_audiohook_lock(audiohook);
@@ -656,20 +651,21 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 			}
 			if (ast_slinfactory_available(&audiohook->write_factory) >= samples && ast_slinfactory_read(&audiohook->write_factory, read_buf, samples)) {
 				/* Take audio from this whisper source and combine it into our main buffer */
-				for (i = 0, data1 = combine_buf, data2 = read_buf; i < samples; i++, data1++, data2++)
-					ast_slinear_saturated_add(data1, data2);
+				ast_slinear_saturated_add_n(combine_buf, read_buf, samples);
 			}
 			ast_audiohook_unlock(audiohook);
 		}
 		AST_LIST_TRAVERSE_SAFE_END
-		/* We take all of the combined whisper sources and combine them into the audio being written out */
-		for (i = 0, data1 = middle_frame->data, data2 = combine_buf; i < samples; i++, data1++, data2++)
-			ast_slinear_saturated_add(data1, data2);
-		end_frame = middle_frame;
+		/* We take all of the combined whisper sources and combine them into the audio being written out,
+		 * which the spies must not see */
+		if (!ast_frame_unshare(middle_frame)) {
+			ast_slinear_saturated_add_n(middle_frame->data, combine_buf, samples);
+			end_frame = middle_frame;
+		}
 	}
 
 	/* Pass off frame to manipulate audiohooks */
-	if (!AST_LIST_EMPTY(&audiohook_list->manipulate_list)) {
+	if (!AST_LIST_EMPTY(&audiohook_list->manipulate_list) && !ast_frame_unshare(middle_frame)) {
 		AST_LIST_TRAVERSE_SAFE_BEGIN(&audiohook_list->manipulate_list, audiohook, list) {
 			ast_audiohook_lock(audiohook);
 			if (audiohook->status != AST_AUDIOHOOK_STATUS_RUNNING) {
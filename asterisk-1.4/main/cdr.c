@@ -39,7 +39,10 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 287114 $")
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "asterisk/lock.h"
 #include "asterisk/channel.h"
@@ -59,10 +62,35 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 287114 $")
 int ast_default_amaflags = AST_CDR_DOCUMENTATION;
 char ast_default_accountcode[AST_MAX_ACCOUNT_CODE];
 
+/*! \brief A CDR chain shared by the queues of every backend posting it */
+struct cdr_post {
+	int usecount;
+	struct ast_cdr *cdr;
+};
+
 struct ast_cdr_beitem {
 	char name[20];
 	char desc[80];
 	ast_cdrbe be;
+	ast_cdrbe_batch batch_be;	/*!< Optional, posts many CDRs at once */
+	/*! Protects the queue and the worker state below */
+	ast_mutex_t lock;
+	ast_cond_t cond;		/*!< Signalled on new work, and when the worker goes idle */
+	struct cdr_post **queue;	/*!< Ring of chains waiting for the worker in batch mode */
+	int queue_size;
+	int queue_head;
+	int queue_count;
+	pthread_t thread;		/*!< Worker posting the queue to this backend */
+	int stop;			/*!< The worker should exit once the queue is empty */
+	int busy;			/*!< The worker is posting */
+	time_t retry;			/*!< After a failure, spool instead of posting until then */
+	/*! Protects the spool files of this backend */
+	ast_mutex_t spool_lock;
+	int spool_pending;		/*!< The spool file has CDRs to replay */
+	unsigned int posted;
+	unsigned int spooled;
+	unsigned int replayed;
+	unsigned int rejected;		/*!< CDRs the backend refused, set aside in cdr/<backend>.rejected */
 	AST_LIST_ENTRY(ast_cdr_beitem) list;
 };
 
@@ -87,6 +115,61 @@ static pthread_t cdr_thread = AST_PTHREADT_NULL;
 #define BATCH_TIME_DEFAULT 300
 #define BATCH_SCHEDULER_ONLY_DEFAULT 0
 #define BATCH_SAFE_SHUTDOWN_DEFAULT 1
+#define BACKEND_QUEUE_DEFAULT 1000
+#define BACKEND_BATCH_DEFAULT 100
+#define BACKEND_RETRY_DEFAULT 30
+#define BACKEND_SPOOL_DEFAULT 1
+
+/*! First line of a spool file, names the version of its format */
+#define CDR_SPOOL_HEADER "Asterisk CDR spool 2"
+/*! Longest line read back from a spool file */
+#define CDR_SPOOL_LINE_LEN 4096
+/*! Room for the spool directory, the backend name and a suffix */
+#define CDR_SPOOL_PATH_LEN (PATH_MAX + sizeof("/cdr/") + sizeof(((struct ast_cdr_beitem *) NULL)->name) + sizeof(".rejected"))
+
+/*! \brief A field of struct ast_cdr in the spool file
+ * Fields are written by name, one per line, so the layout of the structure
+ * can change without making older spool files unreadable.
+ */
+struct cdr_spool_field {
+	const char *name;
+	size_t offset;
+	size_t size;
+	enum {
+		CDR_SPOOL_STR,
+		CDR_SPOOL_LONG,
+		CDR_SPOOL_UINT,
+		CDR_SPOOL_TV,
+	} type;
+};
+
+#define CDR_SPOOL_FIELD(field, type) { #field, offsetof(struct ast_cdr, field), sizeof(((struct ast_cdr *) NULL)->field), type }
+
+static const struct cdr_spool_field cdr_spool_fields[] = {
+	CDR_SPOOL_FIELD(clid, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(src, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(dst, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(dcontext, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(channel, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(dstchannel, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(lastapp, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(lastdata, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(start, CDR_SPOOL_TV),
+	CDR_SPOOL_FIELD(answer, CDR_SPOOL_TV),
+	CDR_SPOOL_FIELD(end, CDR_SPOOL_TV),
+	CDR_SPOOL_FIELD(duration, CDR_SPOOL_LONG),
+	CDR_SPOOL_FIELD(billsec, CDR_SPOOL_LONG),
+	CDR_SPOOL_FIELD(disposition, CDR_SPOOL_LONG),
+	CDR_SPOOL_FIELD(amaflags, CDR_SPOOL_LONG),
+	CDR_SPOOL_FIELD(accountcode, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(uniqueid, CDR_SPOOL_STR),
+	CDR_SPOOL_FIELD(userfield, CDR_SPOOL_STR),
+	/* Last, so it is only applied after the variables are set */
+	CDR_SPOOL_FIELD(flags, CDR_SPOOL_UINT),
+};
+
+/*! Index of the flags in cdr_spool_fields */
+#define CDR_SPOOL_FLAGS_FIELD (ARRAY_LEN(cdr_spool_fields) - 1)
 
 static int enabled;		/*! Is the CDR subsystem enabled ? */
 static int unanswered;
@@ -95,6 +178,10 @@ static int batchsize;
 static int batchtime;
 static int batchscheduleronly;
 static int batchsafeshutdown;
+static int backendqueue;	/*!< Chains each backend may have queued in batch mode */
+static int backendbatch;	/*!< Most CDRs a backend is given at once */
+static int backendretry;	/*!< Seconds to spool for after a backend fails */
+static int backendspool;	/*!< Spool CDRs a backend can not take to disk */
 
 AST_MUTEX_DEFINE_STATIC(cdr_batch_lock);
 
@@ -103,10 +190,18 @@ AST_MUTEX_DEFINE_STATIC(cdr_pending_lock);
 static ast_cond_t cdr_pending_cond;
 
 
+static void cdr_backend_stop(struct ast_cdr_beitem *i);
+static void cdr_backend_resume(struct ast_cdr_beitem *i);
+
 /*! Register a CDR driver. Each registered CDR driver generates a CDR 
 	\return 0 on success, -1 on failure 
 */
 int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be)
+{
+	return ast_cdr_register_batch(name, desc, be, NULL);
+}
+
+int ast_cdr_register_batch(const char *name, const char *desc, ast_cdrbe be, ast_cdrbe_batch batch_be)
 {
 	struct ast_cdr_beitem *i;
 
@@ -133,11 +228,19 @@ int ast_cdr_register(const char *name, const char *desc, ast_cdrbe be)
 		return -1;
 
 	i->be = be;
+	i->batch_be = batch_be;
 	ast_copy_string(i->name, name, sizeof(i->name));
 	ast_copy_string(i->desc, desc, sizeof(i->desc));
+	ast_mutex_init(&i->lock);
+	ast_cond_init(&i->cond, NULL);
+	ast_mutex_init(&i->spool_lock);
+	i->thread = AST_PTHREADT_NULL;
+	/* Replay anything spooled by an earlier run as soon as the worker starts */
+	i->spool_pending = 1;
 
 	AST_LIST_LOCK(&be_list);
 	AST_LIST_INSERT_HEAD(&be_list, i, list);
+	cdr_backend_resume(i);
 	AST_LIST_UNLOCK(&be_list);
 
 	return 0;
@@ -152,14 +255,24 @@ void ast_cdr_unregister(const char *name)
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&be_list, i, list) {
 		if (!strcasecmp(name, i->name)) {
 			AST_LIST_REMOVE_CURRENT(&be_list, list);
-			if (option_verbose > 1)
-				ast_verbose(VERBOSE_PREFIX_2 "Unregistered '%s' CDR backend\n", name);
-			free(i);
 			break;
 		}
 	}
 	AST_LIST_TRAVERSE_SAFE_END;
 	AST_LIST_UNLOCK(&be_list);
+
+	if (!i)
+		return;
+
+	/* Let the worker post what it has queued before the backend goes away */
+	cdr_backend_stop(i);
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "Unregistered '%s' CDR backend\n", name);
+	ast_mutex_destroy(&i->lock);
+	ast_cond_destroy(&i->cond);
+	ast_mutex_destroy(&i->spool_lock);
+	free(i->queue);
+	free(i);
 }
 
 int ast_cdr_isset_unanswered(void)
@@ -1026,10 +1139,13 @@ int ast_cdr_amaflags2int(const char *flag)
 	return -1;
 }
 
-static void post_cdr(struct ast_cdr *cdr)
+/*! \brief Flag the CDRs of a chain as posted, or as not to be posted
+ * \return the number of CDRs in the chain backends should be given
+ */
+static int prepare_post_cdr(struct ast_cdr *cdr)
 {
 	char *chan;
-	struct ast_cdr_beitem *i;
+	int count = 0;
 
 	for ( ; cdr ; cdr = cdr->next) {
 		if (!unanswered && cdr->disposition < AST_CDR_ANSWERED && (ast_strlen_zero(cdr->channel) || ast_strlen_zero(cdr->dstchannel))) {
@@ -1053,6 +1169,21 @@ static void post_cdr(struct ast_cdr *cdr)
 		if (option_verbose > 1 && ast_tvzero(cdr->start))
 			ast_verbose(VERBOSE_PREFIX_2 "CDR on channel '%s' lacks start\n", chan);
 		ast_set_flag(cdr, AST_CDR_FLAG_POSTED);
+		if (!ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
+			count++;
+	}
+
+	return count;
+}
+
+static void post_cdr(struct ast_cdr *cdr)
+{
+	struct ast_cdr_beitem *i;
+
+	if (!prepare_post_cdr(cdr))
+		return;
+
+	for ( ; cdr ; cdr = cdr->next) {
 		if (ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
 			continue;
 		AST_LIST_LOCK(&be_list);
@@ -1141,6 +1272,588 @@ struct ast_cdr *ast_cdr_append(struct ast_cdr *cdr, struct ast_cdr *newcdr)
 	return ret;
 }
 
+static void cdr_post_unref(struct cdr_post *post)
+{
+	if (ast_atomic_dec_and_test(&post->usecount)) {
+		ast_cdr_free(post->cdr);
+		free(post);
+	}
+}
+
+static void cdr_spool_path(struct ast_cdr_beitem *i, const char *suffix, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/cdr/%s%s", ast_config_AST_SPOOL_DIR, i->name, suffix);
+}
+
+/*! \brief Write a string to a spool file, escaping what would break its lines */
+static void cdr_spool_escape(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\\')
+			fputs("\\\\", f);
+		else if (*str == '\n')
+			fputs("\\n", f);
+		else if (*str == '\r')
+			fputs("\\r", f);
+		else
+			fputc(*str, f);
+	}
+}
+
+/*! \brief Undo cdr_spool_escape() in place */
+static void cdr_spool_unescape(char *str)
+{
+	char *out = str;
+
+	for (; *str; str++) {
+		if (*str == '\\' && str[1]) {
+			str++;
+			*out++ = (*str == 'n') ? '\n' : (*str == 'r') ? '\r' : *str;
+		} else
+			*out++ = *str;
+	}
+	*out = '\0';
+}
+
+/*! \brief Append CDRs to one of the spool files of a backend
+ * \note The spool_lock of the backend must be held.
+ * \return 0 on success, -1 if the file could not be written
+ */
+static int cdr_spool_append(struct ast_cdr_beitem *i, const char *suffix, struct ast_cdr **cdrs, int count)
+{
+	char path[CDR_SPOOL_PATH_LEN], buf[32];
+	const struct cdr_spool_field *field;
+	struct ast_var_t *var;
+	struct stat st;
+	FILE *f;
+	int x;
+
+	snprintf(path, sizeof(path), "%s/cdr", ast_config_AST_SPOOL_DIR);
+	mkdir(path, 0755);
+	cdr_spool_path(i, suffix, path, sizeof(path));
+
+	if (!(f = fopen(path, "a"))) {
+		ast_log(LOG_ERROR, "Unable to spool %d CDR%s for backend '%s' to %s: %s\n", count, count == 1 ? "" : "s", i->name, path, strerror(errno));
+		return -1;
+	}
+	if (!fstat(fileno(f), &st) && !st.st_size)
+		fputs(CDR_SPOOL_HEADER "\n", f);
+	for (x = 0; x < count; x++) {
+		for (field = cdr_spool_fields; field < cdr_spool_fields + ARRAY_LEN(cdr_spool_fields); field++) {
+			const char *value = (const char *) cdrs[x] + field->offset;
+
+			switch (field->type) {
+			case CDR_SPOOL_STR:
+				break;
+			case CDR_SPOOL_LONG:
+				snprintf(buf, sizeof(buf), "%ld", *(const long *) value);
+				value = buf;
+				break;
+			case CDR_SPOOL_UINT:
+				snprintf(buf, sizeof(buf), "%u", *(const unsigned int *) value);
+				value = buf;
+				break;
+			case CDR_SPOOL_TV:
+				snprintf(buf, sizeof(buf), "%ld.%06ld", (long) ((const struct timeval *) value)->tv_sec, (long) ((const struct timeval *) value)->tv_usec);
+				value = buf;
+				break;
+			}
+			fprintf(f, "%s=", field->name);
+			cdr_spool_escape(f, value);
+			fputc('\n', f);
+		}
+		AST_LIST_TRAVERSE(&cdrs[x]->varshead, var, entries) {
+			if (!ast_var_name(var))
+				continue;
+			fputs("var:", f);
+			cdr_spool_escape(f, ast_var_name(var));
+			fputc('=', f);
+			cdr_spool_escape(f, S_OR(ast_var_value(var), ""));
+			fputc('\n', f);
+		}
+		/* A blank line ends the record */
+		fputc('\n', f);
+	}
+	if (fclose(f)) {
+		ast_log(LOG_ERROR, "Unable to spool CDRs for backend '%s' to %s: %s\n", i->name, path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief Append CDRs a backend could not take to its spool file */
+static void cdr_spool_write(struct ast_cdr_beitem *i, struct ast_cdr **cdrs, int count)
+{
+	if (!count)
+		return;
+
+	if (!backendspool) {
+		ast_log(LOG_WARNING, "CDR backend '%s' can not take %d CDR%s, dropping them\n", i->name, count, count == 1 ? "" : "s");
+		return;
+	}
+
+	ast_mutex_lock(&i->spool_lock);
+	cdr_spool_append(i, "", cdrs, count);
+	i->spool_pending = 1;
+	i->spooled += count;
+	ast_mutex_unlock(&i->spool_lock);
+}
+
+/*! \brief Set aside a CDR its backend refused, retrying it would only fail again */
+static void cdr_spool_reject(struct ast_cdr_beitem *i, struct ast_cdr *cdr, int res)
+{
+	i->rejected++;
+	if (!backendspool) {
+		ast_log(LOG_ERROR, "CDR backend '%s' refused CDR %s (error %d), dropping it\n", i->name, cdr->uniqueid, res);
+		return;
+	}
+	ast_log(LOG_ERROR, "CDR backend '%s' refused CDR %s (error %d), setting it aside in cdr/%s.rejected\n", i->name, cdr->uniqueid, res, i->name);
+	ast_mutex_lock(&i->spool_lock);
+	cdr_spool_append(i, ".rejected", &cdr, 1);
+	ast_mutex_unlock(&i->spool_lock);
+}
+
+/*! \brief Read back one spooled CDR
+ * \return the CDR, or NULL at the end of the file
+ */
+static struct ast_cdr *cdr_spool_read(FILE *f, const char *path)
+{
+	char line[CDR_SPOOL_LINE_LEN], *value;
+	const struct cdr_spool_field *field;
+	struct ast_cdr *cdr = NULL;
+	unsigned int flags = 0;
+	size_t len;
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		if (!len || line[len - 1] != '\n') {
+			int c;
+
+			/* Too long to be ours, or cut short by a crash */
+			while (!feof(f) && (c = fgetc(f)) != EOF && c != '\n')
+				;
+			ast_log(LOG_WARNING, "Skipping a damaged line in CDR spool file %s\n", path);
+			continue;
+		}
+		line[--len] = '\0';
+		if (!len) {
+			if (!cdr)
+				continue;
+			/* Variables can only be added to a CDR that is not locked */
+			cdr->flags = flags;
+			return cdr;
+		}
+		if (!(value = strchr(line, '=')) || !strcmp(line, CDR_SPOOL_HEADER))
+			continue;
+		*value++ = '\0';
+		if (!cdr && !(cdr = ast_cdr_alloc()))
+			return NULL;
+		cdr_spool_unescape(value);
+		if (!strncmp(line, "var:", 4)) {
+			cdr_spool_unescape(line + 4);
+			ast_cdr_setvar(cdr, line + 4, value, 0);
+			continue;
+		}
+		for (field = cdr_spool_fields; field < cdr_spool_fields + ARRAY_LEN(cdr_spool_fields); field++) {
+			if (strcmp(line, field->name))
+				continue;
+			if (field == &cdr_spool_fields[CDR_SPOOL_FLAGS_FIELD]) {
+				sscanf(value, "%30u", &flags);
+				break;
+			}
+			switch (field->type) {
+			case CDR_SPOOL_STR:
+				ast_copy_string((char *) cdr + field->offset, value, field->size);
+				break;
+			case CDR_SPOOL_LONG:
+				sscanf(value, "%30ld", (long *) ((char *) cdr + field->offset));
+				break;
+			case CDR_SPOOL_UINT:
+				sscanf(value, "%30u", (unsigned int *) ((char *) cdr + field->offset));
+				break;
+			case CDR_SPOOL_TV: {
+				struct timeval *tv = (struct timeval *) ((char *) cdr + field->offset);
+				long sec = 0, usec = 0;
+
+				sscanf(value, "%30ld.%30ld", &sec, &usec);
+				tv->tv_sec = sec;
+				tv->tv_usec = usec;
+				break;
+			}
+			}
+			break;
+		}
+		/* Fields this version does not know are skipped */
+	}
+
+	if (cdr) {
+		/* The file ended in the middle of a record, written when we crashed */
+		ast_log(LOG_WARNING, "Dropping an incomplete CDR at the end of spool file %s\n", path);
+		ast_cdr_free(cdr);
+	}
+	return NULL;
+}
+
+/*! \brief The most CDRs a backend is given at once, as last configured */
+static int cdr_backend_batch_size(void)
+{
+	int size;
+
+	ast_mutex_lock(&cdr_batch_lock);
+	size = backendbatch;
+	ast_mutex_unlock(&cdr_batch_lock);
+
+	return size;
+}
+
+/*! \brief Give CDRs to a backend
+ * CDRs the backend refuses are set aside, and all of them are spooled while
+ * it is down.
+ */
+static void cdr_backend_post(struct ast_cdr_beitem *i, struct ast_cdr **cdrs, int count)
+{
+	int x = 0, res = 0;
+
+	if (time(NULL) < i->retry) {
+		cdr_spool_write(i, cdrs, count);
+		return;
+	}
+
+	if (i->batch_be && !(res = i->batch_be(cdrs, count))) {
+		i->posted += count;
+		return;
+	}
+	/* Unless it is down, find out which records the backend refuses */
+	while (x < count && res != AST_CDR_BACKEND_DOWN) {
+		if ((res = i->be(cdrs[x])) == AST_CDR_BACKEND_DOWN)
+			break;
+		if (res)
+			cdr_spool_reject(i, cdrs[x], res);
+		else
+			i->posted++;
+		x++;
+	}
+	if (x < count) {
+		ast_log(LOG_WARNING, "CDR backend '%s' is down, spooling its CDRs for %d seconds\n", i->name, backendretry);
+		i->retry = time(NULL) + backendretry;
+		cdr_spool_write(i, cdrs + x, count - x);
+	}
+}
+
+/*! \brief Open a spool file for replay, checking it is in a format we read
+ * \return the file positioned after its header, or NULL
+ */
+static FILE *cdr_spool_open(struct ast_cdr_beitem *i, const char *path)
+{
+	char line[CDR_SPOOL_LINE_LEN], bad[CDR_SPOOL_PATH_LEN];
+	FILE *f;
+
+	if (!(f = fopen(path, "r")))
+		return NULL;
+	if (!fgets(line, sizeof(line), f) || !strcmp(line, CDR_SPOOL_HEADER "\n"))
+		return f;
+	fclose(f);
+
+	/* Keep it for whoever can make sense of it */
+	cdr_spool_path(i, ".unknown", bad, sizeof(bad));
+	ast_log(LOG_ERROR, "CDR spool file %s is not in a format this version reads, moving it to %s\n", path, bad);
+	rename(path, bad);
+	return NULL;
+}
+
+/*! \brief Post the CDRs spooled for a backend now that it may be back
+ * \note Only the worker of the backend replays its spool.
+ */
+static void cdr_backend_replay(struct ast_cdr_beitem *i)
+{
+	char path[CDR_SPOOL_PATH_LEN], replay[CDR_SPOOL_PATH_LEN];
+	struct ast_cdr **cdrs;
+	FILE *f;
+	int count, x, size, done = 0;
+
+	cdr_spool_path(i, "", path, sizeof(path));
+	cdr_spool_path(i, ".replay", replay, sizeof(replay));
+
+	/* A replay file left behind by a crash goes first, the spool file stays
+	   pending until the next pass */
+	ast_mutex_lock(&i->spool_lock);
+	if (access(replay, F_OK)) {
+		i->spool_pending = 0;
+		if (rename(path, replay)) {
+			ast_mutex_unlock(&i->spool_lock);
+			return;
+		}
+	}
+	ast_mutex_unlock(&i->spool_lock);
+
+	if (!(f = cdr_spool_open(i, replay))) {
+		if (!access(replay, F_OK)) {
+			/* Left where it is, reloading the CDR engine tries it again */
+			ast_log(LOG_ERROR, "Unable to open CDR spool file %s: %s\n", replay, strerror(errno));
+			ast_mutex_lock(&i->spool_lock);
+			i->spool_pending = 0;
+			ast_mutex_unlock(&i->spool_lock);
+		}
+		return;
+	}
+	size = cdr_backend_batch_size();
+	if (!(cdrs = ast_calloc(size, sizeof(*cdrs)))) {
+		fclose(f);
+		ast_log(LOG_ERROR, "Unable to replay spooled CDRs from %s\n", replay);
+		return;
+	}
+
+	while (!done) {
+		for (count = 0; count < size && (cdrs[count] = cdr_spool_read(f, replay)); count++)
+			;
+		if (count < size)
+			done = 1;
+		if (count) {
+			x = i->posted;
+			cdr_backend_post(i, cdrs, count);
+			i->replayed += i->posted - x;
+			for (x = 0; x < count; x++)
+				ast_cdr_free(cdrs[x]);
+		}
+		if (time(NULL) < i->retry) {
+			/* Still down, put the rest back */
+			while ((cdrs[0] = cdr_spool_read(f, replay))) {
+				cdr_spool_write(i, cdrs, 1);
+				ast_cdr_free(cdrs[0]);
+			}
+			done = 1;
+		}
+	}
+
+	fclose(f);
+	free(cdrs);
+	unlink(replay);
+}
+
+static void *cdr_backend_thread(void *data)
+{
+	struct ast_cdr_beitem *i = data;
+	struct cdr_post **posts = NULL, **tmp;
+	struct ast_cdr **cdrs = NULL, *cdr;
+	struct timespec ts;
+	int count, total, maxcdrs = 0, size, maxposts = 0, x;
+	time_t now;
+
+	for (;;) {
+		/* A reload may have changed the batch size */
+		if ((size = cdr_backend_batch_size()) > maxposts) {
+			if ((tmp = ast_realloc(posts, size * sizeof(*posts)))) {
+				posts = tmp;
+				maxposts = size;
+			} else if (!maxposts) {
+				ast_log(LOG_ERROR, "Unable to start posting CDRs to backend '%s'\n", i->name);
+				break;
+			}
+		}
+		if (size > maxposts)
+			size = maxposts;
+
+		ast_mutex_lock(&i->lock);
+		for (;;) {
+			time(&now);
+			if (i->queue_count || i->stop)
+				break;
+			if (i->spool_pending && now >= i->retry)
+				break;
+			if (i->spool_pending) {
+				ts.tv_sec = i->retry;
+				ts.tv_nsec = 0;
+				ast_cond_timedwait(&i->cond, &i->lock, &ts);
+			} else
+				ast_cond_wait(&i->cond, &i->lock);
+		}
+		if (i->stop && !i->queue_count) {
+			ast_mutex_unlock(&i->lock);
+			break;
+		}
+		for (count = 0; count < size && i->queue_count; count++) {
+			posts[count] = i->queue[i->queue_head];
+			i->queue_head = (i->queue_head + 1) % i->queue_size;
+			i->queue_count--;
+		}
+		i->busy = 1;
+		ast_mutex_unlock(&i->lock);
+
+		if (count) {
+			for (total = 0, x = 0; x < count; x++) {
+				for (cdr = posts[x]->cdr; cdr; cdr = cdr->next)
+					total++;
+			}
+			if (total > maxcdrs) {
+				free(cdrs);
+				maxcdrs = total;
+				if (!(cdrs = ast_calloc(maxcdrs, sizeof(*cdrs))))
+					maxcdrs = 0;
+			}
+			if (cdrs) {
+				for (total = 0, x = 0; x < count; x++) {
+					for (cdr = posts[x]->cdr; cdr; cdr = cdr->next) {
+						if (!ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
+							cdrs[total++] = cdr;
+					}
+				}
+				cdr_backend_post(i, cdrs, total);
+			} else
+				ast_log(LOG_ERROR, "Out of memory, %d CDR batches for backend '%s' lost\n", count, i->name);
+			for (x = 0; x < count; x++)
+				cdr_post_unref(posts[x]);
+		} else
+			cdr_backend_replay(i);
+
+		ast_mutex_lock(&i->lock);
+		i->busy = 0;
+		ast_cond_broadcast(&i->cond);
+		ast_mutex_unlock(&i->lock);
+	}
+
+	free(posts);
+	free(cdrs);
+	return NULL;
+}
+
+/*! \brief Start the worker of a backend if it is not running
+ * \note The backend must be locked.
+ */
+static void cdr_backend_start(struct ast_cdr_beitem *i)
+{
+	if (i->thread != AST_PTHREADT_NULL || i->stop)
+		return;
+	if (!i->queue && (i->queue = ast_calloc(backendqueue, sizeof(*i->queue))))
+		i->queue_size = backendqueue;
+	if (i->queue && ast_pthread_create_background(&i->thread, NULL, cdr_backend_thread, i)) {
+		ast_log(LOG_WARNING, "Unable to start worker thread for CDR backend '%s'\n", i->name);
+		i->thread = AST_PTHREADT_NULL;
+	}
+}
+
+/*! \brief Give the queue of a backend the configured size, keeping what it holds
+ * \note The backend must be locked.
+ */
+static void cdr_backend_resize(struct ast_cdr_beitem *i)
+{
+	struct cdr_post **queue;
+	int size = backendqueue > i->queue_count ? backendqueue : i->queue_count, x;
+
+	if (!i->queue || size == i->queue_size || !(queue = ast_calloc(size, sizeof(*queue))))
+		return;
+	for (x = 0; x < i->queue_count; x++)
+		queue[x] = i->queue[(i->queue_head + x) % i->queue_size];
+	free(i->queue);
+	i->queue = queue;
+	i->queue_size = size;
+	i->queue_head = 0;
+}
+
+/*! \brief Start the worker of a backend that has CDRs spooled, so they are replayed right away */
+static void cdr_backend_resume(struct ast_cdr_beitem *i)
+{
+	char path[CDR_SPOOL_PATH_LEN];
+	struct stat st;
+
+	if (!enabled || !batchmode)
+		return;
+	ast_mutex_lock(&i->lock);
+	cdr_backend_resize(i);
+	ast_mutex_unlock(&i->lock);
+	cdr_spool_path(i, "", path, sizeof(path));
+	if (stat(path, &st)) {
+		cdr_spool_path(i, ".replay", path, sizeof(path));
+		if (stat(path, &st))
+			return;
+	}
+	ast_mutex_lock(&i->spool_lock);
+	i->spool_pending = 1;
+	ast_mutex_unlock(&i->spool_lock);
+	ast_mutex_lock(&i->lock);
+	cdr_backend_start(i);
+	ast_mutex_unlock(&i->lock);
+}
+
+/*! \brief Queue a CDR chain for a backend, starting its worker if needed
+ * \note The be_list must be locked.
+ */
+static void cdr_backend_queue(struct ast_cdr_beitem *i, struct cdr_post *post)
+{
+	struct ast_cdr *cdr, *cdrs[16];
+	int count = 0;
+
+	ast_mutex_lock(&i->lock);
+	cdr_backend_start(i);
+	if (i->thread != AST_PTHREADT_NULL && i->queue_count < i->queue_size) {
+		ast_atomic_fetchadd_int(&post->usecount, 1);
+		i->queue[(i->queue_head + i->queue_count++) % i->queue_size] = post;
+		ast_cond_broadcast(&i->cond);
+		ast_mutex_unlock(&i->lock);
+		return;
+	}
+	ast_mutex_unlock(&i->lock);
+
+	/* The backend is not keeping up, spool the chain rather than grow without bound */
+	for (cdr = post->cdr; cdr; cdr = cdr->next) {
+		if (ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
+			continue;
+		cdrs[count++] = cdr;
+		if (count == ARRAY_LEN(cdrs)) {
+			cdr_spool_write(i, cdrs, count);
+			count = 0;
+		}
+	}
+	cdr_spool_write(i, cdrs, count);
+}
+
+/*! \brief Wait for the worker of a backend to post its queue, spooling what it can not
+ * \param timeout seconds to wait, or -1 to wait until the worker has exited
+ */
+static void cdr_backend_drain(struct ast_cdr_beitem *i, int timeout)
+{
+	struct cdr_post *post;
+	struct ast_cdr *cdr;
+	struct timespec ts;
+	time_t end = time(NULL) + timeout;
+
+	ast_mutex_lock(&i->lock);
+	while ((i->queue_count || i->busy) && (timeout < 0 || time(NULL) < end)) {
+		ts.tv_sec = time(NULL) + 1;
+		ts.tv_nsec = 0;
+		ast_cond_timedwait(&i->cond, &i->lock, &ts);
+	}
+	while (i->queue_count) {
+		post = i->queue[i->queue_head];
+		i->queue_head = (i->queue_head + 1) % i->queue_size;
+		i->queue_count--;
+		ast_mutex_unlock(&i->lock);
+		for (cdr = post->cdr; cdr; cdr = cdr->next) {
+			if (!ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
+				cdr_spool_write(i, &cdr, 1);
+		}
+		cdr_post_unref(post);
+		ast_mutex_lock(&i->lock);
+	}
+	ast_mutex_unlock(&i->lock);
+}
+
+/*! \brief Stop the worker of a backend that is being unregistered */
+static void cdr_backend_stop(struct ast_cdr_beitem *i)
+{
+	pthread_t thread;
+
+	ast_mutex_lock(&i->lock);
+	i->stop = 1;
+	thread = i->thread;
+	ast_cond_broadcast(&i->cond);
+	ast_mutex_unlock(&i->lock);
+
+	if (thread != AST_PTHREADT_NULL)
+		pthread_join(thread, NULL);
+	/* Anything still queued can only be spooled now */
+	cdr_backend_drain(i, 0);
+}
+
 /*! \note Don't call without cdr_batch_lock */
 static void reset_batch(void)
 {
@@ -1165,11 +1878,35 @@ static void *do_batch_backend_process(void *data)
 {
 	struct ast_cdr_batch_item *processeditem;
 	struct ast_cdr_batch_item *batchitem = data;
+	struct ast_cdr_beitem *i;
+	struct cdr_post *post;
 
-	/* Push each CDR into storage mechanism(s) and free all the memory */
+	/* Queue each CDR for every backend's worker, so one slow backend
+	   does not hold up the others, and free all the memory */
 	while (batchitem) {
-		post_cdr(batchitem->cdr);
-		ast_cdr_free(batchitem->cdr);
+		if (!prepare_post_cdr(batchitem->cdr)) {
+			ast_cdr_free(batchitem->cdr);
+		} else if (!(post = ast_calloc(1, sizeof(*post)))) {
+			/* Post it from here as we used to */
+			AST_LIST_LOCK(&be_list);
+			AST_LIST_TRAVERSE(&be_list, i, list) {
+				struct ast_cdr *cdr;
+				for (cdr = batchitem->cdr; cdr; cdr = cdr->next) {
+					if (!ast_test_flag(cdr, AST_CDR_FLAG_POST_DISABLED))
+						i->be(cdr);
+				}
+			}
+			AST_LIST_UNLOCK(&be_list);
+			ast_cdr_free(batchitem->cdr);
+		} else {
+			post->usecount = 1;
+			post->cdr = batchitem->cdr;
+			AST_LIST_LOCK(&be_list);
+			AST_LIST_TRAVERSE(&be_list, i, list)
+				cdr_backend_queue(i, post);
+			AST_LIST_UNLOCK(&be_list);
+			cdr_post_unref(post);
+		}
 		processeditem = batchitem;
 		batchitem = batchitem->next;
 		free(processeditem);
@@ -1200,6 +1937,15 @@ void ast_cdr_submit_batch(int shutdown)
 		if (option_debug)
 			ast_log(LOG_DEBUG, "CDR single-threaded batch processing begins now\n");
 		do_batch_backend_process(oldbatchitems);
+		if (shutdown) {
+			struct ast_cdr_beitem *i;
+
+			/* Give each backend a while to post its queue, then spool the rest */
+			AST_LIST_LOCK(&be_list);
+			AST_LIST_TRAVERSE(&be_list, i, list)
+				cdr_backend_drain(i, 10);
+			AST_LIST_UNLOCK(&be_list);
+		}
 	} else {
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -1346,6 +2092,14 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 		AST_LIST_LOCK(&be_list);
 		AST_LIST_TRAVERSE(&be_list, beitem, list) {
 			ast_cli(fd, "CDR registered backend: %s\n", beitem->name);
+			if (batchmode) {
+				ast_mutex_lock(&beitem->lock);
+				ast_cli(fd, "  queued %d/%d, posted %u, spooled %u, replayed %u, rejected %u%s\n",
+					beitem->queue_count, beitem->queue_size ? beitem->queue_size : backendqueue,
+					beitem->posted, beitem->spooled, beitem->replayed, beitem->rejected,
+					time(NULL) < beitem->retry ? ", failing" : "");
+				ast_mutex_unlock(&beitem->lock);
+			}
 		}
 		AST_LIST_UNLOCK(&be_list);
 	}
@@ -1389,10 +2143,12 @@ static int do_reload(void)
 	const char *size_value;
 	const char *time_value;
 	const char *end_before_h_value;
+	const char *value;
 	int cfg_size;
 	int cfg_time;
 	int was_enabled;
 	int was_batchmode;
+	struct ast_cdr_beitem *beitem;
 	int res=0;
 
 	ast_mutex_lock(&cdr_batch_lock);
@@ -1401,6 +2157,10 @@ static int do_reload(void)
 	batchtime = BATCH_TIME_DEFAULT;
 	batchscheduleronly = BATCH_SCHEDULER_ONLY_DEFAULT;
 	batchsafeshutdown = BATCH_SAFE_SHUTDOWN_DEFAULT;
+	backendqueue = BACKEND_QUEUE_DEFAULT;
+	backendbatch = BACKEND_BATCH_DEFAULT;
+	backendretry = BACKEND_RETRY_DEFAULT;
+	backendspool = BACKEND_SPOOL_DEFAULT;
 	was_enabled = enabled;
 	was_batchmode = batchmode;
 	enabled = 1;
@@ -1441,6 +2201,26 @@ static int do_reload(void)
 			else
 				batchtime = cfg_time;
 		}
+		if ((value = ast_variable_retrieve(config, "general", "backendqueue"))) {
+			if (sscanf(value, "%30d", &cfg_size) < 1 || cfg_size < 1)
+				ast_log(LOG_WARNING, "Invalid backend queue size '%s' specified, using default\n", value);
+			else
+				backendqueue = cfg_size;
+		}
+		if ((value = ast_variable_retrieve(config, "general", "backendbatch"))) {
+			if (sscanf(value, "%30d", &cfg_size) < 1 || cfg_size < 1)
+				ast_log(LOG_WARNING, "Invalid backend batch size '%s' specified, using default\n", value);
+			else
+				backendbatch = cfg_size;
+		}
+		if ((value = ast_variable_retrieve(config, "general", "backendretry"))) {
+			if (sscanf(value, "%30d", &cfg_time) < 1 || cfg_time < 0)
+				ast_log(LOG_WARNING, "Invalid backend retry time '%s' specified, using default\n", value);
+			else
+				backendretry = cfg_time;
+		}
+		if ((value = ast_variable_retrieve(config, "general", "backendspool")))
+			backendspool = ast_true(value);
 		if ((end_before_h_value = ast_variable_retrieve(config, "general", "endbeforehexten")))
 			ast_set2_flag(&ast_options, ast_true(end_before_h_value), AST_OPT_FLAG_END_CDR_BEFORE_H_EXTEN);
 	}
@@ -1450,6 +2230,10 @@ static int do_reload(void)
 	} else if (enabled && batchmode) {
 		cdr_sched = ast_sched_add(sched, batchtime * 1000, submit_scheduled_batch, NULL);
 		ast_log(LOG_NOTICE, "CDR batch mode logging enabled, first of either size %d or time %d seconds.\n", batchsize, batchtime);
+		AST_LIST_LOCK(&be_list);
+		AST_LIST_TRAVERSE(&be_list, beitem, list)
+			cdr_backend_resume(beitem);
+		AST_LIST_UNLOCK(&be_list);
 	} else {
 		ast_log(LOG_NOTICE, "CDR logging disabled, data will be lost.\n");
 	}
@@ -36,6 +36,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 313545 $")
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
 
 #if defined(HAVE_DAHDI) || defined(HAVE_ZAPTEL)
 #include <sys/ioctl.h>
@@ -109,6 +112,28 @@ static AST_LIST_HEAD_NOLOCK_STATIC(backends, chanlist);
     both the channels list and the backends list.  */
 static AST_LIST_HEAD_STATIC(channels, ast_channel);
 
+#ifdef LOW_MEMORY
+#define CHANNEL_BUCKETS 17
+#else
+#define CHANNEL_BUCKETS 563
+#endif
+
+/*! \brief One bucket of the channel name hash.
+ * Lookups by full name only lock the bucket, not the channel list.  Lock
+ * order is channel list, bucket, channel; the only channel lock taken while
+ * holding a bucket lock is a trylock. */
+struct channel_bucket {
+	ast_mutex_t lock;
+	AST_LIST_HEAD_NOLOCK(, ast_channel) chans;
+};
+
+static struct channel_bucket channel_buckets[CHANNEL_BUCKETS];
+
+/*! Serializes moving channels in and out of the name hash, and guards
+ * name_bucket.  Renames take it with channel locks held, so it is taken after
+ * the channel list and any channel lock, and only a bucket lock after it. */
+AST_MUTEX_DEFINE_STATIC(channel_names_lock);
+
 /*! map AST_CAUSE's to readable string representations */
 const struct ast_cause {
 	int cause;
@@ -706,6 +731,60 @@ static const struct ast_channel_tech null_tech = {
 	.description = "Null channel (should not see this)",
 };
 
+/*! \brief Put a channel in the bucket of its name.  Called with channel_names_lock held. */
+static void channel_name_insert(struct ast_channel *chan)
+{
+	struct channel_bucket *bucket;
+
+	chan->name_bucket = ast_str_case_hash(chan->name) % CHANNEL_BUCKETS;
+	bucket = &channel_buckets[chan->name_bucket];
+	ast_mutex_lock(&bucket->lock);
+	AST_LIST_INSERT_HEAD(&bucket->chans, chan, name_list);
+	ast_mutex_unlock(&bucket->lock);
+}
+
+/*! \brief Take a channel out of its bucket.  Called with channel_names_lock held. */
+static void channel_name_remove(struct ast_channel *chan)
+{
+	struct channel_bucket *bucket = &channel_buckets[chan->name_bucket];
+
+	ast_mutex_lock(&bucket->lock);
+	AST_LIST_REMOVE(&bucket->chans, chan, name_list);
+	chan->name_bucket = -1;
+	ast_mutex_unlock(&bucket->lock);
+}
+
+/*! \brief Add a channel to the name hash.  Called with the channel list locked. */
+static void channel_name_link(struct ast_channel *chan)
+{
+	ast_mutex_lock(&channel_names_lock);
+	channel_name_insert(chan);
+	ast_mutex_unlock(&channel_names_lock);
+}
+
+/*! \brief Remove a channel from the name hash.  Called with the channel list locked. */
+static void channel_name_unlink(struct ast_channel *chan)
+{
+	ast_mutex_lock(&channel_names_lock);
+	if (chan->name_bucket > -1)
+		channel_name_remove(chan);
+	ast_mutex_unlock(&channel_names_lock);
+}
+
+/*! \brief Move a channel to the bucket of its new name after a rename.
+ * Callers may hold channel locks, so the channel list is not locked. */
+static void channel_name_rehash(struct ast_channel *chan)
+{
+	int old;
+
+	ast_mutex_lock(&channel_names_lock);
+	if ((old = chan->name_bucket) > -1 && old != ast_str_case_hash(chan->name) % CHANNEL_BUCKETS) {
+		channel_name_remove(chan);
+		channel_name_insert(chan);
+	}
+	ast_mutex_unlock(&channel_names_lock);
+}
+
 /*! \brief Create a new channel structure */
 struct ast_channel *ast_channel_alloc(int needqueue, int state, const char *cid_num, const char *cid_name, const char *acctcode, const char *exten, const char *context, const int amaflag, const char *name_fmt, ...)
 {
@@ -743,6 +822,8 @@ struct ast_channel *ast_channel_alloc(int needqueue, int state, const char *cid_
 	for (x = 0; x < AST_MAX_FDS - 2; x++)
 		tmp->fds[x] = -1;
 
+	tmp->name_bucket = -1;
+
 #ifdef HAVE_DAHDI
 
 	tmp->timingfd = open(DAHDI_FILE_TIMER, O_RDWR);
@@ -789,10 +870,21 @@ alertpipe_failed:
 	} else	/* Make sure we've got it done right if they don't */
 		tmp->alertpipe[0] = tmp->alertpipe[1] = -1;
 
+#ifdef HAVE_EPOLL_CREATE
+	/* Failing this only means this channel is waited on with poll() */
+	if ((tmp->epfd = epoll_create(AST_MAX_FDS)) > -1)
+		fcntl(tmp->epfd, F_SETFD, FD_CLOEXEC);
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		tmp->epfd_data[x].chan = tmp;
+		tmp->epfd_data[x].which = x;
+		tmp->epoll_fds[x] = -1;
+	}
+#endif
+
 	/* Always watch the alertpipe */
-	tmp->fds[AST_ALERT_FD] = tmp->alertpipe[0];
+	ast_channel_set_fd(tmp, AST_ALERT_FD, tmp->alertpipe[0]);
 	/* And timing pipe */
-	tmp->fds[AST_TIMING_FD] = tmp->timingfd;
+	ast_channel_set_fd(tmp, AST_TIMING_FD, tmp->timingfd);
 	ast_string_field_set(tmp, name, "**Unknown**");
 
 	/* Initial state */
@@ -882,6 +974,7 @@ alertpipe_failed:
 
 	AST_LIST_LOCK(&channels);
 	AST_LIST_INSERT_HEAD(&channels, tmp, chan_list);
+	channel_name_link(tmp);
 	AST_LIST_UNLOCK(&channels);
 
 	/*\!note
@@ -1201,6 +1294,35 @@ static struct ast_channel *channel_find_locked(const struct ast_channel *prev,
 	return NULL;
 }
 
+/*! \brief Find a channel by its full name in the name hash, and lock it.
+ * Same lock avoidance as channel_find_locked(), but only the bucket is locked. */
+static struct ast_channel *channel_find_by_name_locked(const char *name)
+{
+	struct channel_bucket *bucket = &channel_buckets[ast_str_case_hash(name) % CHANNEL_BUCKETS];
+	struct ast_channel *c;
+	int retries;
+	int done;
+
+	for (retries = 0; retries < 200; retries++) {
+		ast_mutex_lock(&bucket->lock);
+		AST_LIST_TRAVERSE(&bucket->chans, c, name_list) {
+			if (!strcasecmp(c->name, name))
+				break;
+		}
+		done = c == NULL || ast_channel_trylock(c) == 0;
+		if (!done && option_debug)
+			ast_log(LOG_DEBUG, "Avoiding initial deadlock for channel '%p'\n", c);
+		ast_mutex_unlock(&bucket->lock);
+		if (done)
+			return c;
+		usleep(1);	/* give other threads a chance before retrying */
+	}
+
+	if (option_debug)
+		ast_log(LOG_DEBUG, "Failure, could not lock channel '%s' after %d retries!\n", name, retries);
+	return NULL;
+}
+
 /*! \brief Browse channels in use */
 struct ast_channel *ast_channel_walk_locked(const struct ast_channel *prev)
 {
@@ -1210,7 +1332,8 @@ struct ast_channel *ast_channel_walk_locked(const struct ast_channel *prev)
 /*! \brief Get channel by name and lock it */
 struct ast_channel *ast_get_channel_by_name_locked(const char *name)
 {
-	return channel_find_locked(NULL, name, 0, NULL, NULL);
+	/* A full name only has to be looked for in its hash bucket */
+	return channel_find_by_name_locked(name);
 }
 
 /*! \brief Get channel by name prefix and lock it */
@@ -1356,7 +1479,6 @@ static void free_cid(struct ast_callerid *cid)
 void ast_channel_free(struct ast_channel *chan)
 {
 	int fd;
-	struct ast_var_t *vardata;
 	struct ast_frame *f;
 	struct varshead *headp;
 	struct ast_datastore *datastore = NULL;
@@ -1372,6 +1494,7 @@ void ast_channel_free(struct ast_channel *chan)
 			if (option_debug)
 				ast_log(LOG_DEBUG, "Unable to find channel in list to free. Assuming it has already been done.\n");
 		}
+		channel_name_unlink(chan);
 		/* Lock and unlock the channel just to be sure nobody has it locked still
 		   due to a reference retrieved from the channel list. */
 		ast_channel_lock(chan);
@@ -1426,14 +1549,17 @@ void ast_channel_free(struct ast_channel *chan)
 		close(fd);
 	if ((fd = chan->timingfd) > -1)
 		close(fd);
+#ifdef HAVE_EPOLL_CREATE
+	if (chan->epfd > -1)
+		close(chan->epfd);
+#endif
 	while ((f = AST_LIST_REMOVE_HEAD(&chan->readq, frame_list)))
 		ast_frfree(f);
 	
 	/* loop over the variables list, freeing all data and deleting list items */
 	/* no need to lock the list, as the channel is already locked */
 	
-	while ((vardata = AST_LIST_REMOVE_HEAD(headp, entries)))
-		ast_var_delete(vardata);
+	ast_var_list_destroy(headp);
 
 	ast_app_group_discard(chan);
 
@@ -1671,6 +1797,7 @@ int ast_hangup(struct ast_channel *chan)
 	if (!AST_LIST_REMOVE(&channels, chan, chan_list)) {
 		ast_log(LOG_ERROR, "Unable to find channel in list to free. Assuming it has already been done.\n");
 	}
+	channel_name_unlink(chan);
 	ast_clear_flag(chan, AST_FLAG_IN_CHANNEL_LIST);
 	AST_LIST_UNLOCK(&channels);
 
@@ -1780,7 +1907,7 @@ void ast_deactivate_generator(struct ast_channel *chan)
 			chan->generator->release(chan, chan->generatordata);
 		chan->generatordata = NULL;
 		chan->generator = NULL;
-		chan->fds[AST_GENERATOR_FD] = -1;
+		ast_channel_set_fd(chan, AST_GENERATOR_FD, -1);
 		ast_clear_flag(chan, AST_FLAG_WRITE_INT);
 		ast_settimeout(chan, 0, NULL, NULL);
 	}
@@ -1850,6 +1977,170 @@ int ast_waitfor_n_fd(int *fds, int n, int *ms, int *exception)
 	return winner;
 }
 
+#ifdef HAVE_EPOLL_CREATE
+/*! \brief Move fd number 'which' of chan from oldfd to newfd in the epoll set epfd */
+static void channel_epoll_update(int epfd, struct ast_channel *chan, int which, int oldfd, int newfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP,
+		.data.ptr = &chan->epfd_data[which],
+	};
+
+	/* The old fd may be closed already, which took it out of the set */
+	if (oldfd > -1)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, oldfd, &ev);
+	if (newfd > -1)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, newfd, &ev);
+}
+#endif
+
+#ifdef HAVE_EPOLL_CREATE
+/*! \brief Bring fd number 'which' of chan up to date in its own epoll set and its peer's */
+static void channel_epoll_set(struct ast_channel *chan, int which)
+{
+	struct ast_channel *peer = chan->epoll_peer;
+	int fd = chan->fds[which];
+
+	/* Even an unchanged fd number is re-added, as it may be a new file by now */
+	if (chan->epfd > -1)
+		channel_epoll_update(chan->epfd, chan, which, chan->epoll_fds[which], fd);
+	if (peer && peer->epfd > -1)
+		channel_epoll_update(peer->epfd, chan, which, chan->epoll_fds[which], fd);
+	chan->epoll_fds[which] = fd;
+}
+
+/*! \brief Pick up fds a channel driver wrote into fds[] without ast_channel_set_fd().
+ * Only done when channels start sharing a set, waits trust the sets as they are. */
+static void channel_epoll_sync(struct ast_channel *chan)
+{
+	int x;
+
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		if (chan->fds[x] == chan->epoll_fds[x])
+			continue;
+		if (option_debug > 2)
+			ast_log(LOG_DEBUG, "fd %d of '%s' changed from %d to %d behind our back\n",
+				x, chan->name, chan->epoll_fds[x], chan->fds[x]);
+		channel_epoll_set(chan, x);
+	}
+}
+#endif
+
+void ast_channel_set_fd(struct ast_channel *chan, int which, int fd)
+{
+	chan->fds[which] = fd;
+#ifdef HAVE_EPOLL_CREATE
+	channel_epoll_set(chan, which);
+#endif
+}
+
+void ast_poll_channel_add(struct ast_channel *chan0, struct ast_channel *chan1)
+{
+#ifdef HAVE_EPOLL_CREATE
+	int x;
+
+	if (chan0->epfd < 0 || chan1->epfd < 0 || chan0->epoll_peer || chan1->epoll_peer)
+		return;
+
+	channel_epoll_sync(chan0);
+	channel_epoll_sync(chan1);
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		channel_epoll_update(chan0->epfd, chan1, x, -1, chan1->epoll_fds[x]);
+		channel_epoll_update(chan1->epfd, chan0, x, -1, chan0->epoll_fds[x]);
+	}
+	chan0->epoll_peer = chan1;
+	chan1->epoll_peer = chan0;
+#endif
+}
+
+void ast_poll_channel_del(struct ast_channel *chan0, struct ast_channel *chan1)
+{
+#ifdef HAVE_EPOLL_CREATE
+	int x;
+
+	if (chan0->epoll_peer != chan1 || chan1->epoll_peer != chan0)
+		return;
+
+	chan0->epoll_peer = NULL;
+	chan1->epoll_peer = NULL;
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		channel_epoll_update(chan0->epfd, chan1, x, chan1->epoll_fds[x], -1);
+		channel_epoll_update(chan1->epfd, chan0, x, chan0->epoll_fds[x], -1);
+	}
+#endif
+}
+
+#ifdef HAVE_EPOLL_CREATE
+/*! \brief The epoll half of ast_waitfor_nandfds(), for one channel or two
+ * channels sharing a set, and no extra fds.  Nothing has to be built, the
+ * channels' epoll sets already hold their fds. */
+static struct ast_channel *waitfor_epoll(struct ast_channel **c, int n, long rms, long whentohangup, int *ms)
+{
+	struct timeval start = { 0 , 0 };
+	struct epoll_event ev[AST_MAX_FDS * 2];
+	struct ast_epoll_data *aed;
+	struct ast_channel *winner = NULL;
+	time_t now;
+	int res;
+	int x;
+
+	for (x = 0; x < n; x++)
+		CHECK_BLOCKING(c[x]);
+
+	if (*ms > 0)
+		start = ast_tvnow();
+
+	if (sizeof(int) == 4) {	/* XXX fix timeout > 600000 on linux x86-32 */
+		do {
+			int kbrms = rms;
+			if (kbrms > 600000)
+				kbrms = 600000;
+			res = epoll_wait(c[0]->epfd, ev, AST_MAX_FDS * 2, kbrms);
+			if (!res)
+				rms -= kbrms;
+		} while (!res && (rms > 0));
+	} else {
+		res = epoll_wait(c[0]->epfd, ev, AST_MAX_FDS * 2, rms);
+	}
+	for (x = 0; x < n; x++)
+		ast_clear_flag(c[x], AST_FLAG_BLOCKING);
+	if (res < 0) { /* Simulate a timeout if we were interrupted */
+		if (errno != EINTR)
+			*ms = -1;
+		return NULL;
+	}
+	if (whentohangup) {   /* if we have a timeout, check who expired */
+		time(&now);
+		for (x = 0; x < n; x++) {
+			if (c[x]->whentohangup && now >= c[x]->whentohangup) {
+				c[x]->_softhangup |= AST_SOFTHANGUP_TIMEOUT;
+				if (winner == NULL)
+					winner = c[x];
+			}
+		}
+	}
+	if (res == 0) { /* no fd ready, reset timeout and done */
+		*ms = 0;	/* XXX use 0 since we may not have an exact timeout. */
+		return winner;
+	}
+	for (x = 0; x < res; x++) {
+		aed = ev[x].data.ptr;
+		winner = aed->chan;	/* override previous winners */
+		if (ev[x].events & EPOLLPRI)
+			ast_set_flag(winner, AST_FLAG_EXCEPTION);
+		else
+			ast_clear_flag(winner, AST_FLAG_EXCEPTION);
+		winner->fdno = aed->which;
+	}
+	if (*ms > 0) {
+		*ms -= ast_tvdiff_ms(ast_tvnow(), start);
+		if (*ms < 0)
+			*ms = 0;
+	}
+	return winner;
+}
+#endif
+
 /*! \brief Wait for x amount of time on a file descriptor to have input.  */
 struct ast_channel *ast_waitfor_nandfds(struct ast_channel **c, int n, int *fds, int nfds,
 	int *exception, int *outfd, int *ms)
@@ -1915,6 +2206,12 @@ struct ast_channel *ast_waitfor_nandfds(struct ast_channel **c, int n, int *fds,
 		/* Tiny corner case... call would need to last >24 days */
 		rms = INT_MAX;
 	}
+#ifdef HAVE_EPOLL_CREATE
+	/* A lone channel, or two channels sharing a set, don't need the pollfd array */
+	if (!nfds && n > 0 && c[0]->epfd > -1 &&
+	    ((n == 1 && !c[0]->epoll_peer) || (n == 2 && c[0]->epoll_peer == c[1])))
+		return waitfor_epoll(c, n, rms, whentohangup, ms);
+#endif
 	/*
 	 * Build the pollfd array, putting the channels' fds first,
 	 * followed by individual fds. Order is important because
@@ -3456,6 +3753,8 @@ static int set_format(struct ast_channel *chan, int fmt, int *rawformat, int *fo
 			/* writing */
 			*trans = ast_translator_build_path(*rawformat, *format);
 		}
+		if (*trans)
+			ast_translator_offload(*trans);
 		res = *trans ? 0 : -1;
 	}
 	ast_channel_unlock(chan);
@@ -4059,6 +4358,19 @@ void ast_change_name(struct ast_channel *chan, char *newname)
 {
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", chan->name, newname, chan->uniqueid);
 	ast_string_field_set(chan, name, newname);
+	channel_name_rehash(chan);
+}
+
+void ast_channel_set_name(struct ast_channel *chan, const char *fmt, ...)
+{
+	va_list ap, ap2;
+
+	va_start(ap, fmt);
+	va_start(ap2, fmt);
+	ast_string_field_build_va(chan, name, fmt, ap, ap2);
+	va_end(ap2);
+	va_end(ap);
+	channel_name_rehash(chan);
 }
 
 void ast_channel_inherit_variables(const struct ast_channel *parent, struct ast_channel *child)
@@ -4083,7 +4395,7 @@ void ast_channel_inherit_variables(const struct ast_channel *parent, struct ast_
 		case 1:
 			newvar = ast_var_assign(&varname[1], ast_var_value(current));
 			if (newvar) {
-				AST_LIST_INSERT_TAIL(&child->varshead, newvar, entries);
+				ast_var_insert_tail(&child->varshead, newvar);
 				if (option_debug)
 					ast_log(LOG_DEBUG, "Copying soft-transferable variable %s.\n", ast_var_name(newvar));
 			}
@@ -4091,7 +4403,7 @@ void ast_channel_inherit_variables(const struct ast_channel *parent, struct ast_
 		case 2:
 			newvar = ast_var_assign(ast_var_full_name(current), ast_var_value(current));
 			if (newvar) {
-				AST_LIST_INSERT_TAIL(&child->varshead, newvar, entries);
+				ast_var_insert_tail(&child->varshead, newvar);
 				if (option_debug)
 					ast_log(LOG_DEBUG, "Copying hard-transferable variable %s.\n", ast_var_name(newvar));
 			}
@@ -4118,15 +4430,14 @@ static void clone_variables(struct ast_channel *original, struct ast_channel *cl
 	struct ast_var_t *current, *newvar;
 	/* Append variables from clone channel into original channel */
 	/* XXX Is this always correct?  We have to in order to keep MACROS working XXX */
-	if (AST_LIST_FIRST(&clone->varshead))
-		AST_LIST_APPEND_LIST(&original->varshead, &clone->varshead, entries);
+	ast_var_list_append(&original->varshead, &clone->varshead);
 
 	/* then, dup the varshead list into the clone */
 	
 	AST_LIST_TRAVERSE(&original->varshead, current, entries) {
 		newvar = ast_var_assign(current->name, current->value);
 		if (newvar)
-			AST_LIST_INSERT_TAIL(&clone->varshead, newvar, entries);
+			ast_var_insert_tail(&clone->varshead, newvar);
 	}
 }
 
@@ -4211,6 +4522,8 @@ int ast_do_masquerade(struct ast_channel *original)
 
 	/* Mangle the name of the clone channel */
 	ast_string_field_set(clone, name, masqn);
+	channel_name_rehash(original);
+	channel_name_rehash(clone);
 	
 	/* Notify any managers of the change, first the masq then the other */
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", newn, masqn, clone->uniqueid);
@@ -4303,6 +4616,7 @@ int ast_do_masquerade(struct ast_channel *original)
 	snprintf(zombn, sizeof(zombn), "%s<ZOMBIE>", orig);
 	/* Mangle the name of the clone channel */
 	ast_string_field_set(clone, name, zombn);
+	channel_name_rehash(clone);
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", masqn, zombn, clone->uniqueid);
 
 	/* Update the type. */
@@ -4315,7 +4629,7 @@ int ast_do_masquerade(struct ast_channel *original)
 	/* Copy the FD's other than the generator fd */
 	for (x = 0; x < AST_MAX_FDS; x++) {
 		if (x != AST_GENERATOR_FD)
-			original->fds[x] = clone->fds[x];
+			ast_channel_set_fd(original, x, clone->fds[x]);
 	}
 
 	ast_app_group_update(clone, original);
@@ -4355,7 +4669,7 @@ int ast_do_masquerade(struct ast_channel *original)
 	report_new_callerid(original);
 
 	/* Restore original timing file descriptor */
-	original->fds[AST_TIMING_FD] = original->timingfd;
+	ast_channel_set_fd(original, AST_TIMING_FD, original->timingfd);
 	
 	/* Our native formats are different now */
 	original->nativeformats = clone->nativeformats;
@@ -4587,6 +4901,8 @@ static enum ast_bridge_result ast_generic_bridge(struct ast_channel *c0, struct
 		memset(&config->partialfeature_timer, 0, sizeof(config->partialfeature_timer));
 	}
 
+	ast_poll_channel_add(c0, c1);
+
 	for (;;) {
 		struct ast_channel *who, *other;
 
@@ -4722,6 +5038,9 @@ static enum ast_bridge_result ast_generic_bridge(struct ast_channel *c0, struct
 		cs[0] = cs[1];
 		cs[1] = cs[2];
 	}
+
+	ast_poll_channel_del(c0, c1);
+
 	return res;
 }
 
@@ -5290,6 +5609,11 @@ int ast_plc_reload(void)
 
 void ast_channels_init(void)
 {
+	int x;
+
+	for (x = 0; x < CHANNEL_BUCKETS; x++)
+		ast_mutex_init(&channel_buckets[x].lock);
+
 	ast_cli_register_multiple(cli_channel, sizeof(cli_channel) / sizeof(struct ast_cli_entry));
 
 	ast_plc_reload();
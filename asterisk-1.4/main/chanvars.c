@@ -85,3 +85,140 @@ const char *ast_var_value(const struct ast_var_t *var)
 }
 
 
+/*! Lists with up to this many variables are scanned rather than indexed */
+#define VAR_INDEX_MIN		8
+#define VAR_INDEX_BUCKETS	32
+
+struct ast_var_index {
+	struct ast_var_t *buckets[VAR_INDEX_BUCKETS];
+};
+
+static struct ast_var_t **var_bucket(struct ast_var_index *index, const char *name)
+{
+	return &index->buckets[(unsigned int) ast_str_case_hash(name) % VAR_INDEX_BUCKETS];
+}
+
+static void var_index_add(struct ast_var_index *index, struct ast_var_t *var)
+{
+	struct ast_var_t **bucket = var_bucket(index, ast_var_name(var));
+
+	var->hash_next = *bucket;
+	*bucket = var;
+}
+
+static void var_index_del(struct ast_var_index *index, struct ast_var_t *var)
+{
+	struct ast_var_t **v;
+
+	for (v = var_bucket(index, ast_var_name(var)); *v; v = &(*v)->hash_next) {
+		if (*v == var) {
+			*v = var->hash_next;
+			break;
+		}
+	}
+	var->hash_next = NULL;
+}
+
+/*! \brief Index a list once it holds more than a few variables.
+ * Only called by the functions changing the list, so lookups never write. */
+static void var_index_check(struct varshead *head)
+{
+	struct ast_var_t *var;
+	int count = 0;
+
+	if (head->index)
+		return;
+	AST_LIST_TRAVERSE(head, var, entries) {
+		if (++count > VAR_INDEX_MIN)
+			break;
+	}
+	/* Without memory for it, the list is scanned */
+	if (!var || !(head->index = ast_calloc(1, sizeof(*head->index))))
+		return;
+	AST_LIST_TRAVERSE(head, var, entries)
+		var_index_add(head->index, var);
+}
+
+static int var_cmp(const struct ast_var_t *var, const char *name, int nocase)
+{
+	return nocase ? strcasecmp(ast_var_name(var), name) : strcmp(ast_var_name(var), name);
+}
+
+static struct ast_var_t *var_scan(struct ast_var_t *var, const char *name, int nocase)
+{
+	for (; var; var = AST_LIST_NEXT(var, entries)) {
+		if (!var_cmp(var, name, nocase))
+			break;
+	}
+	return var;
+}
+
+void ast_var_insert_head(struct varshead *head, struct ast_var_t *var)
+{
+	AST_LIST_INSERT_HEAD(head, var, entries);
+	if (head->index)
+		var_index_add(head->index, var);
+	else
+		var_index_check(head);
+}
+
+void ast_var_insert_tail(struct varshead *head, struct ast_var_t *var)
+{
+	AST_LIST_INSERT_TAIL(head, var, entries);
+	if (head->index)
+		var_index_add(head->index, var);
+	else
+		var_index_check(head);
+}
+
+void ast_var_remove(struct varshead *head, struct ast_var_t *var)
+{
+	AST_LIST_REMOVE(head, var, entries);
+	if (head->index)
+		var_index_del(head->index, var);
+}
+
+void ast_var_list_append(struct varshead *head, struct varshead *from)
+{
+	struct ast_var_t *var;
+
+	if (head->index) {
+		AST_LIST_TRAVERSE(from, var, entries)
+			var_index_add(head->index, var);
+	}
+	AST_LIST_APPEND_LIST(head, from, entries);
+	if (from->index) {
+		free(from->index);
+		from->index = NULL;
+	}
+	var_index_check(head);
+}
+
+void ast_var_list_destroy(struct varshead *head)
+{
+	struct ast_var_t *var;
+
+	while ((var = AST_LIST_REMOVE_HEAD(head, entries)))
+		ast_var_delete(var);
+	if (head->index) {
+		free(head->index);
+		head->index = NULL;
+	}
+}
+
+struct ast_var_t *ast_var_find(struct varshead *head, const char *name, int nocase)
+{
+	struct ast_var_t *var, *found = NULL;
+
+	if (!head->index)
+		return var_scan(AST_LIST_FIRST(head), name, nocase);
+
+	for (var = *var_bucket(head->index, name); var; var = var->hash_next) {
+		if (var_cmp(var, name, nocase))
+			continue;
+		if (found)	/* the name is there twice, the order of the list decides */
+			return var_scan(AST_LIST_FIRST(head), name, nocase);
+		found = var;
+	}
+	return found;
+}
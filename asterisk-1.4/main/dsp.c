@@ -1471,6 +1471,9 @@ struct ast_frame *ast_dsp_process(struct ast_channel *chan, struct ast_dsp *dsp,
 		return NULL;
 	if (af->frametype != AST_FRAME_VOICE)
 		return af;
+	/* Muted digits are written over in the frame */
+	if ((dsp->digitmode & (DSP_DIGITMODE_MUTECONF | DSP_DIGITMODE_MUTEMAX)) && ast_frame_unshare(af))
+		return af;
 	odata = af->data;
 	len = af->datalen;
 	/* Make sure we have short data */
@@ -37,6 +37,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 286267 $")
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <utime.h>
+#ifdef HAVE_INOTIFY_INIT
+#include <sys/inotify.h>
+#include <sys/poll.h>
+#endif
 
 #include "asterisk/frame.h"
 #include "asterisk/file.h"
@@ -53,6 +58,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 286267 $")
 #include "asterisk/linkedlists.h"
 #include "asterisk/module.h"
 #include "asterisk/astobj2.h"
+#include "asterisk/astdb.h"
 #include "asterisk/dahdi_compat.h"
 
 /*
@@ -65,6 +71,13 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 286267 $")
  */
 int ast_language_is_prefix;
 
+/*! Look relative sound names up in an index of the sounds directory */
+int ast_sounds_index = 1;
+/*! Kilobytes of recently played sound files to keep in memory, 0 for none */
+int ast_sounds_cache_size;
+/*! Translated playbacks of a sound file before it is compiled to the native format, 0 for never */
+int ast_sounds_compile;
+
 static AST_LIST_HEAD_STATIC(formats, ast_format);
 
 int __ast_format_register(const struct ast_format *f, struct ast_module *mod)
@@ -304,6 +317,1193 @@ static int exts_compare(const char *exts, const char *type)
 	return 0;
 }
 
+/*
+ * Sound file index and prompt cache.
+ *
+ * Finding a prompt probes the sounds directory once per language variant
+ * and per extension of every registered format, so a single Playback()
+ * costs a few dozen stat() calls, most of them for files that do not exist.
+ * With inotify, the names under the sounds directory are indexed at startup
+ * and kept current from directory change events, and relative names are
+ * looked up in memory instead.  Only the index thread reads the events and
+ * rescans directories.  While it has events left to apply, or is indexing
+ * everything again after the kernel dropped some, lookups go to disk, so
+ * files written just before they are played are never missed.
+ *
+ * On top of the index, the bytes of the most recently opened files can be
+ * kept in memory (sounds_cache in asterisk.conf) and handed to the format
+ * modules as memory-backed streams.  Files are cached as they are on disk,
+ * decoding still happens frame by frame in the format module.
+ */
+#ifdef HAVE_INOTIFY_INIT
+/*! \brief Directory levels the index descends to, deeper trees are left to stat() */
+#define SOUNDS_INDEX_DEPTH	16
+
+#define SOUNDS_INDEX_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*! \brief The extensions a sound exists in, by name relative to the sounds directory.
+ * Entries are never changed once linked, updates replace them. */
+struct sound_entry {
+	char *exts;		/*!< as found on disk, e.g. "|gsm|WAV|" */
+	char name[0];
+};
+
+/*! \brief A watched directory, relative to the sounds directory ("" for the top).
+ * Symlinks may make one watch show up under several names. */
+struct sound_dir {
+	int wd;
+	char dir[0];
+};
+
+/*! \brief A directory whose contents are not indexed (a symlink loop, or too deep) */
+struct sound_skip {
+	size_t len;
+	char dir[0];
+};
+
+/*! \brief The directories behind one watch descriptor, see sound_dir_collect_cb() */
+struct sound_dir_list {
+	int wd;
+	int count;
+	struct sound_dir *dirs[8];
+};
+
+/*! \brief The directories above the one being scanned, to detect symlink loops */
+struct sound_ancestors {
+	int count;
+	struct {
+		dev_t dev;
+		ino_t ino;
+	} dir[SOUNDS_INDEX_DEPTH + 2];
+};
+
+static struct ao2_container *sounds;
+static struct ao2_container *sound_dirs;
+static struct ao2_container *sound_skips;
+static int sounds_fd = -1;
+/*! \brief Set while the index is complete and may answer lookups */
+static volatile int sounds_ready;
+/*! \brief Set while the index thread applies change events it has read */
+static volatile int sounds_applying;
+static pthread_t sounds_thread = AST_PTHREADT_NULL;
+static char sounds_path[PATH_MAX];
+/*! \brief Serializes applying change events with loading files into the cache */
+AST_MUTEX_DEFINE_STATIC(sounds_lock);
+
+static struct {
+	int found;
+	int missing;
+	int skipped;
+	int hits;
+	int misses;
+	int uncached;
+	int evictions;
+} sound_stats;
+
+static void sound_cache_drop(const char *name);
+static void sound_cache_flush(void);
+
+static int sound_entry_hash(const void *obj, const int flags)
+{
+	const struct sound_entry *e = obj;
+
+	return ast_str_hash(e->name);
+}
+
+static int sound_entry_cmp(void *obj, void *arg, int flags)
+{
+	struct sound_entry *e = obj, *e2 = arg;
+
+	return !strcmp(e->name, e2->name) ? CMP_MATCH : 0;
+}
+
+static int sound_dir_hash(const void *obj, const int flags)
+{
+	const struct sound_dir *d = obj;
+
+	return d->wd;
+}
+
+static int sound_dir_cmp(void *obj, void *arg, int flags)
+{
+	struct sound_dir *d = obj, *d2 = arg;
+
+	return d->wd == d2->wd ? CMP_MATCH : 0;
+}
+
+static int sound_skip_hash(const void *obj, const int flags)
+{
+	return 0;
+}
+
+static int sound_skip_cmp(void *obj, void *arg, int flags)
+{
+	struct sound_skip *s = obj;
+	const char *name = arg;
+
+	return !strncmp(name, s->dir, s->len) && (name[s->len] == '/' || !name[s->len]) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static int sound_match_all_cb(void *obj, void *arg, int flags)
+{
+	return CMP_MATCH;
+}
+
+static int sound_dir_collect_cb(void *obj, void *arg, int flags)
+{
+	struct sound_dir *d = obj;
+	struct sound_dir_list *l = arg;
+
+	if (d->wd == l->wd && l->count < ARRAY_LEN(l->dirs)) {
+		ao2_ref(d, +1);
+		l->dirs[l->count++] = d;
+	}
+	return 0;
+}
+
+/*! \brief True if dir is name itself or one of its parents */
+static int sound_name_under(const char *name, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	return !strncmp(name, dir, len) && (name[len] == '/' || !name[len]);
+}
+
+static int sound_entry_under_cb(void *obj, void *arg, int flags)
+{
+	struct sound_entry *e = obj;
+
+	return sound_name_under(e->name, arg) && e->name[strlen(arg)] ? CMP_MATCH : 0;
+}
+
+static int sound_dir_under_cb(void *obj, void *arg, int flags)
+{
+	struct sound_dir *d = obj;
+
+	return sound_name_under(d->dir, arg) ? CMP_MATCH : 0;
+}
+
+static int sound_dir_unwatch_cb(void *obj, void *arg, int flags)
+{
+	struct sound_dir *d = obj;
+
+	if (!sound_name_under(d->dir, arg))
+		return 0;
+	inotify_rm_watch(sounds_fd, d->wd);
+	return CMP_MATCH;
+}
+
+static int sound_skip_under_cb(void *obj, void *arg, int flags)
+{
+	struct sound_skip *s = obj;
+
+	return sound_name_under(s->dir, arg) ? CMP_MATCH : 0;
+}
+
+/*!
+ * \brief Relative names the index can answer for: no empty, "." or ".."
+ * components, and not below a directory that was left out.
+ */
+static int sound_name_indexable(const char *name)
+{
+	const char *c = name, *end;
+	size_t len;
+	struct sound_skip *s;
+
+	for (;;) {
+		end = strchr(c, '/');
+		len = end ? end - c : strlen(c);
+		if (!len || (c[0] == '.' && (len == 1 || (len == 2 && c[1] == '.'))))
+			return 0;
+		if (!end)
+			break;
+		c = end + 1;
+	}
+	if (ao2_container_count(sound_skips) && (s = ao2_find(sound_skips, (void *) name, 0))) {
+		ao2_ref(s, -1);
+		return 0;
+	}
+	return 1;
+}
+
+/*! \brief True if the sound exists in format extension ext */
+static int sound_entry_has(struct sound_entry *e, const char *ext)
+{
+	char needle[32];
+
+	if (!strcmp(ext, "wav49"))
+		ext = "WAV";
+	snprintf(needle, sizeof(needle), "|%s|", ext);
+	return strstr(e->exts, needle) != NULL;
+}
+
+/*! \brief Record that sound name does (add) or does not exist in extension ext */
+static void sound_index_update(const char *name, const char *ext, int add)
+{
+	struct sound_entry *key, *old, *e;
+	const char *exts;
+	char *newexts, *found;
+	char needle[32];
+	size_t namelen = strlen(name), needlelen;
+
+	if (strlen(ext) > sizeof(needle) - 3)
+		return;
+	needlelen = snprintf(needle, sizeof(needle), "|%s|", ext);
+	key = alloca(sizeof(*key) + namelen + 1);
+	strcpy(key->name, name);
+
+	ao2_lock(sounds);
+	old = ao2_find(sounds, key, OBJ_POINTER);
+	exts = old ? old->exts : "|";
+	found = strstr(exts, needle);
+	if (!add != !found) {
+		newexts = alloca(strlen(exts) + needlelen);
+		if (add) {
+			sprintf(newexts, "%s%s|", exts, ext);
+		} else {
+			memcpy(newexts, exts, found - exts + 1);
+			strcpy(newexts + (found - exts) + 1, found + needlelen);
+		}
+		if (old)
+			ao2_unlink(sounds, old);
+		if (newexts[1] && (e = ao2_alloc(sizeof(*e) + namelen + 1 + strlen(newexts) + 1, NULL))) {
+			strcpy(e->name, name);
+			e->exts = e->name + namelen + 1;
+			strcpy(e->exts, newexts);
+			ao2_link(sounds, e);
+			ao2_ref(e, -1);
+		}
+	}
+	ao2_unlock(sounds);
+	if (old)
+		ao2_ref(old, -1);
+}
+
+/*! \brief A file appeared in (add) or disappeared from directory dir */
+static void sound_index_file(const char *dir, const char *file, int add)
+{
+	char *name, *ext;
+
+	if (!(ext = strrchr(file, '.')) || ext == file || !ext[1])
+		return;
+	name = alloca(strlen(dir) + strlen(file) + 2);
+	sprintf(name, "%s%s%.*s", dir, *dir ? "/" : "", (int) (ext - file), file);
+	sound_index_update(name, ext + 1, add);
+}
+
+/*! \brief Leave directory dir out of the index, lookups below it go to the filesystem */
+static void sound_index_skip(const char *dir, const char *why)
+{
+	struct sound_skip *s;
+
+	ast_log(LOG_NOTICE, "Not indexing sounds in %s/%s: %s\n", sounds_path, dir, why);
+	if (!(s = ao2_alloc(sizeof(*s) + strlen(dir) + 1, NULL)))
+		return;
+	s->len = strlen(dir);
+	strcpy(s->dir, dir);
+	ao2_link(sound_skips, s);
+	ao2_ref(s, -1);
+}
+
+/*! \brief Watch and index directory dir and everything below it */
+static int sound_index_scan(const char *dir, struct sound_ancestors *anc)
+{
+	char path[PATH_MAX];
+	struct sound_dir_list known = { .count = 0 };
+	struct sound_dir *d;
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+	int i, res = 0;
+
+	snprintf(path, sizeof(path), "%s%s%s", sounds_path, *dir ? "/" : "", dir);
+	if ((known.wd = inotify_add_watch(sounds_fd, path, SOUNDS_INDEX_EVENTS)) < 0) {
+		/* Only an index that sees every directory can say a file does not exist */
+		ast_log(LOG_WARNING, "Unable to watch %s: %s\n", path, strerror(errno));
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	ao2_callback(sound_dirs, OBJ_MULTIPLE | OBJ_NODATA, sound_dir_collect_cb, &known);
+	for (i = 0, d = NULL; i < known.count; i++) {
+		if (!strcmp(known.dirs[i]->dir, dir))
+			d = known.dirs[i];
+		ao2_ref(known.dirs[i], -1);
+	}
+	if (!d && (d = ao2_alloc(sizeof(*d) + strlen(dir) + 1, NULL))) {
+		d->wd = known.wd;
+		strcpy(d->dir, dir);
+		ao2_link(sound_dirs, d);
+		ao2_ref(d, -1);
+	}
+
+	if (!(dp = opendir(path)))
+		return 0;	/* gone again, the parent's events tell */
+	while (!res && (de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s%s%s", sounds_path, dir, *dir ? "/" : "", de->d_name);
+		if (stat(path, &st))
+			continue;
+		if (S_ISREG(st.st_mode)) {
+			sound_index_file(dir, de->d_name, 1);
+		} else if (S_ISDIR(st.st_mode)) {
+			char *sub = path + strlen(sounds_path) + 1;
+
+			for (i = 0; i < anc->count; i++) {
+				if (anc->dir[i].dev == st.st_dev && anc->dir[i].ino == st.st_ino)
+					break;
+			}
+			if (i < anc->count) {
+				sound_index_skip(sub, "symlink loop");
+			} else if (anc->count > SOUNDS_INDEX_DEPTH) {
+				sound_index_skip(sub, "too deep");
+			} else {
+				anc->dir[anc->count].dev = st.st_dev;
+				anc->dir[anc->count++].ino = st.st_ino;
+				res = sound_index_scan(ast_strdupa(sub), anc);
+				anc->count--;
+			}
+		}
+	}
+	closedir(dp);
+	return res;
+}
+
+/*! \brief Index a directory that appeared below the sounds directory */
+static int sound_index_add_dir(const char *dir)
+{
+	struct sound_ancestors anc = { .count = 0 };
+	char path[PATH_MAX];
+	struct stat st;
+	const char *c = dir;
+
+	/* The directories leading to it, and the directory itself */
+	for (;;) {
+		snprintf(path, sizeof(path), "%s%s%.*s", sounds_path, c == dir ? "" : "/", (int) (c - dir), dir);
+		if (stat(path, &st))
+			return 0;
+		if (anc.count > SOUNDS_INDEX_DEPTH) {
+			sound_index_skip(dir, "too deep");
+			return 0;
+		}
+		anc.dir[anc.count].dev = st.st_dev;
+		anc.dir[anc.count++].ino = st.st_ino;
+		if (!*c)
+			break;
+		if (!(c = strchr(c + 1, '/')))
+			c = dir + strlen(dir);
+	}
+	return sound_index_scan(dir, &anc);
+}
+
+/*! \brief Forget directory dir and everything below it */
+static void sound_index_drop_dir(const char *dir, int unwatch)
+{
+	ao2_callback(sounds, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_entry_under_cb, (void *) dir);
+	ao2_callback(sound_dirs, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA,
+		unwatch ? sound_dir_unwatch_cb : sound_dir_under_cb, (void *) dir);
+	ao2_callback(sound_skips, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_skip_under_cb, (void *) dir);
+}
+
+/*! \brief Stop answering lookups from the index, with sounds_lock held */
+static void sound_index_disable(const char *why)
+{
+	ast_log(LOG_WARNING, "Not indexing sounds in %s any more: %s\n", sounds_path, why);
+	sounds_ready = 0;
+	sound_cache_flush();
+}
+
+/*! \brief (Re)build the whole index, with sounds_lock held */
+static void sound_index_build(void)
+{
+	struct sound_ancestors anc = { .count = 0 };
+	struct timeval start = ast_tvnow();
+	struct stat st;
+
+	sounds_ready = 0;
+	sound_cache_flush();
+	ao2_callback(sounds, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_match_all_cb, NULL);
+	ao2_callback(sound_dirs, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_match_all_cb, NULL);
+	ao2_callback(sound_skips, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_match_all_cb, NULL);
+
+	if (stat(sounds_path, &st)) {
+		ast_log(LOG_WARNING, "Not indexing sounds, %s: %s\n", sounds_path, strerror(errno));
+		return;
+	}
+	anc.dir[0].dev = st.st_dev;
+	anc.dir[0].ino = st.st_ino;
+	anc.count = 1;
+	if (sound_index_scan("", &anc)) {
+		ast_log(LOG_WARNING, "Not indexing sounds in %s, looking them up on disk instead\n", sounds_path);
+		return;
+	}
+	sounds_ready = 1;
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "Indexed %d sounds in %d directories of %s in %d ms\n",
+			ao2_container_count(sounds), ao2_container_count(sound_dirs), sounds_path,
+			(int) ast_tvdiff_ms(ast_tvnow(), start));
+}
+
+static void sound_index_event(struct inotify_event *ev)
+{
+	struct sound_dir_list l = { .wd = ev->wd, .count = 0 };
+	struct sound_dir *d, *known;
+	char path[PATH_MAX], *name;
+	struct stat st;
+	int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		ast_log(LOG_NOTICE, "Sound directory changes were lost, indexing %s again\n", sounds_path);
+		sound_index_build();
+		return;
+	}
+	if (!sounds_ready)
+		return;
+
+	ao2_callback(sound_dirs, OBJ_MULTIPLE | OBJ_NODATA, sound_dir_collect_cb, &l);
+	for (i = 0; i < l.count; i++) {
+		d = l.dirs[i];
+		if (ev->mask & IN_IGNORED) {
+			/* The directory is gone, or was moved away */
+			ao2_unlink(sound_dirs, d);
+		} else if (!ev->len) {
+			/* Changes to subdirectories themselves are reported by their parents */
+			if (!*d->dir && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)))
+				sound_index_disable("the sounds directory was moved or removed");
+		} else if (sounds_ready) {
+			name = alloca(strlen(d->dir) + ev->len + 2);
+			sprintf(name, "%s%s%s", d->dir, *d->dir ? "/" : "", ev->name);
+			if (!(ev->mask & IN_ISDIR)) {
+				if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+					sound_index_file(d->dir, ev->name, 1);
+					/* A symlink to a directory is reported as a file */
+					snprintf(path, sizeof(path), "%s/%s", sounds_path, name);
+					if (!stat(path, &st) && S_ISDIR(st.st_mode) && sound_index_add_dir(name))
+						sound_index_disable("unable to watch a new directory");
+				} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					sound_index_file(d->dir, ev->name, 0);
+					if ((known = ao2_callback(sound_dirs, 0, sound_dir_under_cb, name))) {
+						ao2_ref(known, -1);
+						sound_index_drop_dir(name, 0);
+					}
+				}
+				sound_cache_drop(name);
+			} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				if (sound_index_add_dir(name))
+					sound_index_disable("unable to watch a new directory");
+			} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				sound_index_drop_dir(name, ev->mask & IN_MOVED_FROM);
+			}
+		}
+		ao2_ref(d, -1);
+	}
+}
+
+/*! \brief Apply all pending directory changes, with sounds_lock held */
+static void sound_index_read_events(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(sounds_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			sound_index_event(ev);
+		}
+	}
+}
+
+/*! \brief Apply pending directory changes, from the index thread only */
+static void sound_index_sync(void)
+{
+	/* Lookups see either the events still queued or this flag set */
+	ast_atomic_fetchadd_int((int *) &sounds_applying, +1);
+	ast_mutex_lock(&sounds_lock);
+	sound_index_read_events();
+	ast_mutex_unlock(&sounds_lock);
+	ast_atomic_fetchadd_int((int *) &sounds_applying, -1);
+}
+
+/*! \brief True if the index may not yet know about recent directory changes */
+static int sound_index_behind(void)
+{
+	struct pollfd pfd = { .fd = sounds_fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) != 0 || sounds_applying;
+}
+
+static void *sound_index_thread(void *data)
+{
+	struct pollfd pfd = { .fd = sounds_fd, .events = POLLIN };
+
+	ast_mutex_lock(&sounds_lock);
+	sound_index_build();
+	ast_mutex_unlock(&sounds_lock);
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) > 0)
+			sound_index_sync();
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Look a relative sound name up in the index.
+ * \param filename the name, without extension
+ * \param opening the file is about to be opened
+ * \param entry the sound, with a reference held, or NULL if there is none
+ * \retval 0 the index cannot answer for this name, look on disk
+ * \retval 1 *entry is set
+ */
+static int sound_index_find(const char *filename, int opening, struct sound_entry **entry)
+{
+	struct sound_entry *key;
+
+	if (!sounds_ready || !sound_name_indexable(filename)) {
+		ast_atomic_fetchadd_int(&sound_stats.skipped, 1);
+		return 0;
+	}
+	key = alloca(sizeof(*key) + strlen(filename) + 1);
+	strcpy(key->name, filename);
+	*entry = ao2_find(sounds, key, OBJ_POINTER);
+	/* Files just written, or just changed, are not indexed yet, look on disk */
+	if (!sounds_ready || ((opening || !*entry) && sound_index_behind())) {
+		if (*entry) {
+			ao2_ref(*entry, -1);
+			*entry = NULL;
+		}
+		ast_atomic_fetchadd_int(&sound_stats.skipped, 1);
+		return 0;
+	}
+	ast_atomic_fetchadd_int(*entry ? &sound_stats.found : &sound_stats.missing, 1);
+	return 1;
+}
+
+#ifdef HAVE_FOPENCOOKIE
+/*! \brief The contents of a sound file, by full path */
+struct sound_data {
+	unsigned int used;	/*!< when last opened, on sound_cache_clock */
+	size_t len;
+	char *data;
+	char path[0];
+};
+
+/*! \brief A read position in a cached file, the cookie of its FILE */
+struct sound_stream {
+	struct sound_data *d;
+	off64_t pos;
+};
+
+static struct ao2_container *sound_cache;
+static size_t sound_cache_bytes;
+static unsigned int sound_cache_clock;
+
+static int sound_data_hash(const void *obj, const int flags)
+{
+	const struct sound_data *d = obj;
+
+	return ast_str_hash(d->path);
+}
+
+static int sound_data_cmp(void *obj, void *arg, int flags)
+{
+	struct sound_data *d = obj, *d2 = arg;
+
+	return !strcmp(d->path, d2->path) ? CMP_MATCH : 0;
+}
+
+static int sound_data_oldest_cb(void *obj, void *arg, int flags)
+{
+	struct sound_data *d = obj, **oldest = arg;
+
+	if (!*oldest || d->used < (*oldest)->used)
+		*oldest = d;
+	return 0;
+}
+
+static ssize_t sound_stream_read(void *cookie, char *buf, size_t size)
+{
+	struct sound_stream *s = cookie;
+
+	if (s->pos >= s->d->len)
+		return 0;
+	if (size > s->d->len - s->pos)
+		size = s->d->len - s->pos;
+	memcpy(buf, s->d->data + s->pos, size);
+	s->pos += size;
+	return size;
+}
+
+static int sound_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct sound_stream *s = cookie;
+	off64_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = s->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = s->d->len + *offset;
+		break;
+	default:
+		return -1;
+	}
+	if (pos < 0)
+		return -1;
+	*offset = s->pos = pos;
+	return 0;
+}
+
+static int sound_stream_close(void *cookie)
+{
+	struct sound_stream *s = cookie;
+
+	ao2_ref(s->d, -1);
+	free(s);
+	return 0;
+}
+
+static void sound_cache_unlink(struct sound_data *d)
+{
+	sound_cache_bytes -= d->len;
+	ao2_unlink(sound_cache, d);
+}
+
+/*! \brief Forget the cached contents of a file, by name relative to the sounds directory */
+static void sound_cache_drop(const char *name)
+{
+	struct sound_data *key, *d;
+
+	if (!sound_cache)
+		return;
+	key = alloca(sizeof(*key) + strlen(sounds_path) + strlen(name) + 2);
+	sprintf(key->path, "%s/%s", sounds_path, name);
+	ao2_lock(sound_cache);
+	if ((d = ao2_find(sound_cache, key, OBJ_POINTER))) {
+		sound_cache_unlink(d);
+		ao2_ref(d, -1);
+	}
+	ao2_unlock(sound_cache);
+}
+
+static void sound_cache_flush(void)
+{
+	if (!sound_cache)
+		return;
+	ao2_lock(sound_cache);
+	ao2_callback(sound_cache, OBJ_UNLINK | OBJ_MULTIPLE | OBJ_NODATA, sound_match_all_cb, NULL);
+	sound_cache_bytes = 0;
+	ao2_unlock(sound_cache);
+}
+
+/*!
+ * \brief Read a file into the cache.  Loads are serialized with the change
+ * events, so a file changing while it is read is dropped again.  While the
+ * index thread is busy the file is read from disk instead of waiting.
+ */
+static struct sound_data *sound_cache_load(const char *fn)
+{
+	size_t limit = (size_t) ast_sounds_cache_size * 1024;
+	struct sound_data *d = NULL, *old;
+	struct stat st;
+	ssize_t res;
+	size_t len = 0;
+	int fd;
+
+	/* Symlinked files can change without the index knowing */
+	if (lstat(fn, &st) || !S_ISREG(st.st_mode) || st.st_size > limit / 4) {
+		ast_atomic_fetchadd_int(&sound_stats.uncached, 1);
+		return NULL;
+	}
+	if (ast_mutex_trylock(&sounds_lock)) {
+		ast_atomic_fetchadd_int(&sound_stats.uncached, 1);
+		return NULL;
+	}
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		ast_mutex_unlock(&sounds_lock);
+		return NULL;
+	}
+	if (!fstat(fd, &st) && st.st_size <= limit / 4 &&
+	    (d = ao2_alloc(sizeof(*d) + strlen(fn) + 1 + st.st_size, NULL))) {
+		strcpy(d->path, fn);
+		d->data = d->path + strlen(fn) + 1;
+		while (len < st.st_size && (res = read(fd, d->data + len, st.st_size - len)) > 0)
+			len += res;
+		d->len = len;
+		if (len < st.st_size) {
+			ao2_ref(d, -1);
+			d = NULL;
+		}
+	}
+	close(fd);
+	if (!d) {
+		ast_mutex_unlock(&sounds_lock);
+		ast_atomic_fetchadd_int(&sound_stats.uncached, 1);
+		return NULL;
+	}
+
+	ao2_lock(sound_cache);
+	if ((old = ao2_find(sound_cache, d, OBJ_POINTER))) {
+		ao2_ref(d, -1);
+		d = old;
+	} else {
+		ao2_link(sound_cache, d);
+		sound_cache_bytes += d->len;
+		while (sound_cache_bytes > limit) {
+			old = NULL;
+			ao2_callback(sound_cache, OBJ_NODATA, sound_data_oldest_cb, &old);
+			if (!old || old == d)
+				break;
+			sound_cache_unlink(old);
+			ast_atomic_fetchadd_int(&sound_stats.evictions, 1);
+		}
+	}
+	d->used = ++sound_cache_clock;
+	ao2_unlock(sound_cache);
+	ast_mutex_unlock(&sounds_lock);
+	return d;
+}
+
+/*! \brief Open an indexed file from memory, NULL to read it from disk instead */
+static FILE *sound_cache_open(const char *fn)
+{
+	cookie_io_functions_t io = {
+		.read = sound_stream_read,
+		.seek = sound_stream_seek,
+		.close = sound_stream_close,
+	};
+	struct sound_data *key, *d;
+	struct sound_stream *s;
+	FILE *f;
+
+	if (!sound_cache)
+		return NULL;
+	key = alloca(sizeof(*key) + strlen(fn) + 1);
+	strcpy(key->path, fn);
+	ao2_lock(sound_cache);
+	if ((d = ao2_find(sound_cache, key, OBJ_POINTER)))
+		d->used = ++sound_cache_clock;
+	ao2_unlock(sound_cache);
+	if (d)
+		ast_atomic_fetchadd_int(&sound_stats.hits, 1);
+	else if ((d = sound_cache_load(fn)))
+		ast_atomic_fetchadd_int(&sound_stats.misses, 1);
+	else
+		return NULL;
+
+	if (!(s = ast_calloc(1, sizeof(*s)))) {
+		ao2_ref(d, -1);
+		return NULL;
+	}
+	s->d = d;
+	if (!(f = fopencookie(s, "r", io))) {
+		sound_stream_close(s);
+		return NULL;
+	}
+	/* Format modules read whole frames, a stdio buffer would only add a copy */
+	setvbuf(f, NULL, _IONBF, 0);
+	return f;
+}
+#else
+static void sound_cache_drop(const char *name)
+{
+}
+
+static void sound_cache_flush(void)
+{
+}
+
+static FILE *sound_cache_open(const char *fn)
+{
+	return NULL;
+}
+#endif /* HAVE_FOPENCOOKIE */
+
+static void sound_index_start(void)
+{
+	if (!ast_sounds_index)
+		return;
+	snprintf(sounds_path, sizeof(sounds_path), "%s/sounds", ast_config_AST_DATA_DIR);
+	if (!(sounds = ao2_container_alloc(4099, sound_entry_hash, sound_entry_cmp)) ||
+	    !(sound_dirs = ao2_container_alloc(127, sound_dir_hash, sound_dir_cmp)) ||
+	    !(sound_skips = ao2_container_alloc(1, sound_skip_hash, sound_skip_cmp)))
+		return;
+#ifdef HAVE_FOPENCOOKIE
+	if (ast_sounds_cache_size > 0 && !(sound_cache = ao2_container_alloc(1567, sound_data_hash, sound_data_cmp)))
+		return;
+#endif
+	if ((sounds_fd = inotify_init()) < 0) {
+		ast_log(LOG_WARNING, "Unable to watch %s, not indexing sounds: %s\n", sounds_path, strerror(errno));
+		return;
+	}
+	fcntl(sounds_fd, F_SETFL, fcntl(sounds_fd, F_GETFL) | O_NONBLOCK);
+	if (ast_pthread_create_background(&sounds_thread, NULL, sound_index_thread, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start the sounds index thread, not indexing sounds\n");
+		close(sounds_fd);
+		sounds_fd = -1;
+	}
+}
+#else
+struct sound_entry;
+
+static int sound_index_find(const char *filename, int opening, struct sound_entry **entry)
+{
+	return 0;
+}
+
+static int sound_entry_has(struct sound_entry *e, const char *ext)
+{
+	return 1;
+}
+
+static FILE *sound_cache_open(const char *fn)
+{
+	return NULL;
+}
+
+static void sound_index_start(void)
+{
+}
+#endif /* HAVE_INOTIFY_INIT */
+
+/*
+ * Prompt compiler.
+ *
+ * A prompt that only exists in formats a channel cannot take is translated
+ * again on every playback.  With sounds_compile = N in asterisk.conf, once a
+ * prompt has been translated N times to the same native format, a background
+ * thread writes a copy in that format next to the original, which
+ * ast_set_write_format() then picks without translating.
+ *
+ * Compiled copies are listed in the astdb, so that they can be told apart
+ * from files put there by hand.  A copy whose original changed or went away
+ * is deleted when it is looked up, instead of being played.
+ */
+#define PROMPT_DB_FAMILY	"PromptCompiler"
+
+/*! \brief Translated playbacks of a prompt to one native format */
+struct prompt_demand {
+	int format;		/*!< the channel's native format */
+	int srcformat;		/*!< the format the prompt was played from */
+	int count;
+	int queued;		/*!< 1 while waiting to be compiled, 2 once compiled or found impossible */
+	AST_LIST_ENTRY(prompt_demand) list;
+	char name[0];
+};
+
+/*! \brief A compiled copy, by file name relative to the sounds directory */
+struct prompt_variant {
+	time_t mtime;		/*!< of the original, the copy is given the same */
+	off_t srcsize;		/*!< of the original */
+	off_t size;		/*!< of the copy */
+	char *source;		/*!< the original, relative to the sounds directory */
+	char file[0];
+};
+
+static struct ao2_container *prompt_demands;
+static struct ao2_container *prompt_variants;
+static AST_LIST_HEAD_NOLOCK_STATIC(prompt_queue, prompt_demand);
+AST_MUTEX_DEFINE_STATIC(prompt_lock);
+static ast_cond_t prompt_cond;
+static pthread_t prompt_thread = AST_PTHREADT_NULL;
+
+static int prompt_demand_hash(const void *obj, const int flags)
+{
+	const struct prompt_demand *d = obj;
+
+	return ast_str_hash(d->name) ^ d->format;
+}
+
+static int prompt_demand_cmp(void *obj, void *arg, int flags)
+{
+	struct prompt_demand *d = obj, *d2 = arg;
+
+	return d->format == d2->format && !strcmp(d->name, d2->name) ? CMP_MATCH : 0;
+}
+
+static int prompt_variant_hash(const void *obj, const int flags)
+{
+	const struct prompt_variant *v = obj;
+
+	return ast_str_hash(v->file);
+}
+
+static int prompt_variant_cmp(void *obj, void *arg, int flags)
+{
+	struct prompt_variant *v = obj, *v2 = arg;
+
+	return !strcmp(v->file, v2->file) ? CMP_MATCH : 0;
+}
+
+static struct prompt_variant *prompt_variant_alloc(const char *file, const char *source)
+{
+	struct prompt_variant *v;
+
+	if (!(v = ao2_alloc(sizeof(*v) + strlen(file) + strlen(source) + 2, NULL)))
+		return NULL;
+	strcpy(v->file, file);
+	v->source = v->file + strlen(file) + 1;
+	strcpy(v->source, source);
+	return v;
+}
+
+static int prompt_demand_reset_cb(void *obj, void *arg, int flags)
+{
+	struct prompt_demand *d = obj;
+
+	if (d->queued == 2 && !strcmp(d->name, arg)) {
+		d->count = 0;
+		d->queued = 0;
+	}
+	return 0;
+}
+
+static void prompt_variant_forget(struct prompt_variant *v)
+{
+	ao2_unlink(prompt_variants, v);
+	ast_db_del(PROMPT_DB_FAMILY, v->file);
+}
+
+/*!
+ * \brief Check a file about to be used, in case it is an outdated compiled copy.
+ * \retval 1 the file was a compiled copy of an original that changed since,
+ * it has been removed.
+ */
+static int prompt_variant_stale(const char *filename, const char *ext)
+{
+	struct prompt_variant *key, *v;
+	struct stat st;
+	char *fn;
+	int stale = 0;
+
+	if (!prompt_variants || !ao2_container_count(prompt_variants) || filename[0] == '/')
+		return 0;
+	if (!strcmp(ext, "wav49"))
+		ext = "WAV";
+	key = alloca(sizeof(*key) + strlen(filename) + strlen(ext) + 2);
+	sprintf(key->file, "%s.%s", filename, ext);
+	if (!(v = ao2_find(prompt_variants, key, OBJ_POINTER)))
+		return 0;
+
+	fn = alloca(strlen(ast_config_AST_DATA_DIR) + strlen(v->file) + strlen(v->source) + 9);
+	sprintf(fn, "%s/sounds/%s", ast_config_AST_DATA_DIR, v->file);
+	if (stat(fn, &st) || st.st_mtime != v->mtime || st.st_size != v->size) {
+		/* Gone, or replaced by something that is not ours */
+		prompt_variant_forget(v);
+	} else {
+		sprintf(fn, "%s/sounds/%s", ast_config_AST_DATA_DIR, v->source);
+		if (stat(fn, &st) || st.st_mtime != v->mtime || st.st_size != v->srcsize) {
+			sprintf(fn, "%s/sounds/%s", ast_config_AST_DATA_DIR, v->file);
+			if (option_verbose > 2)
+				ast_verbose(VERBOSE_PREFIX_3 "Removing %s, %s changed since it was compiled\n", v->file, v->source);
+			unlink(fn);
+			prompt_variant_forget(v);
+			stale = 1;
+			/* Compile the new original again once there is demand for it */
+			if (prompt_demands) {
+				ao2_lock(prompt_demands);
+				ao2_callback(prompt_demands, OBJ_NODATA, prompt_demand_reset_cb, (void *) filename);
+				ao2_unlock(prompt_demands);
+			}
+		}
+	}
+	ao2_ref(v, -1);
+	return stale;
+}
+
+/*! \brief Count a playback of prompt name in srcformat translated to native format */
+static void prompt_demand(const char *name, int srcformat, int format)
+{
+	struct prompt_demand *key, *d;
+
+	if (!prompt_demands || name[0] == '/' || strstr(name, ".."))
+		return;
+	key = alloca(sizeof(*key) + strlen(name) + 1);
+	strcpy(key->name, name);
+	key->format = format;
+
+	ao2_lock(prompt_demands);
+	if (!(d = ao2_find(prompt_demands, key, OBJ_POINTER)) &&
+	    (d = ao2_alloc(sizeof(*d) + strlen(name) + 1, NULL))) {
+		strcpy(d->name, name);
+		d->format = format;
+		ao2_link(prompt_demands, d);
+	}
+	if (d && !d->queued && ++d->count >= ast_sounds_compile) {
+		d->queued = 1;
+		d->srcformat = srcformat;
+		ao2_ref(d, +1);
+		ast_mutex_lock(&prompt_lock);
+		AST_LIST_INSERT_TAIL(&prompt_queue, d, list);
+		ast_cond_signal(&prompt_cond);
+		ast_mutex_unlock(&prompt_lock);
+	}
+	ao2_unlock(prompt_demands);
+	if (d)
+		ao2_ref(d, -1);
+}
+
+/*! \brief Write prompt d->name in format d->format next to the original */
+static int prompt_compile(struct prompt_demand *d)
+{
+	struct ast_format *f;
+	struct ast_filestream *in, *out;
+	struct ast_frame *fr;
+	struct prompt_variant *v;
+	struct utimbuf times;
+	struct stat st, before;
+	char *stringp, *ext = NULL, *srcext = NULL, *fn = NULL, *src = NULL, *tmp, *tmpfn = NULL;
+	char value[256];
+	int res = -1;
+
+	if (ast_translate_path_steps(d->format, d->srcformat) == -1)
+		return -1;
+	if (AST_LIST_LOCK(&formats)) {
+		ast_log(LOG_WARNING, "Unable to lock format list\n");
+		return -1;
+	}
+	AST_LIST_TRAVERSE(&formats, f, list) {
+		if (!ext && f->format == d->format && f->write) {
+			stringp = ast_strdupa(f->exts);
+			ext = strsep(&stringp, "|");
+		}
+		if (!srcext && f->format == d->srcformat) {
+			char *e;
+
+			stringp = ast_strdupa(f->exts);
+			while (!srcext && (e = strsep(&stringp, "|"))) {
+				if (!(src = build_filename(d->name, e)))
+					continue;
+				if (!stat(src, &before))
+					srcext = e;
+				else {
+					free(src);
+					src = NULL;
+				}
+			}
+		}
+	}
+	AST_LIST_UNLOCK(&formats);
+	if (!ext || !srcext) {
+		ast_log(LOG_NOTICE, "Unable to compile %s to %s: %s\n", d->name, ast_getformatname(d->format),
+			ext ? "original not found" : "no file format writes it");
+		goto done;
+	}
+
+	tmp = alloca(strlen(d->name) + 11);
+	sprintf(tmp, "%s-compiling", d->name);
+	if (!(fn = build_filename(d->name, ext)) || !(tmpfn = build_filename(tmp, ext)) || !stat(fn, &st))
+		goto done;
+	if (!(in = ast_readfile(d->name, srcext, NULL, O_RDONLY, 0, 0)))
+		goto done;
+	if (!(out = ast_writefile(tmp, ext, NULL, 0, 0, 0644))) {
+		ast_closestream(in);
+		goto done;
+	}
+	res = 0;
+	while (!res && (fr = ast_readframe(in))) {
+		res = ast_writestream(out, fr);
+		ast_frfree(fr);
+	}
+	ast_closestream(in);
+	ast_closestream(out);
+
+	/* The copy stands for the original as it was before it was read */
+	if (!res && (stat(src, &st) || st.st_mtime != before.st_mtime || st.st_size != before.st_size))
+		res = -1;
+	times.actime = times.modtime = before.st_mtime;
+	if (res || utime(tmpfn, &times) || stat(tmpfn, &st) || link(tmpfn, fn)) {
+		unlink(tmpfn);
+		res = -1;
+		goto done;
+	}
+	unlink(tmpfn);
+
+	/* Names relative to the sounds directory, as on disk */
+	if ((v = prompt_variant_alloc(fn + strlen(ast_config_AST_DATA_DIR) + 8, src + strlen(ast_config_AST_DATA_DIR) + 8))) {
+		v->mtime = before.st_mtime;
+		v->srcsize = before.st_size;
+		v->size = st.st_size;
+		snprintf(value, sizeof(value), "%ld:%ld:%ld:%s", (long) v->mtime, (long) v->srcsize, (long) v->size, v->source);
+		ast_db_put(PROMPT_DB_FAMILY, v->file, value);
+		ao2_link(prompt_variants, v);
+		ao2_ref(v, -1);
+	}
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Compiled prompt %s from %s to %s\n", d->name, srcext, ext);
+
+done:
+	if (fn)
+		free(fn);
+	if (tmpfn)
+		free(tmpfn);
+	if (src)
+		free(src);
+	return res;
+}
+
+static void *prompt_compiler(void *data)
+{
+	struct prompt_demand *d;
+
+	for (;;) {
+		ast_mutex_lock(&prompt_lock);
+		while (!(d = AST_LIST_REMOVE_HEAD(&prompt_queue, list)))
+			ast_cond_wait(&prompt_cond, &prompt_lock);
+		ast_mutex_unlock(&prompt_lock);
+		prompt_compile(d);
+		ao2_lock(prompt_demands);
+		d->queued = 2;
+		ao2_unlock(prompt_demands);
+		ao2_ref(d, -1);
+	}
+
+	return NULL;
+}
+
+static void prompt_compiler_start(void)
+{
+	struct ast_db_entry *db, *entry;
+	struct prompt_variant *v;
+	long mtime, srcsize, size;
+	int skip = strlen(PROMPT_DB_FAMILY) + 2, n;
+
+	if (!(prompt_variants = ao2_container_alloc(127, prompt_variant_hash, prompt_variant_cmp)))
+		return;
+	/* Copies compiled before must be checked even if no more are made */
+	db = ast_db_gettree(PROMPT_DB_FAMILY, NULL);
+	for (entry = db; entry; entry = entry->next) {
+		if (strlen(entry->key) <= skip || sscanf(entry->data, "%ld:%ld:%ld:%n", &mtime, &srcsize, &size, &n) != 3)
+			continue;
+		if (!(v = prompt_variant_alloc(entry->key + skip, entry->data + n)))
+			continue;
+		v->mtime = mtime;
+		v->srcsize = srcsize;
+		v->size = size;
+		ao2_link(prompt_variants, v);
+		ao2_ref(v, -1);
+	}
+	if (db)
+		ast_db_freetree(db);
+
+	if (ast_sounds_compile < 1)
+		return;
+	if (!(prompt_demands = ao2_container_alloc(1567, prompt_demand_hash, prompt_demand_cmp)))
+		return;
+	ast_cond_init(&prompt_cond, NULL);
+	if (ast_pthread_create_background(&prompt_thread, NULL, prompt_compiler, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start the prompt compiler thread, not compiling prompts\n");
+		ao2_ref(prompt_demands, -1);
+		prompt_demands = NULL;
+	}
+}
+
 static void filestream_destructor(void *arg)
 {
 	char *cmd = NULL;
@@ -424,10 +1624,20 @@ enum file_action {
 static int ast_filehelper(const char *filename, const void *arg2, const char *fmt, const enum file_action action)
 {
 	struct ast_format *f;
+	struct sound_entry *entry = NULL;
 	int res = (action == ACTION_EXISTS) ? 0 : -1;
+	int indexed = 0;
+
+	if (action == ACTION_EXISTS || action == ACTION_OPEN) {
+		indexed = sound_index_find(filename, action == ACTION_OPEN, &entry);
+		if (indexed && !entry)
+			return res;
+	}
 
 	if (AST_LIST_LOCK(&formats)) {
 		ast_log(LOG_WARNING, "Unable to lock format list\n");
+		if (entry)
+			ao2_ref(entry, -1);
 		return res;
 	}
 	/* Check for a specific format */
@@ -444,12 +1654,20 @@ static int ast_filehelper(const char *filename, const void *arg2, const char *fm
 		stringp = ast_strdupa(f->exts);	/* this is in the stack so does not need to be freed */
 		while ( (ext = strsep(&stringp, "|")) ) {
 			struct stat st;
-			char *fn = build_filename(filename, ext);
+			char *fn;
 
+			if (indexed && !sound_entry_has(entry, ext))
+				continue;
+
+			fn = build_filename(filename, ext);
 			if (fn == NULL)
 				continue;
 
-			if ( stat(fn, &st) ) { /* file not existent */
+			if (!indexed && stat(fn, &st)) { /* file not existent */
+				free(fn);
+				continue;
+			}
+			if ((action == ACTION_EXISTS || action == ACTION_OPEN) && prompt_variant_stale(filename, ext)) {
 				free(fn);
 				continue;
 			}
@@ -466,7 +1684,8 @@ static int ast_filehelper(const char *filename, const void *arg2, const char *fm
 					free(fn);
 					continue;	/* not a supported format */
 				}
-				if ( (bfile = fopen(fn, "r")) == NULL) {
+				bfile = indexed ? sound_cache_open(fn) : NULL;
+				if (!bfile && (bfile = fopen(fn, "r")) == NULL) {
 					free(fn);
 					continue;	/* cannot open file */
 				}
@@ -535,6 +1754,8 @@ static int ast_filehelper(const char *filename, const void *arg2, const char *fm
 		}
 	}
 	AST_LIST_UNLOCK(&formats);
+	if (entry)
+		ao2_ref(entry, -1);
 	return res;
 }
 
@@ -672,9 +1893,11 @@ struct ast_filestream *ast_openstream_full(struct ast_channel *chan, const char
 		return NULL;
 	}
 	res = ast_filehelper(buf, chan, NULL, ACTION_OPEN);
-	if (res >= 0)
-		return chan->stream;
-	return NULL;
+	if (res < 0)
+		return NULL;
+	if (chan->writeformat != chan->rawwriteformat)
+		prompt_demand(buf, chan->writeformat, chan->rawwriteformat);
+	return chan->stream;
 }
 
 struct ast_filestream *ast_openvstream(struct ast_channel *chan, const char *filename, const char *preflang)
@@ -1493,10 +2716,45 @@ static int show_file_formats_deprecated(int fd, int argc, char *argv[])
 #undef FORMAT2
 }
 
+static int show_file_cache(int fd, int argc, char *argv[])
+{
+	if (argc != 4)
+		return RESULT_SHOWUSAGE;
+#ifdef HAVE_INOTIFY_INIT
+	if (sounds_fd < 0) {
+		ast_cli(fd, "Sounds are not indexed, they are looked up on disk.\n");
+	} else {
+		ast_cli(fd, "Index:    %d sounds in %d directories of %s%s\n",
+			ao2_container_count(sounds), ao2_container_count(sound_dirs), sounds_path,
+			sounds_ready ? "" : " (not in use)");
+		ast_cli(fd, "Lookups:  %d found, %d not found, %d not indexed\n",
+			sound_stats.found, sound_stats.missing, sound_stats.skipped);
+	}
+#ifdef HAVE_FOPENCOOKIE
+	if (sound_cache) {
+		ast_cli(fd, "Cache:    %d files, %lu of %d KB\n", ao2_container_count(sound_cache),
+			(unsigned long) sound_cache_bytes / 1024, ast_sounds_cache_size);
+		ast_cli(fd, "Opens:    %d from memory, %d loaded, %d not cacheable, %d evicted\n",
+			sound_stats.hits, sound_stats.misses, sound_stats.uncached, sound_stats.evictions);
+	} else
+#endif
+		ast_cli(fd, "Cache:    disabled\n");
+#else
+	ast_cli(fd, "Sounds cannot be indexed on this system, they are looked up on disk.\n");
+#endif
+	ast_cli(fd, "Compiled: %d prompts%s\n", prompt_variants ? ao2_container_count(prompt_variants) : 0,
+		prompt_demands ? "" : " (not compiling)");
+	return RESULT_SUCCESS;
+}
+
 char show_file_formats_usage[] = 
 "Usage: core show file formats\n"
 "       Displays currently registered file formats (if any)\n";
 
+static char show_file_cache_usage[] =
+"Usage: core show file cache\n"
+"       Displays statistics of the sound file index, cache and compiled prompts\n";
+
 struct ast_cli_entry cli_show_file_formats_deprecated = {
 	{ "show", "file", "formats" },
 	show_file_formats_deprecated, NULL,
@@ -1506,10 +2764,16 @@ struct ast_cli_entry cli_file[] = {
 	{ { "core", "show", "file", "formats" },
 	show_file_formats, "Displays file formats",
 	show_file_formats_usage, NULL, &cli_show_file_formats_deprecated },
+
+	{ { "core", "show", "file", "cache" },
+	show_file_cache, "Displays sound file index and cache statistics",
+	show_file_cache_usage },
 };
 
 int ast_file_init(void)
 {
 	ast_cli_register_multiple(cli_file, sizeof(cli_file) / sizeof(struct ast_cli_entry));
+	sound_index_start();
+	prompt_compiler_start();
 	return 0;
 }
@@ -46,8 +46,69 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 269960 $")
 #include "asterisk/translate.h"
 #include "asterisk/dsp.h"
 #include "asterisk/file.h"
+#include "asterisk/slinear.h"
+
+/*! \brief A reference counted frame payload.
+ *
+ * The data follows the payload, after AST_FRIENDLY_OFFSET bytes of space
+ * that belong to the frame the payload was allocated for.  Frames sharing
+ * the payload through ast_frshare() have an offset of 0.
+ */
+struct ast_frame_payload {
+	int refcount;
+	/*! Pool size class the payload belongs to, -1 if it was malloc'd on its own */
+	int class;
+	AST_LIST_ENTRY(ast_frame_payload) list;
+};
+
+#define PAYLOAD_DATA(p) ((char *) (p) + sizeof(struct ast_frame_payload) + AST_FRIENDLY_OFFSET)
+
+/*! \brief Frame allocation counters, for 'core show frame stats' */
+static struct {
+	int headers;		/*!< Frame headers allocated */
+	int header_hits;	/*!< Frame headers taken from a thread's cache */
+	int payloads;		/*!< Payloads allocated */
+	int payload_hits;	/*!< Payloads taken from a thread's cache */
+	int oversized;		/*!< Payloads too big for the pool, malloc'd on their own */
+	int copies;		/*!< Payloads filled by copying the data of another frame */
+	int shares;		/*!< Payloads shared by ast_frshare() instead of copied */
+} frame_stats;
 
 #if !defined(LOW_MEMORY)
+/*! Number of payload size classes in the pool */
+#define FRAME_POOL_CLASSES	4
+
+/*! Size of each slab the pool carves its payload buffers from */
+#define FRAME_POOL_SLAB_SIZE	16384
+
+/*! Maximum number of payloads of each size class kept in a thread's cache */
+#define FRAME_POOL_CACHE_MAX	32
+
+/*! \brief One size class of the frame payload pool.
+ *
+ * Buffers are carved from slabs of FRAME_POOL_SLAB_SIZE bytes and are never
+ * returned to the system, so the pool stays at the size of the peak load.
+ * Freed payloads go to the freeing thread's cache first, and to the shared
+ * free list once that is full.
+ */
+struct frame_pool_class {
+	/*! Buffer size, including struct ast_frame_payload and AST_FRIENDLY_OFFSET */
+	size_t size;
+	ast_mutex_t lock;
+	AST_LIST_HEAD_NOLOCK(, ast_frame_payload) free;
+	int nfree;
+	int slabs;
+	int inuse;
+};
+
+/*! Sizes fit 20ms of ulaw, slinear, wideband slinear and a full size video packet */
+static struct frame_pool_class frame_pool[FRAME_POOL_CLASSES] = {
+	{ .size = 256 },
+	{ .size = 512 },
+	{ .size = 1024 },
+	{ .size = 2048 },
+};
+
 static void frame_cache_cleanup(void *data);
 
 /*! \brief A per-thread cache of frame headers */
@@ -71,6 +132,9 @@ AST_LIST_HEAD_NOLOCK(ast_frames, ast_frame);
 struct ast_frame_cache {
 	struct ast_frames list;
 	size_t size;
+	/*! Cached payloads, by pool size class */
+	AST_LIST_HEAD_NOLOCK(, ast_frame_payload) payloads[FRAME_POOL_CLASSES];
+	int npayloads[FRAME_POOL_CLASSES];
 };
 #endif
 
@@ -298,6 +362,106 @@ void ast_smoother_free(struct ast_smoother *s)
 	free(s);
 }
 
+#if !defined(LOW_MEMORY)
+/*! \brief Carve a new slab into buffers for a pool size class.  Called with the class locked. */
+static int frame_pool_grow(struct frame_pool_class *pool)
+{
+	struct ast_frame_payload *p;
+	char *slab;
+	size_t x;
+
+	if (!(slab = ast_malloc(FRAME_POOL_SLAB_SIZE)))
+		return -1;
+
+	for (x = 0; x + pool->size <= FRAME_POOL_SLAB_SIZE; x += pool->size) {
+		p = (struct ast_frame_payload *) (slab + x);
+		p->class = pool - frame_pool;
+		AST_LIST_INSERT_HEAD(&pool->free, p, list);
+		pool->nfree++;
+	}
+	pool->slabs++;
+
+	return 0;
+}
+#endif
+
+/*! \brief Allocate a payload with room for datalen bytes, with a reference count of 1 */
+static struct ast_frame_payload *frame_payload_new(size_t datalen)
+{
+	struct ast_frame_payload *p = NULL;
+	size_t len = sizeof(*p) + AST_FRIENDLY_OFFSET + datalen;
+
+#if !defined(LOW_MEMORY)
+	struct frame_pool_class *pool;
+	struct ast_frame_cache *frames;
+	int class;
+
+	for (class = 0; class < FRAME_POOL_CLASSES && frame_pool[class].size < len; class++);
+
+	if (class < FRAME_POOL_CLASSES) {
+		pool = &frame_pool[class];
+		if ((frames = ast_threadstorage_get(&frame_cache, sizeof(*frames))) &&
+		    (p = AST_LIST_REMOVE_HEAD(&frames->payloads[class], list))) {
+			frames->npayloads[class]--;
+			ast_atomic_fetchadd_int(&frame_stats.payload_hits, 1);
+		} else {
+			ast_mutex_lock(&pool->lock);
+			if (!AST_LIST_EMPTY(&pool->free) || !frame_pool_grow(pool)) {
+				p = AST_LIST_REMOVE_HEAD(&pool->free, list);
+				pool->nfree--;
+			}
+			ast_mutex_unlock(&pool->lock);
+		}
+		if (p)
+			ast_atomic_fetchadd_int(&pool->inuse, 1);
+	}
+#endif
+
+	if (!p) {
+		if (!(p = ast_malloc(len)))
+			return NULL;
+		p->class = -1;
+		ast_atomic_fetchadd_int(&frame_stats.oversized, 1);
+	}
+
+	p->refcount = 1;
+	ast_atomic_fetchadd_int(&frame_stats.payloads, 1);
+
+	return p;
+}
+
+/*! \brief Drop a reference to a payload, returning it to the pool when it is no longer used */
+static void frame_payload_unref(struct ast_frame_payload *p)
+{
+#if !defined(LOW_MEMORY)
+	struct frame_pool_class *pool;
+	struct ast_frame_cache *frames;
+#endif
+
+	if (ast_atomic_fetchadd_int(&p->refcount, -1) > 1)
+		return;
+
+	if (p->class < 0) {
+		free(p);
+		return;
+	}
+
+#if !defined(LOW_MEMORY)
+	pool = &frame_pool[p->class];
+	ast_atomic_fetchadd_int(&pool->inuse, -1);
+	if ((frames = ast_threadstorage_get(&frame_cache, sizeof(*frames))) &&
+	    (frames->npayloads[p->class] < FRAME_POOL_CACHE_MAX)) {
+		AST_LIST_INSERT_HEAD(&frames->payloads[p->class], p, list);
+		frames->npayloads[p->class]++;
+		return;
+	}
+	ast_mutex_lock(&pool->lock);
+	AST_LIST_INSERT_HEAD(&pool->free, p, list);
+	pool->nfree++;
+	ast_mutex_unlock(&pool->lock);
+#endif
+}
+
 static struct ast_frame *ast_frame_header_new(void)
 {
 	struct ast_frame *f;
@@ -312,6 +476,8 @@ static struct ast_frame *ast_frame_header_new(void)
 			f->mallocd_hdr_len = mallocd_len;
 			f->mallocd = AST_MALLOCD_HDR;
 			frames->size--;
+			ast_atomic_fetchadd_int(&frame_stats.headers, 1);
+			ast_atomic_fetchadd_int(&frame_stats.header_hits, 1);
 			return f;
 		}
 	}
@@ -323,6 +489,7 @@ static struct ast_frame *ast_frame_header_new(void)
 #endif
 
 	f->mallocd_hdr_len = sizeof(*f);
+	ast_atomic_fetchadd_int(&frame_stats.headers, 1);
 	
 	return f;
 }
@@ -332,9 +499,21 @@ static void frame_cache_cleanup(void *data)
 {
 	struct ast_frame_cache *frames = data;
 	struct ast_frame *f;
+	struct ast_frame_payload *p;
+	int class;
 
 	while ((f = AST_LIST_REMOVE_HEAD(&frames->list, frame_list)))
 		free(f);
+
+	/* Give the payloads back to the pool */
+	for (class = 0; class < FRAME_POOL_CLASSES; class++) {
+		ast_mutex_lock(&frame_pool[class].lock);
+		while ((p = AST_LIST_REMOVE_HEAD(&frames->payloads[class], list))) {
+			AST_LIST_INSERT_HEAD(&frame_pool[class].free, p, list);
+			frame_pool[class].nfree++;
+		}
+		ast_mutex_unlock(&frame_pool[class].lock);
+	}
 	
 	free(frames);
 }
@@ -345,6 +524,13 @@ static void __frame_free(struct ast_frame *fr, int cache)
 	if (!fr->mallocd)
 		return;
 
+	if (fr->mallocd & AST_MALLOCD_PAYLOAD) {
+		frame_payload_unref(fr->payload);
+		fr->payload = NULL;
+		fr->data = NULL;
+		fr->mallocd &= ~AST_MALLOCD_PAYLOAD;
+	}
+
 #if !defined(LOW_MEMORY)
 	if (cache && fr->mallocd == AST_MALLOCD_HDR) {
 		/* Cool, only the header is malloc'd, let's just cache those for now 
@@ -393,7 +579,9 @@ void ast_frame_free(struct ast_frame *frame, int cache)
 struct ast_frame *ast_frisolate(struct ast_frame *fr)
 {
 	struct ast_frame *out;
-	void *newdata;
+	struct ast_frame_payload *payload;
+	const char *src;
+	int data_mallocd;
 
 	/* if none of the existing frame is malloc'd, let ast_frdup() do it
 	   since it is more efficient
@@ -403,8 +591,8 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr)
 	}
 
 	/* if everything is already malloc'd, we are done */
-	if ((fr->mallocd & (AST_MALLOCD_HDR | AST_MALLOCD_SRC | AST_MALLOCD_DATA)) ==
-	    (AST_MALLOCD_HDR | AST_MALLOCD_SRC | AST_MALLOCD_DATA)) {
+	if ((fr->mallocd & (AST_MALLOCD_HDR | AST_MALLOCD_SRC)) == (AST_MALLOCD_HDR | AST_MALLOCD_SRC) &&
+	    (fr->mallocd & (AST_MALLOCD_DATA | AST_MALLOCD_PAYLOAD))) {
 		return fr;
 	}
 
@@ -429,46 +617,55 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr)
 		out = fr;
 	}
 	
-	if (!(fr->mallocd & AST_MALLOCD_SRC) && fr->src) {
-		if (!(out->src = ast_strdup(fr->src))) {
+	src = fr->src;
+	if (!(fr->mallocd & AST_MALLOCD_SRC) && src) {
+		if (!(out->src = ast_strdup(src))) {
 			if (out != fr) {
 				free(out);
 			}
 			return NULL;
 		}
-	} else {
-		out->src = fr->src;
+	} else if (out != fr) {
+		out->src = src;
 		fr->src = NULL;
 		fr->mallocd &= ~AST_MALLOCD_SRC;
 	}
 	
-	if (!(fr->mallocd & AST_MALLOCD_DATA))  {
-		if (!(newdata = ast_malloc(fr->datalen + AST_FRIENDLY_OFFSET))) {
-			if (out->src != fr->src) {
+	/* When the header is reused, a malloc'd src, data or payload simply stays where it is */
+	data_mallocd = fr->mallocd & (AST_MALLOCD_DATA | AST_MALLOCD_PAYLOAD);
+	if (!data_mallocd)  {
+		if (!(payload = frame_payload_new(fr->datalen))) {
+			if (out->src != src) {
 				free((void *) out->src);
+				out->src = src;
 			}
 			if (out != fr) {
 				free(out);
 			}
 			return NULL;
 		}
-		newdata += AST_FRIENDLY_OFFSET;
+		memcpy(PAYLOAD_DATA(payload), fr->data, fr->datalen);
+		out->payload = payload;
 		out->offset = AST_FRIENDLY_OFFSET;
 		out->datalen = fr->datalen;
-		memcpy(newdata, fr->data, fr->datalen);
-		out->data = newdata;
-	} else {
+		out->data = PAYLOAD_DATA(payload);
+		ast_atomic_fetchadd_int(&frame_stats.copies, 1);
+		data_mallocd = AST_MALLOCD_PAYLOAD;
+	} else if (out != fr) {
+		out->payload = fr->payload;
 		out->data = fr->data;
+		fr->payload = NULL;
 		fr->data = NULL;
-		fr->mallocd &= ~AST_MALLOCD_DATA;
+		fr->mallocd &= ~(AST_MALLOCD_DATA | AST_MALLOCD_PAYLOAD);
 	}
 
-	out->mallocd = AST_MALLOCD_HDR | AST_MALLOCD_SRC | AST_MALLOCD_DATA;
+	out->mallocd = AST_MALLOCD_HDR | AST_MALLOCD_SRC | data_mallocd;
 	
 	return out;
 }
 
-struct ast_frame *ast_frdup(const struct ast_frame *f)
+/*! \brief Allocate a frame header with a copy of the source and everything but the data of another frame */
+static struct ast_frame *frame_header_dup(const struct ast_frame *f)
 {
 	struct ast_frame *out = NULL;
 	int len, srclen = 0;
@@ -479,7 +676,7 @@ struct ast_frame *ast_frdup(const struct ast_frame *f)
 #endif
 
 	/* Start with standard stuff */
-	len = sizeof(*out) + AST_FRIENDLY_OFFSET + f->datalen;
+	len = sizeof(*out);
 	/* If we have a source, add space for it */
 	/*
 	 * XXX Watch out here - if we receive a src which is not terminated
@@ -500,6 +697,7 @@ struct ast_frame *ast_frdup(const struct ast_frame *f)
 				out->mallocd_hdr_len = mallocd_len;
 				buf = out;
 				frames->size--;
+				ast_atomic_fetchadd_int(&frame_stats.header_hits, 1);
 				break;
 			}
 		}
@@ -513,6 +711,7 @@ struct ast_frame *ast_frdup(const struct ast_frame *f)
 		out = buf;
 		out->mallocd_hdr_len = len;
 	}
+	ast_atomic_fetchadd_int(&frame_stats.headers, 1);
 
 	out->frametype = f->frametype;
 	out->subclass = f->subclass;
@@ -522,15 +721,10 @@ struct ast_frame *ast_frdup(const struct ast_frame *f)
 	/* Set us as having malloc'd header only, so it will eventually
 	   get freed. */
 	out->mallocd = AST_MALLOCD_HDR;
-	out->offset = AST_FRIENDLY_OFFSET;
-	if (out->datalen) {
-		out->data = buf + sizeof(*out) + AST_FRIENDLY_OFFSET;
-		memcpy(out->data, f->data, out->datalen);	
-	}
 	if (srclen > 0) {
 		/* This may seem a little strange, but it's to avoid a gcc (4.2.4) compiler warning */
 		char *src;
-		out->src = buf + sizeof(*out) + AST_FRIENDLY_OFFSET + f->datalen;
+		out->src = buf + sizeof(*out);
 		src = (char *) out->src;
 		/* Must have space since we allocated for it */
 		strcpy(src, f->src);
@@ -542,6 +736,72 @@ struct ast_frame *ast_frdup(const struct ast_frame *f)
 	return out;
 }
 
+struct ast_frame *ast_frdup(const struct ast_frame *f)
+{
+	struct ast_frame *out;
+	struct ast_frame_payload *payload = NULL;
+
+	if (f->datalen > 0 && !(payload = frame_payload_new(f->datalen)))
+		return NULL;
+
+	if (!(out = frame_header_dup(f))) {
+		if (payload)
+			frame_payload_unref(payload);
+		return NULL;
+	}
+
+	out->offset = AST_FRIENDLY_OFFSET;
+	if (payload) {
+		out->payload = payload;
+		out->mallocd |= AST_MALLOCD_PAYLOAD;
+		out->data = PAYLOAD_DATA(payload);
+		memcpy(out->data, f->data, out->datalen);
+		ast_atomic_fetchadd_int(&frame_stats.copies, 1);
+	}
+	return out;
+}
+
+struct ast_frame *ast_frshare(const struct ast_frame *f)
+{
+	struct ast_frame *out;
+
+	if (!(f->mallocd & AST_MALLOCD_PAYLOAD))
+		return ast_frdup(f);
+
+	if (!(out = frame_header_dup(f)))
+		return NULL;
+
+	ast_atomic_fetchadd_int(&f->payload->refcount, 1);
+	ast_atomic_fetchadd_int(&frame_stats.shares, 1);
+	out->payload = f->payload;
+	out->mallocd |= AST_MALLOCD_PAYLOAD;
+	out->data = f->data;
+	/* The space before the data belongs to the frame the payload was made for */
+	out->offset = 0;
+	return out;
+}
+
+int ast_frame_unshare(struct ast_frame *f)
+{
+	struct ast_frame_payload *payload;
+
+	/* If we hold the only reference, nobody else can take one */
+	if (!(f->mallocd & AST_MALLOCD_PAYLOAD) || f->payload->refcount == 1)
+		return 0;
+
+	if (!(payload = frame_payload_new(f->datalen)))
+		return -1;
+	memcpy(PAYLOAD_DATA(payload), f->data, f->datalen);
+	ast_atomic_fetchadd_int(&frame_stats.copies, 1);
+
+	frame_payload_unref(f->payload);
+	f->payload = payload;
+	f->data = PAYLOAD_DATA(payload);
+	f->offset = AST_FRIENDLY_OFFSET;
+
+	return 0;
+}
+
 void ast_swapcopy_samples(void *dst, const void *src, int samples)
 {
 	int i;
@@ -795,6 +1055,42 @@ static char frame_show_codec_n_usage[] =
 "Usage: core show codec <number>\n"
 "       Displays codec mapping\n";
 
+static int show_frame_stats(int fd, int argc, char *argv[])
+{
+#if !defined(LOW_MEMORY)
+	int class, slabs, nfree;
+#endif
+
+	if (argc != 4)
+		return RESULT_SHOWUSAGE;
+
+	ast_cli(fd, "Frame headers allocated:   %u (%u from thread caches)\n",
+		(unsigned int) frame_stats.headers, (unsigned int) frame_stats.header_hits);
+	ast_cli(fd, "Frame payloads allocated:  %u (%u from thread caches, %u too big for the pool)\n",
+		(unsigned int) frame_stats.payloads, (unsigned int) frame_stats.payload_hits, (unsigned int) frame_stats.oversized);
+	ast_cli(fd, "Frame payloads copied:     %u\n", (unsigned int) frame_stats.copies);
+	ast_cli(fd, "Frame payloads shared:     %u\n", (unsigned int) frame_stats.shares);
+#if !defined(LOW_MEMORY)
+	ast_cli(fd, "\n%-8s %8s %8s %8s %8s\n", "Size", "Slabs", "Buffers", "In use", "Free");
+	for (class = 0; class < FRAME_POOL_CLASSES; class++) {
+		ast_mutex_lock(&frame_pool[class].lock);
+		slabs = frame_pool[class].slabs;
+		nfree = frame_pool[class].nfree;
+		ast_mutex_unlock(&frame_pool[class].lock);
+		ast_cli(fd, "%-8d %8d %8d %8d %8d\n", (int) frame_pool[class].size, slabs,
+			slabs * (int) (FRAME_POOL_SLAB_SIZE / frame_pool[class].size), frame_pool[class].inuse, nfree);
+	}
+#endif
+
+	return RESULT_SUCCESS;
+}
+
+static char frame_show_stats_usage[] =
+"Usage: core show frame stats\n"
+"       Displays frame allocation counters and the state of the frame payload\n"
+"       pool.  Payloads not in use or in the shared free lists are cached by\n"
+"       the threads that freed them.\n";
+
 /*! Dump a frame for debugging purposes */
 void ast_frame_dump(const char *name, struct ast_frame *f, char *prefix)
 {
@@ -1022,10 +1318,21 @@ static struct ast_cli_entry my_clis[] = {
 	{ { "core", "show", "codec", NULL },
 	show_codec_n, "Shows a specific codec",
 	frame_show_codec_n_usage, NULL, &cli_show_codec },
+
+	{ { "core", "show", "frame", "stats", NULL },
+	show_frame_stats, "Shows frame allocation statistics",
+	frame_show_stats_usage },
 };
 
 int init_framer(void)
 {
+#if !defined(LOW_MEMORY)
+	int class;
+
+	for (class = 0; class < FRAME_POOL_CLASSES; class++)
+		ast_mutex_init(&frame_pool[class].lock);
+#endif
+
 	ast_cli_register_multiple(my_clis, sizeof(my_clis) / sizeof(struct ast_cli_entry));
 	return 0;	
 }
@@ -1567,8 +1874,6 @@ int ast_codec_get_len(int format, int samples)
 
 int ast_frame_adjust_volume(struct ast_frame *f, int adjustment)
 {
-	int count;
-	short *fdata = f->data;
 	short adjust_value = abs(adjustment);
 
 	if ((f->frametype != AST_FRAME_VOICE) || (f->subclass != AST_FORMAT_SLINEAR))
@@ -1577,21 +1882,19 @@ int ast_frame_adjust_volume(struct ast_frame *f, int adjustment)
 	if (!adjustment)
 		return 0;
 
-	for (count = 0; count < f->samples; count++) {
-		if (adjustment > 0) {
-			ast_slinear_saturated_multiply(&fdata[count], &adjust_value);
-		} else if (adjustment < 0) {
-			ast_slinear_saturated_divide(&fdata[count], &adjust_value);
-		}
-	}
+	if (ast_frame_unshare(f))
+		return -1;
+
+	if (adjustment > 0)
+		ast_slinear_saturated_multiply_n(f->data, adjust_value, f->samples);
+	else
+		ast_slinear_saturated_divide_n(f->data, adjust_value, f->samples);
 
 	return 0;
 }
 
 int ast_frame_slinear_sum(struct ast_frame *f1, struct ast_frame *f2)
 {
-	int count;
-	short *data1, *data2;
 
 	if ((f1->frametype != AST_FRAME_VOICE) || (f1->subclass != AST_FORMAT_SLINEAR))
 		return -1;
@@ -1602,10 +1905,10 @@ int ast_frame_slinear_sum(struct ast_frame *f1, struct ast_frame *f2)
 	if (f1->samples != f2->samples)
 		return -1;
 
-	for (count = 0, data1 = f1->data, data2 = f2->data;
-	     count < f1->samples;
-	     count++, data1++, data2++)
-		ast_slinear_saturated_add(data1, data2);
+	if (ast_frame_unshare(f1))
+		return -1;
+
+	ast_slinear_saturated_add_n(f1->data, f2->data, f1->samples);
 
 	return 0;
 }
@@ -33,6 +33,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 182810 $")
 #include <termios.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
 
 #include "asterisk/io.h"
 #include "asterisk/logger.h"
@@ -44,6 +49,263 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 182810 $")
 #define DEBUG(a) 
 #endif
 
+#ifdef HAVE_EPOLL_CREATE
+/*
+ * The epoll backend.  The kernel keeps the interest list, so adding,
+ * changing and removing an fd is a single epoll_ctl() call and a wakeup
+ * only returns the fds that are ready, instead of poll()ing and scanning
+ * every fd of the context.  Level triggered, like poll(), and the EPOLL*
+ * event bits have the same values as the POLL* ones on Linux, so callbacks
+ * see exactly what they did before.
+ */
+
+/* Maximum number of ready fds handled per ast_io_wait() */
+#define IO_EPOLL_EVENTS 256
+
+/* 
+ * Kept for each file descriptor
+ */
+struct io_rec {
+	int id;					/* ID number, our index in ior; &id is what ast_io_add() returns */
+	int fd;					/* File descriptor being watched */
+	short events;				/* Events being watched for */
+	ast_io_cb callback;			/* What is to be called */
+	void *data; 				/* Data to be passed */
+	struct io_rec *next;			/* Next removed record waiting to be freed */
+};
+
+/* The records grow as needed, by GROW_SHRINK_SIZE entries at once */
+
+#define GROW_SHRINK_SIZE 512
+
+/* Global variables are now in a struct in order to be
+   made threadsafe */
+struct io_context {
+	/* The epoll descriptor */
+	int epfd;
+	/* All I/O records, so they can be dumped and freed */
+	struct io_rec **ior;
+	/* Number of records in use */
+	unsigned int fdcnt;
+	/* Number of records allocated */
+	unsigned int maxfdcnt;
+	/* Whether callbacks are being run */
+	int dispatching;
+	/* Records removed while callbacks run; a later ready event may still point to them */
+	struct io_rec *removed;
+};
+
+struct io_context *io_context_create(void)
+{
+	/* Create an I/O context */
+	struct io_context *tmp;
+
+	if (!(tmp = ast_calloc(1, sizeof(*tmp))))
+		return NULL;
+
+	if ((tmp->epfd = epoll_create(GROW_SHRINK_SIZE)) < 0) {
+		ast_log(LOG_WARNING, "Unable to create epoll descriptor: %s\n", strerror(errno));
+		free(tmp);
+		return NULL;
+	}
+	fcntl(tmp->epfd, F_SETFD, FD_CLOEXEC);
+
+	tmp->maxfdcnt = GROW_SHRINK_SIZE / 2;
+	if (!(tmp->ior = ast_calloc(1, tmp->maxfdcnt * sizeof(*tmp->ior)))) {
+		close(tmp->epfd);
+		free(tmp);
+		return NULL;
+	}
+
+	return tmp;
+}
+
+void io_context_destroy(struct io_context *ioc)
+{
+	/* Free associated memory with an I/O context */
+	unsigned int x;
+
+	for (x = 0; x < ioc->fdcnt; x++)
+		free(ioc->ior[x]);
+	free(ioc->ior);
+	close(ioc->epfd);
+	free(ioc);
+}
+
+/* Translate an ID handed out by ast_io_add() back to its record, or NULL */
+static struct io_rec *io_rec_find(struct io_context *ioc, int *id)
+{
+	struct io_rec *rec;
+
+	if (!id || *id < 0 || *id >= ioc->fdcnt)
+		return NULL;
+	rec = ioc->ior[*id];
+	return &rec->id == id ? rec : NULL;
+}
+
+static int io_ctl(struct io_context *ioc, int op, struct io_rec *rec)
+{
+	struct epoll_event ev = { .events = rec->events, .data.ptr = rec };
+
+	if (epoll_ctl(ioc->epfd, op, rec->fd, &ev)) {
+		ast_log(LOG_WARNING, "Unable to %s fd %d: %s\n",
+			op == EPOLL_CTL_ADD ? "watch" : "change events of", rec->fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int *ast_io_add(struct io_context *ioc, int fd, ast_io_cb callback, short events, void *data)
+{
+	/*
+	 * Add a new I/O entry for this file descriptor
+	 * with the given event mask, to call callback with
+	 * data as an argument.  Returns NULL on failure.
+	 */
+	struct io_rec *rec;
+	DEBUG(ast_log(LOG_DEBUG, "ast_io_add()\n"));
+	if (ioc->fdcnt >= ioc->maxfdcnt) {
+		void *tmp;
+
+		if (!(tmp = ast_realloc(ioc->ior, (ioc->maxfdcnt + GROW_SHRINK_SIZE) * sizeof(*ioc->ior))))
+			return NULL;
+		ioc->ior = tmp;
+		ioc->maxfdcnt += GROW_SHRINK_SIZE;
+	}
+
+	if (!(rec = ast_calloc(1, sizeof(*rec))))
+		return NULL;
+	rec->fd = fd;
+	rec->events = events;
+	rec->callback = callback;
+	rec->data = data;
+	if (io_ctl(ioc, EPOLL_CTL_ADD, rec)) {
+		free(rec);
+		return NULL;
+	}
+
+	rec->id = ioc->fdcnt++;
+	ioc->ior[rec->id] = rec;
+	return &rec->id;
+}
+
+int *ast_io_change(struct io_context *ioc, int *id, int fd, ast_io_cb callback, short events, void *data)
+{
+	struct io_rec *rec;
+
+	if (!(rec = io_rec_find(ioc, id)))
+		return NULL;
+
+	if (callback)
+		rec->callback = callback;
+	if (data)
+		rec->data = data;
+	if (fd > -1) {
+		/* Even the same fd number may be a new socket by now, and closing the
+		   old one already took it out of the epoll set, so always re-add it */
+		epoll_ctl(ioc->epfd, EPOLL_CTL_DEL, rec->fd, NULL);
+		rec->fd = fd;
+		if (events)
+			rec->events = events;
+		io_ctl(ioc, EPOLL_CTL_ADD, rec);
+	} else if (events) {
+		rec->events = events;
+		io_ctl(ioc, EPOLL_CTL_MOD, rec);
+	}
+	return id;
+}
+
+int ast_io_remove(struct io_context *ioc, int *_id)
+{
+	struct io_rec *rec;
+
+	if (!_id) {
+		ast_log(LOG_WARNING, "Asked to remove NULL?\n");
+		return -1;
+	}
+	if (!(rec = io_rec_find(ioc, _id))) {
+		ast_log(LOG_NOTICE, "Unable to remove unknown id %p\n", _id);
+		return -1;
+	}
+
+	/* The fd may have been closed already, which removes it from the set by itself */
+	epoll_ctl(ioc->epfd, EPOLL_CTL_DEL, rec->fd, NULL);
+
+	/* Move the last record into the hole */
+	if (rec->id != --ioc->fdcnt) {
+		ioc->ior[rec->id] = ioc->ior[ioc->fdcnt];
+		ioc->ior[rec->id]->id = rec->id;
+	}
+	ioc->ior[ioc->fdcnt] = NULL;
+
+	if (ioc->dispatching) {
+		rec->id = -1;
+		rec->next = ioc->removed;
+		ioc->removed = rec;
+	} else
+		free(rec);
+	return 0;
+}
+
+int ast_io_wait(struct io_context *ioc, int howlong)
+{
+	/*
+	 * Wait for events, and call
+	 * the callbacks for anything that needs
+	 * to be handled
+	 */
+	struct epoll_event ev[IO_EPOLL_EVENTS];
+	struct io_rec *rec;
+	int res;
+	int x;
+	DEBUG(ast_log(LOG_DEBUG, "ast_io_wait()\n"));
+	res = epoll_wait(ioc->epfd, ev, IO_EPOLL_EVENTS, howlong);
+	if (res > 0) {
+		ioc->dispatching = 1;
+		for (x = 0; x < res; x++) {
+			rec = ev[x].data.ptr;
+			/* It may have been removed by an earlier callback */
+			if (rec->id < 0 || !rec->callback)
+				continue;
+			if (!rec->callback(&rec->id, rec->fd, ev[x].events, rec->data)) {
+				/* Time to delete them since they returned a 0 */
+				if (rec->id >= 0)
+					ast_io_remove(ioc, &rec->id);
+			}
+		}
+		ioc->dispatching = 0;
+		while ((rec = ioc->removed)) {
+			ioc->removed = rec->next;
+			free(rec);
+		}
+	}
+	return res;
+}
+
+void ast_io_dump(struct io_context *ioc)
+{
+	/*
+	 * Print some debugging information via
+	 * the logger interface
+	 */
+	int x;
+	ast_log(LOG_DEBUG, "Asterisk IO Dump: %d entries, %d max entries\n", ioc->fdcnt, ioc->maxfdcnt);
+	ast_log(LOG_DEBUG, "================================================\n");
+	ast_log(LOG_DEBUG, "| ID    FD     Callback    Data        Events  |\n");
+	ast_log(LOG_DEBUG, "+------+------+-----------+-----------+--------+\n");
+	for (x = 0; x < ioc->fdcnt; x++) {
+		ast_log(LOG_DEBUG, "| %.4d | %.4d | %p | %p | %.6x |\n", 
+				ioc->ior[x]->id,
+				ioc->ior[x]->fd,
+				ioc->ior[x]->callback,
+				ioc->ior[x]->data,
+				ioc->ior[x]->events);
+	}
+	ast_log(LOG_DEBUG, "================================================\n");
+}
+
+#else /* !HAVE_EPOLL_CREATE */
+
 /* 
  * Kept for each file descriptor
  */
@@ -312,6 +574,8 @@ void ast_io_dump(struct io_context *ioc)
 	ast_log(LOG_DEBUG, "================================================\n");
 }
 
+#endif /* HAVE_EPOLL_CREATE */
+
 /* Unrelated I/O functions */
 
 int ast_hide_password(int fd)
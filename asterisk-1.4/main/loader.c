@@ -50,6 +50,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 275182 $")
 #include "asterisk/enum.h"
 #include "asterisk/rtp.h"
 #include "asterisk/http.h"
+#include "asterisk/translate.h"
 #include "asterisk/lock.h"
 
 #include <dlfcn.h>
@@ -259,6 +260,7 @@ static struct reload_classes {
 	{ "http",	ast_http_reload },
 	{ "logger",	logger_reload },
 	{ "plc",        ast_plc_reload },
+	{ "transcoder",	ast_transcoder_reload },
 	{ NULL, 	NULL }
 };
 
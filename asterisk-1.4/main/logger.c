@@ -38,6 +38,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 298905 $")
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #if ((defined(AST_DEVMODE)) && (defined(linux)))
 #  include <execinfo.h>
 #  define MAX_BACKTRACE_FRAMES 20
@@ -90,6 +91,37 @@ static char dateformat[256] = "%b %e %T";		/* Original Asterisk Format */
 static int filesize_reload_needed;
 static int global_logmask = -1;
 
+/*! \brief A message waiting for, or being written by, the logger */
+struct logmsg {
+	int level;
+	int line;
+	long tid;			/*!< Thread that logged the message */
+	time_t t;			/*!< When it was logged */
+	const char *file;
+	const char *function;
+	const char *message;
+	struct logmsg *next;		/*!< Link while queued for the logger thread */
+	char data[0];			/*!< Storage for the strings of a queued message */
+};
+
+static int logger_async;		/*!< Hand messages to the logger thread */
+static int logger_queue_size = 10000;	/*!< Most messages waiting for the logger thread */
+static int logger_queued;		/*!< Messages waiting for the logger thread */
+static unsigned int logger_written;	/*!< Queued messages the logger thread wrote */
+static int logger_dropped;		/*!< Messages dropped because the queue was full */
+/*! Queued messages, newest first */
+static struct logmsg *logger_pending;
+#ifndef HAVE_GCC_ATOMICS
+AST_MUTEX_DEFINE_STATIC(logger_pending_lock);
+#endif
+/*! Written to when logger_pending goes from empty to not empty */
+static int logger_alert[2] = { -1, -1 };
+static pthread_t logger_thread = AST_PTHREADT_NULL;
+
+/*! Last timestamp formatted with dateformat, protected by the logchannels lock */
+static time_t date_cache_time;
+static char date_cache[256];
+
 static struct {
 	unsigned int queue_log:1;
 	unsigned int event_log:1;
@@ -144,6 +176,8 @@ AST_THREADSTORAGE(verbose_buf, verbose_buf_init);
 AST_THREADSTORAGE(log_buf, log_buf_init);
 #define LOG_BUF_INIT_SIZE       128
 
+AST_THREADSTORAGE(log_strip_buf, log_strip_buf_init);
+
 static int make_components(char *s, int lineno)
 {
 	char *w;
@@ -282,6 +316,10 @@ static struct logchannel *make_logchannel(char *channel, char *components, int l
 	return chan;
 }
 
+static void logger_thread_start(void);
+static struct logmsg *logger_take(void);
+static void logger_write(struct logmsg *msgs);
+
 static void init_logger_chain(void)
 {
 	struct logchannel *chan;
@@ -296,6 +334,8 @@ static void init_logger_chain(void)
 	AST_LIST_UNLOCK(&logchannels);
 	
 	global_logmask = 0;
+	logger_async = 0;
+	logger_queue_size = 10000;
 	errno = 0;
 	/* close syslog */
 	closelog();
@@ -333,6 +373,15 @@ static void init_logger_chain(void)
 		ast_copy_string(dateformat, s, sizeof(dateformat));
 	else
 		ast_copy_string(dateformat, "%b %e %T", sizeof(dateformat));
+	date_cache_time = 0;
+	if ((s = ast_variable_retrieve(cfg, "general", "async")))
+		logger_async = ast_true(s);
+	if ((s = ast_variable_retrieve(cfg, "general", "asyncqueuesize"))) {
+		if (sscanf(s, "%30d", &logger_queue_size) != 1 || logger_queue_size < 1) {
+			fprintf(stderr, "Invalid asyncqueuesize value '%s', using default value\n", s);
+			logger_queue_size = 10000;
+		}
+	}
 	if ((s = ast_variable_retrieve(cfg, "general", "queue_log")))
 		logfiles.queue_log = ast_true(s);
 	if ((s = ast_variable_retrieve(cfg, "general", "event_log")))
@@ -421,6 +470,7 @@ int reload_logger(int rotate)
 	filesize_reload_needed = 0;
 	
 	init_logger_chain();
+	logger_thread_start();
 
 	if (logfiles.event_log) {
 		snprintf(old, sizeof(old), "%s/%s", (char *)ast_config_AST_LOG_DIR, EVENTLOG);
@@ -543,6 +593,10 @@ static int handle_logger_show_channels(int fd, int argc, char *argv[])
 	}
 	AST_LIST_UNLOCK(&logchannels);
 	ast_cli(fd, "\n");
+	if (logger_thread != AST_PTHREADT_NULL) {
+		ast_cli(fd, "Asynchronous logging: %s, %d queued, %u written, %d dropped\n\n",
+			logger_async ? "Enabled" : "Disabled", logger_queued, logger_written, logger_dropped);
+	}
  		
 	return RESULT_SUCCESS;
 }
@@ -606,6 +660,7 @@ int init_logger(void)
 
 	/* create log channels */
 	init_logger_chain();
+	logger_thread_start();
 
 	/* create the eventlog */
 	if (logfiles.event_log) {
@@ -633,9 +688,14 @@ int init_logger(void)
 void close_logger(void)
 {
 	struct logchannel *f;
+	struct logmsg *msgs;
 
 	AST_LIST_LOCK(&logchannels);
 
+	/* Write out whatever the logger thread has not got to yet */
+	if ((msgs = logger_take()))
+		logger_write(msgs);
+
 	if (eventlog) {
 		fclose(eventlog);
 		eventlog = NULL;
@@ -660,42 +720,298 @@ void close_logger(void)
 	return;
 }
 
-static void __attribute__((format(printf, 5, 0))) ast_log_vsyslog(int level, const char *file, int line, const char *function, const char *fmt, va_list args) 
+static void logger_syslog(struct logmsg *msg)
 {
 	char buf[BUFSIZ];
 	char *s;
+	int level = msg->level;
 
 	if (level >= SYSLOG_NLEVELS) {
 		/* we are locked here, so cannot ast_log() */
-		fprintf(stderr, "ast_log_vsyslog called with bogus level: %d\n", level);
+		fprintf(stderr, "logger_syslog called with bogus level: %d\n", level);
 		return;
 	}
 	if (level == __LOG_VERBOSE) {
-		snprintf(buf, sizeof(buf), "VERBOSE[%ld]: ", (long)GETTID());
+		snprintf(buf, sizeof(buf), "VERBOSE[%ld]: ", msg->tid);
 		level = __LOG_DEBUG;
 	} else if (level == __LOG_DTMF) {
-		snprintf(buf, sizeof(buf), "DTMF[%ld]: ", (long)GETTID());
+		snprintf(buf, sizeof(buf), "DTMF[%ld]: ", msg->tid);
 		level = __LOG_DEBUG;
 	} else {
 		snprintf(buf, sizeof(buf), "%s[%ld]: %s:%d in %s: ",
-			 levels[level], (long)GETTID(), file, line, function);
+			 levels[level], msg->tid, msg->file, msg->line, msg->function);
 	}
 	s = buf + strlen(buf);
-	vsnprintf(s, sizeof(buf) - strlen(buf), fmt, args);
+	ast_copy_string(s, msg->message, sizeof(buf) - strlen(buf));
 	term_strip(s, s, strlen(s) + 1);
 	syslog(syslog_level_map[level], "%s", buf);
 }
 
+/*! \brief Format a timestamp with dateformat, once per second
+ * \note The logchannels list must be locked.
+ */
+static const char *logger_date(time_t t)
+{
+	struct tm tm;
+
+	if (t != date_cache_time) {
+		ast_localtime(&t, &tm, NULL);
+		strftime(date_cache, sizeof(date_cache), dateformat, &tm);
+		date_cache_time = t;
+	}
+	return date_cache;
+}
+
+/*! \brief Write a message to the event log or every log channel that wants it
+ * \note The logchannels list must be locked.  File channels are not flushed.
+ */
+static void logger_print(struct logmsg *msg)
+{
+	struct logchannel *chan;
+	struct ast_dynamic_str *strip = NULL;
+	const char *date = logger_date(msg->t);
+	char prefix[BUFSIZ];
+	int level = msg->level;
+
+	if (logfiles.event_log && level == __LOG_EVENT) {
+		if (eventlog)
+			fprintf(eventlog, "%s asterisk[%ld]: %s", date, (long)getpid(), msg->message);
+		return;
+	}
+
+	AST_LIST_TRAVERSE(&logchannels, chan, list) {
+		if (chan->disabled)
+			break;
+		/* Check syslog channels */
+		if (chan->type == LOGTYPE_SYSLOG && (chan->logmask & (1 << level))) {
+			logger_syslog(msg);
+		/* Console channels */
+		} else if ((chan->logmask & (1 << level)) && (chan->type == LOGTYPE_CONSOLE)) {
+			char linestr[128];
+			char tmp1[80], tmp2[80], tmp3[80], tmp4[80];
+
+			if (level != __LOG_VERBOSE) {
+				sprintf(linestr, "%d", msg->line);
+				snprintf(prefix, sizeof(prefix),
+					"[%s] %s[%ld]: %s:%s %s: ",
+					date,
+					term_color(tmp1, levels[level], colors[level], 0, sizeof(tmp1)),
+					msg->tid,
+					term_color(tmp2, msg->file, COLOR_BRWHITE, 0, sizeof(tmp2)),
+					term_color(tmp3, linestr, COLOR_BRWHITE, 0, sizeof(tmp3)),
+					term_color(tmp4, msg->function, COLOR_BRWHITE, 0, sizeof(tmp4)));
+				/*filter to the console!*/
+				term_filter_escapes(prefix);
+				ast_console_puts_mutable(prefix);
+				ast_console_puts_mutable(msg->message);
+			}
+		/* File channels */
+		} else if ((chan->logmask & (1 << level)) && (chan->fileptr)) {
+			int res;
+			snprintf(prefix, sizeof(prefix), "[%s] %s[%ld] %s: ",
+				date, levels[level], msg->tid, msg->file);
+			res = fprintf(chan->fileptr, "%s", term_strip(prefix, prefix, strlen(prefix) + 1));
+			if (res <= 0 && !ast_strlen_zero(prefix)) {	/* Error, no characters printed */
+				fprintf(stderr,"**** Asterisk Logging Error: ***********\n");
+				if (errno == ENOMEM || errno == ENOSPC) {
+					fprintf(stderr, "Asterisk logging error: Out of disk space, can't log to log file %s\n", chan->filename);
+				} else
+					fprintf(stderr, "Logger Warning: Unable to write to log file '%s': %s (disabled)\n", chan->filename, strerror(errno));
+				manager_event(EVENT_FLAG_SYSTEM, "LogChannel", "Channel: %s\r\nEnabled: No\r\nReason: %d - %s\r\n", chan->filename, errno, strerror(errno));
+				chan->disabled = 1;	
+			} else {
+				/* No error message, continue printing, stripped once for all files */
+				if (!strip && (strip = ast_dynamic_str_thread_get(&log_strip_buf, LOG_BUF_INIT_SIZE)) &&
+				    ast_dynamic_str_thread_set(&strip, 0, &log_strip_buf, "%s", msg->message) != AST_DYNSTR_BUILD_FAILED)
+					term_strip(strip->str, strip->str, strip->len);
+				if (strip)
+					fputs(strip->str, chan->fileptr);
+			}
+		}
+	}
+}
+
+/*! \brief Flush the event log and every file channel
+ * \note The logchannels list must be locked.
+ */
+static void logger_flush(void)
+{
+	struct logchannel *chan;
+
+	if (eventlog)
+		fflush(eventlog);
+	AST_LIST_TRAVERSE(&logchannels, chan, list) {
+		if (chan->fileptr)
+			fflush(chan->fileptr);
+	}
+}
+
+/*! \brief Rotate the logs if a write went over the file size limit */
+static void logger_check_filesize(void)
+{
+	if (filesize_reload_needed) {
+		reload_logger(1);
+		ast_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+		if (option_verbose)
+			ast_verbose("Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+	}
+}
+
+/*! \brief Take every queued message, oldest first */
+static struct logmsg *logger_take(void)
+{
+	struct logmsg *cur, *next, *msgs = NULL;
+
+#ifdef HAVE_GCC_ATOMICS
+	cur = __sync_lock_test_and_set(&logger_pending, NULL);
+#else
+	ast_mutex_lock(&logger_pending_lock);
+	cur = logger_pending;
+	logger_pending = NULL;
+	ast_mutex_unlock(&logger_pending_lock);
+#endif
+
+	/* The stack is newest first, put it back in order */
+	for (; cur; cur = next) {
+		next = cur->next;
+		cur->next = msgs;
+		msgs = cur;
+	}
+
+	return msgs;
+}
+
+/*! \brief Write and free a batch of queued messages
+ * \note The logchannels list must be locked.
+ */
+static void logger_write(struct logmsg *msgs)
+{
+	struct logmsg *next;
+
+	for (; msgs; msgs = next) {
+		next = msgs->next;
+		logger_print(msgs);
+		free(msgs);
+		ast_atomic_fetchadd_int(&logger_queued, -1);
+		logger_written++;
+	}
+	logger_flush();
+}
+
+static void *logger_thread_main(void *data)
+{
+	struct pollfd pfd = {
+		.fd = logger_alert[0],
+		.events = POLLIN,
+	};
+	struct logmsg *msgs;
+	char buf[64];
+
+	for (;;) {
+		if (ast_poll(&pfd, 1, -1) < 1)
+			continue;
+		while (read(logger_alert[0], buf, sizeof(buf)) > 0)
+			;
+		if (!(msgs = logger_take()))
+			continue;
+
+		AST_LIST_LOCK(&logchannels);
+		logger_write(msgs);
+		AST_LIST_UNLOCK(&logchannels);
+
+		logger_check_filesize();
+	}
+
+	return NULL;
+}
+
+/*! \brief Start the logger thread the first time async logging is enabled */
+static void logger_thread_start(void)
+{
+	int flags;
+
+	if (!logger_async || logger_thread != AST_PTHREADT_NULL)
+		return;
+
+	if (pipe(logger_alert)) {
+		fprintf(stderr, "Unable to create logger pipe: %s\n", strerror(errno));
+		logger_async = 0;
+		return;
+	}
+	flags = fcntl(logger_alert[0], F_GETFL);
+	fcntl(logger_alert[0], F_SETFL, flags | O_NONBLOCK);
+	flags = fcntl(logger_alert[1], F_GETFL);
+	fcntl(logger_alert[1], F_SETFL, flags | O_NONBLOCK);
+	if (ast_pthread_create_background(&logger_thread, NULL, logger_thread_main, NULL)) {
+		fprintf(stderr, "Unable to start logger thread, logging synchronously\n");
+		close(logger_alert[0]);
+		close(logger_alert[1]);
+		logger_alert[0] = logger_alert[1] = -1;
+		logger_thread = AST_PTHREADT_NULL;
+		logger_async = 0;
+	}
+}
+
+/*! \brief Copy a message and queue it for the logger thread
+ * \return 0 if queued, -1 if the caller should write it itself
+ */
+static int logger_queue(struct logmsg *msg)
+{
+	struct logmsg *copy, *prev;
+	size_t filelen = strlen(msg->file) + 1, funclen = strlen(msg->function) + 1;
+
+	if (logger_thread == AST_PTHREADT_NULL)
+		return -1;
+
+	if (ast_atomic_fetchadd_int(&logger_queued, 1) >= logger_queue_size) {
+		ast_atomic_fetchadd_int(&logger_queued, -1);
+		ast_atomic_fetchadd_int(&logger_dropped, 1);
+		return 0;
+	}
+
+	/* The file and function names may belong to a module unloaded before
+	 * the message is written, so they are copied along with the message */
+	if (!(copy = ast_malloc(sizeof(*copy) + filelen + funclen + strlen(msg->message) + 1))) {
+		ast_atomic_fetchadd_int(&logger_queued, -1);
+		ast_atomic_fetchadd_int(&logger_dropped, 1);
+		return 0;
+	}
+	*copy = *msg;
+	copy->file = copy->data;
+	memcpy(copy->data, msg->file, filelen);
+	copy->function = copy->data + filelen;
+	memcpy(copy->data + filelen, msg->function, funclen);
+	copy->message = copy->data + filelen + funclen;
+	strcpy(copy->data + filelen + funclen, msg->message);
+
+#ifdef HAVE_GCC_ATOMICS
+	do {
+		prev = logger_pending;
+		copy->next = prev;
+	} while (!__sync_bool_compare_and_swap(&logger_pending, prev, copy));
+#else
+	ast_mutex_lock(&logger_pending_lock);
+	prev = logger_pending;
+	copy->next = prev;
+	logger_pending = copy;
+	ast_mutex_unlock(&logger_pending_lock);
+#endif
+
+	/* A full pipe already has a wakeup in it */
+	if (!prev && write(logger_alert[1], "x", 1) < 0 && errno != EAGAIN)
+		fprintf(stderr, "Unable to wake the logger thread: %s\n", strerror(errno));
+
+	return 0;
+}
+
 /*!
  * \brief send log messages to syslog and/or the console
  */
 void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
 {
-	struct logchannel *chan;
 	struct ast_dynamic_str *buf;
-	time_t t;
-	struct tm tm;
-	char date[256];
+	struct logmsg msg;
+	int res;
 
 	va_list ap;
 
@@ -709,7 +1025,6 @@ void ast_log(int level, const char *file, int line, const char *function, const
 		 * so just log to stdout
 		*/
 		if (level != __LOG_VERBOSE) {
-			int res;
 			va_start(ap, fmt);
 			res = ast_dynamic_str_thread_set_va(&buf, BUFSIZ, &log_buf, fmt, ap);
 			va_end(ap);
@@ -738,96 +1053,30 @@ void ast_log(int level, const char *file, int line, const char *function, const
 	if ((level == __LOG_DEBUG) && !ast_strlen_zero(debug_filename) && strcasecmp(debug_filename, file))
 		return;
 
-	time(&t);
-	ast_localtime(&t, &tm, NULL);
-	strftime(date, sizeof(date), dateformat, &tm);
-
-	AST_LIST_LOCK(&logchannels);
-
-	if (logfiles.event_log && level == __LOG_EVENT) {
-		va_start(ap, fmt);
-
-		fprintf(eventlog, "%s asterisk[%ld]: ", date, (long)getpid());
-		vfprintf(eventlog, fmt, ap);
-		fflush(eventlog);
-
-		va_end(ap);
-		AST_LIST_UNLOCK(&logchannels);
+	/* Format the message once, in this thread's buffer, for every channel */
+	va_start(ap, fmt);
+	res = ast_dynamic_str_thread_set_va(&buf, BUFSIZ, &log_buf, fmt, ap);
+	va_end(ap);
+	if (res == AST_DYNSTR_BUILD_FAILED)
 		return;
-	}
 
-	AST_LIST_TRAVERSE(&logchannels, chan, list) {
-		if (chan->disabled)
-			break;
-		/* Check syslog channels */
-		if (chan->type == LOGTYPE_SYSLOG && (chan->logmask & (1 << level))) {
-			va_start(ap, fmt);
-			ast_log_vsyslog(level, file, line, function, fmt, ap);
-			va_end(ap);
-		/* Console channels */
-		} else if ((chan->logmask & (1 << level)) && (chan->type == LOGTYPE_CONSOLE)) {
-			char linestr[128];
-			char tmp1[80], tmp2[80], tmp3[80], tmp4[80];
+	msg.level = level;
+	msg.line = line;
+	msg.tid = (long)GETTID();
+	msg.t = time(NULL);
+	msg.file = file;
+	msg.function = function;
+	msg.message = buf->str;
 
-			if (level != __LOG_VERBOSE) {
-				int res;
-				sprintf(linestr, "%d", line);
-				ast_dynamic_str_thread_set(&buf, BUFSIZ, &log_buf,
-					"[%s] %s[%ld]: %s:%s %s: ",
-					date,
-					term_color(tmp1, levels[level], colors[level], 0, sizeof(tmp1)),
-					(long)GETTID(),
-					term_color(tmp2, file, COLOR_BRWHITE, 0, sizeof(tmp2)),
-					term_color(tmp3, linestr, COLOR_BRWHITE, 0, sizeof(tmp3)),
-					term_color(tmp4, function, COLOR_BRWHITE, 0, sizeof(tmp4)));
-				/*filter to the console!*/
-				term_filter_escapes(buf->str);
-				ast_console_puts_mutable(buf->str);
-				
-				va_start(ap, fmt);
-				res = ast_dynamic_str_thread_set_va(&buf, BUFSIZ, &log_buf, fmt, ap);
-				va_end(ap);
-				if (res != AST_DYNSTR_BUILD_FAILED)
-					ast_console_puts_mutable(buf->str);
-			}
-		/* File channels */
-		} else if ((chan->logmask & (1 << level)) && (chan->fileptr)) {
-			int res;
-			ast_dynamic_str_thread_set(&buf, BUFSIZ, &log_buf, 
-				"[%s] %s[%ld] %s: ",
-				date, levels[level], (long)GETTID(), file);
-			res = fprintf(chan->fileptr, "%s", term_strip(buf->str, buf->str, strlen(buf->str) + 1));
-			if (res <= 0 && !ast_strlen_zero(buf->str)) {	/* Error, no characters printed */
-				fprintf(stderr,"**** Asterisk Logging Error: ***********\n");
-				if (errno == ENOMEM || errno == ENOSPC) {
-					fprintf(stderr, "Asterisk logging error: Out of disk space, can't log to log file %s\n", chan->filename);
-				} else
-					fprintf(stderr, "Logger Warning: Unable to write to log file '%s': %s (disabled)\n", chan->filename, strerror(errno));
-				manager_event(EVENT_FLAG_SYSTEM, "LogChannel", "Channel: %s\r\nEnabled: No\r\nReason: %d - %s\r\n", chan->filename, errno, strerror(errno));
-				chan->disabled = 1;	
-			} else {
-				int res;
-				/* No error message, continue printing */
-				va_start(ap, fmt);
-				res = ast_dynamic_str_thread_set_va(&buf, BUFSIZ, &log_buf, fmt, ap);
-				va_end(ap);
-				if (res != AST_DYNSTR_BUILD_FAILED) {
-					term_strip(buf->str, buf->str, buf->len);
-					fputs(buf->str, chan->fileptr);
-					fflush(chan->fileptr);
-				}
-			}
-		}
-	}
+	if (logger_async && !logger_queue(&msg))
+		return;
 
+	AST_LIST_LOCK(&logchannels);
+	logger_print(&msg);
+	logger_flush();
 	AST_LIST_UNLOCK(&logchannels);
 
-	if (filesize_reload_needed) {
-		reload_logger(1);
-		ast_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
-		if (option_verbose)
-			ast_verbose("Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
-	}
+	logger_check_filesize();
 }
 
 void ast_backtrace(void)
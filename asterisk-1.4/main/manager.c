@@ -51,6 +51,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 323559 $")
 #include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 #include "asterisk/channel.h"
 #include "asterisk/file.h"
@@ -90,10 +92,12 @@ struct fast_originate_helper {
 	struct ast_variable *vars;
 };
 
+/*! \brief A formatted event, shared by every session queue it sits in */
 struct eventqent {
-	int usecount;
+	int usecount;			/*!< References held by the dispatcher and session queues */
 	int category;
-	struct eventqent *next;
+	int len;			/*!< strlen() of eventdata */
+	struct eventqent *next;		/*!< Link while waiting for the dispatcher */
 	char eventdata[1];
 };
 
@@ -106,6 +110,9 @@ static const int DEFAULT_HTTPTIMEOUT 		= 60;	/*!< Default manager http timeout *
 static const int DEFAULT_BROKENEVENTSACTION	= 0;	/*!< Default setting for brokeneventsaction */
 static const int DEFAULT_AUTHTIMEOUT		= 30;	/*!< Default setting for authtimeout */
 static const int DEFAULT_AUTHLIMIT		= 50;	/*!< Default setting for authlimit */
+static const int DEFAULT_EVENTQUEUESIZE		= 1024;	/*!< Default setting for eventqueuesize */
+static const int DEFAULT_IOTHREADS		= 0;	/*!< Default setting for iothreads, a thread per session */
+static const int DEFAULT_ACTIONTHREADS		= 4;	/*!< Default setting for actionthreads */
 
 
 static int enabled;
@@ -117,14 +124,65 @@ static int httptimeout;
 static int broken_events_action;
 static int authtimeout;
 static int authlimit;
+static int eventqueuesize;
+static int iothreads;
+static int actionthreads;
 
 static pthread_t t;
 static int block_sockets;
 static int num_sessions;
 static int unauth_sessions = 0;
 
-/* Protected by the sessions list lock */
-struct eventqent *master_eventq = NULL;
+/*! Events manager_event() has queued for the dispatcher, newest first */
+static struct eventqent *pending_events;
+#ifndef HAVE_GCC_ATOMICS
+AST_MUTEX_DEFINE_STATIC(pending_lock);
+#endif
+/*! Written to when pending_events goes from empty to not empty */
+static int dispatcher_alert[2] = { -1, -1 };
+static pthread_t dispatcher_thread = AST_PTHREADT_NULL;
+/*! Events fanned out by the dispatcher, and session queue entries dropped */
+static unsigned int events_dispatched;
+static unsigned int events_dropped;
+
+/*! Most events a session writes with one writev() */
+#define EVENTQ_BATCH 64
+
+/*! Most event loop threads iothreads may ask for */
+#define MAX_IOTHREADS 32
+
+struct mansession_session;
+
+/*! \brief An event loop serving many TCP sessions from one thread
+ *
+ * Used instead of a thread per session when iothreads is set.  The loop
+ * reads and parses input for all of its sessions, and hands complete
+ * actions and pending events to the action threads, one job per session
+ * at a time so a session still sees its actions run in order.
+ */
+struct manager_ioloop {
+	/*! Protects sessions and the busy and closing flags of its members */
+	ast_mutex_t lock;
+	AST_LIST_HEAD_NOLOCK(, mansession_session) sessions;
+	int count;				/*!< Sessions served by this loop */
+	int alert[2];				/*!< Written to wake the loop */
+	int alerted;				/*!< A wakeup is already in the pipe */
+	pthread_t thread;
+};
+
+static struct manager_ioloop ioloops[MAX_IOTHREADS];
+static int ioloops_started;
+
+/*! \brief Work for an action thread */
+struct manager_job {
+	struct mansession_session *session;
+	struct message *m;			/*!< Action to run, or NULL to only send events */
+	AST_LIST_ENTRY(manager_job) list;
+};
+
+static AST_LIST_HEAD_STATIC(manager_jobs, manager_job);
+static ast_cond_t manager_jobs_cond;
+static int actionthreads_started;
 
 AST_THREADSTORAGE(manager_event_buf, manager_event_buf_init);
 #define MANAGER_EVENT_BUF_INITSIZE   256
@@ -223,8 +281,18 @@ struct mansession_session {
 	int inlen;
 	int send_events;
 	int displaysystemname;		/*!< Add system name to manager responses and events */
-	/* Queued events that we've not had the ability to send yet */
-	struct eventqent *eventq;
+	/*! Ring of queued events that we've not had the ability to send yet */
+	struct eventqent **eventq;
+	unsigned int eventq_size;	/*!< Slots in eventq, a power of two */
+	unsigned int eventq_head;	/*!< Count of events taken off eventq */
+	unsigned int eventq_tail;	/*!< Count of events put on eventq */
+	unsigned int eventq_dropped;	/*!< Events lost because eventq was full */
+	int eventq_overflow;		/*!< Dropping events until eventq drains */
+	struct manager_ioloop *ioloop;	/*!< Event loop serving us, NULL if we have our own thread */
+	struct message *inmsg;		/*!< Action the event loop is reading */
+	int busy;			/*!< An action thread is working for us */
+	int closing;			/*!< The event loop should end this session */
+	AST_LIST_ENTRY(mansession_session) ioloop_list;
 	/* Timeout for ast_carefulwrite() */
 	int writetimeout;
 	time_t authstart;
@@ -702,17 +770,25 @@ static int handle_showmanconn(int fd, int argc, char *argv[])
 /* Should change to "manager show connected" */
 static int handle_showmaneventq(int fd, int argc, char *argv[])
 {
-	struct eventqent *s;
+#define FORMAT "  %-15.15s  %-15.15s  %7s  %9s\n"
+#define FORMAT2 "  %-15.15s  %-15.15s  %7s  %9u\n"
+	struct mansession_session *s;
+	char depth[16];
 
+	ast_cli(fd, "Events dispatched: %u, dropped: %u\n", events_dispatched, events_dropped);
+	ast_cli(fd, FORMAT, "Username", "IP Address", "Queued", "Dropped");
 	AST_LIST_LOCK(&sessions);
-	for (s = master_eventq; s; s = s->next) {
-		ast_cli(fd, "Usecount: %d\n",s->usecount);
-		ast_cli(fd, "Category: %d\n", s->category);
-		ast_cli(fd, "Event:\n%s", s->eventdata);
+	AST_LIST_TRAVERSE(&sessions, s, list) {
+		ast_mutex_lock(&s->__lock);
+		snprintf(depth, sizeof(depth), "%u/%u", s->eventq_tail - s->eventq_head, s->eventq_size);
+		ast_cli(fd, FORMAT2, s->username, ast_inet_ntoa(s->sin.sin_addr), depth, s->eventq_dropped);
+		ast_mutex_unlock(&s->__lock);
 	}
 	AST_LIST_UNLOCK(&sessions);
 
 	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
 }
 
 static char showmancmd_help[] = 
@@ -730,8 +806,8 @@ static char showmanconn_help[] =
 
 static char showmaneventq_help[] = 
 "Usage: manager show eventq\n"
-"	Prints a listing of all events pending in the Asterisk manger\n"
-"event queue.\n";
+"	Prints how many events each Asterisk manager session has queued\n"
+"and how many it has dropped because it could not keep up.\n";
 
 static char showmanagers_help[] =
 "Usage: manager show users\n"
@@ -790,9 +866,49 @@ static struct ast_cli_entry cli_manager[] = {
 
 static void unuse_eventqent(struct eventqent *e)
 {
-	struct eventqent *next = e->next;
-	if (ast_atomic_dec_and_test(&e->usecount) && next)
-		pthread_kill(t, SIGURG);
+	if (ast_atomic_dec_and_test(&e->usecount))
+		free(e);
+}
+
+/*! \brief Allocate the event ring of a new session */
+static int session_eventq_alloc(struct mansession_session *s)
+{
+	unsigned int size = 16;
+
+	while (size < eventqueuesize && size < (1 << 20))
+		size <<= 1;
+	if (!(s->eventq = ast_calloc(size, sizeof(*s->eventq))))
+		return -1;
+	s->eventq_size = size;
+	return 0;
+}
+
+/*! \brief Take up to max events off the ring of a session
+ * \note The session lock must be held.  The caller owns the references taken.
+ */
+static int session_eventq_take(struct mansession_session *s, struct eventqent **events, int max)
+{
+	int count = 0;
+
+	while (count < max && s->eventq_head != s->eventq_tail)
+		events[count++] = s->eventq[s->eventq_head++ & (s->eventq_size - 1)];
+	if (s->eventq_head == s->eventq_tail && s->eventq_overflow) {
+		s->eventq_overflow = 0;
+		ast_log(LOG_NOTICE, "Manager '%s' from %s caught up, %u events dropped so far\n",
+			s->username, ast_inet_ntoa(s->sin.sin_addr), s->eventq_dropped);
+	}
+	return count;
+}
+
+static void message_free(struct message *m)
+{
+	unsigned int x;
+
+	if (!m)
+		return;
+	for (x = 0; x < m->hdrcount; x++)
+		free((char *) m->headers[x]);
+	free(m);
 }
 
 static void free_session(struct mansession_session *s)
@@ -800,13 +916,15 @@ static void free_session(struct mansession_session *s)
 	struct eventqent *eqe;
 	if (s->fd > -1)
 		close(s->fd);
+	message_free(s->inmsg);
 	if (s->outputstr)
 		free(s->outputstr);
 	ast_mutex_destroy(&s->__lock);
-	while (s->eventq) {
-		eqe = s->eventq;
-		s->eventq = s->eventq->next;
-		unuse_eventqent(eqe);
+	if (s->eventq) {
+		s->eventq_overflow = 0;
+		while (session_eventq_take(s, &eqe, 1))
+			unuse_eventqent(eqe);
+		free(s->eventq);
 	}
 	free(s);
 }
@@ -1368,7 +1486,7 @@ static int action_waitevent(struct mansession *s, const struct message *m)
 		ast_log(LOG_DEBUG, "Starting waiting for an event!\n");
 	for (x=0; ((x < timeout) || (timeout < 0)); x++) {
 		ast_mutex_lock(&s->session->__lock);
-		if (s->session->eventq && s->session->eventq->next)
+		if (s->session->eventq_head != s->session->eventq_tail)
 			needexit = 1;
 		if (s->session->waiting_thread != pthread_self())
 			needexit = 1;
@@ -1390,14 +1508,9 @@ static int action_waitevent(struct mansession *s, const struct message *m)
 	if (s->session->waiting_thread == pthread_self()) {
 		astman_send_response(s, m, "Success", "Waiting for Event...");
 		/* Only show events if we're the most recent waiter */
-		while(s->session->eventq->next) {
-			eqe = s->session->eventq->next;
-			if (((s->session->readperm & eqe->category) == eqe->category) &&
-			    ((s->session->send_events & eqe->category) == eqe->category)) {
-				astman_append(s, "%s", eqe->eventdata);
-			}
-			unuse_eventqent(s->session->eventq);
-			s->session->eventq = eqe;
+		while (session_eventq_take(s->session, &eqe, 1)) {
+			astman_append(s, "%s", eqe->eventdata);
+			unuse_eventqent(eqe);
 		}
 		astman_append(s,
 			"Event: WaitEventComplete\r\n"
@@ -2214,29 +2327,45 @@ static int action_timeout(struct mansession *s, const struct message *m)
 	return 0;
 }
 
+/*! \brief Send the events the dispatcher queued for this session
+ *
+ * Events are taken off the ring in batches under the session lock and
+ * written without it, so the dispatcher never waits on a slow client.
+ */
 static int process_events(struct mansession *s)
 {
-	struct eventqent *eqe;
+	struct eventqent *events[EVENTQ_BATCH];
+	struct iovec iov[EVENTQ_BATCH];
+	int count, x, rounds;
 	int ret = 0;
-	ast_mutex_lock(&s->session->__lock);
-	if (!s->session->eventq)
-		s->session->eventq = master_eventq;
-	while(s->session->eventq->next) {
-		eqe = s->session->eventq->next;
-		if ((s->session->authenticated && (s->session->readperm & eqe->category) == eqe->category) &&
-				   ((s->session->send_events & eqe->category) == eqe->category)) {
-			if (s->fd > -1) {
-				if (!ret && ast_carefulwrite(s->fd, eqe->eventdata, strlen(eqe->eventdata), s->session->writetimeout) < 0)
+
+	/* Don't let a busy event stream starve the session of its input */
+	for (rounds = s->session->eventq_size / EVENTQ_BATCH + 1; rounds; rounds--) {
+		ast_mutex_lock(&s->session->__lock);
+		count = session_eventq_take(s->session, events, EVENTQ_BATCH);
+		if (count && s->fd < 0) {
+			/* No file to write to, keep them for the next HTTP response */
+			for (x = 0; x < count && !ret; x++) {
+				if (!s->session->outputstr && !(s->session->outputstr = ast_calloc(1, sizeof(*s->session->outputstr))))
 					ret = -1;
-			} else if (!s->session->outputstr && !(s->session->outputstr = ast_calloc(1, sizeof(*s->session->outputstr)))) 
+				else
+					ast_dynamic_str_append(&s->session->outputstr, 0, "%s", events[x]->eventdata);
+			}
+		}
+		ast_mutex_unlock(&s->session->__lock);
+		if (!count)
+			break;
+		if (s->fd > -1 && !ret) {
+			for (x = 0; x < count; x++) {
+				iov[x].iov_base = events[x]->eventdata;
+				iov[x].iov_len = events[x]->len;
+			}
+			if (ast_carefulwritev(s->fd, iov, count, s->session->writetimeout) < 0)
 				ret = -1;
-			else 
-				ast_dynamic_str_append(&s->session->outputstr, 0, "%s", eqe->eventdata);
 		}
-		unuse_eventqent(s->session->eventq);
-		s->session->eventq = eqe;
+		for (x = 0; x < count; x++)
+			unuse_eventqent(events[x]);
 	}
-	ast_mutex_unlock(&s->session->__lock);
 	return ret;
 }
 
@@ -2361,14 +2490,13 @@ static int process_message(struct mansession *s, const struct message *m)
 	return process_events(s);
 }
 
-static int get_input(struct mansession_session *s, char *output)
+/*! \brief Take one complete line off the input buffer of a session
+ * \return 1 if output holds a line, 0 if more input is needed
+ */
+static int get_line(struct mansession_session *s, char *output)
 {
 	/* output must have at least sizeof(s->inbuf) space */
-	int res;
 	int x;
-	struct pollfd fds[1];
-	int timeout = -1;
-	time_t now;
 	for (x = 1; x < s->inlen; x++) {
 		if ((s->inbuf[x] == '\n') && (s->inbuf[x-1] == '\r')) {
 			/* Copy output data up to and including \r\n */
@@ -2385,6 +2513,19 @@ static int get_input(struct mansession_session *s, char *output)
 		ast_log(LOG_WARNING, "Dumping long line with no return from %s: %s\n", ast_inet_ntoa(s->sin.sin_addr), s->inbuf);
 		s->inlen = 0;
 	}
+	return 0;
+}
+
+static int get_input(struct mansession_session *s, char *output)
+{
+	/* output must have at least sizeof(s->inbuf) space */
+	int res;
+	struct pollfd fds[1];
+	int timeout = -1;
+	time_t now;
+
+	if (get_line(s, output))
+		return 1;
 	fds[0].fd = s->fd;
 	fds[0].events = POLLIN;
 
@@ -2449,7 +2590,7 @@ static int do_message(struct mansession *s)
 
 	for (;;) {
 		/* Check if any events are pending and do them if needed */
-		if (s->session->eventq->next) {
+		if (s->session->eventq_head != s->session->eventq_tail) {
 			if (process_events(s))
 				return -1;
 		}
@@ -2482,6 +2623,8 @@ static int do_message(struct mansession *s)
 	}
 }
 
+static void session_end(struct mansession_session *session);
+
 static void *session_do(void *data)
 {
 	struct mansession_session *session = data;
@@ -2493,6 +2636,20 @@ static void *session_do(void *data)
 		if ((res = do_message(&s)) < 0)
 			break;
 	}
+
+	/* At one point there was a usleep(1) here intended to allow the call
+	 * to ast_pthread_create_background() to complete before this thread
+	 * exited. This should no longer be necessary as the thread id is no
+	 * longer stored in the mansessions_session.
+	 */
+
+	session_end(session);
+	return NULL;
+}
+
+/*! \brief Log the end of a TCP session and destroy it */
+static void session_end(struct mansession_session *session)
+{
 	if (session->authenticated) {
 		if (option_verbose > 1) {
 			if (displayconnects) 
@@ -2508,22 +2665,324 @@ static void *session_do(void *data)
 		ast_log(LOG_EVENT, "Failed attempt from %s\n", ast_inet_ntoa(session->sin.sin_addr));
 	}
 
-	/* At one point there was a usleep(1) here intended to allow the call
-	 * to ast_pthread_create_background() to complete before this thread
-	 * exited. This should no longer be necessary as the thread id is no
-	 * longer stored in the mansessions_session.
-	 */
-
 	destroy_session(session);
+}
+
+static void ioloop_wake(struct manager_ioloop *loop)
+{
+	if (!ast_atomic_fetchadd_int(&loop->alerted, 1) && write(loop->alert[1], "x", 1) < 0 && errno != EAGAIN)
+		ast_log(LOG_WARNING, "Unable to wake manager event loop: %s\n", strerror(errno));
+}
+
+/*! \brief Run a job for an event loop session, then hand the session back to its loop */
+static void manager_job_run(struct manager_job *job)
+{
+	struct mansession s = { .session = job->session, .fd = job->session->fd };
+	struct manager_ioloop *loop = job->session->ioloop;
+	int res;
+
+	if (job->m)
+		res = process_message(&s, job->m);
+	else
+		res = process_events(&s);
+
+	ast_mutex_lock(&loop->lock);
+	job->session->busy = 0;
+	if (res)
+		job->session->closing = 1;
+	ast_mutex_unlock(&loop->lock);
+	ioloop_wake(loop);
+
+	message_free(job->m);
+	free(job);
+}
+
+/*! \brief Thread for a single job that may block */
+static void *manager_job_thread(void *data)
+{
+	manager_job_run(data);
 	return NULL;
 }
 
+/*! \brief Whether an action can wait for a long time
+ * Such an action would tie up one of the few action threads, and enough of
+ * them would stall every event loop session, so it gets its own thread.
+ */
+static int action_may_block(struct mansession_session *s, const struct message *m)
+{
+	const char *action = astman_get_header(m, "Action");
+
+	/* A failed Login sleeps before it answers */
+	if (!s->authenticated && !strcasecmp(action, "Login"))
+		return 1;
+	if (!strcasecmp(action, "WaitEvent"))
+		return 1;
+	/* A synchronous Originate waits for the call to be answered */
+	if (!strcasecmp(action, "Originate") && !ast_true(astman_get_header(m, "Async")))
+		return 1;
+	return 0;
+}
+
+/*! \brief Parse the buffered input of an idle session and queue any work it has
+ * \note The loop lock must be held.
+ * \return 0 on success, -1 if the session should be ended
+ */
+static int ioloop_schedule(struct mansession_session *s)
+{
+	char header_buf[sizeof(s->inbuf)];
+	struct message *m = NULL;
+	struct manager_job *job;
+
+	while (get_line(s, header_buf)) {
+		/* Strip trailing \r\n */
+		if (strlen(header_buf) < 2)
+			continue;
+		header_buf[strlen(header_buf) - 2] = '\0';
+		if (!s->inmsg && !(s->inmsg = ast_calloc(1, sizeof(*s->inmsg))))
+			return -1;
+		if (ast_strlen_zero(header_buf)) {
+			m = s->inmsg;
+			s->inmsg = NULL;
+			break;
+		} else if (s->inmsg->hdrcount < (AST_MAX_MANHEADERS - 1)) {
+			if (!(s->inmsg->headers[s->inmsg->hdrcount] = ast_strdup(header_buf)))
+				return -1;
+			s->inmsg->hdrcount++;
+		}
+	}
+
+	if (!m && s->eventq_head == s->eventq_tail)
+		return 0;
+	if (!(job = ast_calloc(1, sizeof(*job)))) {
+		message_free(m);
+		return -1;
+	}
+	job->session = s;
+	job->m = m;
+	s->busy = 1;
+
+	if (m && action_may_block(s, m)) {
+		pthread_attr_t attr;
+		pthread_t thread;
+		int res;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		res = ast_pthread_create_background(&thread, &attr, manager_job_thread, job);
+		pthread_attr_destroy(&attr);
+		if (!res)
+			return 0;
+		/* Better late than never, let the action threads have it */
+	}
+
+	AST_LIST_LOCK(&manager_jobs);
+	AST_LIST_INSERT_TAIL(&manager_jobs, job, list);
+	ast_cond_signal(&manager_jobs_cond);
+	AST_LIST_UNLOCK(&manager_jobs);
+
+	return 0;
+}
+
+static void *ioloop_thread(void *data)
+{
+	struct manager_ioloop *loop = data;
+	struct mansession_session *s, **polled = NULL;
+	struct pollfd *fds = NULL;
+	AST_LIST_HEAD_NOLOCK(, mansession_session) ended;
+	int maxfds = 0, nfds, timeout, res, x;
+	char buf[64];
+	time_t now;
+
+	for (;;) {
+		loop->alerted = 0;
+		while (read(loop->alert[0], buf, sizeof(buf)) > 0)
+			;
+
+		AST_LIST_HEAD_INIT_NOLOCK(&ended);
+		time(&now);
+		timeout = -1;
+
+		ast_mutex_lock(&loop->lock);
+		if (maxfds < loop->count + 1) {
+			free(fds);
+			free(polled);
+			maxfds = loop->count + 16;
+			fds = ast_calloc(maxfds, sizeof(*fds));
+			polled = ast_calloc(maxfds, sizeof(*polled));
+			if (!fds || !polled) {
+				ast_mutex_unlock(&loop->lock);
+				/* Try again in a moment */
+				maxfds = 0;
+				usleep(100000);
+				continue;
+			}
+		}
+		fds[0].fd = loop->alert[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&loop->sessions, s, ioloop_list) {
+			if (s->busy)
+				continue;
+			if (!s->closing && !s->authenticated && now - s->authstart > authtimeout) {
+				ast_log(LOG_EVENT, "Client from %s, failed to authenticate in %d seconds\n", ast_inet_ntoa(s->sin.sin_addr), authtimeout);
+				s->closing = 1;
+			}
+			if (!s->closing && ioloop_schedule(s))
+				s->closing = 1;
+			if (s->closing) {
+				AST_LIST_REMOVE_CURRENT(&loop->sessions, ioloop_list);
+				loop->count--;
+				AST_LIST_INSERT_TAIL(&ended, s, ioloop_list);
+				continue;
+			}
+			if (s->busy)
+				continue;
+			if (!s->authenticated)
+				timeout = 1000;
+			fds[nfds].fd = s->fd;
+			fds[nfds].events = POLLIN;
+			polled[nfds] = s;
+			nfds++;
+		}
+		AST_LIST_TRAVERSE_SAFE_END
+		ast_mutex_unlock(&loop->lock);
+
+		while ((s = AST_LIST_REMOVE_HEAD(&ended, ioloop_list)))
+			session_end(s);
+
+		if ((res = ast_poll(fds, nfds, timeout)) < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				ast_log(LOG_WARNING, "Poll returned error: %s\n", strerror(errno));
+			continue;
+		}
+		/* Sessions we polled are idle, so nothing else touches their input */
+		for (x = 1; res > 0 && x < nfds; x++) {
+			if (!fds[x].revents)
+				continue;
+			res--;
+			s = polled[x];
+			if ((fds[x].revents & POLLIN) || !(fds[x].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+				int len = read(s->fd, s->inbuf + s->inlen, sizeof(s->inbuf) - 1 - s->inlen);
+				if (len > 0) {
+					s->inlen += len;
+					s->inbuf[s->inlen] = '\0';
+					continue;
+				} else if (len < 0 && (errno == EINTR || errno == EAGAIN))
+					continue;
+			}
+			ast_mutex_lock(&loop->lock);
+			s->closing = 1;
+			ast_mutex_unlock(&loop->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static void *action_thread(void *ignore)
+{
+	struct manager_job *job;
+
+	for (;;) {
+		AST_LIST_LOCK(&manager_jobs);
+		while (!(job = AST_LIST_REMOVE_HEAD(&manager_jobs, list)))
+			ast_cond_wait(&manager_jobs_cond, &manager_jobs.lock);
+		AST_LIST_UNLOCK(&manager_jobs);
+
+		manager_job_run(job);
+	}
+
+	return NULL;
+}
+
+/*! \brief Start event loop and action threads up to the configured counts
+ *
+ * Threads are never stopped, so lowering the counts on reload only stops
+ * new sessions from being given to the extra event loops.
+ */
+static void manager_ioloops_start(void)
+{
+	struct manager_ioloop *loop;
+	pthread_t thread;
+	int flags;
+
+	if (!iothreads)
+		return;
+
+	while (ioloops_started < iothreads && ioloops_started < MAX_IOTHREADS) {
+		loop = &ioloops[ioloops_started];
+		if (pipe(loop->alert)) {
+			ast_log(LOG_WARNING, "Unable to create manager event loop pipe: %s\n", strerror(errno));
+			break;
+		}
+		flags = fcntl(loop->alert[0], F_GETFL);
+		fcntl(loop->alert[0], F_SETFL, flags | O_NONBLOCK);
+		flags = fcntl(loop->alert[1], F_GETFL);
+		fcntl(loop->alert[1], F_SETFL, flags | O_NONBLOCK);
+		ast_mutex_init(&loop->lock);
+		AST_LIST_HEAD_INIT_NOLOCK(&loop->sessions);
+		if (ast_pthread_create_background(&loop->thread, NULL, ioloop_thread, loop)) {
+			ast_log(LOG_WARNING, "Unable to start manager event loop thread\n");
+			ast_mutex_destroy(&loop->lock);
+			close(loop->alert[0]);
+			close(loop->alert[1]);
+			break;
+		}
+		ioloops_started++;
+	}
+
+	if (!actionthreads_started)
+		ast_cond_init(&manager_jobs_cond, NULL);
+	while (actionthreads_started < actionthreads) {
+		if (ast_pthread_create_background(&thread, NULL, action_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start manager action thread\n");
+			break;
+		}
+		actionthreads_started++;
+	}
+}
+
+/*! \brief Hand a new TCP session to the least busy event loop
+ * \return 0 on success, -1 if the session needs a thread of its own
+ */
+static int ioloop_add(struct mansession_session *s)
+{
+	struct manager_ioloop *loop = NULL;
+	int x, flags, loops = iothreads;
+
+	if (loops > ioloops_started)
+		loops = ioloops_started;
+	if (!loops || !actionthreads_started)
+		return -1;
+	for (x = 0; x < loops; x++) {
+		if (!loop || ioloops[x].count < loop->count)
+			loop = &ioloops[x];
+	}
+
+	/* The loop must never block on a read */
+	flags = fcntl(s->fd, F_GETFL);
+	fcntl(s->fd, F_SETFL, flags | O_NONBLOCK);
+
+	{
+		struct mansession ms = { .session = s, .fd = s->fd };
+		astman_append(&ms, "Asterisk Call Manager/1.0\r\n");
+	}
+
+	ast_mutex_lock(&loop->lock);
+	s->ioloop = loop;
+	AST_LIST_INSERT_TAIL(&loop->sessions, s, ioloop_list);
+	loop->count++;
+	ast_mutex_unlock(&loop->lock);
+	ioloop_wake(loop);
+
+	return 0;
+}
+
 static void *accept_thread(void *ignore)
 {
 	int as;
 	struct sockaddr_in sin;
 	socklen_t sinlen;
-	struct eventqent *eqe;
 	struct mansession_session *s;
 	struct protoent *p;
 	int arg = 1;
@@ -2552,14 +3011,6 @@ static void *accept_thread(void *ignore)
 			}
 		}
 		AST_LIST_TRAVERSE_SAFE_END
-		/* Purge master event queue of old, unused events, but make sure we
-		   always keep at least one in the queue */
-		eqe = master_eventq;
-		while (master_eventq->next && !master_eventq->usecount) {
-			eqe = master_eventq;
-			master_eventq = master_eventq->next;
-			free(eqe);
-		}
 		AST_LIST_UNLOCK(&sessions);
 
 		sinlen = sizeof(sin);
@@ -2594,6 +3045,13 @@ static void *accept_thread(void *ignore)
 			continue;
 		}
 
+		if (session_eventq_alloc(s)) {
+			free(s);
+			close(as);
+			ast_atomic_fetchadd_int(&unauth_sessions, -1);
+			continue;
+		}
+
 		memcpy(&s->sin, &sin, sizeof(sin));
 		s->writetimeout = 100;
 		s->waiting_thread = AST_PTHREADT_NULL;
@@ -2612,12 +3070,6 @@ static void *accept_thread(void *ignore)
 		AST_LIST_LOCK(&sessions);
 		AST_LIST_INSERT_HEAD(&sessions, s, list);
 		num_sessions++;
-		/* Find the last place in the master event queue and hook ourselves
-		   in there */
-		s->eventq = master_eventq;
-		while(s->eventq->next)
-			s->eventq = s->eventq->next;
-		ast_atomic_fetchadd_int(&s->eventq->usecount, 1);
 		AST_LIST_UNLOCK(&sessions);
 		if(time(&s->authstart) == -1) {
 			ast_log(LOG_ERROR, "error executing time(): %s; disconnecting client\n", strerror(errno));
@@ -2625,6 +3077,8 @@ static void *accept_thread(void *ignore)
 			destroy_session(s);
 			continue;
 		}
+		if (!ioloop_add(s))
+			continue;
 		if (ast_pthread_create_background(&t, &attr, session_do, s)) {
 			ast_atomic_fetchadd_int(&unauth_sessions, -1);
 			destroy_session(s);
@@ -2634,36 +3088,155 @@ static void *accept_thread(void *ignore)
 	return NULL;
 }
 
+/*! \brief Queue a formatted event for the dispatcher
+ *
+ * This is called from whatever thread generated the event, so it must not
+ * block: the event is pushed onto a lock free stack and the dispatcher is
+ * only woken when the stack was empty.
+ */
 static int append_event(const char *str, int category)
 {
-	struct eventqent *tmp, *prev = NULL;
-	tmp = ast_malloc(sizeof(*tmp) + strlen(str));
+	struct eventqent *tmp, *prev;
+	int len = strlen(str);
 
-	if (!tmp)
+	if (!(tmp = ast_malloc(sizeof(*tmp) + len)))
 		return -1;
 
-	tmp->next = NULL;
+	tmp->usecount = 1;
 	tmp->category = category;
-	strcpy(tmp->eventdata, str);
-	
-	if (master_eventq) {
-		prev = master_eventq;
-		while (prev->next) 
-			prev = prev->next;
-		prev->next = tmp;
-	} else {
-		master_eventq = tmp;
+	tmp->len = len;
+	memcpy(tmp->eventdata, str, len + 1);
+
+#ifdef HAVE_GCC_ATOMICS
+	do {
+		prev = pending_events;
+		tmp->next = prev;
+	} while (!__sync_bool_compare_and_swap(&pending_events, prev, tmp));
+#else
+	ast_mutex_lock(&pending_lock);
+	prev = pending_events;
+	tmp->next = prev;
+	pending_events = tmp;
+	ast_mutex_unlock(&pending_lock);
+#endif
+
+	if (!prev && dispatcher_alert[1] > -1) {
+		/* A full pipe already has a wakeup in it */
+		if (write(dispatcher_alert[1], "x", 1) < 0 && errno != EAGAIN)
+			ast_log(LOG_WARNING, "Unable to wake the manager event dispatcher: %s\n", strerror(errno));
 	}
-	
-	tmp->usecount = num_sessions;
-	
+
 	return 0;
 }
 
+/*! \brief Take every event queued by append_event(), oldest first */
+static struct eventqent *take_events(void)
+{
+	struct eventqent *cur, *next, *events = NULL;
+
+#ifdef HAVE_GCC_ATOMICS
+	cur = __sync_lock_test_and_set(&pending_events, NULL);
+#else
+	ast_mutex_lock(&pending_lock);
+	cur = pending_events;
+	pending_events = NULL;
+	ast_mutex_unlock(&pending_lock);
+#endif
+
+	/* The stack is newest first, put it back in order */
+	for (; cur; cur = next) {
+		next = cur->next;
+		cur->next = events;
+		events = cur;
+	}
+
+	return events;
+}
+
+/*! \brief Copy a batch of events into the ring of every session that wants them
+ * \note The sessions list must be locked.
+ */
+static void dispatch_events(struct eventqent *events)
+{
+	struct mansession_session *s;
+	struct eventqent *eqe;
+	int queued;
+
+	AST_LIST_TRAVERSE(&sessions, s, list) {
+		queued = 0;
+		ast_mutex_lock(&s->__lock);
+		for (eqe = events; eqe; eqe = eqe->next) {
+			if (!s->authenticated || (s->readperm & eqe->category) != eqe->category ||
+			    (s->send_events & eqe->category) != eqe->category)
+				continue;
+			if (s->eventq_tail - s->eventq_head >= s->eventq_size) {
+				s->eventq_dropped++;
+				events_dropped++;
+				if (!s->eventq_overflow) {
+					s->eventq_overflow = 1;
+					ast_log(LOG_WARNING, "Manager '%s' from %s is not keeping up, dropping events\n",
+						s->username, ast_inet_ntoa(s->sin.sin_addr));
+				}
+				continue;
+			}
+			ast_atomic_fetchadd_int(&eqe->usecount, 1);
+			s->eventq[s->eventq_tail++ & (s->eventq_size - 1)] = eqe;
+			queued = 1;
+		}
+		if (queued) {
+			/* Wake the session once for the whole batch */
+			if (s->waiting_thread != AST_PTHREADT_NULL)
+				pthread_kill(s->waiting_thread, SIGURG);
+			else if (s->ioloop)
+				ioloop_wake(s->ioloop);
+			else
+				/* We have an event to process, but the mansession is
+				 * not waiting for it. We still need to indicate that there
+				 * is an event waiting so that get_input processes the pending
+				 * event instead of polling.
+				 */
+				s->pending_event = 1;
+		}
+		ast_mutex_unlock(&s->__lock);
+	}
+}
+
+static void *event_dispatcher(void *ignore)
+{
+	struct pollfd pfd = {
+		.fd = dispatcher_alert[0],
+		.events = POLLIN,
+	};
+	struct eventqent *events, *next;
+	char buf[64];
+
+	/* Look before the first wait: events queued before the pipe existed
+	   sent no wakeup, and the ones after them only wake an empty stack */
+	for (;;) {
+		if ((events = take_events())) {
+			AST_LIST_LOCK(&sessions);
+			dispatch_events(events);
+			AST_LIST_UNLOCK(&sessions);
+
+			for (; events; events = next) {
+				next = events->next;
+				events_dispatched++;
+				unuse_eventqent(events);
+			}
+		}
+
+		if (ast_poll(&pfd, 1, -1) < 1)
+			continue;
+		while (read(dispatcher_alert[0], buf, sizeof(buf)) > 0)
+			;
+	}
+
+	return NULL;
+}
+
 /*! \brief  manager_event: Send AMI event to client */
 int manager_event(int category, const char *event, const char *fmt, ...)
 {
-	struct mansession_session *s;
 	char auth[80];
 	va_list ap;
 	struct timeval now;
@@ -2693,25 +3266,8 @@ int manager_event(int category, const char *event, const char *fmt, ...)
 	
 	ast_dynamic_str_thread_append(&buf, 0, &manager_event_buf, "\r\n");	
 	
-	/* Append event to master list and wake up any sleeping sessions */
-	AST_LIST_LOCK(&sessions);
-	append_event(buf->str, category);
-	AST_LIST_TRAVERSE(&sessions, s, list) {
-		ast_mutex_lock(&s->__lock);
-		if (s->waiting_thread != AST_PTHREADT_NULL)
-			pthread_kill(s->waiting_thread, SIGURG);
-		else
-			/* We have an event to process, but the mansession is
-			 * not waiting for it. We still need to indicate that there
-			 * is an event waiting so that get_input processes the pending
-			 * event instead of polling.
-			 */
-			s->pending_event = 1;
-		ast_mutex_unlock(&s->__lock);
-	}
-	AST_LIST_UNLOCK(&sessions);
-
-	return 0;
+	/* Hand the event to the dispatcher, which wakes any sleeping sessions */
+	return append_event(buf->str, category);
 }
 
 int ast_manager_unregister(char *action) 
@@ -2910,6 +3466,11 @@ static char *generic_http_callback(int format, struct sockaddr_in *requestor, co
 			*status = 500;
 			goto generic_callback_out;
 		}
+		if (session_eventq_alloc(s)) {
+			free(s);
+			*status = 500;
+			goto generic_callback_out;
+		}
 		memcpy(&s->sin, requestor, sizeof(s->sin));
 		s->fd = -1;
 		s->waiting_thread = AST_PTHREADT_NULL;
@@ -2925,11 +3486,6 @@ static char *generic_http_callback(int format, struct sockaddr_in *requestor, co
 		while ((s->managerid = rand() ^ (unsigned long) s) == 0);
 		AST_LIST_LOCK(&sessions);
 		AST_LIST_INSERT_HEAD(&sessions, s, list);
-		/* Hook into the last spot in the event queue */
-		s->eventq = master_eventq;
-		while (s->eventq->next)
-			s->eventq = s->eventq->next;
-		ast_atomic_fetchadd_int(&s->eventq->usecount, 1);
 		ast_atomic_fetchadd_int(&num_sessions, 1);
 		AST_LIST_UNLOCK(&sessions);
 	}
@@ -3164,8 +3720,25 @@ int init_manager(void)
 		ast_cli_register_multiple(cli_manager, sizeof(cli_manager) / sizeof(struct ast_cli_entry));
 		ast_extension_state_add(NULL, NULL, manager_state_cb, NULL);
 		registered = 1;
-		/* Append placeholder event so master_eventq never runs dry */
-		append_event("Event: Placeholder\r\n\r\n", 0);
+	}
+
+	if (dispatcher_thread == AST_PTHREADT_NULL) {
+		if (pipe(dispatcher_alert)) {
+			ast_log(LOG_ERROR, "Unable to create manager event dispatcher pipe: %s\n", strerror(errno));
+			return -1;
+		}
+		flags = fcntl(dispatcher_alert[0], F_GETFL);
+		fcntl(dispatcher_alert[0], F_SETFL, flags | O_NONBLOCK);
+		flags = fcntl(dispatcher_alert[1], F_GETFL);
+		fcntl(dispatcher_alert[1], F_SETFL, flags | O_NONBLOCK);
+		if (ast_pthread_create_background(&dispatcher_thread, NULL, event_dispatcher, NULL)) {
+			ast_log(LOG_ERROR, "Unable to start manager event dispatcher thread\n");
+			close(dispatcher_alert[0]);
+			close(dispatcher_alert[1]);
+			dispatcher_alert[0] = dispatcher_alert[1] = -1;
+			dispatcher_thread = AST_PTHREADT_NULL;
+			return -1;
+		}
 	}
 
 	portno = DEFAULT_MANAGER_PORT;
@@ -3176,6 +3749,9 @@ int init_manager(void)
 	httptimeout = DEFAULT_HTTPTIMEOUT;
 	authtimeout = DEFAULT_AUTHTIMEOUT;
 	authlimit = DEFAULT_AUTHLIMIT;
+	eventqueuesize = DEFAULT_EVENTQUEUESIZE;
+	iothreads = DEFAULT_IOTHREADS;
+	actionthreads = DEFAULT_ACTIONTHREADS;
 
 	cfg = ast_config_load("manager.conf");
 	if (!cfg) {
@@ -3233,6 +3809,36 @@ int init_manager(void)
 		}
 	}
 
+	if ((val = ast_variable_retrieve(cfg, "general", "eventqueuesize"))) {
+		int size = atoi(val);
+
+		if (size < 1) {
+			ast_log(LOG_WARNING, "Invalid eventqueuesize value '%s', using default value\n", val);
+		} else {
+			eventqueuesize = size;
+		}
+	}
+
+	if ((val = ast_variable_retrieve(cfg, "general", "iothreads"))) {
+		if (sscanf(val, "%30d", &iothreads) != 1 || iothreads < 0) {
+			ast_log(LOG_WARNING, "Invalid iothreads value '%s', using default value\n", val);
+			iothreads = DEFAULT_IOTHREADS;
+		} else if (iothreads > MAX_IOTHREADS) {
+			ast_log(LOG_WARNING, "iothreads may not be more than %d\n", MAX_IOTHREADS);
+			iothreads = MAX_IOTHREADS;
+		}
+	}
+
+	if ((val = ast_variable_retrieve(cfg, "general", "actionthreads"))) {
+		if (sscanf(val, "%30d", &actionthreads) != 1 || actionthreads < 1) {
+			ast_log(LOG_WARNING, "Invalid actionthreads value '%s', using default value\n", val);
+			actionthreads = DEFAULT_ACTIONTHREADS;
+		}
+	}
+
+	if (enabled)
+		manager_ioloops_start();
+
 	memset(&ba, 0, sizeof(ba));
 	ba.sin_family = AF_INET;
 	ba.sin_port = htons(portno);
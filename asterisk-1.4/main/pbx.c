@@ -127,6 +127,8 @@ struct ast_exten {
 	struct ast_exten *peer;		/*!< Next higher priority with our extension */
 	const char *registrar;		/*!< Registrar */
 	struct ast_exten *next;		/*!< Extension with a greater ID */
+	unsigned int order;		/*!< Position in the context, used by the extension trie */
+	struct subst_template *subst;	/*!< Data cut into text and variables, set before the extension is added */
 	char stuff[0];
 };
 
@@ -163,6 +165,10 @@ struct ast_context {
 	ast_mutex_t lock; 			/*!< A lock to prevent multiple threads from clobbering the context */
 	struct ast_exten *root;			/*!< The root of the list of extensions */
 	struct ast_context *next;		/*!< Link them together */
+	struct ast_context *hash_next;		/*!< Next context in the same bucket of the name hash */
+	unsigned int hash;			/*!< ast_str_case_hash() of the name */
+	int published;				/*!< On the contexts list; until then it belongs to the reload building it */
+	struct ext_trie *trie;			/*!< Index of the extensions, built on the first lookup */
 	struct ast_include *includes;		/*!< Include other contexts */
 	struct ast_ignorepat *ignorepats;	/*!< Patterns for which to continue playing dialtone */
 	const char *registrar;			/*!< Registrar */
@@ -505,6 +511,17 @@ static struct ast_context *contexts;
  */
 AST_MUTEX_DEFINE_STATIC(conlock);
 
+#ifdef LOW_MEMORY
+#define CONTEXT_BUCKETS 17
+#else
+#define CONTEXT_BUCKETS 563
+#endif
+
+/*! \brief Hash of the contexts by name, protected by conlock.
+ * Each chain keeps the order of the contexts list, so a lookup finds the
+ * same context a walk of the list would. */
+static struct ast_context *context_buckets[CONTEXT_BUCKETS];
+
 static AST_LIST_HEAD_STATIC(apps, ast_app);
 
 static AST_LIST_HEAD_STATIC(switches, ast_switch);
@@ -922,17 +939,72 @@ int ast_extension_close(const char *pattern, const char *data, int needmore)
 	return extension_match_core(pattern, data, needmore);
 }
 
-struct ast_context *ast_context_find(const char *name)
+/*! \brief Add a context to the head of its chain, as it was just
+ * put at the head of the contexts list.  Called with conlock held. */
+static void context_link(struct ast_context *con)
 {
-	struct ast_context *tmp = NULL;
+	struct ast_context **bucket = &context_buckets[con->hash % CONTEXT_BUCKETS];
 
-	ast_rdlock_contexts();
+	con->hash_next = *bucket;
+	*bucket = con;
+	con->published = 1;
+}
+
+/*! \brief Remove a context from the name hash.  Called with conlock held. */
+static void context_unlink(struct ast_context *con)
+{
+	struct ast_context **c = &context_buckets[con->hash % CONTEXT_BUCKETS];
+
+	for (; *c; c = &(*c)->hash_next) {
+		if (*c == con) {
+			*c = con->hash_next;
+			break;
+		}
+	}
+	con->hash_next = NULL;
+}
+
+/*! \brief Rebuild the name hash from the contexts list, after contexts
+ * were merged into it.  Called with conlock held. */
+static void context_rehash(void)
+{
+	struct ast_context **tails[CONTEXT_BUCKETS];
+	struct ast_context *con;
+	int x;
 
-	while ( (tmp = ast_walk_contexts(tmp)) ) {
-		if (!name || !strcasecmp(name, tmp->name))
+	for (x = 0; x < CONTEXT_BUCKETS; x++) {
+		context_buckets[x] = NULL;
+		tails[x] = &context_buckets[x];
+	}
+	for (con = contexts; con; con = con->next) {
+		x = con->hash % CONTEXT_BUCKETS;
+		con->hash_next = NULL;
+		*tails[x] = con;
+		tails[x] = &con->hash_next;
+		con->published = 1;
+	}
+}
+
+/*! \brief Find the first context in the list with the given name,
+ * case sensitive or not.  Called with conlock held. */
+static struct ast_context *find_context(const char *name, int nocase)
+{
+	unsigned int hash = ast_str_case_hash(name);
+	struct ast_context *con = context_buckets[hash % CONTEXT_BUCKETS];
+
+	for (; con; con = con->hash_next) {
+		if (con->hash == hash && !(nocase ? strcasecmp(con->name, name) : strcmp(con->name, name)))
 			break;
 	}
+	return con;
+}
+
+struct ast_context *ast_context_find(const char *name)
+{
+	struct ast_context *tmp;
 
+	ast_rdlock_contexts();
+	tmp = name ? find_context(name, 1) : contexts;
 	ast_unlock_contexts();
 
 	return tmp;
@@ -971,6 +1043,433 @@ struct pbx_find_info {
 	const char *foundcontext;       /* set on return */
 };
 
+/*
+ * The extension trie.
+ *
+ * Each context keeps an index of its extensions (the heads of the priority
+ * lists) in a trie with one level per character of the extension.  A
+ * lookup walks the trie to collect the extensions that may match, then
+ * checks only those with extension_match_core(), in the order of the
+ * context list, so the result is exactly what a scan of the list gives.
+ * Collection is generous: '-' is skipped anywhere in the data, characters
+ * are compared without case, and a pattern the trie cannot describe is
+ * always a candidate.
+ *
+ * The trie is built on the first lookup in the context, and kept up to
+ * date as extensions are added and removed.  It is protected by conlock.
+ */
+
+/*! Number of slots between the positions given to consecutive extensions,
+ * to leave room for the extensions added later */
+#define EXT_ORDER_GAP	1024
+/*! Candidates that fit on the stack of pbx_find_extension() */
+#define EXT_CANDIDATES	32
+
+enum ext_node_kind {
+	EXT_NODE_CHAR,		/*!< One character, in lower case */
+	EXT_NODE_SET,		/*!< A set of characters: N, X, Z or [...] */
+	EXT_NODE_ANY,		/*!< '.', always the last element of a pattern */
+	EXT_NODE_EARLY,		/*!< '!', always the last element of a pattern */
+};
+
+/*! \brief One element of an extension */
+struct ext_elem {
+	unsigned char kind;
+	unsigned char c;
+	unsigned char set[32];
+};
+
+struct ext_node {
+	unsigned char kind;
+	unsigned char c;		/*!< EXT_NODE_CHAR: the character */
+	unsigned char *set;		/*!< EXT_NODE_SET: bitmap of the characters */
+	struct ext_node *children;
+	struct ext_node *next;		/*!< Next child of the same parent */
+	struct ast_exten **ends;	/*!< Extensions ending at this node */
+	int nends;
+	int aends;
+};
+
+struct ext_trie {
+	struct ext_node root;
+	struct ext_node always;		/*!< Extensions the trie cannot describe */
+};
+
+struct ext_candidates {
+	struct ast_exten **list;
+	int count;
+	int size;
+	int next;
+	int all;			/*!< No index, walk the whole context */
+	struct ast_exten *local[EXT_CANDIDATES];
+};
+
+/*! \brief Mark the characters matched by the [...] between start and end,
+ * exactly as _extension_match_core() compares them */
+static void ext_trie_set(const char *start, const char *end, unsigned char *set)
+{
+	const char *p;
+	int x;
+
+	for (x = 1; x < 256; x++) {
+		char d = (char) x;
+
+		for (p = start; p != end; p++) {
+			if (p + 2 < end && p[1] == '-') {
+				if (d >= p[0] && d <= p[2])
+					break;
+				p += 2;
+			} else if (d == p[0])
+				break;
+		}
+		if (p != end)
+			set[x / 8] |= 1 << (x % 8);
+	}
+}
+
+static void ext_trie_range(unsigned char *set, char first, char last)
+{
+	for (; first <= last; first++)
+		set[first / 8] |= 1 << (first % 8);
+}
+
+/*! \brief Split an extension into trie elements.
+ * \return the number of elements, -1 if the trie cannot describe it */
+static int ext_trie_compile(const char *exten, struct ext_elem *elems)
+{
+	const char *end;
+	int n = 0;
+
+	if (exten[0] != '_') {
+		for (; *exten; exten++) {
+			if (*exten == '-')
+				continue;
+			if (n == AST_MAX_EXTENSION)
+				return -1;
+			elems[n].kind = EXT_NODE_CHAR;
+			elems[n++].c = tolower((unsigned char) *exten);
+		}
+		return n;
+	}
+
+	for (exten++; *exten && *exten != '/'; exten++) {
+		struct ext_elem *el = &elems[n];
+
+		if (*exten == ' ' || *exten == '-')
+			continue;
+		if (n == AST_MAX_EXTENSION)
+			return -1;
+		memset(el, 0, sizeof(*el));
+		el->kind = EXT_NODE_SET;
+		switch (toupper(*exten)) {
+		case '[':
+			if (!(end = strchr(exten + 1, ']')))
+				return -1;
+			ext_trie_set(exten + 1, end, el->set);
+			exten = end;
+			break;
+		case 'N':
+			ext_trie_range(el->set, '2', '9');
+			break;
+		case 'X':
+			ext_trie_range(el->set, '0', '9');
+			break;
+		case 'Z':
+			ext_trie_range(el->set, '1', '9');
+			break;
+		case '.':	/* nothing after these is looked at */
+			el->kind = EXT_NODE_ANY;
+			return n + 1;
+		case '!':
+			el->kind = EXT_NODE_EARLY;
+			return n + 1;
+		default:
+			el->kind = EXT_NODE_CHAR;
+			el->c = tolower((unsigned char) *exten);
+		}
+		n++;
+	}
+	return n;
+}
+
+static int ext_node_is(struct ext_node *node, struct ext_elem *el)
+{
+	if (node->kind != el->kind)
+		return 0;
+	if (node->kind == EXT_NODE_CHAR)
+		return node->c == el->c;
+	if (node->kind == EXT_NODE_SET)
+		return !memcmp(node->set, el->set, sizeof(el->set));
+	return 1;
+}
+
+/*! \brief Find the node where an extension ends, creating it if asked to */
+static struct ext_node *ext_trie_node(struct ext_trie *trie, const char *exten, int create)
+{
+	struct ext_elem elems[AST_MAX_EXTENSION];
+	struct ext_node *node = &trie->root, *child;
+	int n, x;
+
+	if ((n = ext_trie_compile(exten, elems)) < 0)
+		return &trie->always;
+
+	for (x = 0; x < n; x++) {
+		for (child = node->children; child; child = child->next) {
+			if (ext_node_is(child, &elems[x]))
+				break;
+		}
+		if (!child) {
+			if (!create || !(child = ast_calloc(1, sizeof(*child))))
+				return NULL;
+			child->kind = elems[x].kind;
+			child->c = elems[x].c;
+			if (child->kind == EXT_NODE_SET) {
+				if (!(child->set = ast_malloc(sizeof(elems[x].set)))) {
+					free(child);
+					return NULL;
+				}
+				memcpy(child->set, elems[x].set, sizeof(elems[x].set));
+			}
+			child->next = node->children;
+			node->children = child;
+		}
+		node = child;
+	}
+	return node;
+}
+
+static int ext_trie_insert(struct ext_trie *trie, struct ast_exten *e)
+{
+	struct ext_node *node;
+	struct ast_exten **ends;
+
+	if (!(node = ext_trie_node(trie, e->exten, 1)))
+		return -1;
+	if (node->nends == node->aends) {
+		if (!(ends = ast_realloc(node->ends, (node->aends ? node->aends * 2 : 2) * sizeof(*ends))))
+			return -1;
+		node->ends = ends;
+		node->aends = node->aends ? node->aends * 2 : 2;
+	}
+	node->ends[node->nends++] = e;
+	return 0;
+}
+
+static void ext_node_free(struct ext_node *node)
+{
+	struct ext_node *child;
+
+	while ((child = node->children)) {
+		node->children = child->next;
+		ext_node_free(child);
+		free(child);
+	}
+	if (node->set)
+		free(node->set);
+	if (node->ends)
+		free(node->ends);
+}
+
+/*! \brief Drop the index of a context, the next lookup builds it again */
+static void ext_trie_destroy(struct ast_context *con)
+{
+	if (!con->trie)
+		return;
+	ext_node_free(&con->trie->root);
+	ext_node_free(&con->trie->always);
+	free(con->trie);
+	con->trie = NULL;
+}
+
+/*! \brief Get the index of a context, building it if needed */
+static struct ext_trie *ext_trie_get(struct ast_context *con)
+{
+	struct ast_exten *e;
+	unsigned int order = 0;
+
+	if (con->trie)
+		return con->trie;
+	if (!(con->trie = ast_calloc(1, sizeof(*con->trie))))
+		return NULL;
+	for (e = con->root; e; e = e->next) {
+		if (order > UINT_MAX - EXT_ORDER_GAP || ext_trie_insert(con->trie, e)) {
+			ext_trie_destroy(con);
+			return NULL;
+		}
+		e->order = (order += EXT_ORDER_GAP);
+	}
+	return con->trie;
+}
+
+/*! \brief Index an extension just linked in the list of its context, after prev */
+static void ext_trie_link(struct ast_context *con, struct ast_exten *prev, struct ast_exten *e)
+{
+	unsigned int lo = prev ? prev->order : 0;
+	unsigned int hi = e->next ? e->next->order : (lo <= UINT_MAX - 2 * EXT_ORDER_GAP ? lo + 2 * EXT_ORDER_GAP : UINT_MAX);
+
+	if (!con->trie)
+		return;
+	if (hi - lo < 2 || ext_trie_insert(con->trie, e)) {
+		ext_trie_destroy(con);
+		return;
+	}
+	e->order = lo + (hi - lo) / 2;
+}
+
+/*! \brief Put a new head of a priority list in the place of the old one */
+static void ext_trie_replace(struct ast_context *con, struct ast_exten *old, struct ast_exten *e)
+{
+	struct ext_node *node;
+	int x;
+
+	if (!con->trie)
+		return;
+	if ((node = ext_trie_node(con->trie, old->exten, 0))) {
+		for (x = 0; x < node->nends; x++) {
+			if (node->ends[x] == old) {
+				node->ends[x] = e;
+				e->order = old->order;
+				return;
+			}
+		}
+	}
+	ext_trie_destroy(con);
+}
+
+/*! \brief Remove an extension unlinked from the list of its context */
+static void ext_trie_unlink(struct ast_context *con, struct ast_exten *e)
+{
+	struct ext_node *node;
+	int x;
+
+	if (!con->trie)
+		return;
+	if ((node = ext_trie_node(con->trie, e->exten, 0))) {
+		for (x = 0; x < node->nends; x++) {
+			if (node->ends[x] == e) {
+				memmove(&node->ends[x], &node->ends[x + 1], (--node->nends - x) * sizeof(*node->ends));
+				return;
+			}
+		}
+	}
+	ext_trie_destroy(con);
+}
+
+static void ext_candidates_add(struct ext_candidates *c, struct ext_node *node)
+{
+	struct ast_exten **list;
+	int size;
+
+	if (c->all)
+		return;
+	if (c->count + node->nends > c->size) {
+		for (size = c->size * 2; size < c->count + node->nends; size *= 2)
+			;
+		if (c->list == c->local) {
+			if ((list = ast_malloc(size * sizeof(*list))))
+				memcpy(list, c->local, c->count * sizeof(*list));
+		} else
+			list = ast_realloc(c->list, size * sizeof(*list));
+		if (!list) {
+			c->all = 1;	/* fall back to walking the context */
+			return;
+		}
+		c->list = list;
+		c->size = size;
+	}
+	memcpy(&c->list[c->count], node->ends, node->nends * sizeof(*node->ends));
+	c->count += node->nends;
+}
+
+static void ext_candidates_add_all(struct ext_candidates *c, struct ext_node *node)
+{
+	struct ext_node *child;
+
+	ext_candidates_add(c, node);
+	for (child = node->children; child; child = child->next)
+		ext_candidates_add_all(c, child);
+}
+
+/*! \brief Collect the extensions below node that may match data */
+static void ext_trie_collect(struct ext_node *node, const char *data, enum ext_match_t action, struct ext_candidates *c)
+{
+	struct ext_node *child;
+	unsigned char d;
+
+	while (*data == '-')
+		data++;
+	if (!*data) {
+		if ((action & E_MATCH_MASK) != E_MATCH) {
+			/* anything longer can still match */
+			ext_candidates_add_all(c, node);
+			return;
+		}
+		ext_candidates_add(c, node);
+		for (child = node->children; child; child = child->next) {
+			if (child->kind == EXT_NODE_EARLY)
+				ext_candidates_add(c, child);
+		}
+		return;
+	}
+
+	d = *data;
+	for (child = node->children; child; child = child->next) {
+		switch (child->kind) {
+		case EXT_NODE_CHAR:
+			if (child->c == tolower(d))
+				ext_trie_collect(child, data + 1, action, c);
+			break;
+		case EXT_NODE_SET:
+			if (child->set[d / 8] & (1 << (d % 8)))
+				ext_trie_collect(child, data + 1, action, c);
+			break;
+		default:	/* '.' and '!' match whatever is left */
+			ext_candidates_add(c, child);
+		}
+	}
+}
+
+static int ext_order_cmp(const void *a, const void *b)
+{
+	unsigned int x = (*(struct ast_exten **) a)->order, y = (*(struct ast_exten **) b)->order;
+
+	return x < y ? -1 : x > y;
+}
+
+/*! \brief Find the extensions of a context that may match exten, in list order */
+static void ext_candidates_find(struct ext_candidates *c, struct ast_context *con, const char *exten, enum ext_match_t action)
+{
+	struct ext_trie *trie;
+
+	c->list = c->local;
+	c->size = EXT_CANDIDATES;
+	c->count = c->next = 0;
+	c->all = 0;
+
+	/* a pattern given as data matches itself, leave that to the list */
+	if (exten[0] == '_' || !(trie = ext_trie_get(con))) {
+		c->all = 1;
+		return;
+	}
+	ext_trie_collect(&trie->root, exten, action, c);
+	ext_candidates_add(c, &trie->always);
+	if (!c->all && c->count > 1)
+		qsort(c->list, c->count, sizeof(*c->list), ext_order_cmp);
+}
+
+static struct ast_exten *ext_candidates_next(struct ext_candidates *c, struct ast_context *con, struct ast_exten *prev)
+{
+	if (c->all)
+		return ast_walk_context_extensions(con, prev);
+	return c->next < c->count ? c->list[c->next++] : NULL;
+}
+
+static void ext_candidates_free(struct ext_candidates *c)
+{
+	if (c->list != c->local)
+		free(c->list);
+}
+
 static struct ast_exten *pbx_find_extension(struct ast_channel *chan,
 	struct ast_context *bypass, struct pbx_find_info *q,
 	const char *context, const char *exten, int priority,
@@ -981,6 +1480,7 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan,
 	struct ast_exten *e, *eroot;
 	struct ast_include *i;
 	struct ast_sw *sw;
+	struct ext_candidates cands;
 	char *tmpdata = NULL;
 
 	/* Initialize status if appropriate */
@@ -1002,21 +1502,15 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan,
 	}
 	if (bypass)	/* bypass means we only look there */
 		tmp = bypass;
-	else {	/* look in contexts */
-		tmp = NULL;
-		while ((tmp = ast_walk_contexts(tmp)) ) {
-			if (!strcmp(tmp->name, context))
-				break;
-		}
-		if (!tmp)
-			return NULL;
-	}
+	else if (!(tmp = find_context(context, 0)))	/* look in contexts */
+		return NULL;
 	if (q->status < STATUS_NO_EXTENSION)
 		q->status = STATUS_NO_EXTENSION;
 
-	/* scan the list trying to match extension and CID */
+	/* scan the extensions that may match, trying to match extension and CID */
+	ext_candidates_find(&cands, tmp, exten, action);
 	eroot = NULL;
-	while ( (eroot = ast_walk_context_extensions(tmp, eroot)) ) {
+	while ( (eroot = ext_candidates_next(&cands, tmp, eroot)) ) {
 		int match = extension_match_core(eroot->exten, exten, action);
 		/* 0 on fail, 1 on match, 2 on earlymatch */
 
@@ -1026,6 +1520,7 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan,
 			/* We match an extension ending in '!'.
 			 * The decision in this case is final and is NULL (no match).
 			 */
+			ext_candidates_free(&cands);
 			return NULL;
 		}
 		/* found entry, now look for the right priority */
@@ -1044,11 +1539,13 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan,
 			} /* else keep searching */
 		}
 		if (e) {	/* found a valid match */
+			ext_candidates_free(&cands);
 			q->status = STATUS_SUCCESS;
 			q->foundcontext = context;
 			return e;
 		}
 	}
+	ext_candidates_free(&cands);
 	/* Check alternative switches */
 	AST_LIST_TRAVERSE(&tmp->alts, sw, list) {
 		struct ast_switch *asw = pbx_findswitch(sw->name);
@@ -1268,12 +1765,8 @@ void pbx_retrieve_variable(struct ast_channel *c, const char *var, char **ret, c
 			continue;
 		if (places[i] == &globals)
 			ast_mutex_lock(&globalslock);
-		AST_LIST_TRAVERSE(places[i], variables, entries) {
-			if (strcasecmp(ast_var_name(variables), var)==0) {
-				s = ast_var_value(variables);
-				break;
-			}
-		}
+		if ((variables = ast_var_find(places[i], var, 1)))
+			s = ast_var_value(variables);
 		if (places[i] == &globals)
 			ast_mutex_unlock(&globalslock);
 	}
@@ -1710,7 +2203,8 @@ static void pbx_substitute_variables_helper_full(struct ast_channel *c, struct v
 						memcpy(&old, &c->varshead, sizeof(old));
 						memcpy(&c->varshead, headp, sizeof(c->varshead));
 						cp4 = ast_func_read(c, vars, workspace, VAR_BUF_SIZE) ? NULL : workspace;
-						/* Don't deallocate the varshead that was passed in */
+						/* Keep any change, such as a new index, and don't deallocate the varshead that was passed in */
+						memcpy(headp, &c->varshead, sizeof(*headp));
 						memcpy(&c->varshead, &old, sizeof(c->varshead));
 						ast_channel_free(c);
 					} else
@@ -1805,8 +2299,122 @@ void pbx_substitute_variables_varshead(struct varshead *headp, const char *cp1,
 	pbx_substitute_variables_helper_full(NULL, headp, cp1, cp2, count);
 }
 
+/*! \brief A piece of the data of an extension: text to copy, or the name
+ * of a variable or function, with an optional substring, to look up */
+struct subst_piece {
+	const char *text;	/*!< Points into the data of the extension */
+	int len;
+	int isvar;
+};
+
+/*! \brief The data of an extension, parsed once when the extension is added.
+ * Only data made of text and ${...} without nested substitutions or $[...]
+ * expressions is parsed, anything else goes through the full helper. */
+struct subst_template {
+	int count;
+	struct subst_piece pieces[0];
+};
+
+static void subst_template_add(struct subst_template *t, const char *text, int len, int isvar)
+{
+	t->pieces[t->count].text = text;
+	t->pieces[t->count].len = len;
+	t->pieces[t->count++].isvar = isvar;
+}
+
+/*! \brief Parse data the way pbx_substitute_variables_helper_full() does,
+ * returns NULL if it holds anything but text and simple ${...} */
+static struct subst_template *subst_template_build(const char *data)
+{
+	struct subst_template *t;
+	const char *p, *dollar, *vare;
+	int pieces = 1, brackets;
+
+	for (p = data; (p = strchr(p, '$')); p++)
+		pieces += 2;
+	if (!(t = ast_calloc(1, sizeof(*t) + pieces * sizeof(t->pieces[0]))))
+		return NULL;
+
+	for (p = data; *p; ) {
+		if (!(dollar = strchr(p, '$'))) {
+			subst_template_add(t, p, strlen(p), 0);
+			break;
+		}
+		if (dollar[1] == '[')
+			goto complex;
+		if (dollar[1] != '{') {	/* a lone '$' is copied */
+			subst_template_add(t, p, dollar + 1 - p, 0);
+			p = dollar + 1;
+			continue;
+		}
+		if (dollar > p)
+			subst_template_add(t, p, dollar - p, 0);
+		for (vare = dollar + 2, brackets = 1; brackets && *vare; vare++) {
+			if (vare[0] == '$' && (vare[1] == '{' || vare[1] == '['))
+				goto complex;
+			else if (vare[0] == '{')
+				brackets++;
+			else if (vare[0] == '}')
+				brackets--;
+		}
+		if (brackets)
+			goto complex;
+		subst_template_add(t, dollar + 2, vare - dollar - 3, 1);
+		p = vare;
+	}
+	return t;
+
+complex:
+	free(t);
+	return NULL;
+}
+
+static void exten_subst_free(struct ast_exten *e)
+{
+	if (e->subst)
+		free(e->subst);
+}
+
+/*! \brief Substitute the variables of parsed data, with the same result
+ * as pbx_substitute_variables_helper() */
+static void subst_template_apply(struct ast_channel *c, struct subst_template *t, char *cp2, int count)
+{
+	char *var = alloca(VAR_BUF_SIZE), *workspace = alloca(VAR_BUF_SIZE), *cp4;
+	int i, length, offset, offset2, isfunction;
+
+	*cp2 = '\0';
+	for (i = 0; i < t->count && count; i++) {
+		struct subst_piece *piece = &t->pieces[i];
+
+		if (!piece->isvar) {
+			length = piece->len > count ? count : piece->len;
+			memcpy(cp2, piece->text, length);
+		} else {
+			ast_copy_string(var, piece->text, piece->len < VAR_BUF_SIZE ? piece->len + 1 : VAR_BUF_SIZE);
+			workspace[0] = '\0';
+			parse_variable_name(var, &offset, &offset2, &isfunction);
+			if (isfunction)
+				cp4 = ast_func_read(c, var, workspace, VAR_BUF_SIZE) ? NULL : workspace;
+			else
+				pbx_retrieve_variable(c, var, &cp4, workspace, VAR_BUF_SIZE, &c->varshead);
+			if (!cp4)
+				continue;
+			cp4 = substring(cp4, offset, offset2, workspace, VAR_BUF_SIZE);
+			length = strlen(cp4);
+			if (length > count)
+				length = count;
+			memcpy(cp2, cp4, length);
+		}
+		count -= length;
+		cp2 += length;
+		*cp2 = '\0';
+	}
+}
+
 static void pbx_substitute_variables(char *passdata, int datalen, struct ast_channel *c, struct ast_exten *e)
 {
+	struct subst_template *t;
+
 	memset(passdata, 0, datalen);
 
 	/* No variables or expressions in e->data, so why scan it? */
@@ -1815,6 +2423,12 @@ static void pbx_substitute_variables(char *passdata, int datalen, struct ast_cha
 		return;
 	}
 
+	/* Only variables, use the data parsed when the extension was added */
+	if (c && (t = e->subst)) {
+		subst_template_apply(c, t, passdata, datalen - 1);
+		return;
+	}
+
 	pbx_substitute_variables_helper(c, e->data, passdata, datalen - 1);
 }
 
@@ -2668,6 +3282,7 @@ static void destroy_exten(struct ast_exten *e)
 	if (e->priority == PRIORITY_HINT)
 		ast_remove_hint(e);
 
+	exten_subst_free(e);
 	if (e->datad)
 		e->datad(e->data);
 	free(e);
@@ -2753,13 +3368,10 @@ static struct ast_context *find_context_locked(const char *context)
 	struct ast_context *c = NULL;
 
 	ast_rdlock_contexts();
-	while ( (c = ast_walk_contexts(c)) ) {
-		if (!strcmp(ast_get_context_name(c), context))
-			return c;
-	}
-	ast_unlock_contexts();
+	if (!(c = find_context(context, 0)))
+		ast_unlock_contexts();
 
-	return NULL;
+	return c;
 }
 
 /*
@@ -2910,7 +3522,11 @@ int ast_context_remove_extension_callerid2(struct ast_context *con, const char *
 	struct ast_exten *previous_peer = NULL;
 	struct ast_exten *next_peer = NULL;
 	int found = 0;
+	int published = con->published;
 
+	/* The extension trie of a context on the contexts list is protected by conlock */
+	if (published)
+		ast_wrlock_contexts();
 	ast_mutex_lock(&con->lock);
 
 	/* scan the extension list to find first matching extension-registrar */
@@ -2922,6 +3538,8 @@ int ast_context_remove_extension_callerid2(struct ast_context *con, const char *
 	if (!exten) {
 		/* we can't find right extension */
 		ast_mutex_unlock(&con->lock);
+		if (published)
+			ast_unlock_contexts();
 		return -1;
 	}
 
@@ -2949,7 +3567,9 @@ int ast_context_remove_extension_callerid2(struct ast_context *con, const char *
 				}
 				if (peer->peer)	{ /* update the new head of the pri list */
 					peer->peer->next = peer->next;
-				}
+					ext_trie_replace(con, peer, peer->peer);
+				} else
+					ext_trie_unlink(con, peer);
 			} else { /* easy, we are not first priority in extension */
 				previous_peer->peer = peer->peer;
 			}
@@ -2961,6 +3581,8 @@ int ast_context_remove_extension_callerid2(struct ast_context *con, const char *
 		}
 	}
 	ast_mutex_unlock(&con->lock);
+	if (published)
+		ast_unlock_contexts();
 	return found ? 0 : -1;
 }
 
@@ -2976,14 +3598,8 @@ int ast_context_lockmacro(const char *context)
 	int ret = -1;
 
 	ast_rdlock_contexts();
-
-	while ((c = ast_walk_contexts(c))) {
-		if (!strcmp(ast_get_context_name(c), context)) {
-			ret = 0;
-			break;
-		}
-	}
-
+	if ((c = find_context(context, 0)))
+		ret = 0;
 	ast_unlock_contexts();
 
 	/* if we found context, lock macrolock */
@@ -3004,14 +3620,8 @@ int ast_context_unlockmacro(const char *context)
 	int ret = -1;
 
 	ast_rdlock_contexts();
-
-	while ((c = ast_walk_contexts(c))) {
-		if (!strcmp(ast_get_context_name(c), context)) {
-			ret = 0;
-			break;
-		}
-	}
-
+	if ((c = find_context(context, 0)))
+		ret = 0;
 	ast_unlock_contexts();
 
 	/* if we found context, unlock macrolock */
@@ -3966,23 +4576,29 @@ static struct ast_context *__ast_context_create(struct ast_context **extcontexts
 {
 	struct ast_context *tmp, **local_contexts;
 	int length = sizeof(struct ast_context) + strlen(name) + 1;
+	unsigned int hash = ast_str_case_hash(name);
 
 	if (!extcontexts) {
 		ast_rdlock_contexts();
 		local_contexts = &contexts;
-	} else
+		tmp = find_context(name, 1);
+	} else {
+		/* A reload list is not hashed yet, but the names it holds are */
 		local_contexts = extcontexts;
+		for (tmp = *local_contexts; tmp; tmp = tmp->next) {
+			if (tmp->hash == hash && !strcasecmp(tmp->name, name))
+				break;
+		}
+	}
 
-	for (tmp = *local_contexts; tmp; tmp = tmp->next) {
-		if (!strcasecmp(tmp->name, name)) {
-			if (!existsokay) {
-				ast_log(LOG_WARNING, "Tried to register context '%s', already in use\n", name);
-				tmp = NULL;
-			}
-			if (!extcontexts)
-				ast_unlock_contexts();
-			return tmp;
+	if (tmp) {
+		if (!existsokay) {
+			ast_log(LOG_WARNING, "Tried to register context '%s', already in use\n", name);
+			tmp = NULL;
 		}
+		if (!extcontexts)
+			ast_unlock_contexts();
+		return tmp;
 	}
 	
 	if (!extcontexts)
@@ -3992,13 +4608,16 @@ static struct ast_context *__ast_context_create(struct ast_context **extcontexts
 		ast_mutex_init(&tmp->lock);
 		ast_mutex_init(&tmp->macrolock);
 		strcpy(tmp->name, name);
+		tmp->hash = hash;
 		tmp->registrar = registrar;
 		if (!extcontexts)
 			ast_wrlock_contexts();
 		tmp->next = *local_contexts;
 		*local_contexts = tmp;
-		if (!extcontexts)
+		if (!extcontexts) {
+			context_link(tmp);
 			ast_unlock_contexts();
+		}
 		if (option_debug)
 			ast_log(LOG_DEBUG, "Registered context '%s'\n", tmp->name);
 		if (option_verbose > 2)
@@ -4103,6 +4722,7 @@ void ast_merge_contexts_and_delete(struct ast_context **extcontexts, const char
 		lasttmp->next = contexts;
 		contexts = *extcontexts;
 		*extcontexts = NULL;
+		context_rehash();
 	} else
 		ast_log(LOG_WARNING, "Requested contexts didn't get merged\n");
 
@@ -4818,6 +5438,7 @@ static int add_pri(struct ast_context *con, struct ast_exten *tmp,
 			ast_log(LOG_WARNING, "Unable to register extension '%s', priority %d in '%s', already in use\n", tmp->exten, tmp->priority, con->name);
 			if (tmp->datad)
 				tmp->datad(tmp->data);
+			exten_subst_free(tmp);
 			free(tmp);
 			return -1;
 		}
@@ -4828,13 +5449,17 @@ static int add_pri(struct ast_context *con, struct ast_exten *tmp,
 		tmp->peer = e->peer;	/* always meaningful */
 		if (ep)			/* We're in the peer list, just insert ourselves */
 			ep->peer = tmp;
-		else if (el)		/* We're the first extension. Take over e's functions */
-			el->next = tmp;
-		else			/* We're the very first extension.  */
-			con->root = tmp;
+		else {
+			if (el)		/* We're the first extension. Take over e's functions */
+				el->next = tmp;
+			else		/* We're the very first extension.  */
+				con->root = tmp;
+			ext_trie_replace(con, e, tmp);
+		}
 		if (tmp->priority == PRIORITY_HINT)
 			ast_change_hint(e,tmp);
 		/* Destroy the old one */
+		exten_subst_free(e);
 		if (e->datad)
 			e->datad(e->data);
 		free(e);
@@ -4848,6 +5473,7 @@ static int add_pri(struct ast_context *con, struct ast_exten *tmp,
 				el->next = tmp;	/* in the middle... */
 			else
 				con->root = tmp; /* ... or at the head */
+			ext_trie_replace(con, e, tmp);
 			e->next = NULL;	/* e is no more at the head, so e->next must be reset */
 		}
 		/* And immediately return success. */
@@ -4895,6 +5521,7 @@ int ast_add_extension2(struct ast_context *con,
 	 */
 	struct ast_exten *tmp, *e, *el = NULL;
 	int res;
+	int published;
 	int length;
 	char *p;
 	char expand_buf[VAR_BUF_SIZE] = { 0, };
@@ -4947,7 +5574,15 @@ int ast_add_extension2(struct ast_context *con,
 	tmp->data = data;
 	tmp->datad = datad;
 	tmp->registrar = registrar;
-
+	/* Parsed before anyone can see the extension, so it never changes after */
+	if (data && strchr(data, '$'))
+		tmp->subst = subst_template_build(data);
+
+	/* The extension trie of a context on the contexts list is protected by
+	   conlock; one still being built for a reload is nobody else's business */
+	published = con->published;
+	if (published)
+		ast_wrlock_contexts();
 	ast_mutex_lock(&con->lock);
 	res = 0; /* some compilers will think it is uninitialized otherwise */
 	for (e = con->root; e; el = e, e = e->next) {   /* scan the extension list */
@@ -4968,6 +5603,8 @@ int ast_add_extension2(struct ast_context *con,
 	if (e && res == 0) { /* exact match, insert in the pri chain */
 		res = add_pri(con, tmp, el, e, replace);
 		ast_mutex_unlock(&con->lock);
+		if (published)
+			ast_unlock_contexts();
 		if (res < 0) {
 			errno = EEXIST;	/* XXX do we care ? */
 			return 0; /* XXX should we return -1 maybe ? */
@@ -4982,7 +5619,10 @@ int ast_add_extension2(struct ast_context *con,
 			el->next = tmp;
 		else
 			con->root = tmp;
+		ext_trie_link(con, el, tmp);
 		ast_mutex_unlock(&con->lock);
+		if (published)
+			ast_unlock_contexts();
 		if (tmp->priority == PRIORITY_HINT)
 			ast_add_hint(tmp);
 	}
@@ -5431,6 +6071,7 @@ void __ast_context_destroy(struct ast_context *con, const char *registrar)
 			tmpl->next = next;
 		else
 			contexts = next;
+		context_unlink(tmp);
 		/* Okay, now we're safe to let it go -- in a sense, we were
 		   ready to let it go as soon as we locked it. */
 		ast_mutex_unlock(&tmp->lock);
@@ -5456,6 +6097,7 @@ void __ast_context_destroy(struct ast_context *con, const char *registrar)
 			e = e->next;
 			destroy_exten(el);
 		}
+		ext_trie_destroy(tmp);
 		ast_mutex_destroy(&tmp->lock);
 		free(tmp);
 		/* if we have a specific match, we are done, otherwise continue */
@@ -5951,12 +6593,8 @@ const char *pbx_builtin_getvar_helper(struct ast_channel *chan, const char *name
 			continue;
 		if (places[i] == &globals)
 			ast_mutex_lock(&globalslock);
-		AST_LIST_TRAVERSE(places[i], variables, entries) {
-			if (!strcmp(name, ast_var_name(variables))) {
-				ret = ast_var_value(variables);
-				break;
-			}
-		}
+		if ((variables = ast_var_find(places[i], name, 0)))
+			ret = ast_var_value(variables);
 		if (places[i] == &globals)
 			ast_mutex_unlock(&globalslock);
 		if (ret)
@@ -5994,7 +6632,7 @@ void pbx_builtin_pushvar_helper(struct ast_channel *chan, const char *name, cons
 		if ((option_verbose > 1) && (headp == &globals))
 			ast_verbose(VERBOSE_PREFIX_2 "Setting global variable '%s' to '%s'\n", name, value);
 		newvariable = ast_var_assign(name, value);
-		AST_LIST_INSERT_HEAD(headp, newvariable, entries);
+		ast_var_insert_head(headp, newvariable);
 	}
 
 	if (chan)
@@ -6031,21 +6669,17 @@ void pbx_builtin_setvar_helper(struct ast_channel *chan, const char *name, const
 			nametail++;
 	}
 
-	AST_LIST_TRAVERSE_SAFE_BEGIN(headp, newvariable, entries) {
-		if (strcmp(ast_var_name(newvariable), nametail) == 0) {
-			/* there is already such a variable, delete it */
-			AST_LIST_REMOVE_CURRENT(headp, entries);
-			ast_var_delete(newvariable);
-			break;
-		}
+	if ((newvariable = ast_var_find(headp, nametail, 0))) {
+		/* there is already such a variable, delete it */
+		ast_var_remove(headp, newvariable);
+		ast_var_delete(newvariable);
 	}
-	AST_LIST_TRAVERSE_SAFE_END;
 
 	if (value) {
 		if ((option_verbose > 1) && (headp == &globals))
 			ast_verbose(VERBOSE_PREFIX_2 "Setting global variable '%s' to '%s'\n", name, value);
 		newvariable = ast_var_assign(name, value);
-		AST_LIST_INSERT_HEAD(headp, newvariable, entries);
+		ast_var_insert_head(headp, newvariable);
 	}
 
 	if (chan)
@@ -6157,11 +6791,8 @@ static int pbx_builtin_noop(struct ast_channel *chan, void *data)
 
 void pbx_builtin_clear_globals(void)
 {
-	struct ast_var_t *vardata;
-
 	ast_mutex_lock(&globalslock);
-	while ((vardata = AST_LIST_REMOVE_HEAD(&globals, entries)))
-		ast_var_delete(vardata);
+	ast_var_list_destroy(&globals);
 	ast_mutex_unlock(&globalslock);
 }
 
@@ -42,6 +42,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 289797 $")
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
 
 #include "asterisk/rtp.h"
 #include "asterisk/frame.h"
@@ -56,6 +59,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 289797 $")
 #include "asterisk/cli.h"
 #include "asterisk/unaligned.h"
 #include "asterisk/utils.h"
+#include "asterisk/astobj2.h"
 
 #define MAX_TIMESTAMP_SKEW	640
 
@@ -75,10 +79,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 289797 $")
 
 #define DEFAULT_DTMF_TIMEOUT (150 * (8000 / 1000))	/*!< samples */
 
+#define DEFAULT_RTP_QUARANTINE	2000	/*!< milliseconds */
+#define RTP_WARMPOOL_MAX	256
+#define RTP_POOL_DRAIN		32	/*!< datagrams dropped from each socket of a warm pair, at most */
+
 static int dtmftimeout = DEFAULT_DTMF_TIMEOUT;
 
 static int rtpstart;			/*!< First port for RTP sessions (set in rtp.conf) */
 static int rtpend;			/*!< Last port for RTP sessions (set in rtp.conf) */
+static int rtpquarantine = DEFAULT_RTP_QUARANTINE;	/*!< Milliseconds a freed port pair is not reused if another one is free */
+static int rtpwarmpool;			/*!< Port pairs kept bound ahead of time */
 static int rtpdebug;			/*!< Are we debugging? */
 static int rtcpdebug;			/*!< Are we debugging RTCP? */
 static int rtcpstats;			/*!< Are we debugging RTCP? */
@@ -93,6 +103,30 @@ static int nochecksums;
 /* Uncomment this to enable more intense native bridging, but note: this is currently buggy */
 /* #define P2P_INTENSE */
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define RTP_P2P_BATCH	8	/*!< Packets a Packet2Packet bridged stream reads and forwards at once */
+#define RTP_P2P_MTU	2048
+
+/*! \brief Packets read at once from a Packet2Packet bridged stream */
+struct rtp_batch {
+	int count;			/*!< packets read */
+	int next;			/*!< the first one not handled yet */
+	struct mmsghdr msgs[RTP_P2P_BATCH];
+	struct iovec iov[RTP_P2P_BATCH];
+	struct sockaddr_in sin[RTP_P2P_BATCH];
+	unsigned char data[RTP_P2P_BATCH][RTP_P2P_MTU];
+};
+
+#ifdef HAVE_EPOLL_CREATE
+#define RTP_RELAY
+#define RTP_RELAY_MAX_THREADS	16	/*!< Most relay threads rtp.conf may ask for */
+#endif
+#endif
+
+#ifdef RTP_RELAY
+static int relaythreads;		/*!< Threads relaying Packet2Packet bridged calls, 0 to read them through the channels */
+#endif
+
 /*!
  * \brief Structure representing a RTP session.
  *
@@ -155,7 +189,7 @@ struct ast_rtp {
 	struct timeval rxcore;
 	struct timeval txcore;
 	double drxcore;                 /*!< The double representation of the first received packet */
-	struct timeval lastrx;          /*!< timeval when we last received a packet */
+	struct timeval lastrx;          /*!< timeval when we last relayed a packet */
 	struct timeval dtmfmute;
 	struct ast_smoother *smoother;
 	int *ioid;
@@ -165,7 +199,7 @@ struct ast_rtp {
 	struct io_context *io;
 	void *data;
 	ast_rtp_callback callback;
-	ast_mutex_t bridge_lock;
+	ast_mutex_t bridge_lock;	/*!< Also guards the payload types and writes of them, read by relay threads */
 	struct rtpPayloadType current_RTP_PT[MAX_RTP_PT];
 	int rtp_lookup_code_cache_isAstFormat; /*!< a cache for the result of rtp_lookup_code(): */
 	int rtp_lookup_code_cache_code;
@@ -174,6 +208,9 @@ struct ast_rtp {
 	struct ast_codec_pref pref;
 	struct ast_rtp *bridged;        /*!< Who we are Packet bridged to */
 	int set_marker_bit:1;           /*!< Whether to set the marker bit or not */
+#ifdef RTP_P2P_BATCH
+	struct rtp_batch *batch;	/*!< Packets read ahead while Packet2Packet bridged */
+#endif
 };
 
 AST_LIST_HEAD_NOLOCK(frame_list, ast_frame);
@@ -588,6 +625,11 @@ int ast_rtp_get_rtpkeepalive(struct ast_rtp *rtp)
 	return rtp->rtpkeepalive;
 }
 
+time_t ast_rtp_get_lastrelayed(struct ast_rtp *rtp)
+{
+	return rtp->lastrx.tv_sec;
+}
+
 void ast_rtp_set_data(struct ast_rtp *rtp, void *data)
 {
 	rtp->data = data;
@@ -1120,10 +1162,13 @@ static void calc_rxstamp(struct timeval *tv, struct ast_rtp *rtp, unsigned int t
 		rtp->rtcp->minrxjitter = rtp->rxjitter;
 }
 
-/*! \brief Perform a Packet2Packet RTP write */
-static int bridge_p2p_rtp_write(struct ast_rtp *rtp, struct ast_rtp *bridged, unsigned int *rtpheader, int len, int hdrlen)
+/*!
+ * \brief Rewrite the header of a packet for the stream it is Packet2Packet bridged to
+ * \retval -1 the packet has to go to the core instead
+ */
+static int bridge_p2p_rtp_rewrite(struct ast_rtp *rtp, struct ast_rtp *bridged, unsigned int *rtpheader)
 {
-	int res = 0, payload = 0, bridged_payload = 0, mark;
+	int payload = 0, bridged_payload = 0, mark;
 	struct rtpPayloadType rtpPT;
 	int reconstruct = ntohl(rtpheader[0]);
 
@@ -1142,7 +1187,7 @@ static int bridge_p2p_rtp_write(struct ast_rtp *rtp, struct ast_rtp *bridged, un
 	bridged_payload = ast_rtp_lookup_code(bridged, rtpPT.isAstFormat, rtpPT.code);
 
 	/* If the payload coming in is not one of the negotiated ones then send it to the core, this will cause formats to change and the bridge to break */
-	if (!bridged->current_RTP_PT[bridged_payload].code)
+	if (!ast_rtp_lookup_pt(bridged, bridged_payload).code)
 		return -1;
 
 
@@ -1158,8 +1203,12 @@ static int bridge_p2p_rtp_write(struct ast_rtp *rtp, struct ast_rtp *bridged, un
 	reconstruct |= (mark << 23);
 	rtpheader[0] = htonl(reconstruct);
 
-	/* Send the packet back out */
-	res = sendto(bridged->s, (void *)rtpheader, len, 0, (struct sockaddr *)&bridged->them, sizeof(bridged->them));
+	return 0;
+}
+
+/*! \brief Report how sending a Packet2Packet packet went */
+static void bridge_p2p_rtp_sent(struct ast_rtp *bridged, int res, unsigned int *rtpheader, int len, int hdrlen)
+{
 	if (res < 0) {
 		if (!bridged->nat || (bridged->nat && (ast_test_flag(bridged, FLAG_NAT_ACTIVE) == FLAG_NAT_ACTIVE))) {
 			ast_log(LOG_DEBUG, "RTP Transmission error of packet to %s:%d: %s\n", ast_inet_ntoa(bridged->them.sin_addr), ntohs(bridged->them.sin_port), strerror(errno));
@@ -1168,13 +1217,148 @@ static int bridge_p2p_rtp_write(struct ast_rtp *rtp, struct ast_rtp *bridged, un
 				ast_log(LOG_DEBUG, "RTP NAT: Can't write RTP to private address %s:%d, waiting for other end to send audio...\n", ast_inet_ntoa(bridged->them.sin_addr), ntohs(bridged->them.sin_port));
 			ast_set_flag(bridged, FLAG_NAT_INACTIVE_NOWARN);
 		}
-		return 0;
 	} else if (rtp_debug_test_addr(&bridged->them))
-			ast_verbose("Sent RTP P2P packet to %s:%u (type %-2.2d, len %-6.6u)\n", ast_inet_ntoa(bridged->them.sin_addr), ntohs(bridged->them.sin_port), bridged_payload, len - hdrlen);
+			ast_verbose("Sent RTP P2P packet to %s:%u (type %-2.2d, len %-6.6u)\n", ast_inet_ntoa(bridged->them.sin_addr), ntohs(bridged->them.sin_port), (ntohl(rtpheader[0]) & 0x7f0000) >> 16, len - hdrlen);
+}
+
+/*! \brief Perform a Packet2Packet RTP write */
+static int bridge_p2p_rtp_write(struct ast_rtp *rtp, struct ast_rtp *bridged, unsigned int *rtpheader, int len, int hdrlen)
+{
+	int res;
+
+	if (bridge_p2p_rtp_rewrite(rtp, bridged, rtpheader))
+		return -1;
+
+	/* Send the packet back out */
+	res = sendto(bridged->s, (void *)rtpheader, len, 0, (struct sockaddr *)&bridged->them, sizeof(bridged->them));
+	bridge_p2p_rtp_sent(bridged, res, rtpheader, len, hdrlen);
 
 	return 0;
 }
 
+#ifdef RTP_P2P_BATCH
+/*!
+ * \brief Read everything queued on a Packet2Packet bridged stream with one
+ * recvmmsg(), and forward what can be with one sendmmsg().
+ *
+ * Forwarding stops at the first packet the core has to see (STUN, a new
+ * NAT source, DTMF the bridge listens for, an unexpected payload), which is
+ * left as rtp->batch->next.  Packets read after it are handled by the next
+ * call, before the socket is read again.
+ *
+ * \param sent incremented by the number of packets forwarded
+ * \param octets incremented by their size
+ * \return 1 if a packet is left for the core, 0 if everything was forwarded,
+ * -1 on a read error
+ */
+static int bridge_p2p_rtp_forward(struct ast_rtp *rtp, unsigned int *sent, unsigned int *octets)
+{
+	struct rtp_batch *b = rtp->batch;
+	struct mmsghdr out[RTP_P2P_BATCH];
+	struct sockaddr_in them, bridged_them;
+	struct ast_rtp *bridged;
+	unsigned int *header;
+	int i, n = 0, len, res;
+
+	if (b->next >= b->count) {
+		for (i = 0; i < RTP_P2P_BATCH; i++) {
+			b->iov[i].iov_base = b->data[i];
+			b->iov[i].iov_len = sizeof(b->data[i]);
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+			b->msgs[i].msg_hdr.msg_name = &b->sin[i];
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->sin[i]);
+		}
+		b->next = 0;
+		if ((b->count = recvmmsg(rtp->s, b->msgs, RTP_P2P_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+			b->count = 0;
+			return -1;
+		}
+	}
+
+	memset(out, 0, sizeof(out));
+	if ((bridged = ast_rtp_get_bridged(rtp))) {
+		/* A re-INVITE may move either end while a relay thread forwards */
+		ast_mutex_lock(&rtp->bridge_lock);
+		them = rtp->them;
+		ast_mutex_unlock(&rtp->bridge_lock);
+		ast_mutex_lock(&bridged->bridge_lock);
+		bridged_them = bridged->them;
+		ast_mutex_unlock(&bridged->bridge_lock);
+	}
+	for (; bridged && b->next < b->count; b->next++) {
+		i = b->next;
+		len = b->msgs[i].msg_len;
+		header = (unsigned int *) b->data[i];
+		if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			ast_log(LOG_WARNING, "RTP packet from %s:%d does not fit %d bytes, dropped\n",
+				ast_inet_ntoa(b->sin[i].sin_addr), ntohs(b->sin[i].sin_port), RTP_P2P_MTU);
+			continue;
+		}
+		if (len < 12 || (ntohl(header[0]) & 0xC0000000) != 0x80000000)
+			break;
+		if (rtp->nat && (them.sin_addr.s_addr != b->sin[i].sin_addr.s_addr ||
+		    them.sin_port != b->sin[i].sin_port))
+			break;
+		if (bridge_p2p_rtp_rewrite(rtp, bridged, header))
+			break;
+		b->iov[i].iov_len = len;
+		out[n].msg_hdr.msg_iov = &b->iov[i];
+		out[n].msg_hdr.msg_iovlen = 1;
+		out[n].msg_hdr.msg_name = &bridged_them;
+		out[n].msg_hdr.msg_namelen = sizeof(bridged_them);
+		*octets += len;
+		n++;
+	}
+	*sent += n;
+
+	for (i = 0; i < n; i += res) {
+		if ((res = sendmmsg(bridged->s, out + i, n - i, 0)) < 1) {
+			/* Account for the failed one like sendto() would, then go on */
+			bridge_p2p_rtp_sent(bridged, -1, out[i].msg_hdr.msg_iov->iov_base, out[i].msg_hdr.msg_iov->iov_len, 12);
+			res = 1;
+			continue;
+		}
+		if (rtpdebug) {
+			int j;
+
+			for (j = i; j < i + res; j++)
+				bridge_p2p_rtp_sent(bridged, out[j].msg_len, out[j].msg_hdr.msg_iov->iov_base, out[j].msg_hdr.msg_iov->iov_len, 12);
+		}
+	}
+
+	return b->next < b->count;
+}
+
+/*!
+ * \brief Forward what can be of the packets queued on a Packet2Packet bridged
+ * stream, and copy the first one the core has to see to rtp->rawdata.
+ * \return the length of the packet left for the core, its source in *sin,
+ * 0 if everything was forwarded, -1 on a read error
+ */
+static int bridge_p2p_rtp_read(struct ast_rtp *rtp, struct sockaddr_in *sin)
+{
+	struct rtp_batch *b = rtp->batch;
+	unsigned int sent = 0, octets = 0;
+	int i, len, res;
+
+	if (!b && !(b = rtp->batch = ast_calloc(1, sizeof(*b)))) {
+		socklen_t sinlen = sizeof(*sin);
+
+		return recvfrom(rtp->s, rtp->rawdata + AST_FRIENDLY_OFFSET, sizeof(rtp->rawdata) - AST_FRIENDLY_OFFSET,
+			0, (struct sockaddr *) sin, &sinlen);
+	}
+	if ((res = bridge_p2p_rtp_forward(rtp, &sent, &octets)) < 1)
+		return res;
+
+	i = b->next++;
+	len = b->msgs[i].msg_len;
+	memcpy(rtp->rawdata + AST_FRIENDLY_OFFSET, b->data[i], len);
+	*sin = b->sin[i];
+	return len;
+}
+#endif
+
 struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 {
 	int res;
@@ -1201,6 +1385,12 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 
 	len = sizeof(sin);
 	
+#ifdef RTP_P2P_BATCH
+	if ((rtp->batch && rtp->batch->next < rtp->batch->count) || ast_rtp_get_bridged(rtp)) {
+		if (!(res = bridge_p2p_rtp_read(rtp, &sin)))
+			return &ast_null_frame;
+	} else
+#endif
 	/* Cache where the header will go */
 	res = recvfrom(rtp->s, rtp->rawdata + AST_FRIENDLY_OFFSET, sizeof(rtp->rawdata) - AST_FRIENDLY_OFFSET,
 					0, (struct sockaddr *)&sin, &len);
@@ -1228,7 +1418,9 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 	if (!version) {
 		if ((stun_handle_packet(rtp->s, &sin, rtp->rawdata + AST_FRIENDLY_OFFSET, res) == STUN_ACCEPT) &&
 			(!rtp->them.sin_port && !rtp->them.sin_addr.s_addr)) {
+			ast_mutex_lock(&rtp->bridge_lock);
 			memcpy(&rtp->them, &sin, sizeof(rtp->them));
+			ast_mutex_unlock(&rtp->bridge_lock);
 		}
 		return &ast_null_frame;
 	}
@@ -1245,7 +1437,9 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 		    (rtp->them.sin_port != sin.sin_port)) &&
 		    ((rtp->altthem.sin_addr.s_addr != sin.sin_addr.s_addr) ||
 		    (rtp->altthem.sin_port != sin.sin_port))) {
+			ast_mutex_lock(&rtp->bridge_lock);
 			rtp->them = sin;
+			ast_mutex_unlock(&rtp->bridge_lock);
 			if (rtp->rtcp) {
 				memcpy(&rtp->rtcp->them, &sin, sizeof(rtp->rtcp->them));
 				rtp->rtcp->them.sin_port = htons(ntohs(rtp->them.sin_port)+1);
@@ -1964,28 +2158,384 @@ static int rtp_socket(void)
 	return s;
 }
 
+/*
+ * RTP port allocation.
+ *
+ * Port pairs from rtpstart to rtpend are handed out from a queue of the free
+ * ones, freed longest ago first, so that packets still on their way to a port
+ * from its last call have died out when it is used again.  A pair is only
+ * reused within rtpquarantine milliseconds of being freed when no other one
+ * is free.  A pair found bound by another process goes to the end of the
+ * queue, to be tried again later.  A bitmap tells which pairs are in use.
+ *
+ * With rtpwarmpool = N in rtp.conf, a thread keeps N pairs bound ahead of
+ * time, for the address RTP was last asked for, and calls take those first.
+ */
+struct rtp_pool_entry {
+	int s;
+	int rtcp_s;
+	int port;
+	struct in_addr addr;
+};
+
+static struct rtp_ports {
+	int base;			/*!< first port, even */
+	int count;			/*!< pairs */
+	int used;			/*!< pairs in use, warm pool included */
+	unsigned int *inuse;		/*!< bitmap of the pairs in use */
+	struct timeval *freed;		/*!< when each pair was last freed */
+	int *queue;			/*!< the free pairs, freed longest ago first */
+	int head;
+	int len;
+	/* Statistics */
+	unsigned int allocated;		/*!< pairs given to RTP sessions */
+	unsigned int pooled;		/*!< of them, from the warm pool */
+	unsigned int early;		/*!< of them, reused before their quarantine was over */
+	unsigned int taken;		/*!< pairs found bound by another process */
+	unsigned int exhausted;		/*!< sessions that found no free pair */
+	unsigned int errors;		/*!< sessions that could not be set up for another reason */
+} ports;
+
+static struct rtp_pool_entry rtp_pool[RTP_WARMPOOL_MAX];
+static int rtp_pool_len;
+static struct in_addr rtp_pool_addr;	/*!< RTP was last asked for on this address */
+static pthread_t rtp_pool_thread = AST_PTHREADT_NULL;
+static ast_cond_t rtp_pool_cond;
+AST_MUTEX_DEFINE_STATIC(ports_lock);
+
+#define PORT_INUSE(i)	(ports.inuse[(i) / 32] & (1U << ((i) % 32)))
+
 /*!
- * \brief Initialize a new RTCP session.
+ * \brief Take the free pair freed longest ago that is out of quarantine,
+ * or the one at the head of the queue if they all are in it, with ports_lock held
+ */
+static int rtp_port_take(void)
+{
+	struct timeval now = ast_tvnow();
+	int i, k;
+
+	if (!ports.len)
+		return -1;
+	/* Pairs found bound elsewhere go back in the queue without a new freed
+	   time, so one out of quarantine may wait behind one still in it */
+	for (k = 0; k < ports.len; k++) {
+		if (ast_tvdiff_ms(now, ports.freed[ports.queue[(ports.head + k) % ports.count]]) >= rtpquarantine)
+			break;
+	}
+	if (k == ports.len) {
+		k = 0;
+		ports.early++;
+	}
+	i = ports.queue[(ports.head + k) % ports.count];
+	/* Close the gap, keeping the order of the pairs in front of it */
+	for (; k > 0; k--)
+		ports.queue[(ports.head + k) % ports.count] = ports.queue[(ports.head + k - 1) % ports.count];
+	ports.head = (ports.head + 1) % ports.count;
+	ports.len--;
+	ports.inuse[i / 32] |= 1U << (i % 32);
+	ports.used++;
+
+	return ports.base + 2 * i;
+}
+
+/*!
+ * \brief Put a pair back at the end of the queue, with ports_lock held
+ * \param used whether it was bound by us, and so is quarantined
+ */
+static void rtp_port_put(int port, int used)
+{
+	int i = (port - ports.base) / 2;
+
+	if (port < ports.base || i >= ports.count || !PORT_INUSE(i))
+		return;
+	ports.inuse[i / 32] &= ~(1U << (i % 32));
+	ports.used--;
+	if (used)
+		ports.freed[i] = ast_tvnow();
+	ports.queue[(ports.head + ports.len++) % ports.count] = i;
+	if (rtp_pool_len < rtpwarmpool)
+		ast_cond_signal(&rtp_pool_cond);
+}
+
+/*! \brief Give back the port pair of an RTP session, once its sockets are closed */
+static void rtp_port_free(int port)
+{
+	ast_mutex_lock(&ports_lock);
+	rtp_port_put(port, 1);
+	ast_mutex_unlock(&ports_lock);
+}
+
+/*! \brief Open sockets bound to port, and to port + 1 if rtcp_s is given */
+static int rtp_port_bind(struct in_addr addr, int port, int *s, int *rtcp_s)
+{
+	struct sockaddr_in sin;
+	int err;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = addr;
+	sin.sin_port = htons(port);
+	if ((*s = rtp_socket()) < 0)
+		return -1;
+	if (bind(*s, (struct sockaddr *) &sin, sizeof(sin)))
+		goto fail;
+	if (!rtcp_s)
+		return 0;
+	sin.sin_port = htons(port + 1);
+	if ((*rtcp_s = rtp_socket()) < 0)
+		goto fail;
+	if (bind(*rtcp_s, (struct sockaddr *) &sin, sizeof(sin))) {
+		err = errno;
+		close(*rtcp_s);
+		errno = err;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	err = errno;
+	close(*s);
+	errno = err;
+	return -1;
+}
+
+/*!
+ * \brief Bind sockets to a free port pair
+ * \return the RTP port, -1 with errno EADDRINUSE if no pair is free
+ */
+static int rtp_port_bind_free(struct in_addr addr, int *s, int *rtcp_s)
+{
+	int port, tries;
+
+	for (tries = 0; ; tries++) {
+		ast_mutex_lock(&ports_lock);
+		port = tries < ports.count ? rtp_port_take() : -1;
+		ast_mutex_unlock(&ports_lock);
+		if (port < 0) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		if (!rtp_port_bind(addr, port, s, rtcp_s))
+			return port;
+
+		ast_mutex_lock(&ports_lock);
+		if (errno == EADDRINUSE)
+			ports.taken++;
+		rtp_port_put(port, 0);
+		ast_mutex_unlock(&ports_lock);
+		if (errno != EADDRINUSE)
+			return -1;
+	}
+}
+
+/*! \brief Take a pair from the warm pool, bound to addr */
+static int rtp_pool_take(struct in_addr addr, int *s, int *rtcp_s)
+{
+	struct rtp_pool_entry e;
+	char buf[64];
+	int i, n;
+
+	ast_mutex_lock(&ports_lock);
+	if (!rtpwarmpool) {
+		ast_mutex_unlock(&ports_lock);
+		return -1;
+	}
+	if (rtp_pool_addr.s_addr != addr.s_addr) {
+		rtp_pool_addr = addr;
+		ast_cond_signal(&rtp_pool_cond);
+	}
+	for (i = rtp_pool_len - 1; i >= 0 && rtp_pool[i].addr.s_addr != addr.s_addr; i--)
+		;
+	if (i < 0) {
+		ast_mutex_unlock(&ports_lock);
+		return -1;
+	}
+	e = rtp_pool[i];
+	rtp_pool[i] = rtp_pool[--rtp_pool_len];
+	ast_cond_signal(&rtp_pool_cond);
+	ast_mutex_unlock(&ports_lock);
+
+	/* Whatever reached them while they waited is not for this session.  A
+	   flood is not drained here: the session gets what is left of it, as it
+	   would have on a port bound just now. */
+	for (n = 0; n < RTP_POOL_DRAIN && recv(e.s, buf, sizeof(buf), 0) >= 0; n++)
+		;
+	for (n = 0; n < RTP_POOL_DRAIN && recv(e.rtcp_s, buf, sizeof(buf), 0) >= 0; n++)
+		;
+	*s = e.s;
+	if (rtcp_s)
+		*rtcp_s = e.rtcp_s;
+	else
+		close(e.rtcp_s);
+
+	return e.port;
+}
+
+/*!
+ * \brief Bind the sockets of a new RTP session
+ * \return the RTP port, -1 on failure, with errno EADDRINUSE if no pair is free
+ */
+static int rtp_port_open(struct in_addr addr, int *s, int *rtcp_s)
+{
+	int port, pooled = 0, err;
+
+	if ((port = rtp_pool_take(addr, s, rtcp_s)) > -1)
+		pooled = 1;
+	else
+		port = rtp_port_bind_free(addr, s, rtcp_s);
+
+	err = errno;
+	ast_mutex_lock(&ports_lock);
+	if (port > -1) {
+		ports.allocated++;
+		ports.pooled += pooled;
+	} else if (err == EADDRINUSE)
+		ports.exhausted++;
+	else
+		ports.errors++;
+	ast_mutex_unlock(&ports_lock);
+	errno = err;
+
+	return port;
+}
+
+/*! \brief Close a warm pool entry, with ports_lock held */
+static void rtp_pool_close(struct rtp_pool_entry *e)
+{
+	close(e->s);
+	close(e->rtcp_s);
+	rtp_port_put(e->port, 1);
+}
+
+/*! \brief Keep rtpwarmpool pairs bound for the address RTP was last asked for */
+static void *rtp_pool_run(void *data)
+{
+	struct rtp_pool_entry e;
+	int i;
+
+	ast_mutex_lock(&ports_lock);
+	for (;;) {
+		/* Let go of what is no longer wanted */
+		for (i = 0; i < rtp_pool_len; ) {
+			if (rtp_pool_len > rtpwarmpool || rtp_pool[i].addr.s_addr != rtp_pool_addr.s_addr) {
+				rtp_pool_close(&rtp_pool[i]);
+				rtp_pool[i] = rtp_pool[--rtp_pool_len];
+			} else
+				i++;
+		}
+		if (rtp_pool_len >= rtpwarmpool) {
+			ast_cond_wait(&rtp_pool_cond, &ports_lock);
+			continue;
+		}
+
+		e.addr = rtp_pool_addr;
+		ast_mutex_unlock(&ports_lock);
+		e.port = rtp_port_bind_free(e.addr, &e.s, &e.rtcp_s);
+		ast_mutex_lock(&ports_lock);
+		if (e.port < 0) {
+			/* Wait for a pair to be freed */
+			ast_cond_wait(&rtp_pool_cond, &ports_lock);
+			continue;
+		}
+		if (rtp_pool_len < rtpwarmpool)
+			rtp_pool[rtp_pool_len++] = e;
+		else
+			rtp_pool_close(&e);
+	}
+	ast_mutex_unlock(&ports_lock);
+
+	return NULL;
+}
+
+/*! \brief Set up the port pairs of rtpstart..rtpend, keeping those in use */
+static void rtp_ports_init(void)
+{
+	struct rtp_ports old;
+	int base = (rtpstart + 1) & ~1, count = (rtpend - base) / 2 + 1;
+	int i, j, n, tmp;
+
+	ast_mutex_lock(&ports_lock);
+	if (ports.queue && ports.base == base && ports.count == count)
+		goto done;
+
+	old = ports;
+	ports.base = base;
+	ports.count = count;
+	ports.used = 0;
+	ports.head = 0;
+	ports.len = 0;
+	if (!(ports.inuse = ast_calloc((count + 31) / 32, sizeof(*ports.inuse))) ||
+	    !(ports.freed = ast_calloc(count, sizeof(*ports.freed))) ||
+	    !(ports.queue = ast_calloc(count, sizeof(*ports.queue)))) {
+		if (ports.inuse)
+			free(ports.inuse);
+		if (ports.freed)
+			free(ports.freed);
+		ports = old;
+		goto done;
+	}
+	for (i = 0; i < count; i++) {
+		j = (base + 2 * i - old.base) / 2;
+		if (old.queue && base + 2 * i >= old.base && j < old.count) {
+			ports.freed[i] = old.freed[j];
+			if (old.inuse[j / 32] & (1U << (j % 32))) {
+				ports.inuse[i / 32] |= 1U << (i % 32);
+				ports.used++;
+				continue;
+			}
+		}
+		ports.queue[ports.len++] = i;
+	}
+	/* Free pairs are handed out in a random order to start with */
+	for (n = ports.len; n > 1; n--) {
+		i = ast_random() % n;
+		tmp = ports.queue[i];
+		ports.queue[i] = ports.queue[n - 1];
+		ports.queue[n - 1] = tmp;
+	}
+	if (old.queue) {
+		free(old.inuse);
+		free(old.freed);
+		free(old.queue);
+	}
+
+	/* Pooled pairs out of the new range are no longer tracked */
+	for (i = 0; i < rtp_pool_len; ) {
+		if (rtp_pool[i].port < base || (rtp_pool[i].port - base) / 2 >= count) {
+			close(rtp_pool[i].s);
+			close(rtp_pool[i].rtcp_s);
+			rtp_pool[i] = rtp_pool[--rtp_pool_len];
+		} else
+			i++;
+	}
+
+done:
+	if (rtpwarmpool && rtp_pool_thread == AST_PTHREADT_NULL) {
+		if (ast_pthread_create_background(&rtp_pool_thread, NULL, rtp_pool_run, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start the RTP warm pool thread\n");
+			rtp_pool_thread = AST_PTHREADT_NULL;
+		}
+	} else if (rtp_pool_thread != AST_PTHREADT_NULL)
+		ast_cond_signal(&rtp_pool_cond);
+	ast_mutex_unlock(&ports_lock);
+}
+
+/*!
+ * \brief Initialize a new RTCP session, on socket s.
  * 
  * \returns The newly initialized RTCP session.
  */
-static struct ast_rtcp *ast_rtcp_new(void)
+static struct ast_rtcp *ast_rtcp_new(int s)
 {
 	struct ast_rtcp *rtcp;
 
 	if (!(rtcp = ast_calloc(1, sizeof(*rtcp))))
 		return NULL;
-	rtcp->s = rtp_socket();
+	rtcp->s = s;
 	rtcp->us.sin_family = AF_INET;
 	rtcp->them.sin_family = AF_INET;
 	rtcp->schedid = -1;
 
-	if (rtcp->s < 0) {
-		free(rtcp);
-		ast_log(LOG_WARNING, "Unable to allocate RTCP socket: %s\n", strerror(errno));
-		return NULL;
-	}
-
 	return rtcp;
 }
 
@@ -2009,79 +2559,30 @@ void ast_rtp_new_init(struct ast_rtp *rtp)
 struct ast_rtp *ast_rtp_new_with_bindaddr(struct sched_context *sched, struct io_context *io, int rtcpenable, int callbackmode, struct in_addr addr)
 {
 	struct ast_rtp *rtp;
-	int x;
-	int first;
-	int startplace;
+	int port, rtcp_s = -1;
 	
 	if (!(rtp = ast_calloc(1, sizeof(*rtp))))
 		return NULL;
 
 	ast_rtp_new_init(rtp);
 
-	rtp->s = rtp_socket();
-	if (rtp->s < 0) {
+	/* Must be an even port number by RTP spec, RTCP uses the next one */
+	if ((port = rtp_port_open(addr, &rtp->s, (sched && rtcpenable) ? &rtcp_s : NULL)) < 0) {
+		if (errno == EADDRINUSE)
+			ast_log(LOG_ERROR, "No RTP ports remaining. Can't setup media stream for this call.\n");
+		else
+			ast_log(LOG_ERROR, "Unable to set up RTP on a free port: %s\n", strerror(errno));
 		free(rtp);
-		ast_log(LOG_ERROR, "Unable to allocate socket: %s\n", strerror(errno));
 		return NULL;
 	}
-	if (sched && rtcpenable) {
-		rtp->sched = sched;
-		rtp->rtcp = ast_rtcp_new();
-	}
-	
-	/* Select a random port number in the range of possible RTP */
-	x = (rtpend == rtpstart) ? rtpstart : (ast_random() % (rtpend - rtpstart)) + rtpstart;
-	x = x & ~1;
-	/* Save it for future references. */
-	startplace = x;
-	/* Iterate tring to bind that port and incrementing it otherwise untill a port was found or no ports are available. */
-	for (;;) {
-		/* Must be an even port number by RTP spec */
-		rtp->us.sin_port = htons(x);
-		rtp->us.sin_addr = addr;
-		/* If there's rtcp, initialize it as well. */
-		if (rtp->rtcp) {
-			rtp->rtcp->us.sin_port = htons(x + 1);
+	rtp->us.sin_port = htons(port);
+	rtp->us.sin_addr = addr;
+	if (rtcp_s > -1) {
+		if ((rtp->rtcp = ast_rtcp_new(rtcp_s))) {
+			rtp->rtcp->us.sin_port = htons(port + 1);
 			rtp->rtcp->us.sin_addr = addr;
-		}
-		/* Try to bind it/them. */
-		if (!(first = bind(rtp->s, (struct sockaddr *)&rtp->us, sizeof(rtp->us))) &&
-			(!rtp->rtcp || !bind(rtp->rtcp->s, (struct sockaddr *)&rtp->rtcp->us, sizeof(rtp->rtcp->us))))
-			break;
-		if (!first) {
-			/* Primary bind succeeded! Gotta recreate it */
-			close(rtp->s);
-			rtp->s = rtp_socket();
-		}
-		if (errno != EADDRINUSE) {
-			/* We got an error that wasn't expected, abort! */
-			ast_log(LOG_ERROR, "Unexpected bind error: %s\n", strerror(errno));
-			close(rtp->s);
-			if (rtp->rtcp) {
-				close(rtp->rtcp->s);
-				free(rtp->rtcp);
-			}
-			free(rtp);
-			return NULL;
-		}
-		/* The port was used, increment it (by two). */
-		x += 2;
-		/* Did we go over the limit ? */
-		if (x > rtpend)
-			/* then, start from the begingig. */
-			x = (rtpstart + 1) & ~1;
-		/* Check if we reached the place were we started. */
-		if (x == startplace) {
-			/* If so, there's no ports available. */
-			ast_log(LOG_ERROR, "No RTP ports remaining. Can't setup media stream for this call.\n");
-			close(rtp->s);
-			if (rtp->rtcp) {
-				close(rtp->rtcp->s);
-				free(rtp->rtcp);
-			}
-			free(rtp);
-			return NULL;
-		}
+		} else
+			close(rtcp_s);
 	}
 	rtp->sched = sched;
 	rtp->io = io;
@@ -2135,8 +2636,10 @@ void ast_rtp_change_source(struct ast_rtp *rtp)
 
 void ast_rtp_set_peer(struct ast_rtp *rtp, struct sockaddr_in *them)
 {
+	ast_mutex_lock(&rtp->bridge_lock);
 	rtp->them.sin_port = them->sin_port;
 	rtp->them.sin_addr = them->sin_addr;
+	ast_mutex_unlock(&rtp->bridge_lock);
 	if (rtp->rtcp) {
 		rtp->rtcp->them.sin_port = htons(ntohs(them->sin_port) + 1);
 		rtp->rtcp->them.sin_addr = them->sin_addr;
@@ -2189,8 +2692,10 @@ void ast_rtp_stop(struct ast_rtp *rtp)
 		AST_SCHED_DEL(rtp->sched, rtp->rtcp->schedid);
 	}
 
+	ast_mutex_lock(&rtp->bridge_lock);
 	memset(&rtp->them.sin_addr, 0, sizeof(rtp->them.sin_addr));
 	memset(&rtp->them.sin_port, 0, sizeof(rtp->them.sin_port));
+	ast_mutex_unlock(&rtp->bridge_lock);
 	if (rtp->rtcp) {
 		memset(&rtp->rtcp->them.sin_addr, 0, sizeof(rtp->rtcp->them.sin_addr));
 		memset(&rtp->rtcp->them.sin_port, 0, sizeof(rtp->rtcp->them.sin_port));
@@ -2295,9 +2800,14 @@ void ast_rtp_destroy(struct ast_rtp *rtp)
 		free(rtp->rtcp);
 		rtp->rtcp=NULL;
 	}
+	rtp_port_free(ntohs(rtp->us.sin_port));
 
 	ast_mutex_destroy(&rtp->bridge_lock);
 
+#ifdef RTP_P2P_BATCH
+	if (rtp->batch)
+		free(rtp->batch);
+#endif
 	free(rtp);
 }
 
@@ -3238,16 +3748,25 @@ static int p2p_rtp_callback(int *id, int fd, short events, void *cbdata)
 {
 	int res = 0, hdrlen = 12;
 	struct sockaddr_in sin;
+#ifndef RTP_P2P_BATCH
 	socklen_t len;
+#endif
 	unsigned int *header;
 	struct ast_rtp *rtp = cbdata, *bridged = NULL;
 
 	if (!rtp)
 		return 1;
 
+#ifdef RTP_P2P_BATCH
+	/* Most packets are forwarded right away, the rest are handled one by one */
+	do {
+		if ((res = bridge_p2p_rtp_read(rtp, &sin)) < 1)
+			return 1;
+#else
 	len = sizeof(sin);
 	if ((res = recvfrom(fd, rtp->rawdata + AST_FRIENDLY_OFFSET, sizeof(rtp->rawdata) - AST_FRIENDLY_OFFSET, 0, (struct sockaddr *)&sin, &len)) < 0)
 		return 1;
+#endif
 
 	header = (unsigned int *)(rtp->rawdata + AST_FRIENDLY_OFFSET);
 
@@ -3255,7 +3774,9 @@ static int p2p_rtp_callback(int *id, int fd, short events, void *cbdata)
 	if ((rtp->nat) && 
 	    ((rtp->them.sin_addr.s_addr != sin.sin_addr.s_addr) ||
 	     (rtp->them.sin_port != sin.sin_port))) {
+		ast_mutex_lock(&rtp->bridge_lock);
 		rtp->them = sin;
+		ast_mutex_unlock(&rtp->bridge_lock);
 		rtp->rxseqno = 0;
 		ast_set_flag(rtp, FLAG_NAT_ACTIVE);
 		if (option_debug || rtpdebug)
@@ -3265,6 +3786,9 @@ static int p2p_rtp_callback(int *id, int fd, short events, void *cbdata)
 	/* Write directly out to other RTP stream if bridged */
 	if ((bridged = ast_rtp_get_bridged(rtp)))
 		bridge_p2p_rtp_write(rtp, bridged, header, res, hdrlen);
+#ifdef RTP_P2P_BATCH
+	} while (rtp->batch && rtp->batch->next < rtp->batch->count);
+#endif
 
 	return 1;
 }
@@ -3284,7 +3808,7 @@ static int p2p_callback_enable(struct ast_channel *chan, struct ast_rtp *rtp, in
 
 	/* Steal the file descriptors from the channel and stash them away */
 	fds[0] = chan->fds[0];
-	chan->fds[0] = -1;
+	ast_channel_set_fd(chan, 0, -1);
 
 	/* Now, fire up callback mode */
 	iod[0] = ast_io_add(rtp->io, fds[0], p2p_rtp_callback, AST_IO_IN, rtp);
@@ -3307,7 +3831,7 @@ static int p2p_callback_disable(struct ast_channel *chan, struct ast_rtp *rtp, i
 	ast_io_remove(rtp->io, iod[0]);
 
 	/* Restore file descriptors */
-	chan->fds[0] = fds[0];
+	ast_channel_set_fd(chan, 0, fds[0]);
 	ast_channel_unlock(chan);
 
 	/* Restore callback mode if previously used */
@@ -3327,6 +3851,356 @@ static void p2p_set_bridge(struct ast_rtp *rtp0, struct ast_rtp *rtp1)
 	return;
 }
 
+#ifdef RTP_RELAY
+/*
+ * Relay threads.
+ *
+ * Once a Packet2Packet bridge is up, most packets only need their payload
+ * type rewritten on their way through.  Rather than waking the bridge thread
+ * for each of them, the RTP sockets of both legs are taken from the channels
+ * and given to one of a few relay threads, which forward them in batches.
+ *
+ * A packet the core has to see (STUN, a new NAT source, DTMF the bridge
+ * listens for, an unexpected payload) makes the relay thread give the streams
+ * back to the bridge thread, which reads it through the channel, then has
+ * them relayed again.  Control frames, and with them re-INVITEs and hangups,
+ * still reach the bridge thread through the channels' other fds, and it stops
+ * the relay before acting on them.
+ */
+
+/*! \brief One way of a relayed bridge */
+struct rtp_relay_leg {
+	struct rtp_relay *relay;
+	struct ast_channel *chan;
+	struct ast_rtp *rtp;		/*!< read, and forwarded to what it is bridged to */
+	int fd;				/*!< taken from the channel while relayed */
+	void *pvt;			/*!< tech_pvt of the channel when fd was taken */
+	unsigned int packets;		/*!< relayed */
+	unsigned int octets;
+	char name[AST_CHANNEL_NAME];
+};
+
+/*! \brief A Packet2Packet bridge whose RTP is relayed */
+struct rtp_relay {
+	int active;			/*!< the relay thread forwards, under the relay's lock */
+	int engaged;			/*!< the channels' fds are taken, bridge thread only */
+	int handbacks;			/*!< times the streams were given back to the core */
+	int failed;			/*!< could not be relayed, left to the core */
+	int pipe[2];			/*!< the relay thread wakes the bridge thread with it */
+	struct rtp_relay_thread *thread;
+	struct timeval start;
+	struct rtp_relay_leg leg[2];
+	AST_LIST_ENTRY(rtp_relay) list;
+};
+
+struct rtp_relay_thread {
+	pthread_t thread;
+	int epfd;
+	int relays;			/*!< bridges relayed */
+	AST_LIST_HEAD_NOLOCK(, rtp_relay) dead;	/*!< relays to let go of before waiting again */
+};
+
+static struct rtp_relay_thread relay_threads[RTP_RELAY_MAX_THREADS];
+static int relay_thread_count;
+AST_MUTEX_DEFINE_STATIC(relay_lock);
+static struct ao2_container *relays;
+
+/*! \brief Stop forwarding, with the relay locked */
+static void rtp_relay_deactivate(struct rtp_relay *relay)
+{
+	struct epoll_event ev = { 0, };
+	int i;
+
+	relay->active = 0;
+	for (i = 0; i < 2; i++)
+		epoll_ctl(relay->thread->epfd, EPOLL_CTL_DEL, relay->leg[i].rtp->s, &ev);
+}
+
+/*! \brief Forward what was received on one leg, or give the streams back */
+static void rtp_relay_forward(struct rtp_relay_leg *leg)
+{
+	struct rtp_relay *relay = leg->relay;
+	int res;
+
+	ao2_lock(relay);
+	if (!relay->active) {
+		ao2_unlock(relay);
+		return;
+	}
+	if (!(res = bridge_p2p_rtp_forward(leg->rtp, &leg->packets, &leg->octets)))
+		leg->rtp->lastrx = ast_tvnow();
+	else if (res > 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		rtp_relay_deactivate(relay);
+		relay->handbacks++;
+		if (write(relay->pipe[1], "", 1) < 0)
+			ast_log(LOG_WARNING, "Unable to wake up the bridge of %s and %s: %s\n", relay->leg[0].name, relay->leg[1].name, strerror(errno));
+	}
+	ao2_unlock(relay);
+}
+
+static void *rtp_relay_run(void *data)
+{
+	struct rtp_relay_thread *t = data;
+	struct epoll_event ev[64];
+	struct rtp_relay *relay;
+	int i, res;
+
+	for (;;) {
+		/* Nothing returned from here on is about relays stopped before */
+		ast_mutex_lock(&relay_lock);
+		while ((relay = AST_LIST_REMOVE_HEAD(&t->dead, list)))
+			ao2_ref(relay, -1);
+		ast_mutex_unlock(&relay_lock);
+
+		if ((res = epoll_wait(t->epfd, ev, ARRAY_LEN(ev), 1000)) < 0) {
+			if (errno != EINTR) {
+				ast_log(LOG_WARNING, "RTP relay wait failed: %s\n", strerror(errno));
+				usleep(100000);
+			}
+			continue;
+		}
+		for (i = 0; i < res; i++)
+			rtp_relay_forward(ev[i].data.ptr);
+	}
+
+	return NULL;
+}
+
+static int rtp_relay_thread_start(struct rtp_relay_thread *t)
+{
+	if ((t->epfd = epoll_create(64)) < 0) {
+		ast_log(LOG_WARNING, "Unable to create an epoll set for RTP relaying: %s\n", strerror(errno));
+		return -1;
+	}
+	AST_LIST_HEAD_INIT_NOLOCK(&t->dead);
+	if (ast_pthread_create_background(&t->thread, NULL, rtp_relay_run, t)) {
+		ast_log(LOG_WARNING, "Unable to start an RTP relay thread\n");
+		close(t->epfd);
+		return -1;
+	}
+	return 0;
+}
+
+static void rtp_relay_destructor(void *obj)
+{
+	struct rtp_relay *relay = obj;
+
+	if (relay->pipe[0] > -1) {
+		close(relay->pipe[0]);
+		close(relay->pipe[1]);
+	}
+}
+
+/*! \brief Set up relaying of a Packet2Packet bridge, if rtp.conf asks for it */
+static struct rtp_relay *rtp_relay_new(struct ast_channel *c0, struct ast_rtp *p0, struct ast_channel *c1, struct ast_rtp *p1)
+{
+	struct rtp_relay *relay;
+	struct rtp_relay_thread *t = NULL;
+	int threads = relaythreads, i, flags;
+
+	if (!threads || !relays)
+		return NULL;
+	if ((!p0->batch && !(p0->batch = ast_calloc(1, sizeof(*p0->batch)))) ||
+	    (!p1->batch && !(p1->batch = ast_calloc(1, sizeof(*p1->batch)))))
+		return NULL;
+	if (!(relay = ao2_alloc(sizeof(*relay), rtp_relay_destructor)))
+		return NULL;
+	if (pipe(relay->pipe)) {
+		ast_log(LOG_WARNING, "Unable to create a pipe for RTP relaying: %s\n", strerror(errno));
+		relay->pipe[0] = relay->pipe[1] = -1;
+		ao2_ref(relay, -1);
+		return NULL;
+	}
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(relay->pipe[i], F_GETFL);
+		fcntl(relay->pipe[i], F_SETFL, flags | O_NONBLOCK);
+	}
+
+	/* Threads are started as they are first needed, the least busy one is picked */
+	ast_mutex_lock(&relay_lock);
+	while (relay_thread_count < threads && !rtp_relay_thread_start(&relay_threads[relay_thread_count]))
+		relay_thread_count++;
+	for (i = 0; i < relay_thread_count && i < threads; i++) {
+		if (!t || relay_threads[i].relays < t->relays)
+			t = &relay_threads[i];
+	}
+	if (t)
+		t->relays++;
+	ast_mutex_unlock(&relay_lock);
+	if (!t) {
+		ao2_ref(relay, -1);
+		return NULL;
+	}
+
+	relay->thread = t;
+	relay->start = ast_tvnow();
+	relay->leg[0].chan = c0;
+	relay->leg[0].rtp = p0;
+	ast_copy_string(relay->leg[0].name, c0->name, sizeof(relay->leg[0].name));
+	relay->leg[1].chan = c1;
+	relay->leg[1].rtp = p1;
+	ast_copy_string(relay->leg[1].name, c1->name, sizeof(relay->leg[1].name));
+	for (i = 0; i < 2; i++) {
+		relay->leg[i].relay = relay;
+		relay->leg[i].fd = -1;
+	}
+	/* The relay thread's reference, given up through its dead list */
+	ao2_ref(relay, +1);
+	ao2_link(relays, relay);
+
+	return relay;
+}
+
+/*! \brief Find a leg with a packet the relay left to the core, and have its channel read next */
+static struct ast_channel *rtp_relay_pending(struct rtp_relay *relay)
+{
+	struct rtp_relay_leg *leg;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		leg = &relay->leg[i];
+		if (leg->rtp->batch->next < leg->rtp->batch->count) {
+			ast_channel_lock(leg->chan);
+			ast_clear_flag(leg->chan, AST_FLAG_EXCEPTION);
+			leg->chan->fdno = 0;
+			ast_channel_unlock(leg->chan);
+			return leg->chan;
+		}
+	}
+
+	return NULL;
+}
+
+/*! \brief Find the channel a masquerade gave the media of a leg to
+ * \return the channel, locked, or NULL
+ */
+static struct ast_channel *rtp_relay_owner(struct rtp_relay_leg *leg)
+{
+	struct ast_channel *chan = NULL;
+
+	while ((chan = ast_channel_walk_locked(chan))) {
+		if (chan->tech_pvt == leg->pvt)
+			return chan;
+		ast_channel_unlock(chan);
+	}
+
+	return NULL;
+}
+
+/*! \brief Stop the relay thread and give the streams back to the channels */
+static void rtp_relay_disengage(struct rtp_relay *relay)
+{
+	struct rtp_relay_leg *leg;
+	struct ast_channel *chan;
+	char buf[16];
+	int i;
+
+	if (!relay->engaged)
+		return;
+
+	ao2_lock(relay);
+	if (relay->active)
+		rtp_relay_deactivate(relay);
+	ao2_unlock(relay);
+
+	for (i = 0; i < 2; i++) {
+		leg = &relay->leg[i];
+		chan = leg->chan;
+		ast_channel_lock(chan);
+		if (chan->tech_pvt != leg->pvt) {
+			/* A masquerade run by another thread moved our media, and the
+			 * fd we took, to the channel it was cloned into */
+			ast_channel_unlock(chan);
+			chan = rtp_relay_owner(leg);
+		}
+		if (chan) {
+			/* Unless the masquerade also gave it the fds of other media */
+			if (chan->fds[0] == -1)
+				ast_channel_set_fd(chan, 0, leg->fd);
+			ast_channel_unlock(chan);
+		}
+		leg->fd = -1;
+		leg->pvt = NULL;
+	}
+	relay->engaged = 0;
+
+	while (read(relay->pipe[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+/*! \brief Take the streams from the channels and have the relay thread forward them */
+static void rtp_relay_engage(struct rtp_relay *relay)
+{
+	struct epoll_event ev = { 0, };
+	struct rtp_relay_leg *leg;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		leg = &relay->leg[i];
+		ast_channel_lock(leg->chan);
+		leg->fd = leg->chan->fds[0];
+		leg->pvt = leg->chan->tech_pvt;
+		ast_channel_set_fd(leg->chan, 0, -1);
+		ast_channel_unlock(leg->chan);
+	}
+	relay->engaged = 1;
+
+	ao2_lock(relay);
+	relay->active = 1;
+	for (i = 0; i < 2 && relay->active; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &relay->leg[i];
+		if (epoll_ctl(relay->thread->epfd, EPOLL_CTL_ADD, relay->leg[i].rtp->s, &ev)) {
+			ast_log(LOG_WARNING, "Unable to relay RTP of %s: %s\n", relay->leg[i].name, strerror(errno));
+			rtp_relay_deactivate(relay);
+			relay->failed = 1;
+		}
+	}
+	ao2_unlock(relay);
+
+	if (relay->failed)
+		rtp_relay_disengage(relay);
+}
+
+/*! \brief ast_waitfor_n() for a relayed bridge, which keeps the relay going */
+static struct ast_channel *rtp_relay_waitfor(struct rtp_relay *relay, struct ast_channel **cs, int *ms)
+{
+	struct ast_channel *who;
+	int outfd;
+
+	/* A masquerade is run while waiting, the fds it moves must be back by then */
+	if (cs[0]->masq || cs[0]->masqr || cs[1]->masq || cs[1]->masqr)
+		rtp_relay_disengage(relay);
+	/* The streams go back to the relay once the core read what it was left */
+	else if (!relay->engaged && !relay->failed && ast_rtp_get_bridged(relay->leg[0].rtp)) {
+		if ((who = rtp_relay_pending(relay)))
+			return who;
+		rtp_relay_engage(relay);
+	}
+
+	if (!(who = ast_waitfor_nandfds(cs, 2, &relay->pipe[0], 1, NULL, &outfd, ms)) && outfd == relay->pipe[0]) {
+		rtp_relay_disengage(relay);
+		who = rtp_relay_pending(relay);
+	}
+
+	return who;
+}
+
+/*! \brief Stop relaying a bridge for good */
+static void rtp_relay_destroy(struct rtp_relay *relay)
+{
+	rtp_relay_disengage(relay);
+	ao2_unlink(relays, relay);
+
+	ast_mutex_lock(&relay_lock);
+	relay->thread->relays--;
+	AST_LIST_INSERT_TAIL(&relay->thread->dead, relay, list);
+	ast_mutex_unlock(&relay_lock);
+
+	ao2_ref(relay, -1);
+}
+#endif
+
 /*! \brief Bridge loop for partial native bridge (packet2packet) */
 static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast_channel *c1, struct ast_rtp *p0, struct ast_rtp *p1, int timeoutms, int flags, struct ast_frame **fo, struct ast_channel **rc, void *pvt0, void *pvt1)
 {
@@ -3336,6 +4210,9 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 	int *p0_iod[2] = {NULL, NULL}, *p1_iod[2] = {NULL, NULL};
 	int p0_callback = 0, p1_callback = 0;
 	enum ast_bridge_result res = AST_BRIDGE_FAILED;
+#ifdef RTP_RELAY
+	struct rtp_relay *relay = NULL;
+#endif
 
 	/* Okay, setup each RTP structure to do P2P forwarding */
 	ast_clear_flag(p0, FLAG_P2P_SENT_MARK);
@@ -3346,11 +4223,19 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 	/* Activate callback modes if possible */
 	p0_callback = p2p_callback_enable(c0, p0, &p0_fds[0], &p0_iod[0]);
 	p1_callback = p2p_callback_enable(c1, p1, &p1_fds[0], &p1_iod[0]);
+#ifdef RTP_RELAY
+	/* Otherwise leave forwarding to the relay threads, if there are any */
+	if (!p0_callback && !p1_callback)
+		relay = rtp_relay_new(c0, p0, c1, p1);
+#endif
 
 	/* Now let go of the channel locks and be on our way */
 	ast_channel_unlock(c0);
 	ast_channel_unlock(c1);
 
+	/* Wait on both channels with a single epoll set, where available */
+	ast_poll_channel_add(c0, c1);
+
 	/* Go into a loop forwarding frames until we don't need to anymore */
 	cs[0] = c0;
 	cs[1] = c1;
@@ -3368,6 +4253,11 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 		    (c0->masq || c0->masqr || c1->masq || c1->masqr) ||
 		    (c0->monitor || c0->audiohooks || c1->monitor || c1->audiohooks)) {
 			ast_log(LOG_DEBUG, "Oooh, something is weird, backing out\n");
+#ifdef RTP_RELAY
+			/* Reading runs the masquerade, which must see the channels' own fds */
+			if (relay)
+				rtp_relay_disengage(relay);
+#endif
 			if ((c0->masq || c0->masqr) && (fr = ast_read(c0)))
 				ast_frfree(fr);
 			if ((c1->masq || c1->masqr) && (fr = ast_read(c1)))
@@ -3376,7 +4266,13 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 			break;
 		}
 		/* Wait on a channel to feed us a frame */
-		if (!(who = ast_waitfor_n(cs, 2, &timeoutms))) {
+#ifdef RTP_RELAY
+		if (relay)
+			who = rtp_relay_waitfor(relay, cs, &timeoutms);
+		else
+#endif
+		who = ast_waitfor_n(cs, 2, &timeoutms);
+		if (!who) {
 			if (!timeoutms) {
 				res = AST_BRIDGE_RETRY;
 				break;
@@ -3408,6 +4304,10 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 			    (fr->subclass == AST_CONTROL_SRCUPDATE)) {
 				/* If we are going on hold, then break callback mode and P2P bridging */
 				if (fr->subclass == AST_CONTROL_HOLD) {
+#ifdef RTP_RELAY
+					if (relay)
+						rtp_relay_disengage(relay);
+#endif
 					if (p0_callback)
 						p0_callback = p2p_callback_disable(c0, p0, &p0_fds[0], &p0_iod[0]);
 					if (p1_callback)
@@ -3452,6 +4352,13 @@ static enum ast_bridge_result bridge_p2p_loop(struct ast_channel *c0, struct ast
 		cs[1] = cs[2];
 	}
 
+#ifdef RTP_RELAY
+	if (relay)
+		rtp_relay_destroy(relay);
+#endif
+
+	ast_poll_channel_del(c0, c1);
+
 	/* If we are totally avoiding the core, then restore our link to it */
 	if (p0_callback)
 		p0_callback = p2p_callback_disable(c0, p0, &p0_fds[0], &p0_iod[0]);
@@ -3832,6 +4739,69 @@ static int stun_no_debug(int fd, int argc, char *argv[])
 	return RESULT_SUCCESS;
 }
 
+#ifdef RTP_RELAY
+static int rtp_show_relays(int fd, int argc, char *argv[])
+{
+#define FORMAT  "%-20.20s %-20.20s %-6.6s %-8.8s %10.10s %10.10s %12.12s %12.12s %9.9s %8.8s\n"
+#define FORMAT2 "%-20.20s %-20.20s %-6d %-8.8s %10u %10u %12u %12u %9d %8ld\n"
+	struct ao2_iterator i;
+	struct rtp_relay *relay;
+	int count = 0;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	if (!relays) {
+		ast_cli(fd, "RTP relaying is not available\n");
+		return RESULT_SUCCESS;
+	}
+	ast_cli(fd, FORMAT, "Channel", "Bridged to", "Thread", "State", "Packets", "Returned", "Bytes", "Returned", "Handbacks", "Seconds");
+	i = ao2_iterator_init(relays, 0);
+	while ((relay = ao2_iterator_next(&i))) {
+		ast_cli(fd, FORMAT2, relay->leg[0].name, relay->leg[1].name, (int) (relay->thread - relay_threads),
+			relay->active ? "Relayed" : "Core",
+			relay->leg[0].packets, relay->leg[1].packets, relay->leg[0].octets, relay->leg[1].octets,
+			relay->handbacks, (long) ast_tvdiff_ms(ast_tvnow(), relay->start) / 1000);
+		ao2_ref(relay, -1);
+		count++;
+	}
+	ao2_iterator_destroy(&i);
+	ast_cli(fd, "%d relayed bridge%s, %d relay thread%s running (relaythreads = %d)\n",
+		count, (count != 1) ? "s" : "", relay_thread_count, (relay_thread_count != 1) ? "s" : "", relaythreads);
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+#endif
+
+static int rtp_show_ports(int fd, int argc, char *argv[])
+{
+	struct rtp_ports p;
+	int quarantined = 0, pooled, i;
+	struct timeval now = ast_tvnow();
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	ast_mutex_lock(&ports_lock);
+	p = ports;
+	pooled = rtp_pool_len;
+	for (i = 0; i < ports.len; i++) {
+		if (ast_tvdiff_ms(now, ports.freed[ports.queue[(ports.head + i) % ports.count]]) < rtpquarantine)
+			quarantined++;
+	}
+	ast_mutex_unlock(&ports_lock);
+
+	ast_cli(fd, "Port range:         %d-%d (%d pair%s)\n", p.base, p.base + 2 * p.count - 1, p.count, (p.count != 1) ? "s" : "");
+	ast_cli(fd, "In use:             %d, %d of them in the warm pool (rtpwarmpool = %d)\n", p.used, pooled, rtpwarmpool);
+	ast_cli(fd, "Free:               %d, %d of them in quarantine (rtpquarantine = %d ms)\n", p.len, quarantined, rtpquarantine);
+	ast_cli(fd, "Allocated:          %u, %u of them from the warm pool\n", p.allocated, p.pooled);
+	ast_cli(fd, "Reused early:       %u\n", p.early);
+	ast_cli(fd, "Taken by others:    %u\n", p.taken);
+	ast_cli(fd, "Failed, no ports:   %u\n", p.exhausted);
+	ast_cli(fd, "Failed, errors:     %u\n", p.errors);
+	return RESULT_SUCCESS;
+}
+
 static char debug_usage[] =
   "Usage: rtp debug [ip host[:port]]\n"
   "       Enable dumping of all RTP packets to and from host.\n";
@@ -3856,6 +4826,19 @@ static char rtcp_no_debug_usage[] =
   "Usage: rtcp debug off\n"
   "       Disable all RTCP debugging\n";
 
+static char show_ports_usage[] =
+  "Usage: rtp show ports\n"
+  "       Show how the RTP port range is used: pairs in use, free and in\n"
+  "       quarantine, how many were handed out, and the allocation failures.\n";
+
+#ifdef RTP_RELAY
+static char show_relays_usage[] =
+  "Usage: rtp show relays\n"
+  "       List the Packet2Packet bridges whose RTP is relayed, with the packets\n"
+  "       and bytes relayed from the channel and returned from the one it is\n"
+  "       bridged to, and how often the streams were handed back to the core.\n";
+#endif
+
 static char rtcp_stats_usage[] =
   "Usage: rtcp stats\n"
   "       Enable dumping of RTCP stats.\n";
@@ -3939,6 +4922,16 @@ static struct ast_cli_entry cli_rtp[] = {
 	{ { "stun", "debug", "off", NULL },
 	stun_no_debug, "Disable STUN debugging",
 	stun_no_debug_usage, NULL, &cli_stun_no_debug_deprecated },
+
+	{ { "rtp", "show", "ports", NULL },
+	rtp_show_ports, "Show RTP port allocation",
+	show_ports_usage },
+
+#ifdef RTP_RELAY
+	{ { "rtp", "show", "relays", NULL },
+	rtp_show_relays, "List relayed RTP bridges",
+	show_relays_usage },
+#endif
 };
 
 int ast_rtp_reload(void)
@@ -3948,7 +4941,12 @@ int ast_rtp_reload(void)
 
 	rtpstart = 5000;
 	rtpend = 31000;
+	rtpquarantine = DEFAULT_RTP_QUARANTINE;
+	rtpwarmpool = 0;
 	dtmftimeout = DEFAULT_DTMF_TIMEOUT;
+#ifdef RTP_RELAY
+	relaythreads = 0;
+#endif
 	cfg = ast_config_load("rtp.conf");
 	if (cfg) {
 		if ((s = ast_variable_retrieve(cfg, "general", "rtpstart"))) {
@@ -3965,6 +4963,20 @@ int ast_rtp_reload(void)
 			if (rtpend > 65535)
 				rtpend = 65535;
 		}
+		if ((s = ast_variable_retrieve(cfg, "general", "rtpquarantine"))) {
+			rtpquarantine = atoi(s);
+			if (rtpquarantine < 0)
+				rtpquarantine = 0;
+		}
+		if ((s = ast_variable_retrieve(cfg, "general", "rtpwarmpool"))) {
+			rtpwarmpool = atoi(s);
+			if (rtpwarmpool < 0)
+				rtpwarmpool = 0;
+			if (rtpwarmpool > RTP_WARMPOOL_MAX) {
+				ast_log(LOG_WARNING, "rtpwarmpool of '%d' is too large, using %d instead\n", rtpwarmpool, RTP_WARMPOOL_MAX);
+				rtpwarmpool = RTP_WARMPOOL_MAX;
+			}
+		}
 		if ((s = ast_variable_retrieve(cfg, "general", "rtcpinterval"))) {
 			rtcpinterval = atoi(s);
 			if (rtcpinterval == 0)
@@ -3993,6 +5005,20 @@ int ast_rtp_reload(void)
 				dtmftimeout = DEFAULT_DTMF_TIMEOUT;
 			};
 		}
+		if ((s = ast_variable_retrieve(cfg, "general", "relaythreads"))) {
+#ifdef RTP_RELAY
+			relaythreads = atoi(s);
+			if (relaythreads < 0)
+				relaythreads = 0;
+			if (relaythreads > RTP_RELAY_MAX_THREADS) {
+				ast_log(LOG_WARNING, "relaythreads of '%d' is too many, using %d instead\n", relaythreads, RTP_RELAY_MAX_THREADS);
+				relaythreads = RTP_RELAY_MAX_THREADS;
+			}
+#else
+			if (atoi(s) > 0)
+				ast_log(LOG_WARNING, "Relaying RTP is not supported on this operating system!\n");
+#endif
+		}
 		ast_config_destroy(cfg);
 	}
 	if (rtpstart >= rtpend) {
@@ -4000,6 +5026,7 @@ int ast_rtp_reload(void)
 		rtpstart = 5000;
 		rtpend = 31000;
 	}
+	rtp_ports_init();
 	if (option_verbose > 1)
 		ast_verbose(VERBOSE_PREFIX_2 "RTP Allocating from port range %d -> %d\n", rtpstart, rtpend);
 	return 0;
@@ -4008,6 +5035,10 @@ int ast_rtp_reload(void)
 /*! \brief Initialize the RTP system in Asterisk */
 void ast_rtp_init(void)
 {
+#ifdef RTP_RELAY
+	relays = ao2_container_alloc(1, NULL, NULL);
+#endif
+	ast_cond_init(&rtp_pool_cond, NULL);
 	ast_cli_register_multiple(cli_rtp, sizeof(cli_rtp) / sizeof(struct ast_cli_entry));
 	ast_rtp_reload();
 }
@@ -49,9 +49,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 253631 $")
 #include "asterisk/utils.h"
 #include "asterisk/linkedlists.h"
 #include "asterisk/options.h"
+#include "asterisk/cli.h"
+
+/*! Initial number of slots in the heap and in the id hash of a context */
+#define SCHED_INITIAL_SIZE 64
 
 struct sched {
-	AST_LIST_ENTRY(sched) list;
+	AST_LIST_ENTRY(sched) list;   /*!< Entry in the cache of unused structures */
+	struct sched *next_id;        /*!< Next event in the same id hash bucket */
+	unsigned int heap_index;      /*!< Position of the event in the heap */
+	unsigned int tie;             /*!< Insertion sequence, keeps events due at the same time in FIFO order */
 	int id;                       /*!< ID number of event */
 	struct timeval when;          /*!< Absolute time event should take place */
 	int resched;                  /*!< When to reschedule */
@@ -60,18 +67,38 @@ struct sched {
 	ast_sched_cb callback;        /*!< Callback */
 };
 
+/*! \brief Count and latency of one kind of scheduler operation */
+struct sched_op_stats {
+	unsigned int count;           /*!< Number of operations */
+	uint64_t total;               /*!< Total time spent, in microseconds */
+	unsigned int max;             /*!< Slowest operation, in microseconds */
+};
+
 struct sched_context {
 	ast_mutex_t lock;
 	unsigned int eventcnt;                  /*!< Number of events processed */
 	unsigned int schedcnt;                  /*!< Number of outstanding schedule events */
-	AST_LIST_HEAD_NOLOCK(, sched) schedq;   /*!< Schedule entry and main queue */
+	unsigned int tiecnt;                    /*!< Next insertion sequence number */
+	struct sched **heap;                    /*!< Min-heap of outstanding events, soonest first */
+	unsigned int heapsize;                  /*!< Number of slots allocated in the heap */
+	struct sched **ids;                     /*!< Hash of outstanding events by id */
+	unsigned int idbuckets;                 /*!< Number of buckets in the id hash, a power of two */
+
+	unsigned int maxdepth;                  /*!< Highest number of outstanding events seen */
+	struct sched_op_stats adds;             /*!< Time spent adding events */
+	struct sched_op_stats dels;             /*!< Time spent deleting events */
+	struct sched_op_stats runs;             /*!< Time spent in event callbacks */
 
 #ifdef SCHED_MAX_CACHE
 	AST_LIST_HEAD_NOLOCK(, sched) schedc;   /*!< Cache of unused schedule structures and how many */
 	unsigned int schedccnt;
 #endif
+	AST_LIST_ENTRY(sched_context) list;     /*!< Entry in the list of all contexts */
 };
 
+/*! \brief All scheduler contexts, for 'core show sched' */
+static AST_LIST_HEAD_STATIC(contexts, sched_context);
+
 struct sched_context *sched_context_create(void)
 {
 	struct sched_context *tmp;
@@ -79,8 +106,22 @@ struct sched_context *sched_context_create(void)
 	if (!(tmp = ast_calloc(1, sizeof(*tmp))))
 		return NULL;
 
+	if (!(tmp->heap = ast_calloc(SCHED_INITIAL_SIZE, sizeof(*tmp->heap))) ||
+	    !(tmp->ids = ast_calloc(SCHED_INITIAL_SIZE, sizeof(*tmp->ids)))) {
+		if (tmp->heap)
+			free(tmp->heap);
+		free(tmp);
+		return NULL;
+	}
+	tmp->heapsize = SCHED_INITIAL_SIZE;
+	tmp->idbuckets = SCHED_INITIAL_SIZE;
+
 	ast_mutex_init(&tmp->lock);
 	tmp->eventcnt = 1;
+
+	AST_LIST_LOCK(&contexts);
+	AST_LIST_INSERT_HEAD(&contexts, tmp, list);
+	AST_LIST_UNLOCK(&contexts);
 	
 	return tmp;
 }
@@ -88,6 +129,11 @@ struct sched_context *sched_context_create(void)
 void sched_context_destroy(struct sched_context *con)
 {
 	struct sched *s;
+	unsigned int i;
+
+	AST_LIST_LOCK(&contexts);
+	AST_LIST_REMOVE(&contexts, con, list);
+	AST_LIST_UNLOCK(&contexts);
 
 	ast_mutex_lock(&con->lock);
 
@@ -98,8 +144,10 @@ void sched_context_destroy(struct sched_context *con)
 #endif
 
 	/* And the queue */
-	while ((s = AST_LIST_REMOVE_HEAD(&con->schedq, list)))
-		free(s);
+	for (i = 0; i < con->schedcnt; i++)
+		free(con->heap[i]);
+	free(con->heap);
+	free(con->ids);
 	
 	/* And the context */
 	ast_mutex_unlock(&con->lock);
@@ -141,6 +189,127 @@ static void sched_release(struct sched_context *con, struct sched *tmp)
 		free(tmp);
 }
 
+/*! \brief Order two events by due time, then by insertion order */
+static int sched_cmp(const struct sched *a, const struct sched *b)
+{
+	int res = ast_tvcmp(a->when, b->when);
+
+	if (!res)
+		res = (int) (a->tie - b->tie) < 0 ? -1 : 1;
+	return res;
+}
+
+/*! \brief Store an event in a heap slot */
+static inline void heap_set(struct sched_context *con, unsigned int i, struct sched *s)
+{
+	con->heap[i] = s;
+	s->heap_index = i;
+}
+
+/*! \brief Move the event at slot i towards the root until the heap is ordered */
+static void heap_up(struct sched_context *con, unsigned int i)
+{
+	struct sched *s = con->heap[i];
+
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (sched_cmp(s, con->heap[parent]) >= 0)
+			break;
+		heap_set(con, i, con->heap[parent]);
+		i = parent;
+	}
+	heap_set(con, i, s);
+}
+
+/*! \brief Move the event at slot i towards the leaves until the heap is ordered */
+static void heap_down(struct sched_context *con, unsigned int i)
+{
+	struct sched *s = con->heap[i];
+
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= con->schedcnt)
+			break;
+		if (child + 1 < con->schedcnt && sched_cmp(con->heap[child + 1], con->heap[child]) < 0)
+			child++;
+		if (sched_cmp(s, con->heap[child]) <= 0)
+			break;
+		heap_set(con, i, con->heap[child]);
+		i = child;
+	}
+	heap_set(con, i, s);
+}
+
+/*! \brief Double the number of buckets in the id hash, if memory allows */
+static void ids_grow(struct sched_context *con)
+{
+	unsigned int buckets = con->idbuckets * 2;
+	struct sched **ids, *s, *next;
+	unsigned int i;
+
+	/* Failing here only makes the chains longer, so no need to complain loudly */
+	if (!(ids = calloc(buckets, sizeof(*ids))))
+		return;
+
+	for (i = 0; i < con->idbuckets; i++) {
+		for (s = con->ids[i]; s; s = next) {
+			next = s->next_id;
+			s->next_id = ids[s->id & (buckets - 1)];
+			ids[s->id & (buckets - 1)] = s;
+		}
+	}
+	free(con->ids);
+	con->ids = ids;
+	con->idbuckets = buckets;
+}
+
+/*! \brief Find an outstanding event by id, optionally unlinking it from the id hash */
+static struct sched *ids_find(struct sched_context *con, int id, int unlink)
+{
+	struct sched **prev, *s;
+
+	for (prev = &con->ids[id & (con->idbuckets - 1)]; (s = *prev); prev = &s->next_id) {
+		if (s->id == id) {
+			if (unlink)
+				*prev = s->next_id;
+			break;
+		}
+	}
+
+	return s;
+}
+
+/*! \brief Remove an event from the queue and the id hash */
+static void unschedule(struct sched_context *con, struct sched *s)
+{
+	unsigned int i = s->heap_index;
+
+	ids_find(con, s->id, 1);
+
+	if (i != --con->schedcnt) {
+		heap_set(con, i, con->heap[con->schedcnt]);
+		if (i > 0 && sched_cmp(con->heap[i], con->heap[(i - 1) / 2]) < 0)
+			heap_up(con, i);
+		else
+			heap_down(con, i);
+	}
+	con->heap[con->schedcnt] = NULL;
+}
+
+/*! \brief Account for the time spent in one operation, starting at 'start' */
+static void sched_op_done(struct sched_op_stats *stats, struct timeval start)
+{
+	struct timeval elapsed = ast_tvsub(ast_tvnow(), start);
+	unsigned int us = elapsed.tv_sec < 0 ? 0 : elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+
+	stats->count++;
+	stats->total += us;
+	if (us > stats->max)
+		stats->max = us;
+}
+
 /*! \brief
  * Return the number of milliseconds 
  * until the next scheduled event
@@ -152,10 +321,10 @@ int ast_sched_wait(struct sched_context *con)
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_wait()\n"));
 
 	ast_mutex_lock(&con->lock);
-	if (AST_LIST_EMPTY(&con->schedq)) {
+	if (!con->schedcnt) {
 		ms = -1;
 	} else {
-		ms = ast_tvdiff_ms(AST_LIST_FIRST(&con->schedq)->when, ast_tvnow());
+		ms = ast_tvdiff_ms(con->heap[0]->when, ast_tvnow());
 		if (ms < 0)
 			ms = 0;
 	}
@@ -168,24 +337,37 @@ int ast_sched_wait(struct sched_context *con)
 /*! \brief
  * Take a sched structure and put it in the
  * queue, such that the soonest event is
- * first in the list. 
+ * at the top of the heap.  Events due at the
+ * same time run in the order they were added.
+ * Returns -1 if the heap could not be grown.
  */
-static void schedule(struct sched_context *con, struct sched *s)
+static int schedule(struct sched_context *con, struct sched *s)
 {
-	 
-	struct sched *cur = NULL;
-	
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&con->schedq, cur, list) {
-		if (ast_tvcmp(s->when, cur->when) == -1) {
-			AST_LIST_INSERT_BEFORE_CURRENT(&con->schedq, s, list);
-			break;
-		}
+	unsigned int bucket;
+
+	if (con->schedcnt == con->heapsize) {
+		struct sched **heap;
+
+		if (!(heap = ast_realloc(con->heap, con->heapsize * 2 * sizeof(*heap))))
+			return -1;
+		con->heap = heap;
+		con->heapsize *= 2;
 	}
-	AST_LIST_TRAVERSE_SAFE_END
-	if (!cur)
-		AST_LIST_INSERT_TAIL(&con->schedq, s, list);
-	
-	con->schedcnt++;
+
+	s->tie = con->tiecnt++;
+	heap_set(con, con->schedcnt++, s);
+	heap_up(con, s->heap_index);
+
+	if (con->schedcnt > con->idbuckets)
+		ids_grow(con);
+	bucket = s->id & (con->idbuckets - 1);
+	s->next_id = con->ids[bucket];
+	con->ids[bucket] = s;
+
+	if (con->schedcnt > con->maxdepth)
+		con->maxdepth = con->schedcnt;
+
+	return 0;
 }
 
 /*! \brief
@@ -213,6 +395,7 @@ static int sched_settime(struct timeval *tv, int when)
 int ast_sched_add_variable(struct sched_context *con, int when, ast_sched_cb callback, const void *data, int variable)
 {
 	struct sched *tmp;
+	struct timeval start = ast_tvnow();
 	int res = -1;
 
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_add()\n"));
@@ -225,10 +408,9 @@ int ast_sched_add_variable(struct sched_context *con, int when, ast_sched_cb cal
 		tmp->resched = when;
 		tmp->variable = variable;
 		tmp->when = ast_tv(0, 0);
-		if (sched_settime(&tmp->when, when)) {
+		if (sched_settime(&tmp->when, when) || schedule(con, tmp)) {
 			sched_release(con, tmp);
 		} else {
-			schedule(con, tmp);
 			res = tmp->id;
 		}
 	}
@@ -237,6 +419,7 @@ int ast_sched_add_variable(struct sched_context *con, int when, ast_sched_cb cal
 	if (option_debug)
 		ast_sched_dump(con);
 #endif
+	sched_op_done(&con->adds, start);
 	ast_mutex_unlock(&con->lock);
 
 	return res;
@@ -250,7 +433,7 @@ int ast_sched_add(struct sched_context *con, int when, ast_sched_cb callback, co
 /*! \brief
  * Delete the schedule entry with number
  * "id".  It's nearly impossible that there
- * would be two or more in the list with that
+ * would be two or more in the queue with that
  * id.
  */
 #ifndef AST_DEVMODE
@@ -260,25 +443,22 @@ int _ast_sched_del(struct sched_context *con, int id, const char *file, int line
 #endif
 {
 	struct sched *s;
+	struct timeval start = ast_tvnow();
 
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_del()\n"));
 	
 	ast_mutex_lock(&con->lock);
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&con->schedq, s, list) {
-		if (s->id == id) {
-			AST_LIST_REMOVE_CURRENT(&con->schedq, list);
-			con->schedcnt--;
-			sched_release(con, s);
-			break;
-		}
+	if ((s = ids_find(con, id, 0))) {
+		unschedule(con, s);
+		sched_release(con, s);
 	}
-	AST_LIST_TRAVERSE_SAFE_END
 
 #ifdef DUMP_SCHEDULER
 	/* Dump contents of the context while we have the lock so nothing gets screwed up by accident. */
 	if (option_debug)
 		ast_sched_dump(con);
 #endif
+	sched_op_done(&con->dels, start);
 	ast_mutex_unlock(&con->lock);
 
 	if (!s) {
@@ -295,22 +475,37 @@ int _ast_sched_del(struct sched_context *con, int id, const char *file, int line
 	return 0;
 }
 
+static int sched_sort(const void *a, const void *b)
+{
+	return sched_cmp(*(const struct sched **) a, *(const struct sched **) b);
+}
+
 /*! \brief Dump the contents of the scheduler to LOG_DEBUG */
 void ast_sched_dump(const struct sched_context *con)
 {
-	struct sched *q;
+	struct sched **sorted, *q;
 	struct timeval tv = ast_tvnow();
+	unsigned int i;
 #ifdef SCHED_MAX_CACHE
 	ast_log(LOG_DEBUG, "Asterisk Schedule Dump (%d in Q, %d Total, %d Cache)\n", con->schedcnt, con->eventcnt - 1, con->schedccnt);
 #else
 	ast_log(LOG_DEBUG, "Asterisk Schedule Dump (%d in Q, %d Total)\n", con->schedcnt, con->eventcnt - 1);
 #endif
 
+	/* The heap is only partially ordered, so sort a copy to list the soonest events first */
+	if ((sorted = ast_malloc(con->schedcnt * sizeof(*sorted) + 1))) {
+		memcpy(sorted, con->heap, con->schedcnt * sizeof(*sorted));
+		qsort(sorted, con->schedcnt, sizeof(*sorted), sched_sort);
+	}
+
 	ast_log(LOG_DEBUG, "=============================================================\n");
 	ast_log(LOG_DEBUG, "|ID    Callback          Data              Time  (sec:ms)   |\n");
 	ast_log(LOG_DEBUG, "+-----+-----------------+-----------------+-----------------+\n");
-	AST_LIST_TRAVERSE(&con->schedq, q, list) {
-		struct timeval delta = ast_tvsub(q->when, tv);
+	for (i = 0; i < con->schedcnt; i++) {
+		struct timeval delta;
+
+		q = sorted ? sorted[i] : con->heap[i];
+		delta = ast_tvsub(q->when, tv);
 
 		ast_log(LOG_DEBUG, "|%.4d | %-15p | %-15p | %.6ld : %.6ld |\n", 
 			q->id,
@@ -320,7 +515,9 @@ void ast_sched_dump(const struct sched_context *con)
 			(long int)delta.tv_usec);
 	}
 	ast_log(LOG_DEBUG, "=============================================================\n");
-	
+
+	if (sorted)
+		free(sorted);
 }
 
 /*! \brief
@@ -329,7 +526,7 @@ void ast_sched_dump(const struct sched_context *con)
 int ast_sched_runq(struct sched_context *con)
 {
 	struct sched *current;
-	struct timeval tv;
+	struct timeval tv, start;
 	int numevents;
 	int res;
 
@@ -337,18 +534,18 @@ int ast_sched_runq(struct sched_context *con)
 		
 	ast_mutex_lock(&con->lock);
 
-	for (numevents = 0; !AST_LIST_EMPTY(&con->schedq); numevents++) {
+	for (numevents = 0; con->schedcnt; numevents++) {
 		/* schedule all events which are going to expire within 1ms.
 		 * We only care about millisecond accuracy anyway, so this will
 		 * help us get more than one event at one time if they are very
 		 * close together.
 		 */
 		tv = ast_tvadd(ast_tvnow(), ast_tv(0, 1000));
-		if (ast_tvcmp(AST_LIST_FIRST(&con->schedq)->when, tv) != -1)
+		if (ast_tvcmp(con->heap[0]->when, tv) != -1)
 			break;
 		
-		current = AST_LIST_REMOVE_HEAD(&con->schedq, list);
-		con->schedcnt--;
+		current = con->heap[0];
+		unschedule(con, current);
 
 		/*
 		 * At this point, the schedule queue is still intact.  We
@@ -360,18 +557,23 @@ int ast_sched_runq(struct sched_context *con)
 		 */
 			
 		ast_mutex_unlock(&con->lock);
+		start = ast_tvnow();
 		res = current->callback(current->data);
 		ast_mutex_lock(&con->lock);
+		sched_op_done(&con->runs, start);
 			
 		if (res) {
 		 	/*
 			 * If they return non-zero, we should schedule them to be
-			 * run again.
+			 * run again.  The callback may have filled the heap while
+			 * the lock was released, so that can fail too.
 			 */
 			if (sched_settime(&current->when, current->variable? res : current->resched)) {
 				sched_release(con, current);
-			} else
-				schedule(con, current);
+			} else if (schedule(con, current)) {
+				ast_log(LOG_ERROR, "Unable to reschedule event %d, it will not run again\n", current->id);
+				sched_release(con, current);
+			}
 		} else {
 			/* No longer needed, so release it */
 		 	sched_release(con, current);
@@ -390,11 +592,7 @@ long ast_sched_when(struct sched_context *con,int id)
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_when()\n"));
 
 	ast_mutex_lock(&con->lock);
-	AST_LIST_TRAVERSE(&con->schedq, s, list) {
-		if (s->id == id)
-			break;
-	}
-	if (s) {
+	if ((s = ids_find(con, id, 0))) {
 		struct timeval now = ast_tvnow();
 		secs = s->when.tv_sec - now.tv_sec;
 	}
@@ -402,3 +600,49 @@ long ast_sched_when(struct sched_context *con,int id)
 	
 	return secs;
 }
+
+static char show_sched_help[] =
+"Usage: core show sched\n"
+"       Shows the depth of every scheduler context and the average and\n"
+"       worst time, in microseconds, spent adding events, deleting events\n"
+"       and running event callbacks.\n";
+
+static int handle_show_sched(int fd, int argc, char *argv[])
+{
+#define FORMAT  "%-18s %6s %6s %10s %13s %10s %13s %10s %13s\n"
+#define FORMAT2 "%-18p %6u %6u %10u %6u/%-6u %10u %6u/%-6u %10u %6u/%u\n"
+	struct sched_context *con;
+	int count = 0;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	ast_cli(fd, FORMAT, "Context", "Depth", "Peak", "Adds", "Avg/Max", "Dels", "Avg/Max", "Runs", "Avg/Max");
+	AST_LIST_LOCK(&contexts);
+	AST_LIST_TRAVERSE(&contexts, con, list) {
+		ast_mutex_lock(&con->lock);
+		ast_cli(fd, FORMAT2, con, con->schedcnt, con->maxdepth,
+			con->adds.count, con->adds.count ? (unsigned int) (con->adds.total / con->adds.count) : 0, con->adds.max,
+			con->dels.count, con->dels.count ? (unsigned int) (con->dels.total / con->dels.count) : 0, con->dels.max,
+			con->runs.count, con->runs.count ? (unsigned int) (con->runs.total / con->runs.count) : 0, con->runs.max);
+		ast_mutex_unlock(&con->lock);
+		count++;
+	}
+	AST_LIST_UNLOCK(&contexts);
+	ast_cli(fd, "%d scheduler contexts\n", count);
+
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
+static struct ast_cli_entry cli_sched[] = {
+	{ { "core", "show", "sched", NULL },
+	handle_show_sched, "Show scheduler statistics",
+	show_sched_help },
+};
+
+void ast_sched_init(void)
+{
+	ast_cli_register_multiple(cli_sched, sizeof(cli_sched) / sizeof(struct ast_cli_entry));
+}
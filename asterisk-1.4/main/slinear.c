@@ -0,0 +1,660 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Signed linear sample kernels
+ *
+ * Each kernel has a scalar version built from the ast_slinear_saturated_*()
+ * helpers and the u-law and A-law tables, and on x86 SSE2 and AVX2 versions
+ * that are picked at startup if the CPU has them.  The SIMD versions must
+ * give the same results as the scalar ones for every input, including the
+ * -32767 floor of the saturating helpers and the way the conversion tables
+ * round (they encode the largest sample of each 4 (u-law) or 8 (A-law)
+ * sharing a table entry).  tests/test_slinear.c checks this.
+ */
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk/slinear.h"
+#include "asterisk/utils.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+
+/* Function specific target options need gcc 4.9 for the intrinsics */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SLINEAR_X86
+#include <immintrin.h>
+#endif
+
+struct slinear_kernels {
+	const char *name;
+	int (*supported)(void);
+	void (*add)(short *dst, const short *src, int samples);
+	void (*multiply)(short *data, short value, int samples);
+	void (*divide)(short *data, short value, int samples);
+	void (*ulaw_decode)(short *dst, const unsigned char *src, int samples);
+	void (*ulaw_encode)(unsigned char *dst, const short *src, int samples);
+	void (*alaw_decode)(short *dst, const unsigned char *src, int samples);
+	void (*alaw_encode)(unsigned char *dst, const short *src, int samples);
+};
+
+static void add_scalar(short *dst, const short *src, int samples)
+{
+	short value;
+
+	for (; samples > 0; samples--, dst++, src++) {
+		value = *src;
+		ast_slinear_saturated_add(dst, &value);
+	}
+}
+
+static void multiply_scalar(short *data, short value, int samples)
+{
+	for (; samples > 0; samples--, data++)
+		ast_slinear_saturated_multiply(data, &value);
+}
+
+static void divide_scalar(short *data, short value, int samples)
+{
+	for (; samples > 0; samples--, data++)
+		ast_slinear_saturated_divide(data, &value);
+}
+
+static void ulaw_decode_scalar(short *dst, const unsigned char *src, int samples)
+{
+	while (samples-- > 0)
+		*dst++ = AST_MULAW(*src++);
+}
+
+static void ulaw_encode_scalar(unsigned char *dst, const short *src, int samples)
+{
+	while (samples-- > 0)
+		*dst++ = AST_LIN2MU(*src++);
+}
+
+static void alaw_decode_scalar(short *dst, const unsigned char *src, int samples)
+{
+	while (samples-- > 0)
+		*dst++ = AST_ALAW(*src++);
+}
+
+static void alaw_encode_scalar(unsigned char *dst, const short *src, int samples)
+{
+	while (samples-- > 0)
+		*dst++ = AST_LIN2A(*src++);
+}
+
+static int supported_scalar(void)
+{
+	return 1;
+}
+
+static const struct slinear_kernels scalar_kernels = {
+	.name = "scalar",
+	.supported = supported_scalar,
+	.add = add_scalar,
+	.multiply = multiply_scalar,
+	.divide = divide_scalar,
+	.ulaw_decode = ulaw_decode_scalar,
+	.ulaw_encode = ulaw_encode_scalar,
+	.alaw_decode = alaw_decode_scalar,
+	.alaw_encode = alaw_encode_scalar,
+};
+
+#ifdef SLINEAR_X86
+/*
+ * The codecs shift by a different amount in each sample, which SSE2 cannot
+ * do, so they let the float conversion do it.  A magnitude of 2^7 or more
+ * converted to a float has the exponent 134 + e and the next 4 bits in the
+ * top of the mantissa, which is the u-law or A-law byte (e << 4) | mantissa
+ * once 0x860 is taken off bits 19 and up.  Going the other way, that byte
+ * plus 0x860 shifted up to bit 19, with the rounding bit below it set, is
+ * the float of the decoded magnitude.
+ */
+
+#define SSE2 __attribute__((target("sse2")))
+
+static SSE2 int supported_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static SSE2 void add_sse2(short *dst, const short *src, int samples)
+{
+	const __m128i floor = _mm_set1_epi16(-32767);
+	__m128i a, b;
+	int x;
+
+	for (x = 0; x + 8 <= samples; x += 8) {
+		a = _mm_loadu_si128((__m128i *) (dst + x));
+		b = _mm_loadu_si128((const __m128i *) (src + x));
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_max_epi16(_mm_adds_epi16(a, b), floor));
+	}
+	add_scalar(dst + x, src + x, samples - x);
+}
+
+static SSE2 void multiply_sse2(short *data, short value, int samples)
+{
+	const __m128i floor = _mm_set1_epi16(-32767);
+	const __m128i v = _mm_set1_epi16(value);
+	__m128i a, lo, hi;
+	int x;
+
+	for (x = 0; x + 8 <= samples; x += 8) {
+		a = _mm_loadu_si128((__m128i *) (data + x));
+		lo = _mm_mullo_epi16(a, v);
+		hi = _mm_mulhi_epi16(a, v);
+		a = _mm_packs_epi32(_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi));
+		_mm_storeu_si128((__m128i *) (data + x), _mm_max_epi16(a, floor));
+	}
+	multiply_scalar(data + x, value, samples - x);
+}
+
+/*! \brief Divide 4 magnitudes by d, truncating, and give them the signs in s */
+static inline SSE2 __m128i divide_4_sse2(__m128i mag, __m128i s, __m128 d, __m128 inv)
+{
+	const __m128i one = _mm_set1_epi32(1);
+	__m128 f = _mm_cvtepi32_ps(mag), r;
+	__m128i q;
+
+	/* The estimate is off by at most one, which the remainder shows */
+	q = _mm_cvttps_epi32(_mm_mul_ps(f, inv));
+	r = _mm_sub_ps(f, _mm_mul_ps(_mm_cvtepi32_ps(q), d));
+	q = _mm_add_epi32(q, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(r, d)), one));
+	q = _mm_sub_epi32(q, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(r, _mm_setzero_ps())), one));
+
+	return _mm_sub_epi32(_mm_xor_si128(q, s), s);
+}
+
+static SSE2 void divide_sse2(short *data, short value, int samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 d = _mm_set1_ps(value), inv = _mm_set1_ps(1.0f / value);
+	__m128i a, s, mag;
+	int x = 0;
+
+	/* Only positive divisors, as volume adjustment uses */
+	if (value > 0) {
+		for (; x + 8 <= samples; x += 8) {
+			a = _mm_loadu_si128((__m128i *) (data + x));
+			s = _mm_srai_epi16(a, 15);
+			mag = _mm_sub_epi16(_mm_xor_si128(a, s), s);
+			a = _mm_packs_epi32(
+				divide_4_sse2(_mm_unpacklo_epi16(mag, zero), _mm_unpacklo_epi16(s, s), d, inv),
+				divide_4_sse2(_mm_unpackhi_epi16(mag, zero), _mm_unpackhi_epi16(s, s), d, inv));
+			_mm_storeu_si128((__m128i *) (data + x), a);
+		}
+	}
+	divide_scalar(data + x, value, samples - x);
+}
+
+static inline SSE2 __m128i g711_encode_4_sse2(__m128i mag)
+{
+	return _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(mag)), 19), _mm_set1_epi32(0x860));
+}
+
+static inline SSE2 __m128i g711_decode_4_sse2(__m128i b)
+{
+	__m128i bits = _mm_slli_epi32(_mm_add_epi32(b, _mm_set1_epi32(0x860)), 19);
+
+	return _mm_cvttps_epi32(_mm_castsi128_ps(_mm_or_si128(bits, _mm_set1_epi32(0x40000))));
+}
+
+/*! \brief 8 samples of (e << 4) | mantissa to their magnitudes */
+static inline SSE2 __m128i g711_decode_8_sse2(__m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	return _mm_packs_epi32(g711_decode_4_sse2(_mm_unpacklo_epi16(b, zero)),
+		g711_decode_4_sse2(_mm_unpackhi_epi16(b, zero)));
+}
+
+/*! \brief 8 magnitudes from 2^7 to 2^15 - 1 to (e << 4) | mantissa */
+static inline SSE2 __m128i g711_encode_8_sse2(__m128i mag)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	return _mm_packs_epi32(g711_encode_4_sse2(_mm_unpacklo_epi16(mag, zero)),
+		g711_encode_4_sse2(_mm_unpackhi_epi16(mag, zero)));
+}
+
+static inline SSE2 __m128i ulaw_decode_8_sse2(__m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i mu = _mm_xor_si128(b, _mm_set1_epi16(0xff));
+	__m128i mag = g711_decode_8_sse2(_mm_and_si128(mu, _mm_set1_epi16(0x7f)));
+	__m128i s = _mm_cmpgt_epi16(_mm_and_si128(mu, _mm_set1_epi16(0x80)), zero);
+
+	mag = _mm_sub_epi16(mag, _mm_set1_epi16(0x84));
+
+	return _mm_sub_epi16(_mm_xor_si128(mag, s), s);
+}
+
+static SSE2 void ulaw_decode_sse2(short *dst, const unsigned char *src, int samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		b = _mm_loadu_si128((const __m128i *) (src + x));
+		_mm_storeu_si128((__m128i *) (dst + x), ulaw_decode_8_sse2(_mm_unpacklo_epi8(b, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x + 8), ulaw_decode_8_sse2(_mm_unpackhi_epi8(b, zero)));
+	}
+	ulaw_decode_scalar(dst + x, src + x, samples - x);
+}
+
+static inline SSE2 __m128i ulaw_encode_8_sse2(__m128i y)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s, mag, b;
+
+	/* The table entry shared by 4 samples is for the largest of them */
+	y = _mm_or_si128(y, _mm_set1_epi16(3));
+	s = _mm_srai_epi16(y, 15);
+	mag = _mm_sub_epi16(_mm_xor_si128(y, s), s);
+	mag = _mm_add_epi16(_mm_min_epi16(mag, _mm_set1_epi16(32635)), _mm_set1_epi16(0x84));
+	b = _mm_or_si128(g711_encode_8_sse2(mag), _mm_and_si128(s, _mm_set1_epi16(0x80)));
+	b = _mm_xor_si128(b, _mm_set1_epi16(0xff));
+	/* CCITT zero trap */
+	return _mm_or_si128(b, _mm_and_si128(_mm_cmpeq_epi16(b, zero), _mm_set1_epi16(0x02)));
+}
+
+static SSE2 void ulaw_encode_sse2(unsigned char *dst, const short *src, int samples)
+{
+	__m128i lo, hi;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		lo = ulaw_encode_8_sse2(_mm_loadu_si128((const __m128i *) (src + x)));
+		hi = ulaw_encode_8_sse2(_mm_loadu_si128((const __m128i *) (src + x + 8)));
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(lo, hi));
+	}
+	ulaw_encode_scalar(dst + x, src + x, samples - x);
+}
+
+static inline SSE2 __m128i alaw_decode_8_sse2(__m128i b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_xor_si128(b, _mm_set1_epi16(0x55));
+	__m128i sq = _mm_and_si128(a, _mm_set1_epi16(0x7f));
+	__m128i i = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(a, _mm_set1_epi16(0x0f)), 4), _mm_set1_epi16(8));
+	__m128i c = _mm_cmpgt_epi16(sq, _mm_set1_epi16(0x0f)), s;
+
+	/* Segment 0 has no leading bit for the float to find */
+	i = _mm_or_si128(_mm_and_si128(c, g711_decode_8_sse2(sq)), _mm_andnot_si128(c, i));
+	s = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x80)), zero);
+
+	return _mm_sub_epi16(_mm_xor_si128(i, s), s);
+}
+
+static SSE2 void alaw_decode_sse2(short *dst, const unsigned char *src, int samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		b = _mm_loadu_si128((const __m128i *) (src + x));
+		_mm_storeu_si128((__m128i *) (dst + x), alaw_decode_8_sse2(_mm_unpacklo_epi8(b, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x + 8), alaw_decode_8_sse2(_mm_unpackhi_epi8(b, zero)));
+	}
+	alaw_decode_scalar(dst + x, src + x, samples - x);
+}
+
+static inline SSE2 __m128i alaw_encode_8_sse2(__m128i y)
+{
+	__m128i s, pcm, mask, c, q;
+
+	/* The table entry shared by 8 samples is for the largest of them */
+	y = _mm_or_si128(y, _mm_set1_epi16(7));
+	s = _mm_srai_epi16(y, 15);
+	pcm = _mm_sub_epi16(_mm_xor_si128(y, s), s);
+	mask = _mm_xor_si128(_mm_set1_epi16(0xd5), _mm_and_si128(s, _mm_set1_epi16(0x80)));
+	/* Segment 0 is pcm >> 4 */
+	c = _mm_cmpgt_epi16(pcm, _mm_set1_epi16(0xff));
+	q = _mm_or_si128(_mm_and_si128(c, g711_encode_8_sse2(pcm)), _mm_andnot_si128(c, _mm_srli_epi16(pcm, 4)));
+
+	return _mm_xor_si128(q, mask);
+}
+
+static SSE2 void alaw_encode_sse2(unsigned char *dst, const short *src, int samples)
+{
+	__m128i lo, hi;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		lo = alaw_encode_8_sse2(_mm_loadu_si128((const __m128i *) (src + x)));
+		hi = alaw_encode_8_sse2(_mm_loadu_si128((const __m128i *) (src + x + 8)));
+		_mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(lo, hi));
+	}
+	alaw_encode_scalar(dst + x, src + x, samples - x);
+}
+
+static const struct slinear_kernels sse2_kernels = {
+	.name = "sse2",
+	.supported = supported_sse2,
+	.add = add_sse2,
+	.multiply = multiply_sse2,
+	.divide = divide_sse2,
+	.ulaw_decode = ulaw_decode_sse2,
+	.ulaw_encode = ulaw_encode_sse2,
+	.alaw_decode = alaw_decode_sse2,
+	.alaw_encode = alaw_encode_sse2,
+};
+
+/* The AVX2 kernels are the SSE2 ones on twice as many samples at a time */
+
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 int supported_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static AVX2 void add_avx2(short *dst, const short *src, int samples)
+{
+	const __m256i floor = _mm256_set1_epi16(-32767);
+	__m256i a, b;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		a = _mm256_loadu_si256((__m256i *) (dst + x));
+		b = _mm256_loadu_si256((const __m256i *) (src + x));
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_max_epi16(_mm256_adds_epi16(a, b), floor));
+	}
+	add_scalar(dst + x, src + x, samples - x);
+}
+
+static AVX2 void multiply_avx2(short *data, short value, int samples)
+{
+	const __m256i floor = _mm256_set1_epi16(-32767);
+	const __m256i v = _mm256_set1_epi16(value);
+	__m256i a, lo, hi;
+	int x;
+
+	/* The unpacks and the pack work within each 128 bit lane, so the order is kept */
+	for (x = 0; x + 16 <= samples; x += 16) {
+		a = _mm256_loadu_si256((__m256i *) (data + x));
+		lo = _mm256_mullo_epi16(a, v);
+		hi = _mm256_mulhi_epi16(a, v);
+		a = _mm256_packs_epi32(_mm256_unpacklo_epi16(lo, hi), _mm256_unpackhi_epi16(lo, hi));
+		_mm256_storeu_si256((__m256i *) (data + x), _mm256_max_epi16(a, floor));
+	}
+	multiply_scalar(data + x, value, samples - x);
+}
+
+static inline AVX2 __m256i divide_8_avx2(__m256i mag, __m256i s, __m256 d, __m256 inv)
+{
+	const __m256i one = _mm256_set1_epi32(1);
+	__m256 f = _mm256_cvtepi32_ps(mag), r;
+	__m256i q;
+
+	q = _mm256_cvttps_epi32(_mm256_mul_ps(f, inv));
+	r = _mm256_sub_ps(f, _mm256_mul_ps(_mm256_cvtepi32_ps(q), d));
+	q = _mm256_add_epi32(q, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(r, d, _CMP_GE_OQ)), one));
+	q = _mm256_sub_epi32(q, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(r, _mm256_setzero_ps(), _CMP_LT_OQ)), one));
+
+	return _mm256_sub_epi32(_mm256_xor_si256(q, s), s);
+}
+
+static AVX2 void divide_avx2(short *data, short value, int samples)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256 d = _mm256_set1_ps(value), inv = _mm256_set1_ps(1.0f / value);
+	__m256i a, s, mag;
+	int x = 0;
+
+	if (value > 0) {
+		for (; x + 16 <= samples; x += 16) {
+			a = _mm256_loadu_si256((__m256i *) (data + x));
+			s = _mm256_srai_epi16(a, 15);
+			mag = _mm256_sub_epi16(_mm256_xor_si256(a, s), s);
+			a = _mm256_packs_epi32(
+				divide_8_avx2(_mm256_unpacklo_epi16(mag, zero), _mm256_unpacklo_epi16(s, s), d, inv),
+				divide_8_avx2(_mm256_unpackhi_epi16(mag, zero), _mm256_unpackhi_epi16(s, s), d, inv));
+			_mm256_storeu_si256((__m256i *) (data + x), a);
+		}
+	}
+	divide_scalar(data + x, value, samples - x);
+}
+
+static inline AVX2 __m256i g711_decode_16_avx2(__m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_slli_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(b, zero), _mm256_set1_epi32(0x860)), 19);
+	__m256i hi = _mm256_slli_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(b, zero), _mm256_set1_epi32(0x860)), 19);
+
+	lo = _mm256_cvttps_epi32(_mm256_castsi256_ps(_mm256_or_si256(lo, _mm256_set1_epi32(0x40000))));
+	hi = _mm256_cvttps_epi32(_mm256_castsi256_ps(_mm256_or_si256(hi, _mm256_set1_epi32(0x40000))));
+
+	return _mm256_packs_epi32(lo, hi);
+}
+
+static inline AVX2 __m256i g711_encode_16_avx2(__m256i mag)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(mag, zero)));
+	__m256i hi = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(mag, zero)));
+
+	lo = _mm256_sub_epi32(_mm256_srli_epi32(lo, 19), _mm256_set1_epi32(0x860));
+	hi = _mm256_sub_epi32(_mm256_srli_epi32(hi, 19), _mm256_set1_epi32(0x860));
+
+	return _mm256_packs_epi32(lo, hi);
+}
+
+static inline AVX2 __m256i ulaw_decode_16_avx2(__m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i mu = _mm256_xor_si256(b, _mm256_set1_epi16(0xff));
+	__m256i mag = g711_decode_16_avx2(_mm256_and_si256(mu, _mm256_set1_epi16(0x7f)));
+	__m256i s = _mm256_cmpgt_epi16(_mm256_and_si256(mu, _mm256_set1_epi16(0x80)), zero);
+
+	mag = _mm256_sub_epi16(mag, _mm256_set1_epi16(0x84));
+
+	return _mm256_sub_epi16(_mm256_xor_si256(mag, s), s);
+}
+
+static AVX2 void ulaw_decode_avx2(short *dst, const unsigned char *src, int samples)
+{
+	__m256i b;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + x)));
+		_mm256_storeu_si256((__m256i *) (dst + x), ulaw_decode_16_avx2(b));
+	}
+	ulaw_decode_scalar(dst + x, src + x, samples - x);
+}
+
+static inline AVX2 __m256i ulaw_encode_16_avx2(__m256i y)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i s, mag, b;
+
+	y = _mm256_or_si256(y, _mm256_set1_epi16(3));
+	s = _mm256_srai_epi16(y, 15);
+	mag = _mm256_sub_epi16(_mm256_xor_si256(y, s), s);
+	mag = _mm256_add_epi16(_mm256_min_epi16(mag, _mm256_set1_epi16(32635)), _mm256_set1_epi16(0x84));
+	b = _mm256_or_si256(g711_encode_16_avx2(mag), _mm256_and_si256(s, _mm256_set1_epi16(0x80)));
+	b = _mm256_xor_si256(b, _mm256_set1_epi16(0xff));
+
+	return _mm256_or_si256(b, _mm256_and_si256(_mm256_cmpeq_epi16(b, zero), _mm256_set1_epi16(0x02)));
+}
+
+static AVX2 void ulaw_encode_avx2(unsigned char *dst, const short *src, int samples)
+{
+	__m256i lo, hi;
+	int x;
+
+	/* The pack works within each 128 bit lane, so put the quarters back in order */
+	for (x = 0; x + 32 <= samples; x += 32) {
+		lo = ulaw_encode_16_avx2(_mm256_loadu_si256((const __m256i *) (src + x)));
+		hi = ulaw_encode_16_avx2(_mm256_loadu_si256((const __m256i *) (src + x + 16)));
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+	}
+	ulaw_encode_sse2(dst + x, src + x, samples - x);
+}
+
+static inline AVX2 __m256i alaw_decode_16_avx2(__m256i b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_xor_si256(b, _mm256_set1_epi16(0x55));
+	__m256i sq = _mm256_and_si256(a, _mm256_set1_epi16(0x7f));
+	__m256i i = _mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x0f)), 4), _mm256_set1_epi16(8));
+	__m256i c = _mm256_cmpgt_epi16(sq, _mm256_set1_epi16(0x0f)), s;
+
+	i = _mm256_blendv_epi8(i, g711_decode_16_avx2(sq), c);
+	s = _mm256_cmpeq_epi16(_mm256_and_si256(a, _mm256_set1_epi16(0x80)), zero);
+
+	return _mm256_sub_epi16(_mm256_xor_si256(i, s), s);
+}
+
+static AVX2 void alaw_decode_avx2(short *dst, const unsigned char *src, int samples)
+{
+	__m256i b;
+	int x;
+
+	for (x = 0; x + 16 <= samples; x += 16) {
+		b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + x)));
+		_mm256_storeu_si256((__m256i *) (dst + x), alaw_decode_16_avx2(b));
+	}
+	alaw_decode_scalar(dst + x, src + x, samples - x);
+}
+
+static inline AVX2 __m256i alaw_encode_16_avx2(__m256i y)
+{
+	__m256i s, pcm, mask, c, q;
+
+	y = _mm256_or_si256(y, _mm256_set1_epi16(7));
+	s = _mm256_srai_epi16(y, 15);
+	pcm = _mm256_sub_epi16(_mm256_xor_si256(y, s), s);
+	mask = _mm256_xor_si256(_mm256_set1_epi16(0xd5), _mm256_and_si256(s, _mm256_set1_epi16(0x80)));
+	c = _mm256_cmpgt_epi16(pcm, _mm256_set1_epi16(0xff));
+	q = _mm256_blendv_epi8(_mm256_srli_epi16(pcm, 4), g711_encode_16_avx2(pcm), c);
+
+	return _mm256_xor_si256(q, mask);
+}
+
+static AVX2 void alaw_encode_avx2(unsigned char *dst, const short *src, int samples)
+{
+	__m256i lo, hi;
+	int x;
+
+	for (x = 0; x + 32 <= samples; x += 32) {
+		lo = alaw_encode_16_avx2(_mm256_loadu_si256((const __m256i *) (src + x)));
+		hi = alaw_encode_16_avx2(_mm256_loadu_si256((const __m256i *) (src + x + 16)));
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+	}
+	alaw_encode_sse2(dst + x, src + x, samples - x);
+}
+
+static const struct slinear_kernels avx2_kernels = {
+	.name = "avx2",
+	.supported = supported_avx2,
+	.add = add_avx2,
+	.multiply = multiply_avx2,
+	.divide = divide_avx2,
+	.ulaw_decode = ulaw_decode_avx2,
+	.ulaw_encode = ulaw_encode_avx2,
+	.alaw_decode = alaw_decode_avx2,
+	.alaw_encode = alaw_encode_avx2,
+};
+#endif /* SLINEAR_X86 */
+
+/*! Implementations, best first */
+static const struct slinear_kernels *all_kernels[] = {
+#ifdef SLINEAR_X86
+	&avx2_kernels,
+	&sse2_kernels,
+#endif
+	&scalar_kernels,
+};
+
+static const struct slinear_kernels *kernels = &scalar_kernels;
+
+void ast_slinear_saturated_add_n(short *dst, const short *src, int samples)
+{
+	kernels->add(dst, src, samples);
+}
+
+void ast_slinear_saturated_multiply_n(short *data, short value, int samples)
+{
+	kernels->multiply(data, value, samples);
+}
+
+void ast_slinear_saturated_divide_n(short *data, short value, int samples)
+{
+	kernels->divide(data, value, samples);
+}
+
+void ast_ulaw_to_slinear_n(short *dst, const unsigned char *src, int samples)
+{
+	kernels->ulaw_decode(dst, src, samples);
+}
+
+void ast_slinear_to_ulaw_n(unsigned char *dst, const short *src, int samples)
+{
+	kernels->ulaw_encode(dst, src, samples);
+}
+
+void ast_alaw_to_slinear_n(short *dst, const unsigned char *src, int samples)
+{
+	kernels->alaw_decode(dst, src, samples);
+}
+
+void ast_slinear_to_alaw_n(unsigned char *dst, const short *src, int samples)
+{
+	kernels->alaw_encode(dst, src, samples);
+}
+
+int ast_slinear_select(const char *name)
+{
+	int x;
+
+	for (x = 0; x < ARRAY_LEN(all_kernels); x++) {
+		if (name && strcasecmp(name, all_kernels[x]->name))
+			continue;
+		if (all_kernels[x]->supported()) {
+			kernels = all_kernels[x];
+			return 0;
+		}
+		if (name)
+			break;
+	}
+
+	return -1;
+}
+
+const char *ast_slinear_selected(void)
+{
+	return kernels->name;
+}
+
+void ast_slinear_init(void)
+{
+#ifdef SLINEAR_X86
+	__builtin_cpu_init();
+#endif
+	ast_slinear_select(NULL);
+}
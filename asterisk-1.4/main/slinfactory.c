@@ -96,7 +96,7 @@ int ast_slinfactory_feed(struct ast_slinfactory *sf, struct ast_frame *f)
 			ast_frfree(begin_frame);
 		}
 	} else {
-		if (!(duped_frame = ast_frdup(f)))
+		if (!(duped_frame = ast_frshare(f)))
 			return 0;
 	}
 
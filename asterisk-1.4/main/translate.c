@@ -34,6 +34,10 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 267539 $")
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
 
 #include "asterisk/lock.h"
 #include "asterisk/channel.h"
@@ -45,8 +49,14 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 267539 $")
 #include "asterisk/sched.h"
 #include "asterisk/cli.h"
 #include "asterisk/term.h"
+#include "asterisk/config.h"
+#include "asterisk/utils.h"
 
 #define MAX_RECALC 200 /* max sample recalc */
+#define MAX_POOLED_PVTS 16 /* max idle pvts kept by each translator */
+#define MAX_TRANSCODER_THREADS 64 /* max threads of the transcoder */
+#define TRANSCODER_BATCH 8 /* max paths a transcoder thread takes at a time */
+#define TRANSCODER_BACKLOG 4 /* max frames of a path waiting for or in the transcoder */
 
 /*! \brief the list of translators */
 static AST_LIST_HEAD_STATIC(translators, ast_translator);
@@ -69,6 +79,23 @@ struct translator_path {
  */
 static struct translator_path tr_matrix[MAX_FORMAT][MAX_FORMAT];
 
+/*! \brief the translators of each step of a path, in order */
+struct translator_path_steps {
+	int count;
+	struct ast_translator *step[0];
+};
+
+/*! \brief the paths built so far, filled in from tr_matrix the first
+ * time a path is needed and thrown away when the matrix is rebuilt.
+ *
+ * Array indexes are 'src' and 'dest', and the lock of the 'translators'
+ * list protects it, as for tr_matrix.
+ */
+static struct translator_path_steps *tr_paths[MAX_FORMAT][MAX_FORMAT];
+
+/*! \brief protects the pools of idle pvts of the translators */
+AST_MUTEX_DEFINE_STATIC(pool_lock);
+
 /*! \todo
  * TODO: sample frames for each supported input format.
  * We build this on the fly, by taking an SLIN frame and using
@@ -92,6 +119,57 @@ static force_inline int powerof(unsigned int d)
  * wrappers around the translator routines.
  */
 
+static void destroy(struct ast_trans_pvt *pvt)
+{
+	struct ast_translator *t = pvt->t;
+
+	if (t->destroy)
+		t->destroy(pvt);
+	free(pvt);
+	ast_module_unref(t->module);
+}
+
+/*! \brief whether the pvts of a translator can be reset and reused */
+static int poolable(struct ast_translator *t)
+{
+	return t->reset || (!t->newpvt && !t->destroy);
+}
+
+/*!
+ * \brief Take an idle pvt from the pool of the translator, and make it
+ * look like a new one.
+ */
+static struct ast_trans_pvt *pool_get(struct ast_translator *t)
+{
+	struct ast_trans_pvt *pvt;
+
+	ast_mutex_lock(&pool_lock);
+	if ((pvt = t->pool)) {
+		t->pool = pvt->next;
+		t->pool_count--;
+	}
+	ast_mutex_unlock(&pool_lock);
+
+	if (!pvt)
+		return NULL;
+
+	ast_module_ref(t->module);
+	memset(&pvt->f, 0, sizeof(pvt->f));
+	pvt->samples = 0;
+	pvt->datalen = 0;
+	pvt->next = NULL;
+	pvt->xc = NULL;
+	if (t->reset) {
+		if (t->reset(pvt)) {
+			destroy(pvt);
+			return NULL;
+		}
+	} else if (t->desc_size)
+		memset(pvt->pvt, 0, t->desc_size);
+
+	return pvt;
+}
+
 /*!
  * \brief Allocate the descriptor, required outbuf space,
  * and possibly desc.
@@ -102,6 +180,9 @@ static void *newpvt(struct ast_translator *t)
 	int len;
 	char *ofs;
 
+	if ((pvt = pool_get(t)))
+		return pvt;
+
 	/*
 	 * compute the required size adding private descriptor,
 	 * buffer, AST_FRIENDLY_OFFSET.
@@ -129,14 +210,29 @@ static void *newpvt(struct ast_translator *t)
 	return pvt;
 }
 
-static void destroy(struct ast_trans_pvt *pvt)
+/*! \brief Keep a pvt that is no longer used in the pool of its translator,
+ * or destroy it if the translator cannot reuse it or has enough already.
+ */
+static void release(struct ast_trans_pvt *pvt)
 {
 	struct ast_translator *t = pvt->t;
+	int pooled = 0;
+
+	if (poolable(t)) {
+		ast_mutex_lock(&pool_lock);
+		if (t->pool_count < MAX_POOLED_PVTS) {
+			pvt->next = t->pool;
+			t->pool = pvt;
+			t->pool_count++;
+			pooled = 1;
+		}
+		ast_mutex_unlock(&pool_lock);
+	}
 
-	if (t->destroy)
-		t->destroy(pvt);
-	free(pvt);
-	ast_module_unref(t->module);
+	if (pooled)
+		ast_module_unref(t->module);
+	else
+		destroy(pvt);
 }
 
 /*! \brief framein wrapper, deals with bound checks.  */
@@ -218,12 +314,66 @@ static struct ast_frame *default_frameout(struct ast_trans_pvt *pvt)
 
 /* end of callback wrappers and helpers */
 
-void ast_translator_free_path(struct ast_trans_pvt *p)
+static void translator_path_destroy(struct ast_trans_pvt *p)
 {
 	struct ast_trans_pvt *pn = p;
 	while ( (p = pn) ) {
 		pn = p->next;
-		destroy(p);
+		release(p);
+	}
+}
+
+static int transcoder_release(struct ast_trans_pvt *path);
+void ast_translator_free_path(struct ast_trans_pvt *p)
+{
+	if (p && p->xc && transcoder_release(p))
+		return;
+	translator_path_destroy(p);
+}
+
+/*!
+ * \brief Get the steps of the path from src to dest, following tr_matrix
+ * the first time.
+ * \note This function expects the list of translators to be locked
+ */
+static struct translator_path_steps *path_steps(int src, int dest)
+{
+	struct translator_path_steps *path;
+	struct ast_translator *steps[MAX_FORMAT];
+	int count = 0, fmt = src;
+
+	if ((path = tr_paths[src][dest]))
+		return path;
+
+	while (fmt != dest) {
+		struct ast_translator *t = tr_matrix[fmt][dest].step;
+
+		if (!t || count == MAX_FORMAT)
+			return NULL;
+		steps[count++] = t;
+		fmt = t->dstfmt;
+	}
+
+	if (!(path = ast_malloc(sizeof(*path) + count * sizeof(path->step[0]))))
+		return NULL;
+	path->count = count;
+	memcpy(path->step, steps, count * sizeof(path->step[0]));
+
+	return (tr_paths[src][dest] = path);
+}
+
+/*! \brief Forget the paths built from the old matrix */
+static void flush_paths(void)
+{
+	int x, z;
+
+	for (x = 0; x < MAX_FORMAT; x++) {
+		for (z = 0; z < MAX_FORMAT; z++) {
+			if (tr_paths[x][z]) {
+				free(tr_paths[x][z]);
+				tr_paths[x][z] = NULL;
+			}
+		}
 	}
 }
 
@@ -231,6 +381,8 @@ void ast_translator_free_path(struct ast_trans_pvt *p)
 struct ast_trans_pvt *ast_translator_build_path(int dest, int source)
 {
 	struct ast_trans_pvt *head = NULL, *tail = NULL;
+	struct translator_path_steps *path;
+	int x;
 	
 	source = powerof(source);
 	dest = powerof(dest);
@@ -240,19 +392,24 @@ struct ast_trans_pvt *ast_translator_build_path(int dest, int source)
 		return NULL;
 	}
 
+	if (source == dest)
+		return NULL;
+
 	AST_LIST_LOCK(&translators);
 
-	while (source != dest) {
+	if (!(path = path_steps(source, dest))) {
+		ast_log(LOG_WARNING, "No translator path from %s to %s\n", 
+			ast_getformatname(source), ast_getformatname(dest));
+		AST_LIST_UNLOCK(&translators);
+		return NULL;
+	}
+
+	for (x = 0; x < path->count; x++) {
 		struct ast_trans_pvt *cur;
-		struct ast_translator *t = tr_matrix[source][dest].step;
-		if (!t) {
-			ast_log(LOG_WARNING, "No translator path from %s to %s\n", 
-				ast_getformatname(source), ast_getformatname(dest));
-			AST_LIST_UNLOCK(&translators);
-			return NULL;
-		}
+		struct ast_translator *t = path->step[x];
+
 		if (!(cur = newpvt(t))) {
-			ast_log(LOG_WARNING, "Failed to build translator step from %d to %d\n", source, dest);
+			ast_log(LOG_WARNING, "Failed to build translator step from %d to %d\n", t->srcfmt, dest);
 			if (head)
 				ast_translator_free_path(head);	
 			AST_LIST_UNLOCK(&translators);
@@ -264,19 +421,400 @@ struct ast_trans_pvt *ast_translator_build_path(int dest, int source)
 			tail->next = cur;
 		tail = cur;
 		cur->nextin = cur->nextout = ast_tv(0, 0);
-		/* Keep going if this isn't the final destination */
-		source = cur->t->dstfmt;
 	}
 
 	AST_LIST_UNLOCK(&translators);
 	return head;
 }
 
+/*! \brief run a frame through every step of a path */
+static struct ast_frame *translate_steps(struct ast_trans_pvt *p, struct ast_frame *f)
+{
+	struct ast_frame *out = f;
+
+	for ( ; out && p ; p = p->next) {
+		framein(p, out);
+		if (out != f)
+			ast_frfree(out);
+		out = p->t->frameout(p);
+	}
+
+	return out;
+}
+
+/*
+ * The transcoder.
+ *
+ * When codecs.conf asks for it, the steps of paths that go through an
+ * expensive translator (one with the offload flag set) are run by a fixed
+ * set of threads, each pinned to a core, instead of by the channel thread.
+ * ast_translate() queues the frame on its path and returns whatever the
+ * threads finished translating since the last call, without waiting, so
+ * a channel gets its frames one call late.  Only channels' read and write
+ * paths are run this way, see ast_translator_offload().  A path is on the queue at
+ * most once, so its frames are translated in order by one thread at a
+ * time, and a thread takes several paths at a time when the queue is
+ * backing up.
+ */
+
+/*! \brief the transcoder side of a path, hung off its first step */
+struct transcoder_path {
+	struct ast_trans_pvt *path;
+	AST_LIST_HEAD_NOLOCK(, ast_frame) in;	/*!< frames waiting to be translated */
+	AST_LIST_HEAD_NOLOCK(, ast_frame) out;	/*!< translated frames not returned yet */
+	int pending;		/*!< frames in 'in' */
+	int done;		/*!< frames in 'out' */
+	struct timeval queued;	/*!< when the path was queued */
+	unsigned int busy:1;	/*!< queued, or being translated by a thread */
+	unsigned int freed:1;	/*!< the path was freed meanwhile, the thread destroys it */
+	AST_LIST_ENTRY(transcoder_path) list;
+};
+
+/*! \brief what the transcoder threads did for a translation step */
+struct transcoder_stats {
+	unsigned int frames;
+	uint64_t samples;	/*!< samples produced */
+	int64_t busy;		/*!< microseconds spent translating */
+	int64_t wait;		/*!< microseconds the frames spent queued */
+	int64_t wait_max;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(transcoder_queue, transcoder_path);
+/*! \brief protects the queue, the transcoder side of every path and the threads */
+AST_MUTEX_DEFINE_STATIC(transcoder_lock);
+static ast_cond_t transcoder_cond;	/*!< signalled when paths are queued */
+static pthread_t transcoder_threads[MAX_TRANSCODER_THREADS];
+static int transcoder_count;		/*!< threads running */
+static int transcoder_stop;		/*!< threads are being stopped */
+static int transcoder_pin = 1;		/*!< pin the threads to cores */
+static int transcoder_depth;		/*!< paths in the queue */
+static unsigned int transcoder_dropped;	/*!< frames dropped as a path fell behind */
+
+/*! \brief per translation step, indexes are 'src' and 'dest' */
+static struct transcoder_stats transcoder_stats[MAX_FORMAT][MAX_FORMAT];
+AST_MUTEX_DEFINE_STATIC(transcoder_stats_lock);
+
+static int64_t transcoder_usecs(struct timeval tv)
+{
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*! \brief translate_steps() for a transcoder thread, keeping stats */
+static struct ast_frame *transcoder_steps(struct ast_trans_pvt *path, struct ast_frame *f, int64_t wait)
+{
+	struct ast_trans_pvt *p;
+	struct ast_frame *out = f;
+	struct transcoder_stats *stats;
+	struct timeval start;
+
+	for (p = path; out && p; p = p->next) {
+		start = ast_tvnow();
+		framein(p, out);
+		if (out != f)
+			ast_frfree(out);
+		out = p->t->frameout(p);
+
+		stats = &transcoder_stats[p->t->srcfmt][p->t->dstfmt];
+		ast_mutex_lock(&transcoder_stats_lock);
+		stats->frames++;
+		stats->samples += out ? out->samples : 0;
+		stats->busy += transcoder_usecs(ast_tvsub(ast_tvnow(), start));
+		stats->wait += wait;
+		if (wait > stats->wait_max)
+			stats->wait_max = wait;
+		ast_mutex_unlock(&transcoder_stats_lock);
+	}
+
+	return out;
+}
+
+/*! \brief Free the frames of the transcoder side of a path, and the side itself */
+static void transcoder_path_free(struct transcoder_path *xc)
+{
+	struct ast_frame *f;
+
+	while ((f = AST_LIST_REMOVE_HEAD(&xc->in, frame_list)))
+		ast_frfree(f);
+	while ((f = AST_LIST_REMOVE_HEAD(&xc->out, frame_list)))
+		ast_frfree(f);
+	free(xc);
+}
+
+static void translator_path_destroy(struct ast_trans_pvt *p);
+
+static void *transcoder_thread(void *data)
+{
+	struct transcoder_path *xcs[TRANSCODER_BATCH];
+	AST_LIST_HEAD_NOLOCK(, ast_frame) in[TRANSCODER_BATCH], out[TRANSCODER_BATCH];
+	struct ast_frame *f, *res;
+	struct timeval now;
+	int64_t wait;
+	int x, n, take;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (transcoder_pin) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET((long) data % (cpus > 0 ? cpus : 1), &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			ast_log(LOG_WARNING, "Unable to pin transcoder thread %ld: %s\n", (long) data, strerror(errno));
+	}
+#endif
+
+	ast_mutex_lock(&transcoder_lock);
+	for (;;) {
+		while (!transcoder_stop && AST_LIST_EMPTY(&transcoder_queue))
+			ast_cond_wait(&transcoder_cond, &transcoder_lock);
+		/* Finish what was queued before stopping */
+		if (AST_LIST_EMPTY(&transcoder_queue))
+			break;
+
+		/* Share a backlog with the other threads */
+		take = (transcoder_depth + transcoder_count - 1) / transcoder_count;
+		if (take > TRANSCODER_BATCH)
+			take = TRANSCODER_BATCH;
+		for (n = 0; n < take && (xcs[n] = AST_LIST_REMOVE_HEAD(&transcoder_queue, list)); n++) {
+			transcoder_depth--;
+			/* Take every frame queued so far, the channel may add more meanwhile */
+			in[n].first = xcs[n]->in.first;
+			in[n].last = xcs[n]->in.last;
+			AST_LIST_HEAD_INIT_NOLOCK(&xcs[n]->in);
+			xcs[n]->pending = 0;
+			AST_LIST_HEAD_INIT_NOLOCK(&out[n]);
+		}
+		ast_mutex_unlock(&transcoder_lock);
+
+		now = ast_tvnow();
+		for (x = 0; x < n; x++) {
+			wait = transcoder_usecs(ast_tvsub(now, xcs[x]->queued));
+			while ((f = AST_LIST_REMOVE_HEAD(&in[x], frame_list))) {
+				if ((res = transcoder_steps(xcs[x]->path, f, wait))) {
+					/* ast_translate() hands it out a call later, keep the timing it came with */
+					if (ast_tvzero(f->delivery)) {
+						ast_copy_flags(res, f, AST_FRFLAG_HAS_TIMING_INFO);
+						res->ts = f->ts;
+						res->len = f->len;
+						res->seqno = f->seqno;
+					}
+					AST_LIST_INSERT_TAIL(&out[x], res, frame_list);
+				}
+				ast_frfree(f);
+			}
+		}
+
+		ast_mutex_lock(&transcoder_lock);
+		for (x = 0; x < n; x++) {
+			while ((f = AST_LIST_REMOVE_HEAD(&out[x], frame_list))) {
+				AST_LIST_INSERT_TAIL(&xcs[x]->out, f, frame_list);
+				xcs[x]->done++;
+			}
+			/* Do not hoard frames for a channel that stopped reading */
+			while (xcs[x]->done > TRANSCODER_BACKLOG) {
+				ast_frfree(AST_LIST_REMOVE_HEAD(&xcs[x]->out, frame_list));
+				xcs[x]->done--;
+				transcoder_dropped++;
+			}
+			if (xcs[x]->freed) {
+				/* Nobody else knows about it any more */
+				ast_mutex_unlock(&transcoder_lock);
+				translator_path_destroy(xcs[x]->path);
+				transcoder_path_free(xcs[x]);
+				ast_mutex_lock(&transcoder_lock);
+			} else if (!AST_LIST_EMPTY(&xcs[x]->in)) {
+				xcs[x]->queued = ast_tvnow();
+				AST_LIST_INSERT_TAIL(&transcoder_queue, xcs[x], list);
+				transcoder_depth++;
+			} else
+				xcs[x]->busy = 0;
+		}
+	}
+	ast_mutex_unlock(&transcoder_lock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Queue a frame for the transcoder threads, and take a frame they
+ * finished translating, if any
+ * \param path the path, see ast_translator_offload()
+ * \param f the frame, it is copied
+ * \param out the frames translated since the last call, or NULL if none is ready yet
+ * \retval 0 queued, *out is set
+ * \retval -1 the path is not for the transcoder, or it is not running
+ */
+static int transcoder_translate(struct ast_trans_pvt *path, struct ast_frame *f, struct ast_frame **out)
+{
+	struct transcoder_path *xc = path->xc;
+	struct ast_frame *in;
+
+	/* Unlocked, the transcoder is started or stopped once in a while */
+	if (!xc || (!transcoder_count && !xc->done))
+		return -1;
+	if (!(in = ast_frdup(f)))
+		return -1;
+
+	ast_mutex_lock(&transcoder_lock);
+	if (!transcoder_count || transcoder_stop) {
+		if (xc->busy) {
+			/* A thread finishing the queue still has the path, skip the frame */
+			ast_mutex_unlock(&transcoder_lock);
+			ast_frfree(in);
+			*out = NULL;
+			return 0;
+		}
+		/* Stopped, frames it did not hand back are too old by now */
+		while ((*out = AST_LIST_REMOVE_HEAD(&xc->out, frame_list)))
+			ast_frfree(*out);
+		xc->done = 0;
+		ast_mutex_unlock(&transcoder_lock);
+		ast_frfree(in);
+		return -1;
+	}
+	if (xc->pending >= TRANSCODER_BACKLOG) {
+		ast_frfree(AST_LIST_REMOVE_HEAD(&xc->in, frame_list));
+		xc->pending--;
+		transcoder_dropped++;
+	}
+	AST_LIST_INSERT_TAIL(&xc->in, in, frame_list);
+	xc->pending++;
+	if (!xc->busy) {
+		xc->busy = 1;
+		xc->queued = ast_tvnow();
+		AST_LIST_INSERT_TAIL(&transcoder_queue, xc, list);
+		transcoder_depth++;
+		ast_cond_signal(&transcoder_cond);
+	}
+	/* Hand back everything that is ready, as a list, so the delay does not grow */
+	*out = AST_LIST_FIRST(&xc->out);
+	AST_LIST_HEAD_INIT_NOLOCK(&xc->out);
+	xc->done = 0;
+	ast_mutex_unlock(&transcoder_lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Let go of the transcoder side of a path being freed
+ * \retval 1 a thread is translating for it, and destroys the path when done
+ * \retval 0 the path can be destroyed now
+ */
+static int transcoder_release(struct ast_trans_pvt *path)
+{
+	struct transcoder_path *xc = path->xc;
+
+	ast_mutex_lock(&transcoder_lock);
+	if (xc->busy) {
+		xc->freed = 1;
+		ast_mutex_unlock(&transcoder_lock);
+		return 1;
+	}
+	ast_mutex_unlock(&transcoder_lock);
+
+	path->xc = NULL;
+	transcoder_path_free(xc);
+	return 0;
+}
+
+void ast_translator_offload(struct ast_trans_pvt *path)
+{
+	struct transcoder_path *xc;
+	struct ast_trans_pvt *p;
+
+	for (p = path; p && !p->t->offload; p = p->next)
+		;
+	if (!p || path->xc || !(xc = ast_calloc(1, sizeof(*xc))))
+		return;
+	xc->path = path;
+	path->xc = xc;
+}
+
+/*! \brief Stop the transcoder threads, once they are done with the queue */
+static void transcoder_shutdown(void)
+{
+	int x, count;
+
+	ast_mutex_lock(&transcoder_lock);
+	transcoder_stop = 1;
+	count = transcoder_count;
+	ast_cond_broadcast(&transcoder_cond);
+	ast_mutex_unlock(&transcoder_lock);
+
+	for (x = 0; x < count; x++)
+		pthread_join(transcoder_threads[x], NULL);
+
+	ast_mutex_lock(&transcoder_lock);
+	transcoder_count = 0;
+	transcoder_stop = 0;
+	ast_mutex_unlock(&transcoder_lock);
+}
+
+/*! \brief Start the transcoder with the given number of threads */
+static void transcoder_start(int count)
+{
+	long x;
+
+	ast_mutex_lock(&transcoder_lock);
+	for (x = 0; x < count; x++) {
+		if (ast_pthread_create(&transcoder_threads[x], NULL, transcoder_thread, (void *) x)) {
+			ast_log(LOG_WARNING, "Unable to start transcoder thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+	transcoder_count = x;
+	ast_mutex_unlock(&transcoder_lock);
+
+	if (option_verbose > 1 && transcoder_count)
+		ast_verbose(VERBOSE_PREFIX_2 "Transcoder started with %d threads%s\n",
+			transcoder_count, transcoder_pin ? " pinned to cores" : "");
+}
+
+int ast_transcoder_reload(void)
+{
+	struct ast_variable *var;
+	struct ast_config *cfg;
+	int threads = 0, pin = 1;
+
+	if ((cfg = ast_config_load("codecs.conf"))) {
+		for (var = ast_variable_browse(cfg, "transcoder"); var; var = var->next) {
+			if (!strcasecmp(var->name, "threads")) {
+				if (sscanf(var->value, "%d", &threads) != 1 || threads < 0) {
+					ast_log(LOG_WARNING, "Invalid transcoder threads '%s', at line %d of codecs.conf\n", var->value, var->lineno);
+					threads = 0;
+				} else if (threads > MAX_TRANSCODER_THREADS) {
+					ast_log(LOG_WARNING, "Transcoder threads %d is more than %d\n", threads, MAX_TRANSCODER_THREADS);
+					threads = MAX_TRANSCODER_THREADS;
+				}
+			} else if (!strcasecmp(var->name, "pin")) {
+				pin = ast_true(var->value);
+			}
+		}
+		ast_config_destroy(cfg);
+	}
+
+	if (threads == transcoder_count && pin == transcoder_pin)
+		return 0;
+
+	transcoder_shutdown();
+	transcoder_pin = pin;
+	if (threads)
+		transcoder_start(threads);
+
+	return 0;
+}
+
+void ast_transcoder_init(void)
+{
+	ast_cond_init(&transcoder_cond, NULL);
+	ast_transcoder_reload();
+}
+
 /*! \brief do the actual translation */
 struct ast_frame *ast_translate(struct ast_trans_pvt *path, struct ast_frame *f, int consume)
 {
 	struct ast_trans_pvt *p = path;
-	struct ast_frame *out = f;
+	struct ast_frame *out = f, *cur;
 	struct timeval delivery;
 	int has_timing_info;
 	long ts;
@@ -311,40 +849,41 @@ struct ast_frame *ast_translate(struct ast_trans_pvt *path, struct ast_frame *f,
 		path->nextin = ast_tvadd(path->nextin, ast_samp2tv(f->samples, ast_format_rate(f->subclass)));
 	}
 	delivery = f->delivery;
-	for ( ; out && p ; p = p->next) {
-		framein(p, out);
-		if (out != f)
-			ast_frfree(out);
-		out = p->t->frameout(p);
+	if (transcoder_translate(p, f, &out)) {
+		out = translate_steps(p, f);
+		if (out && ast_tvzero(delivery)) {
+			ast_set2_flag(out, has_timing_info, AST_FRFLAG_HAS_TIMING_INFO);
+			if (has_timing_info) {
+				out->ts = ts;
+				out->len = len;
+				out->seqno = seqno;
+			}
+		}
 	}
 	if (consume)
 		ast_frfree(f);
 	if (out == NULL)
 		return NULL;
-	/* we have a frame, play with times */
-	if (!ast_tvzero(delivery)) {
-		/* Regenerate prediction after a discontinuity */
-		if (ast_tvzero(path->nextout))
-			path->nextout = ast_tvnow();
-
-		/* Use next predicted outgoing timestamp */
-		out->delivery = path->nextout;
-		
-		/* Predict next outgoing timestamp from samples in this
-		   frame. */
-		path->nextout = ast_tvadd(path->nextout, ast_samp2tv(out->samples, ast_format_rate(out->subclass)));
-	} else {
-		out->delivery = ast_tv(0, 0);
-		ast_set2_flag(out, has_timing_info, AST_FRFLAG_HAS_TIMING_INFO);
-		if (has_timing_info) {
-			out->ts = ts;
-			out->len = len;
-			out->seqno = seqno;
-		}
-	}
-	/* Invalidate prediction if we're entering a silence period */
-	if (out->frametype == AST_FRAME_CNG)
-		path->nextout = ast_tv(0, 0);
+	/* we have a frame, play with times.  Frames from the transcoder
+	   already carry the timing info of the frame they were made from. */
+	for (cur = out; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+		if (!ast_tvzero(delivery)) {
+			/* Regenerate prediction after a discontinuity */
+			if (ast_tvzero(path->nextout))
+				path->nextout = ast_tvnow();
+
+			/* Use next predicted outgoing timestamp */
+			cur->delivery = path->nextout;
+			
+			/* Predict next outgoing timestamp from samples in this
+			   frame. */
+			path->nextout = ast_tvadd(path->nextout, ast_samp2tv(cur->samples, ast_format_rate(cur->subclass)));
+		} else
+			cur->delivery = ast_tv(0, 0);
+		/* Invalidate prediction if we're entering a silence period */
+		if (cur->frametype == AST_FRAME_CNG)
+			path->nextout = ast_tv(0, 0);
+	}
 	return out;
 }
 
@@ -418,6 +957,7 @@ static void rebuild_matrix(int samples)
 		ast_log(LOG_DEBUG, "Resetting translation matrix\n");
 
 	bzero(tr_matrix, sizeof(tr_matrix));
+	flush_paths();
 
 	/* first, compute all direct costs */
 	AST_LIST_TRAVERSE(&translators, t, list) {
@@ -621,6 +1161,55 @@ static int show_translation(int fd, int argc, char *argv[])
 	return RESULT_SUCCESS;
 }
 
+static int show_transcoder(int fd, int argc, char *argv[])
+{
+#define FORMAT "%-20s %10u %12llu %10lld %11lld %12lld %12lld\n"
+#define FORMAT2 "%-20s %10s %12s %10s %11s %12s %12s\n"
+	struct transcoder_stats *stats;
+	char name[40];
+	int x, z, depth, count;
+	unsigned int dropped;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	ast_mutex_lock(&transcoder_lock);
+	count = transcoder_count;
+	depth = transcoder_depth;
+	dropped = transcoder_dropped;
+	ast_mutex_unlock(&transcoder_lock);
+
+	if (count)
+		ast_cli(fd, "Transcoder threads: %d%s, %d calls queued, %u frames dropped\n\n", count, transcoder_pin ? " (pinned)" : "", depth, dropped);
+	else
+		ast_cli(fd, "Transcoder threads: none, translating in the channel threads\n\n");
+
+	ast_cli(fd, FORMAT2, "Translation", "Frames", "Samples", "Busy(ms)", "Samples/ms", "AvgWait(us)", "MaxWait(us)");
+	ast_mutex_lock(&transcoder_stats_lock);
+	for (x = 0; x < MAX_FORMAT; x++) {
+		for (z = 0; z < MAX_FORMAT; z++) {
+			stats = &transcoder_stats[x][z];
+			if (!stats->frames)
+				continue;
+			snprintf(name, sizeof(name), "%s->%s", ast_getformatname(1 << x), ast_getformatname(1 << z));
+			ast_cli(fd, FORMAT, name, stats->frames, (unsigned long long) stats->samples, (long long) stats->busy / 1000,
+				(long long) (stats->busy ? stats->samples * 1000LL / stats->busy : 0),
+				(long long) stats->wait / stats->frames, (long long) stats->wait_max);
+		}
+	}
+	ast_mutex_unlock(&transcoder_stats_lock);
+
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
+static char show_transcoder_usage[] =
+"Usage: core show transcoder\n"
+"       Displays the threads of the transcoder, and for each translation\n"
+"step they ran, the frames and samples they produced, the time spent,\n"
+"and how long frames waited in the queue.\n";
+
 static char show_trans_usage[] =
 "Usage: core show translation [recalc] [<recalc seconds>]\n"
 "       Displays known codec translators and the cost associated\n"
@@ -637,6 +1226,10 @@ static struct ast_cli_entry cli_translate[] = {
 	{ { "core", "show", "translation", NULL },
 	show_translation, "Display translation matrix",
 	show_trans_usage, NULL, &cli_show_translation_deprecated },
+
+	{ { "core", "show", "transcoder", NULL },
+	show_transcoder, "Display transcoder threads and statistics",
+	show_transcoder_usage },
 };
 
 /*! \brief register codec translator */
@@ -656,6 +1249,8 @@ int __ast_register_translator(struct ast_translator *t, struct ast_module *mod)
 	}
 
 	t->module = mod;
+	t->pool = NULL;
+	t->pool_count = 0;
 
 	t->srcfmt = powerof(t->srcfmt);
 	t->dstfmt = powerof(t->dstfmt);
@@ -736,6 +1331,7 @@ int ast_unregister_translator(struct ast_translator *t)
 {
 	char tmp[80];
 	struct ast_translator *u;
+	struct ast_trans_pvt *p;
 	int found = 0;
 
 	AST_LIST_LOCK(&translators);
@@ -755,6 +1351,18 @@ int ast_unregister_translator(struct ast_translator *t)
 
 	AST_LIST_UNLOCK(&translators);
 
+	/* The idle pvts do not hold a reference to the module, which is
+	   still loaded as it is unregistering its translators */
+	ast_mutex_lock(&pool_lock);
+	while ((p = t->pool)) {
+		t->pool = p->next;
+		if (t->destroy)
+			t->destroy(p);
+		free(p);
+	}
+	t->pool_count = 0;
+	ast_mutex_unlock(&pool_lock);
+
 	return (u ? 0 : -1);
 }
 
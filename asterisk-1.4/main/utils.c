@@ -39,6 +39,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 310779 $")
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #define AST_API_MODULE		/* ensure that inlinable API functions will be built in lock.h if required */
 #include "asterisk/lock.h"
@@ -991,6 +993,64 @@ int ast_carefulwrite(int fd, char *s, int len, int timeoutms)
 	return res;
 }
 
+int ast_carefulwritev(int fd, struct iovec *iov, int iovcnt, int timeoutms)
+{
+	struct timeval start = ast_tvnow();
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLOUT,
+	};
+	int res, elapsed;
+
+	while (iovcnt) {
+#ifdef IOV_MAX
+		res = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+#else
+		res = writev(fd, iov, iovcnt);
+#endif
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				/* fatal error from writev() */
+				ast_log(LOG_ERROR, "writev() returned error: %s\n", strerror(errno));
+				return -1;
+			}
+			/* It was an acceptable error */
+			res = 0;
+		}
+
+		/* Step over what went out, leaving iov at the first unwritten byte */
+		while (iovcnt && (size_t) res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (!iovcnt)
+			break;
+		iov->iov_base = (char *) iov->iov_base + res;
+		iov->iov_len -= res;
+
+		elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+		if (elapsed >= timeoutms) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Timed out trying to write\n");
+			return -1;
+		}
+
+		/* poll() until the fd can take some more */
+		res = ast_poll(&pfd, 1, timeoutms - elapsed);
+		if (res == 0) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Timed out trying to write\n");
+			return -1;
+		} else if (res < 0 && errno != EINTR && errno != EAGAIN) {
+			ast_log(LOG_ERROR, "poll returned error: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 char *ast_strip_quoted(char *s, const char *beg_quotes, const char *end_quotes)
 {
 	char *e;
@@ -549,7 +549,7 @@ static int dundi_lookup_local(struct dundi_result *dr, struct dundi_mapping *map
 			ast_clear_flag(&flags, DUNDI_FLAG_MATCHMORE|DUNDI_FLAG_CANMATCH);
 		}
 		if (ast_test_flag(&flags, AST_FLAGS_ALL)) {
-			struct varshead headp;
+			struct varshead headp = { 0, };
 			struct ast_var_t *newvariable;
 			ast_set_flag(&flags, map->options & 0xffff);
 			ast_copy_flags(dr + anscnt, &flags, AST_FLAGS_ALL);
@@ -560,7 +560,6 @@ static int dundi_lookup_local(struct dundi_result *dr, struct dundi_mapping *map
 			dr[anscnt].eid = *us_eid;
 			dundi_eid_to_str(dr[anscnt].eid_str, sizeof(dr[anscnt].eid_str), &dr[anscnt].eid);
 			if (ast_test_flag(&flags, DUNDI_FLAG_EXISTS)) {
-				AST_LIST_HEAD_INIT_NOLOCK(&headp);
 				newvariable = ast_var_assign("NUMBER", called_number);
 				AST_LIST_INSERT_HEAD(&headp, newvariable, entries);
 				newvariable = ast_var_assign("EID", dr[anscnt].eid_str);
@@ -570,8 +569,7 @@ static int dundi_lookup_local(struct dundi_result *dr, struct dundi_mapping *map
 				newvariable = ast_var_assign("IPADDR", ipaddr);
 				AST_LIST_INSERT_HEAD(&headp, newvariable, entries);
 				pbx_substitute_variables_varshead(&headp, map->dest, dr[anscnt].dest, sizeof(dr[anscnt].dest));
-				while ((newvariable = AST_LIST_REMOVE_HEAD(&headp, entries)))
-					ast_var_delete(newvariable);
+				ast_var_list_destroy(&headp);
 			} else
 				dr[anscnt].dest[0] = '\0';
 			anscnt++;
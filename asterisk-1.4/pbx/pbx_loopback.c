@@ -91,12 +91,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 211528 $")
 static char *loopback_subst(char *buf, int buflen, const char *exten, const char *context, int priority, const char *data)
 {
 	struct ast_var_t *newvariable;
-	struct varshead headp;
+	struct varshead headp = { 0, };
 	char tmp[80];
 
 	snprintf(tmp, sizeof(tmp), "%d", priority);
 	memset(buf, 0, buflen);
-	AST_LIST_HEAD_INIT_NOLOCK(&headp);
 	newvariable = ast_var_assign("EXTEN", exten);
 	AST_LIST_INSERT_HEAD(&headp, newvariable, entries);
 	newvariable = ast_var_assign("CONTEXT", context);
@@ -106,8 +105,7 @@ static char *loopback_subst(char *buf, int buflen, const char *exten, const char
 	/* Substitute variables */
 	pbx_substitute_variables_varshead(&headp, data, buf, buflen);
 	/* free the list */
-	while ((newvariable = AST_LIST_REMOVE_HEAD(&headp, entries)))
-                ast_var_delete(newvariable);
+	ast_var_list_destroy(&headp);
 	return buf;
 }
 
@@ -312,7 +312,7 @@ static void set_null_chan_tech(struct ast_channel *chan)
 			/* Don't clear these fd's. */
 			break;
 		default:
-			chan->fds[idx] = -1;
+			ast_channel_set_fd(chan, idx, -1);
 			break;
 		}
 	}
@@ -339,7 +339,7 @@ static void set_new_chan_name(struct ast_channel *chan)
 	ast_channel_lock(chan);
 
 	orig_name = ast_strdupa(chan->name);
-	ast_string_field_build(chan, name, "%s<XFER_%x>", orig_name,
+	ast_channel_set_name(chan, "%s<XFER_%x>", orig_name,
 		ast_atomic_fetchadd_int(&seq_num, +1));
 
 	ast_channel_unlock(chan);
@@ -126,12 +126,24 @@ struct moh_files_state {
 	int pos;
 	int save_pos;
 	char *save_pos_filename;
+	/*! The shared output this listener reads from, in "shared" classes */
+	struct moh_shared_output *output;
+	/*! The next frame of the shared output to play */
+	unsigned int seq;
 };
 
 #define MOH_QUIET		(1 << 0)
 #define MOH_SINGLE		(1 << 1)
 #define MOH_CUSTOM		(1 << 2)
 #define MOH_RANDOMIZE		(1 << 3)
+#define MOH_SHARED		(1 << 4)
+
+/*! Frames kept for each codec of a shared class, about 1.3 seconds */
+#define MOH_SHARED_FRAMES	64
+/*! Milliseconds of audio a shared class decodes per tick */
+#define MOH_SHARED_TICK		20
+/*! Frames behind the live position a new listener of a shared class starts */
+#define MOH_SHARED_OFFSET	3
 
 struct mohclass {
 	char name[MAX_MUSICCLASS];
@@ -159,6 +171,31 @@ struct mohclass {
 	unsigned int deprecated:1;
 	AST_LIST_HEAD_NOLOCK(, mohdata) members;
 	AST_LIST_ENTRY(mohclass) list;
+	/*! Protects the shared playout below */
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! The file being played to all listeners of a shared class */
+	struct ast_filestream *stream;
+	int stream_pos;
+	/*! One output per codec the listeners want */
+	AST_LIST_HEAD_NOLOCK(, moh_shared_output) outputs;
+	int listeners;
+	/*! Frames behind the live position a new listener starts */
+	int offset;
+	unsigned int stop:1;
+};
+
+/*! \brief The frames of a shared class, encoded for one codec */
+struct moh_shared_output {
+	int format;
+	/*! The format trans translates from, 0 if not yet built */
+	int srcformat;
+	struct ast_trans_pvt *trans;
+	struct ast_frame *frames[MOH_SHARED_FRAMES];
+	/*! Number of frames produced so far */
+	unsigned int seq;
+	int listeners;
+	AST_LIST_ENTRY(moh_shared_output) list;
 };
 
 struct mohdata {
@@ -364,6 +401,307 @@ static struct ast_generator moh_file_stream = {
 	.generate = moh_files_generator,
 };
 
+/*!
+ * \brief Read the next frame of a shared class, moving on to the next file as needed
+ * \note Only the playout thread touches the class stream.
+ */
+static struct ast_frame *moh_shared_read(struct mohclass *class)
+{
+	struct ast_frame *f;
+	char *file;
+	int tries;
+
+	if (class->stream && (f = ast_readframe(class->stream))) {
+		return f;
+	}
+
+	for (tries = 0; tries < class->total_files; tries++) {
+		if (class->stream) {
+			ast_closestream(class->stream);
+			class->stream = NULL;
+		}
+
+		if (ast_test_flag(class, MOH_RANDOMIZE)) {
+			class->stream_pos = ast_random() % class->total_files;
+		} else {
+			class->stream_pos = (class->stream_pos + 1) % class->total_files;
+		}
+
+		/* The extension is stored right after the name, see moh_add_file() */
+		file = class->filearray[class->stream_pos];
+		if (!(class->stream = ast_readfile(file, file + strlen(file) + 1, NULL, O_RDONLY, 0, 0))) {
+			continue;
+		}
+
+		if (option_debug) {
+			ast_log(LOG_DEBUG, "Class '%s' opened file %d '%s'\n", class->name, class->stream_pos, file);
+		}
+
+		if ((f = ast_readframe(class->stream))) {
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Add a frame to every output of a shared class
+ * \note The class must be locked.
+ */
+static void moh_shared_post(struct mohclass *class, struct ast_frame *f)
+{
+	struct moh_shared_output *out;
+	struct ast_frame *tf, **slot;
+
+	AST_LIST_TRAVERSE(&class->outputs, out, list) {
+		tf = f;
+		if (out->format != f->subclass) {
+			if (out->srcformat != f->subclass) {
+				if (out->trans) {
+					ast_translator_free_path(out->trans);
+				}
+				out->srcformat = f->subclass;
+				if (!(out->trans = ast_translator_build_path(out->format, f->subclass))) {
+					ast_log(LOG_WARNING, "Unable to translate music on hold class '%s' from %s to %s\n",
+						class->name, ast_getformatname(f->subclass), ast_getformatname(out->format));
+				}
+			}
+			if (!out->trans || !(tf = ast_translate(out->trans, f, 0))) {
+				continue;
+			}
+		}
+
+		slot = &out->frames[out->seq % MOH_SHARED_FRAMES];
+		if (*slot) {
+			ast_frfree(*slot);
+		}
+		if ((*slot = ast_frdup(tf))) {
+			out->seq++;
+		}
+	}
+}
+
+static void moh_shared_output_free(struct moh_shared_output *out)
+{
+	int x;
+
+	for (x = 0; x < MOH_SHARED_FRAMES; x++) {
+		if (out->frames[x]) {
+			ast_frfree(out->frames[x]);
+		}
+	}
+	if (out->trans) {
+		ast_translator_free_path(out->trans);
+	}
+	free(out);
+}
+
+/*!
+ * \brief Playout thread of a shared class
+ *
+ * Decodes the class files once per tick while anyone is listening and
+ * encodes each frame once for every codec in use.  The thread holds no
+ * reference to the class; the class destructor stops it.
+ */
+static void *moh_shared_thread(void *data)
+{
+	struct mohclass *class = data;
+	struct ast_frame *f;
+	struct timeval next = { 0, 0 };
+	struct timespec ts;
+	int samples = 0;
+
+	ast_mutex_lock(&class->lock);
+	while (!class->stop) {
+		if (!class->listeners) {
+			ast_cond_wait(&class->cond, &class->lock);
+			next = ast_tv(0, 0);
+			samples = 0;
+			continue;
+		}
+
+		if (ast_tvzero(next) || ast_tvdiff_ms(ast_tvnow(), next) > 1000) {
+			/* Starting out, or so late that catching up would only be a burst */
+			next = ast_tvnow();
+		}
+		if (ast_tvdiff_ms(next, ast_tvnow()) > 0) {
+			ts.tv_sec = next.tv_sec;
+			ts.tv_nsec = next.tv_usec * 1000;
+			ast_cond_timedwait(&class->cond, &class->lock, &ts);
+			continue;
+		}
+		next = ast_tvadd(next, ast_samp2tv(MOH_SHARED_TICK, 1000));
+
+		samples += MOH_SHARED_TICK * 8;
+		while (samples > 0 && !class->stop) {
+			/* Read without the lock, so that slow storage does not hold up the listeners */
+			ast_mutex_unlock(&class->lock);
+			f = moh_shared_read(class);
+			ast_mutex_lock(&class->lock);
+			if (!f) {
+				ast_log(LOG_WARNING, "No playable files for class '%s'\n", class->name);
+				next = ast_tvadd(ast_tvnow(), ast_samp2tv(5, 1));
+				samples = 0;
+				break;
+			}
+			moh_shared_post(class, f);
+			samples -= f->samples;
+		}
+	}
+	ast_mutex_unlock(&class->lock);
+
+	return NULL;
+}
+
+/*! \brief The codec a listener of a shared class is sent, the one the channel already uses if possible */
+static int moh_shared_format(struct ast_channel *chan)
+{
+	int format = chan->rawwriteformat & AST_FORMAT_AUDIO_MASK;
+
+	if (!format) {
+		format = ast_best_codec(chan->nativeformats);
+	}
+	if (!format || (format != AST_FORMAT_SLINEAR && ast_translate_path_steps(format, AST_FORMAT_SLINEAR) == -1)) {
+		format = AST_FORMAT_SLINEAR;
+	}
+
+	return format;
+}
+
+static void moh_shared_release(struct ast_channel *chan, void *data)
+{
+	struct moh_files_state *state = data;
+	struct mohclass *class = state->class;
+	struct moh_shared_output *out = state->output;
+
+	ast_mutex_lock(&class->lock);
+	class->listeners--;
+	if (!--out->listeners) {
+		AST_LIST_REMOVE(&class->outputs, out, list);
+		moh_shared_output_free(out);
+	}
+	ast_mutex_unlock(&class->lock);
+	state->output = NULL;
+
+	if (chan) {
+		if (state->origwfmt && ast_set_write_format(chan, state->origwfmt)) {
+			ast_log(LOG_WARNING, "Unable to restore channel '%s' to format '%d'\n", chan->name, state->origwfmt);
+		}
+		if (option_verbose > 2) {
+			ast_verbose(VERBOSE_PREFIX_3 "Stopped music on hold on %s\n", chan->name);
+		}
+	}
+
+	state->class = mohclass_unref(class);
+}
+
+static void *moh_shared_alloc(struct ast_channel *chan, void *params)
+{
+	struct moh_files_state *state;
+	struct mohclass *class = params;
+	struct moh_shared_output *out;
+	int format = moh_shared_format(chan);
+
+	if (!chan->music_state && !(chan->music_state = ast_calloc(1, sizeof(*state)))) {
+		return NULL;
+	}
+	state = chan->music_state;
+	memset(state, 0, sizeof(*state));
+
+	state->origwfmt = chan->writeformat;
+	if (ast_set_write_format(chan, format)) {
+		ast_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, ast_codec2str(format));
+		return NULL;
+	}
+
+	ast_mutex_lock(&class->lock);
+	AST_LIST_TRAVERSE(&class->outputs, out, list) {
+		if (out->format == format) {
+			break;
+		}
+	}
+	if (!out) {
+		if (!(out = ast_calloc(1, sizeof(*out)))) {
+			ast_mutex_unlock(&class->lock);
+			ast_set_write_format(chan, state->origwfmt);
+			return NULL;
+		}
+		out->format = format;
+		AST_LIST_INSERT_HEAD(&class->outputs, out, list);
+	}
+	out->listeners++;
+	state->output = out;
+	state->seq = out->seq > class->offset ? out->seq - class->offset : 0;
+	if (!class->listeners++) {
+		ast_cond_signal(&class->cond);
+	}
+	ast_mutex_unlock(&class->lock);
+
+	state->class = mohclass_ref(class);
+
+	if (option_verbose > 2) {
+		ast_verbose(VERBOSE_PREFIX_3 "Started music on hold, class '%s', on %s\n",
+				class->name, chan->name);
+	}
+
+	return state;
+}
+
+static int moh_shared_generator(struct ast_channel *chan, void *data, int len, int samples)
+{
+	struct moh_files_state *state = data;
+	struct mohclass *class = state->class;
+	struct moh_shared_output *out = state->output;
+	short buf[1280 + AST_FRIENDLY_OFFSET / 2];
+	struct ast_frame f, *src;
+
+	state->sample_queue += samples;
+
+	while (state->sample_queue > 0) {
+		ast_mutex_lock(&class->lock);
+		if (out->seq - state->seq > MOH_SHARED_FRAMES) {
+			/* We fell behind the oldest frame kept, skip ahead */
+			state->seq = out->seq - class->offset;
+		}
+		if (state->seq == out->seq) {
+			/* Ahead of the playout thread, nothing new to send */
+			ast_mutex_unlock(&class->lock);
+			state->sample_queue = 0;
+			break;
+		}
+		src = out->frames[state->seq++ % MOH_SHARED_FRAMES];
+		if (src->datalen > sizeof(buf) - AST_FRIENDLY_OFFSET) {
+			ast_mutex_unlock(&class->lock);
+			continue;
+		}
+		/* Copy the frame out, the playout thread reuses its slot */
+		memset(&f, 0, sizeof(f));
+		f.frametype = AST_FRAME_VOICE;
+		f.subclass = src->subclass;
+		f.datalen = src->datalen;
+		f.samples = src->samples;
+		f.offset = AST_FRIENDLY_OFFSET;
+		f.data = buf + AST_FRIENDLY_OFFSET / 2;
+		memcpy(f.data, src->data, src->datalen);
+		ast_mutex_unlock(&class->lock);
+
+		state->sample_queue -= f.samples;
+		if (ast_write(chan, &f) < 0) {
+			ast_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static struct ast_generator moh_shared_stream = {
+	.alloc    = moh_shared_alloc,
+	.release  = moh_shared_release,
+	.generate = moh_shared_generator,
+};
+
 #ifdef HAVE_WORKING_FORK
 static int spawn_mp3(struct mohclass *class)
 {
@@ -807,8 +1145,15 @@ static struct ast_generator mohgen = {
 	.generate = moh_generate,
 };
 
-static int moh_add_file(struct mohclass *class, const char *filepath)
+/*!
+ * \brief Add a file to a "files" class
+ * \note The extension is kept after the terminating NUL of the name, for
+ * the shared playout which opens a file by its exact format.
+ */
+static int moh_add_file(struct mohclass *class, const char *filepath, const char *ext)
 {
+	size_t len = strlen(filepath) + 1;
+
 	if (!class->allowed_files) {
 		if (!(class->filearray = ast_calloc(1, INITIAL_NUM_FILES * sizeof(*class->filearray))))
 			return -1;
@@ -822,8 +1167,10 @@ static int moh_add_file(struct mohclass *class, const char *filepath)
 		class->allowed_files *= 2;
 	}
 
-	if (!(class->filearray[class->total_files] = ast_strdup(filepath)))
+	if (!(class->filearray[class->total_files] = ast_malloc(len + strlen(ext) + 1)))
 		return -1;
+	memcpy(class->filearray[class->total_files], filepath, len);
+	strcpy(class->filearray[class->total_files] + len, ext);
 
 	class->total_files++;
 
@@ -886,13 +1233,17 @@ static int moh_scan_files(struct mohclass *class) {
 			ext++;
 		}
 
+		/* The shared playout opens files by extension, so only take those of a known format */
+		if (ast_test_flag(class, MOH_SHARED) && (!ext || ast_fileexists(filepath, ext, NULL) <= 0))
+			continue;
+
 		/* if the file is present in multiple formats, ensure we only put it into the list once */
 		for (i = 0; i < class->total_files; i++)
 			if (!strcmp(filepath, class->filearray[i]))
 				break;
 
 		if (i == class->total_files) {
-			if (moh_add_file(class, filepath))
+			if (moh_add_file(class, filepath, S_OR(ext, "")))
 				break;
 		}
 	}
@@ -927,6 +1278,15 @@ static int init_files_class(struct mohclass *class)
 		ast_set_flag(class, MOH_RANDOMIZE);
 	}
 
+	if (ast_test_flag(class, MOH_SHARED)) {
+		class->stream_pos = ast_test_flag(class, MOH_RANDOMIZE) ? ast_random() % class->total_files : -1;
+		if (ast_pthread_create_background(&class->thread, NULL, moh_shared_thread, class)) {
+			ast_log(LOG_WARNING, "Unable to create shared moh thread for class '%s', each listener will play the files itself\n", class->name);
+			class->thread = 0;
+			ast_clear_flag(class, MOH_SHARED);
+		}
+	}
+
 	return 0;
 }
 
@@ -994,6 +1354,11 @@ static int moh_register(struct mohclass *moh, int reload)
 
 	time(&moh->start);
 	moh->start -= respawn_time;
+
+	if (ast_test_flag(moh, MOH_SHARED) && strcasecmp(moh->mode, "files")) {
+		ast_log(LOG_WARNING, "Only classes with mode=files can be shared, ignoring shared for class '%s'\n", moh->name);
+		ast_clear_flag(moh, MOH_SHARED);
+	}
 	
 	if (!strcasecmp(moh->mode, "files")) {
 		if (init_files_class(moh)) {
@@ -1070,7 +1435,7 @@ static int local_ast_moh_start(struct ast_channel *chan, const char *mclass, con
 	ast_set_flag(chan, AST_FLAG_MOH);
 
 	if (mohclass->total_files) {
-		res = ast_activate_generator(chan, &moh_file_stream, mohclass);
+		res = ast_activate_generator(chan, ast_test_flag(mohclass, MOH_SHARED) ? &moh_shared_stream : &moh_file_stream, mohclass);
 	} else {
 		res = ast_activate_generator(chan, &mohgen, mohclass);
 	}
@@ -1099,6 +1464,7 @@ static void moh_class_destructor(void *obj)
 {
 	struct mohclass *class = obj;
 	struct mohdata *member;
+	struct moh_shared_output *output;
 
 	if (option_debug) {
 		ast_log(LOG_DEBUG, "Destroying MOH class '%s'\n", class->name);
@@ -1138,11 +1504,32 @@ static void moh_class_destructor(void *obj)
 	}
 
 	if (class->thread) {
-		pthread_cancel(class->thread);
+		/* A files class only ever runs the shared playout, which is asked to
+		 * stop.  Every other mode runs monmp3thread, which has to be cancelled. */
+		if (!strcasecmp(class->mode, "files")) {
+			ast_mutex_lock(&class->lock);
+			class->stop = 1;
+			ast_cond_signal(&class->cond);
+			ast_mutex_unlock(&class->lock);
+		} else {
+			pthread_cancel(class->thread);
+		}
 		pthread_join(class->thread, NULL);
 		class->thread = AST_PTHREADT_NULL;
 	}
 
+	if (class->stream) {
+		ast_closestream(class->stream);
+		class->stream = NULL;
+	}
+
+	while ((output = AST_LIST_REMOVE_HEAD(&class->outputs, list))) {
+		moh_shared_output_free(output);
+	}
+
+	ast_mutex_destroy(&class->lock);
+	ast_cond_destroy(&class->cond);
+
 	if (class->pseudofd > -1) {
 		close(class->pseudofd);
 		class->pseudofd = -1;
@@ -1166,6 +1553,9 @@ static struct mohclass *moh_class_malloc(void)
 		class->format = AST_FORMAT_SLINEAR;
 		class->srcfd = -1;
 		class->pseudofd = -1;
+		class->offset = MOH_SHARED_OFFSET;
+		ast_mutex_init(&class->lock);
+		ast_cond_init(&class->cond, NULL);
 	}
 
 	return class;
@@ -1229,6 +1619,17 @@ static int load_moh_classes(int reload)
 				ast_copy_string(class->args, var->value, sizeof(class->args));
 			} else if (!strcasecmp(var->name, "random")) {
 				ast_set2_flag(class, ast_true(var->value), MOH_RANDOMIZE);
+			} else if (!strcasecmp(var->name, "shared")) {
+				ast_set2_flag(class, ast_true(var->value), MOH_SHARED);
+			} else if (!strcasecmp(var->name, "sharedoffset")) {
+				int offset;
+
+				if (sscanf(var->value, "%30d", &offset) != 1 || offset < 0) {
+					ast_log(LOG_WARNING, "Invalid sharedoffset '%s' for class '%s', using default\n", var->value, class->name);
+				} else if ((class->offset = offset / MOH_SHARED_TICK) >= MOH_SHARED_FRAMES) {
+					class->offset = MOH_SHARED_FRAMES - 1;
+					ast_log(LOG_WARNING, "sharedoffset for class '%s' is too large, using %d\n", class->name, class->offset * MOH_SHARED_TICK);
+				}
 			} else if (!strcasecmp(var->name, "format")) {
 				class->format = ast_getformatbyname(var->value);
 				if (!class->format) {
@@ -1411,6 +1812,16 @@ static int moh_classes_show(int fd, int argc, char *argv[])
 		if (strcasecmp(class->mode, "files")) {
 			ast_cli(fd, "\tFormat: %s\n", ast_getformatname(class->format));
 		}
+		if (ast_test_flag(class, MOH_SHARED)) {
+			struct moh_shared_output *out;
+
+			ast_mutex_lock(&class->lock);
+			ast_cli(fd, "\tShared: %d listener%s\n", class->listeners, class->listeners == 1 ? "" : "s");
+			AST_LIST_TRAVERSE(&class->outputs, out, list) {
+				ast_cli(fd, "\t\t%s: %d\n", ast_getformatname(out->format), out->listeners);
+			}
+			ast_mutex_unlock(&class->lock);
+		}
 	}
 
  	ao2_iterator_destroy(&i);
@@ -1501,7 +1912,7 @@ static int moh_class_inuse(void *obj, void *arg, int flags)
 {
 	struct mohclass *class = obj;
 
-	return AST_LIST_EMPTY(&class->members) ? 0 : CMP_MATCH | CMP_STOP;
+	return (AST_LIST_EMPTY(&class->members) && !class->listeners) ? 0 : CMP_MATCH | CMP_STOP;
 }
 
 static int unload_module(void)
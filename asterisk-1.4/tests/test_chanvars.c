@@ -0,0 +1,208 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief Channel Variable Lookup Tests
+ *
+ * Set, change and unset variables on lists short enough to be scanned and
+ * long enough to be indexed, and check what every lookup finds, with and
+ * without regard to case.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/chanvars.h"
+#include "asterisk/channel.h"
+#include "asterisk/pbx.h"
+
+/*! \brief Check what a lookup finds, returns 0 if it is what was expected */
+static int chanvars_expect(struct ast_test *test, struct varshead *head, const char *name, int nocase, const char *expect)
+{
+	struct ast_var_t *var = ast_var_find(head, name, nocase);
+	const char *got = var ? ast_var_value(var) : NULL;
+
+	if ((!got && !expect) || (got && expect && !strcmp(got, expect)))
+		return 0;
+	ast_test_status_update(test, "'%s'%s found '%s', not '%s'\n", name, nocase ? " (any case)" : "",
+		got ? got : "(nothing)", expect ? expect : "(nothing)");
+	return -1;
+}
+
+/*! \brief Fill a list with count variables VARn=n, and check lookups as it changes */
+static int chanvars_list(struct ast_test *test, int count)
+{
+	struct varshead head = { 0, };
+	struct ast_var_t *var;
+	char name[32], value[32];
+	int bad = 0, i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "%sVAR%d", (i % 3) ? "" : "_", i);
+		snprintf(value, sizeof(value), "%d", i);
+		if (!(var = ast_var_assign(name, value))) {
+			ast_var_list_destroy(&head);
+			return -1;
+		}
+		if (i % 2)
+			ast_var_insert_head(&head, var);
+		else
+			ast_var_insert_tail(&head, var);
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "VAR%d", i);
+		snprintf(value, sizeof(value), "%d", i);
+		bad |= chanvars_expect(test, &head, name, 0, value);
+		snprintf(name, sizeof(name), "var%d", i);
+		bad |= chanvars_expect(test, &head, name, 1, value);
+		bad |= chanvars_expect(test, &head, name, 0, NULL);
+	}
+	bad |= chanvars_expect(test, &head, "NOSUCHVAR", 1, NULL);
+
+	/* A second variable of the same name in front of the first hides it */
+	if ((var = ast_var_assign("VAR0", "again"))) {
+		ast_var_insert_head(&head, var);
+		bad |= chanvars_expect(test, &head, "VAR0", 0, "again");
+		ast_var_remove(&head, var);
+		ast_var_delete(var);
+		bad |= chanvars_expect(test, &head, "VAR0", 0, "0");
+	}
+
+	/* Unset every other one */
+	for (i = 0; i < count; i += 2) {
+		snprintf(name, sizeof(name), "VAR%d", i);
+		if ((var = ast_var_find(&head, name, 0))) {
+			ast_var_remove(&head, var);
+			ast_var_delete(var);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "Var%d", i);
+		snprintf(value, sizeof(value), "%d", i);
+		bad |= chanvars_expect(test, &head, name, 1, (i % 2) ? value : NULL);
+	}
+
+	ast_var_list_destroy(&head);
+	return bad;
+}
+
+/*! \brief Set, change and unset variables of a channel through the dialplan functions */
+static int chanvars_channel(struct ast_test *test, int count)
+{
+	struct ast_channel *chan;
+	char name[32], value[32], buf[64];
+	const char *got;
+	int bad = 0, i;
+
+	if (!(chan = ast_channel_alloc(0, AST_STATE_DOWN, NULL, NULL, NULL, NULL, NULL, 0, "Test/chanvars")))
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "CHANVAR%d", i);
+		snprintf(value, sizeof(value), "%d", i);
+		pbx_builtin_setvar_helper(chan, name, value);
+	}
+	pbx_builtin_setvar_helper(chan, "CHANVAR0", "changed");
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "CHANVAR%d", i);
+		snprintf(value, sizeof(value), "%d", i);
+		if (!i)
+			ast_copy_string(value, "changed", sizeof(value));
+		got = pbx_builtin_getvar_helper(chan, name);
+		if (!got || strcmp(got, value)) {
+			ast_test_status_update(test, "%s is '%s' after set, not '%s'\n", name, got ? got : "(nothing)", value);
+			bad = -1;
+		}
+		/* ${...} looks names up in any case */
+		snprintf(name, sizeof(name), "${chanvar%d}", i);
+		pbx_substitute_variables_helper(chan, name, buf, sizeof(buf) - 1);
+		if (strcmp(buf, value)) {
+			ast_test_status_update(test, "%s is '%s', not '%s'\n", name, buf, value);
+			bad = -1;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "CHANVAR%d", i);
+		pbx_builtin_setvar_helper(chan, name, NULL);
+		if ((got = pbx_builtin_getvar_helper(chan, name))) {
+			ast_test_status_update(test, "%s is '%s' after unset\n", name, got);
+			bad = -1;
+		}
+	}
+
+	ast_channel_free(chan);
+	return bad;
+}
+
+AST_TEST_DEFINE(chanvars_lookup)
+{
+	static const int sizes[] = { 3, 8, 9, 40, 300 };
+	int res = AST_TEST_PASS, i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "chanvars_lookup";
+		info->category = "main/chanvars/";
+		info->summary = "channel variable lookups after set and unset";
+		info->description =
+			"Sets, changes and unsets variables in lists short enough to be scanned\n"
+			"and long enough to be indexed, and checks that lookups, exact and in any\n"
+			"case, find the variable set last or nothing once it is unset.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(sizes); i++) {
+		if (chanvars_list(test, sizes[i]) || chanvars_channel(test, sizes[i])) {
+			ast_test_status_update(test, "Lookups failed with %d variables\n", sizes[i]);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(chanvars_lookup);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(chanvars_lookup);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Channel variable lookup test");
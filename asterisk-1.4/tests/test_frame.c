@@ -0,0 +1,134 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief Frame Duplication Tests
+ *
+ * Verify that frames duplicated with ast_frshare() refer to the same data,
+ * that ast_frame_unshare() gives a frame its own copy before it is written
+ * to, and that ast_frisolate() keeps the data of an already isolated frame.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <string.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/frame.h"
+
+#define FRAME_TEST_SAMPLES 160
+
+AST_TEST_DEFINE(frame_test_share)
+{
+	short samples[FRAME_TEST_SAMPLES];
+	struct ast_frame f = { AST_FRAME_VOICE, };
+	struct ast_frame *dup, *shared, *isolated;
+	int res = AST_TEST_PASS, i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "frame_test_share";
+		info->category = "main/frame/";
+		info->summary = "unit test for sharing frame data";
+		info->description =
+			"Verifies that ast_frshare() shares the data of a duplicated frame,\n"
+			"that ast_frame_unshare() copies it before it is changed, and that\n"
+			"ast_frisolate() does not copy data that is already isolated.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < FRAME_TEST_SAMPLES; i++)
+		samples[i] = i;
+	f.subclass = AST_FORMAT_SLINEAR;
+	f.data = samples;
+	f.datalen = sizeof(samples);
+	f.samples = FRAME_TEST_SAMPLES;
+	f.src = "test_frame";
+
+	if (!(dup = ast_frdup(&f))) {
+		ast_test_status_update(test, "Unable to duplicate a frame\n");
+		return AST_TEST_FAIL;
+	}
+	if (dup->data == f.data || dup->offset < AST_FRIENDLY_OFFSET || memcmp(dup->data, samples, sizeof(samples))) {
+		ast_test_status_update(test, "ast_frdup() did not copy the data\n");
+		res = AST_TEST_FAIL;
+	}
+
+	if (!(shared = ast_frshare(dup))) {
+		ast_test_status_update(test, "Unable to share a frame\n");
+		ast_frfree(dup);
+		return AST_TEST_FAIL;
+	}
+	if (shared->data != dup->data || strcmp(shared->src, "test_frame")) {
+		ast_test_status_update(test, "ast_frshare() did not share the data\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* Changing one of them must leave the other alone */
+	ast_frame_adjust_volume(dup, 2);
+	if (shared->data == dup->data || memcmp(shared->data, samples, sizeof(samples))) {
+		ast_test_status_update(test, "Changing a shared frame changed the other one\n");
+		res = AST_TEST_FAIL;
+	}
+	if (((short *) dup->data)[FRAME_TEST_SAMPLES - 1] != 2 * (FRAME_TEST_SAMPLES - 1)) {
+		ast_test_status_update(test, "The volume of the unshared frame was not adjusted\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* The data of the shared frame must still be valid once the original is gone */
+	ast_frfree(dup);
+	if (!(isolated = ast_frisolate(shared))) {
+		ast_test_status_update(test, "Unable to isolate a frame\n");
+		ast_frfree(shared);
+		return AST_TEST_FAIL;
+	}
+	if (isolated != shared) {
+		ast_frfree(shared);
+	}
+	if (memcmp(isolated->data, samples, sizeof(samples))) {
+		ast_test_status_update(test, "The data of a shared frame was lost\n");
+		res = AST_TEST_FAIL;
+	}
+	ast_frfree(isolated);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(frame_test_share);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(frame_test_share);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Frame duplication test");
@@ -0,0 +1,328 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief Dialplan Extension Matching Tests
+ *
+ * Build a context with many DIDs and patterns, replay a corpus of dialled
+ * numbers against it, and check that every lookup finds the extension a
+ * scan of the context in order finds, before and after extensions are
+ * added and removed.  Report how many lookups per millisecond both make.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/pbx.h"
+
+#define PBX_MATCH_CONTEXT	"test_pbx_match"
+#define PBX_MATCH_REGISTRAR	"test_pbx_match"
+/*! DIDs in the context */
+#define PBX_MATCH_DIDS		5000
+/*! Dialled numbers in the corpus */
+#define PBX_MATCH_LOOKUPS	20000
+
+static const char *patterns[] = {
+	"_1NXXNXXXXXX", "_NXXNXXXXXX", "_011.", "_X.", "_9!", "_*7X", "_555[1-3]XXX",
+	"_[a-c]x", "_1800-NXX-XXXX", "_Z", "s", "i", "*72", "_[0-35-7]X[#*]",
+};
+
+static const char *specials[] = {
+	"s", "S", "i", "*72", "*75", "a5", "B9", "", "_X.", "1800-555-1234",
+	"5552123", "0#", "4x*",
+};
+
+struct pbx_match_corpus {
+	char numbers[PBX_MATCH_LOOKUPS][AST_MAX_EXTENSION];
+	unsigned int seed;
+	int added;
+};
+
+static unsigned int pbx_match_random(struct pbx_match_corpus *corpus)
+{
+	corpus->seed = corpus->seed * 1103515245 + 12345;
+	return (corpus->seed >> 8) & 0xffffff;
+}
+
+static void pbx_match_did(char *buf, size_t len, int did)
+{
+	snprintf(buf, len, (did % 4) ? "1%03d555%04d" : "1-%03d-555-%04d", 200 + (did % 800), did);
+}
+
+/*! \brief Add an extension with priority 1, and a priority labelled "match"
+ * that tells it apart from the others */
+static int pbx_match_add(struct ast_context *con, const char *exten, int id)
+{
+	if (ast_add_extension2(con, 0, exten, 1, NULL, NULL, "NoOp", NULL, NULL, PBX_MATCH_REGISTRAR))
+		return -1;
+	return ast_add_extension2(con, 0, exten, id + 2, "match", NULL, "NoOp", NULL, NULL, PBX_MATCH_REGISTRAR);
+}
+
+static void pbx_match_build_corpus(struct pbx_match_corpus *corpus)
+{
+	char did[AST_MAX_EXTENSION];
+	int i, x, len;
+
+	for (i = 0; i < PBX_MATCH_LOOKUPS; i++) {
+		char *buf = corpus->numbers[i];
+		unsigned int r = pbx_match_random(corpus);
+
+		switch (r % 8) {
+		case 0:
+		case 1:
+			pbx_match_did(buf, AST_MAX_EXTENSION, pbx_match_random(corpus) % PBX_MATCH_DIDS);
+			if (r % 8) {	/* dialled without the dashes, or with them */
+				pbx_match_did(did, sizeof(did), pbx_match_random(corpus) % PBX_MATCH_DIDS);
+				for (len = 0, x = 0; did[x]; x++) {
+					if (did[x] != '-')
+						buf[len++] = did[x];
+				}
+				buf[len] = '\0';
+			}
+			break;
+		case 2:	/* still dialling */
+			pbx_match_did(buf, AST_MAX_EXTENSION, pbx_match_random(corpus) % PBX_MATCH_DIDS);
+			buf[pbx_match_random(corpus) % strlen(buf)] = '\0';
+			break;
+		case 3:
+			snprintf(buf, AST_MAX_EXTENSION, "%03d%07d", pbx_match_random(corpus) % 1000, pbx_match_random(corpus) % 10000000);
+			break;
+		case 4:
+			snprintf(buf, AST_MAX_EXTENSION, "011%d", pbx_match_random(corpus));
+			break;
+		case 5:
+			snprintf(buf, AST_MAX_EXTENSION, "9%d", pbx_match_random(corpus) % 1000);
+			break;
+		case 6:
+			ast_copy_string(buf, specials[pbx_match_random(corpus) % ARRAY_LEN(specials)], AST_MAX_EXTENSION);
+			break;
+		default:
+			len = 1 + pbx_match_random(corpus) % 12;
+			for (x = 0; x < len; x++)
+				buf[x] = "0123456789*#-"[pbx_match_random(corpus) % 13];
+			buf[len] = '\0';
+		}
+	}
+}
+
+/*! \brief Priority of the "match" label of the first extension matching,
+ * found by a scan of the context in order, 0 if none */
+static int pbx_match_scan(struct ast_context *con, const char *number)
+{
+	struct ast_exten *e = NULL, *p;
+
+	while ((e = ast_walk_context_extensions(con, e))) {
+		if (!ast_extension_match(ast_get_extension_name(e), number))
+			continue;
+		for (p = NULL; (p = ast_walk_extension_priorities(e, p)); ) {
+			if (ast_get_extension_label(p) && !strcmp(ast_get_extension_label(p), "match"))
+				return ast_get_extension_priority(p);
+		}
+	}
+	return 0;
+}
+
+/*! \brief What ast_canmatch_extension() (needmore 1) or ast_matchmore_extension()
+ * (needmore 0) should say, from a scan of the context in order */
+static int pbx_match_scan_close(struct ast_context *con, const char *number, int needmore)
+{
+	struct ast_exten *e = NULL;
+	int res;
+
+	while ((e = ast_walk_context_extensions(con, e))) {
+		if ((res = ast_extension_close(ast_get_extension_name(e), number, needmore)))
+			return !needmore && res == 2 ? 0 : 1;
+	}
+	return 0;
+}
+
+/*! \brief Check every number of the corpus, returns the number of mismatches */
+static int pbx_match_check(struct ast_test *test, struct ast_context *con, struct pbx_match_corpus *corpus)
+{
+	int bad = 0, i, expect, got;
+
+	for (i = 0; i < PBX_MATCH_LOOKUPS; i++) {
+		const char *number = corpus->numbers[i];
+
+		expect = pbx_match_scan(con, number);
+		got = ast_findlabel_extension(NULL, PBX_MATCH_CONTEXT, number, "match", NULL);
+		if (got < 0)
+			got = 0;
+		if (got != expect && !bad++)
+			ast_test_status_update(test, "'%s' matched priority %d, not %d\n", number, got, expect);
+
+		expect = pbx_match_scan_close(con, number, 1);
+		got = ast_canmatch_extension(NULL, PBX_MATCH_CONTEXT, number, 1, NULL) ? 1 : 0;
+		if (got != expect && !bad++)
+			ast_test_status_update(test, "'%s' can match %d, not %d\n", number, got, expect);
+
+		expect = pbx_match_scan_close(con, number, 0);
+		got = ast_matchmore_extension(NULL, PBX_MATCH_CONTEXT, number, 1, NULL) ? 1 : 0;
+		if (got != expect && !bad++)
+			ast_test_status_update(test, "'%s' matches more %d, not %d\n", number, got, expect);
+	}
+	return bad;
+}
+
+static void pbx_match_report(struct ast_test *test, const char *what, struct timeval start)
+{
+	struct timeval diff = ast_tvsub(ast_tvnow(), start);
+	int64_t us = (int64_t) diff.tv_sec * 1000000 + diff.tv_usec;
+
+	ast_test_status_update(test, "%-14s %10.1f lookups/ms\n", what,
+		us ? (double) PBX_MATCH_LOOKUPS * 1000 / us : 0.0);
+}
+
+/*! \brief Time the lookups of the whole corpus, and a scan of the context for each */
+static void pbx_match_bench(struct ast_test *test, struct ast_context *con, struct pbx_match_corpus *corpus)
+{
+	struct timeval start;
+	struct ast_exten *e;
+	int i;
+
+	start = ast_tvnow();
+	for (i = 0; i < PBX_MATCH_LOOKUPS; i++)
+		ast_exists_extension(NULL, PBX_MATCH_CONTEXT, corpus->numbers[i], 1, NULL);
+	pbx_match_report(test, "dialplan", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < PBX_MATCH_LOOKUPS; i++) {
+		for (e = NULL; (e = ast_walk_context_extensions(con, e)); ) {
+			if (ast_extension_match(ast_get_extension_name(e), corpus->numbers[i]))
+				break;
+		}
+	}
+	pbx_match_report(test, "context scan", start);
+}
+
+/*! \brief Add and remove extensions, in front of and behind those already there */
+static int pbx_match_change(struct ast_context *con, struct pbx_match_corpus *corpus)
+{
+	char did[AST_MAX_EXTENSION];
+	int i, id = corpus->added;
+
+	for (i = 0; i < PBX_MATCH_DIDS; i += 7) {
+		pbx_match_did(did, sizeof(did), i);
+		if (ast_context_remove_extension2(con, did, 0, PBX_MATCH_REGISTRAR))
+			return -1;
+	}
+	for (i = 1; i < PBX_MATCH_DIDS; i += 11) {
+		pbx_match_did(did, sizeof(did), i);
+		/* a new head for the priorities of an extension */
+		if (ast_add_extension2(con, 1, did, 0, NULL, NULL, "NoOp", NULL, NULL, PBX_MATCH_REGISTRAR))
+			return -1;
+	}
+	for (i = 0; i < 500; i++) {
+		snprintf(did, sizeof(did), "1%03d555%04d", pbx_match_random(corpus) % 1000, pbx_match_random(corpus) % 10000);
+		if (pbx_match_add(con, did, id++))
+			return -1;
+	}
+	if (pbx_match_add(con, "_1NXX555XXXX", id++) || pbx_match_add(con, "_0!", id++) ||
+		ast_context_remove_extension2(con, "_X.", 0, PBX_MATCH_REGISTRAR))
+		return -1;
+	corpus->added = id;
+	return 0;
+}
+
+AST_TEST_DEFINE(pbx_match_corpus)
+{
+	struct pbx_match_corpus *corpus;
+	struct ast_context *con;
+	char did[AST_MAX_EXTENSION];
+	int res = AST_TEST_PASS, i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "pbx_match_corpus";
+		info->category = "main/pbx/";
+		info->summary = "dialplan extension matching results and speed";
+		info->description =
+			"Replays a corpus of dialled numbers against a context with many DIDs and\n"
+			"patterns, checks the extension found by every lookup against a scan of\n"
+			"the context in order, before and after extensions are added and removed,\n"
+			"and reports the lookups per millisecond.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(corpus = ast_calloc(1, sizeof(*corpus))))
+		return AST_TEST_FAIL;
+	if (!(con = ast_context_create(NULL, PBX_MATCH_CONTEXT, PBX_MATCH_REGISTRAR))) {
+		ast_test_status_update(test, "Unable to create context '%s'\n", PBX_MATCH_CONTEXT);
+		free(corpus);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < PBX_MATCH_DIDS; i++) {
+		pbx_match_did(did, sizeof(did), i);
+		if (pbx_match_add(con, did, i))
+			res = AST_TEST_FAIL;
+	}
+	for (i = 0; i < ARRAY_LEN(patterns); i++) {
+		if (pbx_match_add(con, patterns[i], PBX_MATCH_DIDS + i))
+			res = AST_TEST_FAIL;
+	}
+	corpus->added = PBX_MATCH_DIDS + i;
+	corpus->seed = 42;
+	pbx_match_build_corpus(corpus);
+
+	if (res == AST_TEST_FAIL)
+		ast_test_status_update(test, "Unable to add the extensions\n");
+	else if (pbx_match_check(test, con, corpus))
+		res = AST_TEST_FAIL;
+	else {
+		pbx_match_bench(test, con, corpus);
+		if (pbx_match_change(con, corpus)) {
+			ast_test_status_update(test, "Unable to change the extensions\n");
+			res = AST_TEST_FAIL;
+		} else if (pbx_match_check(test, con, corpus))
+			res = AST_TEST_FAIL;
+	}
+
+	ast_context_destroy(con, PBX_MATCH_REGISTRAR);
+	free(corpus);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(pbx_match_corpus);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(pbx_match_corpus);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Dialplan extension matching test");
@@ -0,0 +1,228 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief Scheduler Tests
+ *
+ * Verify that scheduled events run in time order, that events due at the
+ * same time run in the order they were added, and that events can be
+ * looked up and deleted by id.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/sched.h"
+
+#define SCHED_TEST_EVENTS 1000
+
+struct sched_test_event {
+	int id;
+	int when;
+};
+
+/*! Order in which the events ran */
+static struct sched_test_event *ran[SCHED_TEST_EVENTS];
+static int ranned;
+
+static int sched_test_cb(const void *data)
+{
+	struct sched_test_event *ev = (struct sched_test_event *) data;
+
+	if (ranned < SCHED_TEST_EVENTS)
+		ran[ranned++] = ev;
+	return 0;
+}
+
+AST_TEST_DEFINE(sched_test_order)
+{
+	struct sched_context *con;
+	struct sched_test_event *events;
+	int res = AST_TEST_PASS, i, tries;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "sched_test_order";
+		info->category = "main/sched/";
+		info->summary = "unit test for scheduler event ordering";
+		info->description =
+			"Verifies that ast_sched_runq() runs events in time order,\n"
+			"and events due at the same time in the order they were added.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(con = sched_context_create())) {
+		ast_test_status_update(test, "Unable to create scheduler context\n");
+		return AST_TEST_FAIL;
+	}
+	if (!(events = ast_calloc(SCHED_TEST_EVENTS, sizeof(*events)))) {
+		sched_context_destroy(con);
+		return AST_TEST_FAIL;
+	}
+
+	ast_test_status_update(test, "Adding %d events due now\n", SCHED_TEST_EVENTS);
+	ranned = 0;
+	for (i = 0; i < SCHED_TEST_EVENTS; i++)
+		events[i].id = ast_sched_add(con, 0, sched_test_cb, &events[i]);
+	ast_sched_runq(con);
+	for (i = 0; i < SCHED_TEST_EVENTS; i++) {
+		if (i >= ranned || ran[i] != &events[i]) {
+			ast_test_status_update(test, "Event %d did not run in the order it was added\n", i);
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+
+	ast_test_status_update(test, "Adding %d events due at random times\n", SCHED_TEST_EVENTS);
+	ranned = 0;
+	for (i = 0; i < SCHED_TEST_EVENTS; i++) {
+		events[i].when = ast_random() % 50;
+		events[i].id = ast_sched_add(con, events[i].when, sched_test_cb, &events[i]);
+	}
+	for (tries = 0; ranned < SCHED_TEST_EVENTS && tries < 100; tries++) {
+		usleep(10000);
+		ast_sched_runq(con);
+	}
+	if (ranned != SCHED_TEST_EVENTS) {
+		ast_test_status_update(test, "Only %d of %d events ran\n", ranned, SCHED_TEST_EVENTS);
+		res = AST_TEST_FAIL;
+	}
+	/* An event added earlier with no longer a delay is due first, so it must have run first */
+	for (i = 1; i < ranned; i++) {
+		if (ran[i]->when <= ran[i - 1]->when && ran[i]->id < ran[i - 1]->id) {
+			ast_test_status_update(test, "Event %d (delay %d) ran after event %d (delay %d)\n",
+				ran[i]->id, ran[i]->when, ran[i - 1]->id, ran[i - 1]->when);
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+
+	if (ast_sched_wait(con) != -1) {
+		ast_test_status_update(test, "Scheduler context is not empty after running every event\n");
+		res = AST_TEST_FAIL;
+	}
+
+	free(events);
+	sched_context_destroy(con);
+
+	return res;
+}
+
+AST_TEST_DEFINE(sched_test_del)
+{
+	struct sched_context *con;
+	struct sched_test_event *events;
+	int res = AST_TEST_PASS, i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "sched_test_del";
+		info->category = "main/sched/";
+		info->summary = "unit test for deleting scheduler events";
+		info->description =
+			"Verifies that ast_sched_del() and ast_sched_when() find events by id,\n"
+			"and that deleted events never run.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(con = sched_context_create())) {
+		ast_test_status_update(test, "Unable to create scheduler context\n");
+		return AST_TEST_FAIL;
+	}
+	if (!(events = ast_calloc(SCHED_TEST_EVENTS, sizeof(*events)))) {
+		sched_context_destroy(con);
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < SCHED_TEST_EVENTS; i++) {
+		events[i].when = (i % 10) * 1000;
+		events[i].id = ast_sched_add(con, events[i].when, sched_test_cb, &events[i]);
+	}
+
+	ast_test_status_update(test, "Deleting every other event\n");
+	for (i = 0; i < SCHED_TEST_EVENTS; i += 2) {
+		if (ast_sched_del(con, events[i].id)) {
+			ast_test_status_update(test, "Unable to delete event %d\n", events[i].id);
+			res = AST_TEST_FAIL;
+		}
+	}
+	for (i = 0; i < SCHED_TEST_EVENTS; i++) {
+		long secs = ast_sched_when(con, events[i].id);
+
+		if ((i % 2 == 0 && secs != -1) || (i % 2 == 1 && (secs < 0 || secs > events[i].when / 1000))) {
+			ast_test_status_update(test, "ast_sched_when() returned %ld for event %d\n", secs, events[i].id);
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+
+	ranned = 0;
+	ast_sched_runq(con);
+	if (ranned) {
+		ast_test_status_update(test, "%d deleted events ran\n", ranned);
+		res = AST_TEST_FAIL;
+	}
+
+	ast_test_status_update(test, "Deleting the remaining events\n");
+	for (i = 1; i < SCHED_TEST_EVENTS; i += 2) {
+		if (ast_sched_del(con, events[i].id)) {
+			ast_test_status_update(test, "Unable to delete event %d\n", events[i].id);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (ast_sched_wait(con) != -1) {
+		ast_test_status_update(test, "Scheduler context is not empty after deleting every event\n");
+		res = AST_TEST_FAIL;
+	}
+
+	free(events);
+	sched_context_destroy(con);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(sched_test_order);
+	AST_TEST_UNREGISTER(sched_test_del);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(sched_test_order);
+	AST_TEST_REGISTER(sched_test_del);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Scheduler test");
@@ -0,0 +1,244 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief Signed linear kernel Tests
+ *
+ * Check every implementation of the signed linear kernels this CPU supports
+ * against the scalar helpers and conversion tables for every input, and
+ * report how many samples per nanosecond each kernel processes.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/slinear.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+
+/*! Every 16 bit sample, with an odd number of them left over for the scalar tails */
+#define SLINEAR_TEST_SAMPLES 65537
+/*! Samples per benchmark call, 20ms at 8kHz */
+#define SLINEAR_BENCH_SAMPLES 160
+/*! Benchmark calls per kernel */
+#define SLINEAR_BENCH_CALLS 100000
+
+static const char *implementations[] = { "scalar", "sse2", "avx2" };
+
+struct slinear_test_bufs {
+	short in[SLINEAR_TEST_SAMPLES];
+	short other[SLINEAR_TEST_SAMPLES];
+	short out[SLINEAR_TEST_SAMPLES];
+	unsigned char bytes[SLINEAR_TEST_SAMPLES];
+};
+
+/*! \brief Compare every kernel with the scalar helpers, returns the number of mismatches */
+static int slinear_check(struct ast_test *test, struct slinear_test_bufs *b)
+{
+	static const short values[] = { 1, 2, 3, 7, 10, 127, 1000, 32767 };
+	short expect;
+	int bad = 0, i, v;
+
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		b->in[i] = (short) (i - 32768);
+		b->other[i] = (short) (ast_random() & 0xffff);
+	}
+
+	memcpy(b->out, b->in, sizeof(b->out));
+	ast_slinear_saturated_add_n(b->out, b->other, SLINEAR_TEST_SAMPLES);
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		expect = b->in[i];
+		ast_slinear_saturated_add(&expect, &b->other[i]);
+		if (b->out[i] != expect && !bad++)
+			ast_test_status_update(test, "%s add: %d + %d gave %d, not %d\n",
+				ast_slinear_selected(), b->in[i], b->other[i], b->out[i], expect);
+	}
+
+	for (v = 0; v < ARRAY_LEN(values); v++) {
+		short value = values[v];
+
+		memcpy(b->out, b->in, sizeof(b->out));
+		ast_slinear_saturated_multiply_n(b->out, value, SLINEAR_TEST_SAMPLES);
+		for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+			expect = b->in[i];
+			ast_slinear_saturated_multiply(&expect, &value);
+			if (b->out[i] != expect && !bad++)
+				ast_test_status_update(test, "%s multiply: %d * %d gave %d, not %d\n",
+					ast_slinear_selected(), b->in[i], value, b->out[i], expect);
+		}
+
+		memcpy(b->out, b->in, sizeof(b->out));
+		ast_slinear_saturated_divide_n(b->out, value, SLINEAR_TEST_SAMPLES);
+		for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+			expect = b->in[i];
+			ast_slinear_saturated_divide(&expect, &value);
+			if (b->out[i] != expect && !bad++)
+				ast_test_status_update(test, "%s divide: %d / %d gave %d, not %d\n",
+					ast_slinear_selected(), b->in[i], value, b->out[i], expect);
+		}
+	}
+
+	ast_slinear_to_ulaw_n(b->bytes, b->in, SLINEAR_TEST_SAMPLES);
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		if (b->bytes[i] != AST_LIN2MU(b->in[i]) && !bad++)
+			ast_test_status_update(test, "%s u-law encode: %d gave %d, not %d\n",
+				ast_slinear_selected(), b->in[i], b->bytes[i], AST_LIN2MU(b->in[i]));
+	}
+	ast_slinear_to_alaw_n(b->bytes, b->in, SLINEAR_TEST_SAMPLES);
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		if (b->bytes[i] != AST_LIN2A(b->in[i]) && !bad++)
+			ast_test_status_update(test, "%s A-law encode: %d gave %d, not %d\n",
+				ast_slinear_selected(), b->in[i], b->bytes[i], AST_LIN2A(b->in[i]));
+	}
+
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++)
+		b->bytes[i] = i & 0xff;
+	ast_ulaw_to_slinear_n(b->out, b->bytes, SLINEAR_TEST_SAMPLES);
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		if (b->out[i] != AST_MULAW(b->bytes[i]) && !bad++)
+			ast_test_status_update(test, "%s u-law decode: %d gave %d, not %d\n",
+				ast_slinear_selected(), b->bytes[i], b->out[i], AST_MULAW(b->bytes[i]));
+	}
+	ast_alaw_to_slinear_n(b->out, b->bytes, SLINEAR_TEST_SAMPLES);
+	for (i = 0; i < SLINEAR_TEST_SAMPLES; i++) {
+		if (b->out[i] != AST_ALAW(b->bytes[i]) && !bad++)
+			ast_test_status_update(test, "%s A-law decode: %d gave %d, not %d\n",
+				ast_slinear_selected(), b->bytes[i], b->out[i], AST_ALAW(b->bytes[i]));
+	}
+
+	return bad;
+}
+
+static void slinear_report(struct ast_test *test, const char *kernel, struct timeval start)
+{
+	struct timeval diff = ast_tvsub(ast_tvnow(), start);
+	int64_t us = (int64_t) diff.tv_sec * 1000000 + diff.tv_usec;
+
+	ast_test_status_update(test, "%-7s %-16s %6.2f samples/ns\n", ast_slinear_selected(), kernel,
+		us ? (double) SLINEAR_BENCH_SAMPLES * SLINEAR_BENCH_CALLS / (us * 1000.0) : 0.0);
+}
+
+/*! \brief Time each kernel on frame sized blocks */
+static void slinear_bench(struct ast_test *test, struct slinear_test_bufs *b)
+{
+	struct timeval start;
+	int i;
+
+	for (i = 0; i < SLINEAR_BENCH_SAMPLES; i++)
+		b->bytes[i] = AST_LIN2MU(b->other[i]);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_slinear_saturated_add_n(b->out, b->other, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "add", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_slinear_saturated_multiply_n(b->out, 2, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "multiply", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_slinear_saturated_divide_n(b->out, 2, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "divide", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_ulaw_to_slinear_n(b->out, b->bytes, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "u-law decode", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_slinear_to_ulaw_n(b->bytes, b->other, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "u-law encode", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_alaw_to_slinear_n(b->out, b->bytes, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "A-law decode", start);
+
+	start = ast_tvnow();
+	for (i = 0; i < SLINEAR_BENCH_CALLS; i++)
+		ast_slinear_to_alaw_n(b->bytes, b->other, SLINEAR_BENCH_SAMPLES);
+	slinear_report(test, "A-law encode", start);
+}
+
+AST_TEST_DEFINE(slinear_kernels)
+{
+	struct slinear_test_bufs *b;
+	const char *selected = ast_slinear_selected();
+	int res = AST_TEST_PASS, i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "slinear_kernels";
+		info->category = "main/slinear/";
+		info->summary = "signed linear kernel results and speed";
+		info->description =
+			"Checks each implementation of the signed linear kernels supported by\n"
+			"this CPU against the scalar helpers for every input, and reports the\n"
+			"samples per nanosecond of each kernel.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(b = ast_calloc(1, sizeof(*b))))
+		return AST_TEST_FAIL;
+
+	for (i = 0; i < ARRAY_LEN(implementations); i++) {
+		if (ast_slinear_select(implementations[i])) {
+			ast_test_status_update(test, "%s is not supported, skipping it\n", implementations[i]);
+			continue;
+		}
+		if (slinear_check(test, b))
+			res = AST_TEST_FAIL;
+		else
+			slinear_bench(test, b);
+	}
+
+	ast_slinear_select(selected);
+	free(b);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(slinear_kernels);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(slinear_kernels);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Signed linear kernel test");
@@ -0,0 +1,206 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2010, Digium, Inc.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*!
+ * \file
+ * \brief ast_waitfor_n() Tests
+ *
+ * Drive a simulated two channel bridge through ast_waitfor_n(), once with
+ * the channels waited on separately (a poll() of every fd on every call)
+ * and once sharing an epoll set with ast_poll_channel_add(), checking that
+ * every wakeup names the right channel and fd and reporting the wall and
+ * CPU time of each wait.  Either way a wait is a single poll() or
+ * epoll_wait(), what the shared set saves is the kernel walking and
+ * registering every fd each time, which shows up as CPU time.
+ * \ingroup tests
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "asterisk/utils.h"
+#include "asterisk/module.h"
+#include "asterisk/test.h"
+#include "asterisk/channel.h"
+
+/*! Media fds per channel, like RTP and RTCP of audio and video */
+#define WAITFOR_TEST_FDS 4
+/*! Frames per run, 20 seconds of a call at 50 frames per second per leg */
+#define WAITFOR_TEST_FRAMES 2000
+
+struct waitfor_leg {
+	struct ast_channel *chan;
+	int remote[WAITFOR_TEST_FDS];		/*!< Our end of each of the channel's socket pairs */
+};
+
+static void waitfor_legs_free(struct waitfor_leg *legs)
+{
+	int i, x;
+
+	for (i = 0; i < 2; i++) {
+		if (legs[i].chan) {
+			for (x = 0; x < WAITFOR_TEST_FDS; x++) {
+				if (legs[i].chan->fds[x] > -1)
+					close(legs[i].chan->fds[x]);
+				ast_channel_set_fd(legs[i].chan, x, -1);
+			}
+			ast_channel_free(legs[i].chan);
+		}
+		for (x = 0; x < WAITFOR_TEST_FDS; x++) {
+			if (legs[i].remote[x] > -1)
+				close(legs[i].remote[x]);
+		}
+	}
+}
+
+static int waitfor_legs_alloc(struct ast_test *test, struct waitfor_leg *legs)
+{
+	int sv[2];
+	int i, x;
+
+	memset(legs, 0, 2 * sizeof(*legs));
+	for (i = 0; i < 2; i++) {
+		for (x = 0; x < WAITFOR_TEST_FDS; x++)
+			legs[i].remote[x] = -1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (!(legs[i].chan = ast_channel_alloc(1, AST_STATE_UP, NULL, NULL, NULL, NULL, NULL, 0, "Test/waitfor-%d", i))) {
+			ast_test_status_update(test, "Unable to allocate a channel\n");
+			return -1;
+		}
+		for (x = 0; x < WAITFOR_TEST_FDS; x++) {
+			if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+				ast_test_status_update(test, "Unable to create a socket pair: %s\n", strerror(errno));
+				return -1;
+			}
+			ast_channel_set_fd(legs[i].chan, x, sv[0]);
+			legs[i].remote[x] = sv[1];
+		}
+	}
+	return 0;
+}
+
+/*! \brief Feed WAITFOR_TEST_FRAMES frames into the legs in turn and wait for each one */
+static int waitfor_run(struct ast_test *test, struct waitfor_leg *legs, const char *desc)
+{
+	struct ast_channel *cs[3] = { legs[0].chan, legs[1].chan, NULL };
+	struct ast_channel *who;
+	struct rusage start, end;
+	struct timeval began;
+	unsigned char frame[160] = { 0, };
+	int64_t wall, cpu;
+	int i, ms, leg, fd;
+
+	getrusage(RUSAGE_SELF, &start);
+	began = ast_tvnow();
+	for (i = 0; i < WAITFOR_TEST_FRAMES; i++) {
+		leg = i % 2;
+		/* Mostly RTP, with an occasional RTCP or video packet */
+		fd = (i % 10) ? 0 : (i / 10) % WAITFOR_TEST_FDS;
+		if (write(legs[leg].remote[fd], frame, sizeof(frame)) < 0) {
+			ast_test_status_update(test, "Unable to write a frame: %s\n", strerror(errno));
+			return -1;
+		}
+		ms = 1000;
+		if (!(who = ast_waitfor_n(cs, 2, &ms))) {
+			ast_test_status_update(test, "%s: frame %d was not seen\n", desc, i);
+			return -1;
+		}
+		if (who != legs[leg].chan || who->fdno != fd) {
+			ast_test_status_update(test, "%s: frame %d was for %s fd %d, but %s fd %d woke up\n",
+				desc, i, legs[leg].chan->name, fd, who->name, who->fdno);
+			return -1;
+		}
+		if (read(who->fds[fd], frame, sizeof(frame)) < 0) {
+			ast_test_status_update(test, "Unable to read a frame: %s\n", strerror(errno));
+			return -1;
+		}
+		/* Swap who gets priority, as bridges do */
+		cs[2] = cs[0];
+		cs[0] = cs[1];
+		cs[1] = cs[2];
+	}
+	wall = ast_tvdiff_ms(ast_tvnow(), began);
+	getrusage(RUSAGE_SELF, &end);
+	cpu = (int64_t) ast_tvdiff_ms(end.ru_utime, start.ru_utime) + ast_tvdiff_ms(end.ru_stime, start.ru_stime);
+
+	ast_test_status_update(test, "%s: %d waits in %lld ms wall, %lld ms CPU (%.2f us CPU per wait)\n",
+		desc, WAITFOR_TEST_FRAMES, (long long) wall, (long long) cpu, cpu * 1000.0 / WAITFOR_TEST_FRAMES);
+	return 0;
+}
+
+AST_TEST_DEFINE(waitfor_bridge)
+{
+	struct waitfor_leg legs[2];
+	int res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "waitfor_bridge";
+		info->category = "main/channel/";
+		info->summary = "ast_waitfor_n() wakeups and cost for a bridged call";
+		info->description =
+			"Feeds frames into two channels and checks that ast_waitfor_n() reports\n"
+			"the right channel and fd, waiting on each channel's fds separately and\n"
+			"with both channels sharing one epoll set.  Reports the CPU time per wait.\n";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (waitfor_legs_alloc(test, legs)) {
+		waitfor_legs_free(legs);
+		return AST_TEST_FAIL;
+	}
+
+	if (waitfor_run(test, legs, "Separate channels"))
+		res = AST_TEST_FAIL;
+
+	ast_poll_channel_add(legs[0].chan, legs[1].chan);
+	if (res == AST_TEST_PASS && waitfor_run(test, legs, "Shared epoll set"))
+		res = AST_TEST_FAIL;
+	ast_poll_channel_del(legs[0].chan, legs[1].chan);
+
+	waitfor_legs_free(legs);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(waitfor_bridge);
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(waitfor_bridge);
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "ast_waitfor_n() test");